@@ -3,6 +3,7 @@
 #include "thread.hh"
 #include "assembler.hh"
 #include "capability.hh"
+#include "heapprofile.hh"
 
 #include <iostream>
 
@@ -25,6 +26,13 @@ extern "C" int LC_USED
 heapCheckFail(ExitState *s)
 {
   Capability *cap = s->T->owner();
+  HeapProfile *prof = cap->mm()->heapProfile();
+  if (LC_UNLIKELY(prof != NULL) && s->F_id != TRACE_ID_NONE) {
+    // asmHeapOverflow was called with the exit number in rdi.
+    ExitNo n = (ExitNo)s->gpr[RID_EDI];
+    prof->recordAllocation(Jit::traceById(s->F_id)->snap(n).pc(),
+                           Block::kBlockSize);
+  }
   Word *hpold = (Word*)s->gpr[RID_HP];
   Word *hplim = s->hplim;
   int ok = cap->heapCheckFailQuick((char **)&s->gpr[RID_HP], (char **)&s->hplim);
@@ -40,6 +48,20 @@ heapCheckFail(ExitState *s)
   return ok;
 }
 
+// Called if heapCheckFail returned non-zero.  Returns 0 if the GC
+// was done and the trace can continue.
+extern "C" int LC_USED
+heapCheckGC(ExitNo n, ExitState *s)
+{
+  if (LC_UNLIKELY(s->F_id == TRACE_ID_NONE))
+    return 1;
+  Fragment *F = Jit::traceById(s->F_id);
+  if (!F->collectGarbage(n, s))
+    return 1;
+  ++trace_gcs;
+  return 0;
+}
+
 extern "C" void LC_USED
 handleStackOverflow(void) {
   fprintf(stderr, "Stack overflow (in JIT)\n");
@@ -52,6 +74,7 @@ handleStackOverflow(void) {
 #define ASM_TRACE NAME_PREFIX "asmTrace"
 #define ASM_HEAP_OVERFLOW NAME_PREFIX "asmHeapOverflow"
 #define ASM_STACK_OVERFLOW NAME_PREFIX "asmStackOverflow"
+#define ASM_WRITE_BARRIER NAME_PREFIX "asmWriteBarrier"
 
 #define SAVE_SIZE (80 + 256 * sizeof(Word))
 
@@ -157,67 +180,16 @@ asmExitIsImplementedInAssembly() {
     ".globl " ASM_EXIT "\n"
     ASM_EXIT  ":\n\t"
 
-    /* construct the ExitState structure on the stack */
-    "push %%r13\n\t"
-    "push %%r12\n\t"
-    "push %%r11\n\t"
-    "push %%r10\n\t"
-    "push %%r9\n\t"
-    "push %%r8\n\t"
-    "push %%rdi\n\t"
-    "push %%rsi\n\t"
-    "push %%rbp\n\t"
-    /* save the value of rsp that we ahd during exection of our machine code
-     * That rsp was 88 higher than its current level for the 11 pushes
-     * we have done since we started exection. Two pushes for the exit number
-     * plus the 9 pushes of the registers we have saved so far */
-    "lea  88(%%rsp), %%rbp\n\t"
-    "push %%rbp\n\t"
-    "push %%rbx\n\t"
-    "push %%rdx\n\t"
-    "push %%rcx\n\t"
-    "push %%rax\n\t"
-
-    /* reconstruct the exit number */
-    "movzbl -8(%%rbp), %%eax\n\t" /* low byte is exit number */
-    "mov   -16(%%rbp), %%ah\n\t" /* high byte is exit group */
-    "mov   %%eax, %%edi\n\t"     /* pass as first param to exitTrace funciton */
-
-    /* save remaining registers where the exit number was stored */
-    "mov  %%r15, -8(%%rbp)\n\t"
-    "mov  %%r14, -16(%%rbp)\n\t"
-
-    /* save the xmm registers */
-    "sub   $128, %%rsp\n\t"  /* make room for them on the stack */
-    "sub   $128, %%rbp\n\t"  /* skip past the int regs */
-
-    /* For now, we don't actually save the xmm registers because
-     * we don't support floating point operations. We still need to
-     * make space for them on the stack so that the ExitState data
-     * structure is properly constructed. The ExitState has room for
-     * the xmm regs, but all the xmm reg data will be invalid. */
-#if 0
-    "movsd %%xmm15, -8(%%rbp)\n\t"
-    "movsd %%xmm14, -16(%%rbp)\n\t"
-    "movsd %%xmm13, -24(%%rbp)\n\t"
-    "movsd %%xmm12, -32(%%rbp)\n\t"
-    "movsd %%xmm11, -40(%%rbp)\n\t"
-    "movsd %%xmm10, -48(%%rbp)\n\t"
-    "movsd %%xmm9,  -56(%%rbp)\n\t"
-    "movsd %%xmm8,  -64(%%rbp)\n\t"
-    "movsd %%xmm7,  -72(%%rbp)\n\t"
-    "movsd %%xmm6,  -80(%%rbp)\n\t"
-    "movsd %%xmm5,  -88(%%rbp)\n\t"
-    "movsd %%xmm4,  -96(%%rbp)\n\t"
-    "movsd %%xmm3,  -104(%%rbp)\n\t"
-    "movsd %%xmm2,  -112(%%rbp)\n\t"
-    "movsd %%xmm1,  -120(%%rbp)\n\t"
-    "movsd %%xmm0,  -128(%%rbp)\n\t"
-#endif
+    /* The exit stub has built the ExitState structure on the stack
+     * and put the exit number into edi.  It only saved the registers
+     * needed to restore the snapshot (see Assembler::setupExitStubs).
+     * The xmm registers are never saved because we don't support
+     * floating point operations, but the ExitState has room for
+     * them. */
 
     /* call the generic restore routine exitTrace(ExitNo n, ExitState *s)
      * rdi = ExitNo
-     * rsi = ExitState* (stored on the c-stack */
+     * rsi = ExitState* (stored on the c-stack) */
     "movq %%rsp, %%rsi\n\t"
     "call " NAME_PREFIX "exitTrace\n\t"
 
@@ -317,6 +289,60 @@ asmTraceIsImplementedInAssembly(void) {
     : : );
 }
 
+static void LC_USED
+asmWriteBarrierIsImplementedInAssembly(void) {
+  asm volatile(
+    ".globl " ASM_WRITE_BARRIER "\n"
+    ASM_WRITE_BARRIER ":\n\t"
+
+    /* Frame:
+
+                +----------------+
+       rbp + 16 | closure        |   pushed by the trace
+                +----------------+
+       rbp + 8  | return address |
+                +----------------+
+       rbp + 0  | saved rbp      |
+                +----------------+
+
+       Trace code does not expect any register to change, so we
+       save all caller-saved registers and the flags.  Traces don't
+       use XMM registers, yet.
+    */
+    "pushq %%rbp\n\t"
+    "movq %%rsp, %%rbp\n\t"
+    "pushfq\n\t"
+    "pushq %%rax\n\t"
+    "pushq %%rcx\n\t"
+    "pushq %%rdx\n\t"
+    "pushq %%rsi\n\t"
+    "pushq %%rdi\n\t"
+    "pushq %%r8\n\t"
+    "pushq %%r9\n\t"
+    "pushq %%r10\n\t"
+    "pushq %%r11\n\t"
+
+    "movq 16(%%rbp), %%rdi\n\t"
+    "andq $-16, %%rsp\n\t"  /* align stack for the C call */
+    "call " NAME_PREFIX "rememberClosure\n\t"
+
+    "leaq -80(%%rbp), %%rsp\n\t"
+    "popq %%r11\n\t"
+    "popq %%r10\n\t"
+    "popq %%r9\n\t"
+    "popq %%r8\n\t"
+    "popq %%rdi\n\t"
+    "popq %%rsi\n\t"
+    "popq %%rdx\n\t"
+    "popq %%rcx\n\t"
+    "popq %%rax\n\t"
+    "popfq\n\t"
+    "popq %%rbp\n\t"
+    "ret $8\n\t"
+
+    : : );
+}
+
 static void LC_USED
 asmHeapBufOverflowDummy(void) {
   asm volatile(
@@ -371,6 +397,7 @@ asmHeapBufOverflowDummy(void) {
     "jnz .L1\n\t"
 
     /* Common case: we jump back to the trace code. */
+    ".LheapCheckResume:\n\t"
     "addq   $128, %%rsp\n\t"   /* deallocate XMM registers */
 
     "movq   0(%%rsp), %%rax\n\t"
@@ -405,6 +432,9 @@ asmHeapBufOverflowDummy(void) {
        [rsp + (16 + 6) * 8] = bytes        = rsp + 176
     */
 
+    "movq   232(%%rsp), %%rax\n\t"  // return address
+    "movq   %%rax, 272(%%rsp)\n\t"  // ExitState::retaddr
+
     "movl   184(%%rsp), %%edi\n\t"  // exit no.
     "movq   248(%%rsp), %%rax\n\t"  // saved rdi
     "movq   %%rax, 184(%%rsp)\n\t"  // expected saved location for rdi
@@ -417,8 +447,32 @@ asmHeapBufOverflowDummy(void) {
     "mov    %%r15, 248(%%rsp)\n\t"
     "mov    %%r14, 240(%%rsp)\n\t"
     "mov    %%r13, 232(%%rsp)\n\t"
-    "mov    %%rsp, %%rsi\n\t"
 
+    /* Try to do the GC without leaving the trace.  The ExitState
+       is now complete, so the GC can update any of the registers.
+       rbx is restored from the ExitState or the asmEnter frame in
+       either case, so we can use it to keep the exit number. */
+    "movl   %%edi, %%ebx\n\t"
+    "mov    %%rsp, %%rsi\n\t"
+    "call " NAME_PREFIX "heapCheckGC\n\t"
+    "test   %%eax, %%eax\n\t"
+    "jnz .LheapCheckExit\n\t"
+
+    /* Undo the shuffling above, then resume like the common case. */
+    "movq   232(%%rsp), %%r13\n\t"
+    "movq   240(%%rsp), %%r14\n\t"
+    "movq   248(%%rsp), %%r15\n\t"
+    "movq   176(%%rsp), %%rax\n\t"  // rsi
+    "movq   %%rax, 240(%%rsp)\n\t"
+    "movq   184(%%rsp), %%rax\n\t"  // rdi
+    "movq   %%rax, 248(%%rsp)\n\t"
+    "movq   272(%%rsp), %%rax\n\t"  // return address
+    "movq   %%rax, 232(%%rsp)\n\t"
+    "jmp .LheapCheckResume\n\t"
+
+    ".LheapCheckExit:\n\t"
+    "movl   %%ebx, %%edi\n\t"
+    "mov    %%rsp, %%rsi\n\t"
     "call " NAME_PREFIX "exitTrace\n\t"
 
     /* We can't increment the stack pointer just yet. */
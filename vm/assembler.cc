@@ -1,12 +1,15 @@
 #include "assembler.hh"
 #include "jit.hh"
 #include "ir-inl.hh"
+#include "memorymanager.hh"
 
 #include <iostream>
 #include <fstream>
 #include <string.h>
 
 #define MCLIM_REDZONE 64
+// jmp rel32 plus the trace ID store (see emitSetTraceId).
+#define FALLTHROUGH_BRIDGE_SIZE (5 + 8)
 
 #include "assembler-debug.hh"
 
@@ -47,6 +50,35 @@ SpillSet::allocSpillHigh()
   exit(EXIT_FAILURE);
 }
 
+uint32_t
+SpillSet::allocReuse(IRRef lastuse)
+{
+  // Best fit: pick the slot whose previous value was defined closest
+  // after our last use.  This keeps slots released further down the
+  // trace available for values that live longer.
+  uint32_t best = 0;
+  IRRef1 bestRef = 0;
+  for (uint32_t i = 0; i < countof(reusable_); ++i) {
+    Word work = reusable_[i];
+    while (work != 0) {
+      uint32_t bit = lc_ffsl(work);
+      work &= work - 1;
+      uint32_t slot = (i * (sizeof(Word) * 8)) + bit;
+      IRRef1 def = releasedAt_[slot];
+      if (def > lastuse && (best == 0 || def < bestRef)) {
+        best = slot;
+        bestRef = def;
+      }
+    }
+  }
+  if (best != 0) {
+    reusable_[best >> LC_ARCH_BITS_LOG2] &=
+      ~((Word)1 << (best & ((1 << LC_ARCH_BITS_LOG2) - 1)));
+    return best;
+  }
+  return alloc();
+}
+
 
 static inline int32_t jmprel(MCode *p, MCode *target) {
   ptrdiff_t delta = target - p;
@@ -105,6 +137,9 @@ void Assembler::setupRegAlloc() {
 void Assembler::setup(IRBuffer *buf) {
   numHeapChecks_ = buf->setHeapOffsets();
   mcQuickHeapCheck_ = NULL;
+  GCMap nomap = { 0, 0, false };
+  gcmaps_.assign(buf->numSnapshots(), nomap);
+  gcroots_.clear();
 
   setupRegAlloc();
 
@@ -115,6 +150,7 @@ void Assembler::setup(IRBuffer *buf) {
   curins_ = buf->bufmax_;
   nins_ = buf->bufmax_;
   stopins_ = buf->stopins_;
+  computeLiveness(buf);
 
   // Initialise reg/spill fields for constants.
   for (IRRef i = buf->bufmin_; i < REF_BIAS; ++i) {
@@ -151,6 +187,79 @@ void Assembler::setup(IRBuffer *buf) {
   }
 }
 
+inline void Assembler::extendLive(IRRef ref, IRRef at) {
+  if (!irref_islit(ref) && lastuse_[ref - REF_BIAS] < at)
+    lastuse_[ref - REF_BIAS] = at;
+}
+
+inline void Assembler::extendLiveOperands(IR *ins, IRRef at) {
+  IR::IRMode mode = IR::mode(ins->opcode());
+  if (irmode_left(mode) == IR::IRMref)
+    extendLive(ins->op1(), at);
+  if (irmode_right(mode) == IR::IRMref)
+    extendLive(ins->op2(), at);
+}
+
+inline void Assembler::noteUse(IRRef ref, IRRef at) {
+  if (irref_islit(ref))
+    return;
+  IR *ins = ir(ref);
+  extendLive(ref, at);
+  ++nuses_[ref - REF_BIAS];
+  // Some instructions may be fused into their use site (see
+  // fuseLoad and leaAdd), so their operands may be live until there.
+  switch (ins->opcode()) {
+  case IR::kFLOAD:
+    extendLive(ins->op1(), at);
+    extendLiveOperands(ir(ins->op1()), at);
+    break;
+  case IR::kFREF:
+  case IR::kAREF:
+  case IR::kADD:
+  case IR::kBSHL:
+    extendLiveOperands(ins, at);
+    break;
+  default:
+    break;
+  }
+}
+
+// Compute the last use of each instruction.  We need this to decide
+// whether a spill slot released by one instruction can be reused by
+// another.  This must be conservative: it must cover all uses
+// including snapshot entries and heap-allocated fields.
+void Assembler::computeLiveness(IRBuffer *buf) {
+  size_t n = nins_ - REF_BIAS;
+  lastuse_.assign(n, 0);
+  nuses_.assign(n, 0);
+  for (IRRef i = REF_FIRST; i < nins_; ++i)
+    lastuse_[i - REF_BIAS] = i;  // Dead values die at their definition.
+
+  SnapNo snapno = 0;
+  for (IRRef i = REF_FIRST; i < nins_; ++i) {
+    IR *ins = ir(i);
+    IR::IRMode mode = IR::mode(ins->opcode());
+    if (irmode_left(mode) == IR::IRMref)
+      noteUse(ins->op1(), i);
+    if (irmode_right(mode) == IR::IRMref)
+      noteUse(ins->op2(), i);
+    if (ins->opcode() == IR::kNEW) {
+      IRBuffer::HeapEntry eid = ins->op2();
+      for (int f = 0; f < buf->numFields(eid); ++f)
+        noteUse(buf->getField(eid, f), i);
+    }
+    if (ins->isGuard() && snapno < buf->numSnapshots()) {
+      Snapshot &snap = buf->snap(snapno);
+      if (snap.ref() == i) {
+        SnapshotData *snapmap = buf->snapmap();
+        for (Snapshot::MapRef se = snap.begin(); se != snap.end(); ++se)
+          noteUse(snapmap->slotRef(se), i);
+        ++snapno;
+      }
+    }
+  }
+}
+
 MCode *Assembler::finish() {
   MCode *top = mcp;
   jit()->mcode()->commit(top);
@@ -393,10 +502,17 @@ found:
   RA_DBGX((this, "alloc     $f $r", ref, r));
   ins->setReg(r);
   freeset_.clear(r);
-  cost_[r] = RegCost(ref, (IRType)ins->t());
+  cost_[r] = spillCost(ref, ins);
   return r;
 }
 
+inline RegCost Assembler::spillCost(IRRef ref, IR *ins) {
+  if (irref_islit(ref))
+    return RegCost(ref, (IRType)ins->t());
+  return RegCost(ref, (IRType)ins->t(), nuses_[ref - REF_BIAS],
+                 ins->spill() != 0);
+}
+
 inline int32_t Assembler::spillOffset(uint8_t spillSlot) const {
   return SPILL_SP_OFFS + sizeof(Word) * spillSlot;
 }
@@ -404,7 +520,10 @@ inline int32_t Assembler::spillOffset(uint8_t spillSlot) const {
 int32_t Assembler::spill(IR *ins) {
   int32_t slot = ins->spill();
   if (slot == 0) {
-    slot = spills_.alloc();
+    // The exit handler reads a value from its spill slot (if it has
+    // one) at *any* exit where the value is live, so the slot must
+    // be ours for the whole live range, not just from this point.
+    slot = spills_.allocReuse(lastUse((IRRef)(ins - ir_)));
     ins->setSpill(slot);
   }
   return spillOffset(slot);
@@ -504,10 +623,12 @@ Reg Assembler::destReg(IR *ins, RegSet allow) {
   RA_DBGX((this, "dest           $r", dest));
   if (LC_UNLIKELY(ins->spill() != 0)) {
     saveReg(ins, dest);
-    // TODO: A more sophisticated scheme might be able to safely reuse
-    // spill slots, but this is wrong:
-    // 
-    //     spills_.free(ins->spill());
+    // This is the definition site, so no code before this point can
+    // refer to the slot.  Only values whose live range ends before
+    // here may reuse it.  Simply freeing the slot would be wrong: a
+    // value spilled later (i.e., further up) might still be live
+    // further down where it would clash with us.
+    spills_.release(ins->spill(), (IRRef)(ins - ir_));
   }
   return dest;
 }
@@ -604,10 +725,140 @@ Reg Assembler::fuseLoad(IRRef ref, RegSet allow) {
     mrm_.idx = RID_NONE;
     return RID_MRM;
   }
-  // TODO: Do the actual fusing.
+  if (canFuse(ref)) {
+    RegSet baseallow = allow.isEmpty() ? kGPR : allow;
+    if (ins->opcode() == IR::kFLOAD) {
+      // op r, [base + ofs]
+      IR *frefins = ir(ins->op1());
+      LC_ASSERT(frefins->opcode() == IR::kFREF);
+      mrm_.base = alloc1(frefins->op1(), baseallow);
+      mrm_.ofs = sizeof(Word) * frefins->op2();
+      mrm_.idx = RID_NONE;
+      return RID_MRM;
+    } else if (ins->opcode() == IR::kSLOAD) {
+      // op r, [BASE + slot]
+      mrm_.base = RID_BASE;
+      mrm_.ofs = sizeof(Word) * (int16_t)ins->op1();
+      mrm_.idx = RID_NONE;
+      return RID_MRM;
+    }
+  }
+  if (ins->spill() != 0 && freeset_.intersect(allow).isEmpty()) {
+    // Avoid evicting another register if the operand is in its
+    // spill slot anyway.
+    mrm_.base = RID_ESP;
+    mrm_.ofs = spillOffset(ins->spill());
+    mrm_.idx = RID_NONE;
+    return RID_MRM;
+  }
   return allocRef(ref, allow);
 }
 
+// An instruction can be fused into its use site (the current
+// instruction) if that is its only use (including snapshots) and it
+// hasn't been allocated a register or spill slot yet.  For loads we
+// additionally require that there is no store (or anything else with
+// side effects, e.g., a heap check that may trigger a GC) between the
+// load and its use.
+inline bool Assembler::canFuseLoad(IRRef ref) {
+  return !irref_islit(ref) &&
+    (ir(ref)->opcode() == IR::kFLOAD || ir(ref)->opcode() == IR::kSLOAD) &&
+    canFuse(ref);
+}
+
+bool Assembler::canFuse(IRRef ref) {
+  if (ref < stopins_)
+    return false;  // Inherited from parent trace.
+  IR *ins = ir(ref);
+  if (isReg(ins->reg()) || ins->spill() != 0 ||
+      nuses_[ref - REF_BIAS] != 1)
+    return false;
+  IR::IRMode mode = IR::mode(ins->opcode());
+  if ((mode & IR::IRM_S) == IR::IRM_L) {
+    if (ins->opcode() == IR::kSLOAD && (ins->op2() & IR_SLOAD_INHERIT))
+      return false;
+    for (IRRef i = ref + 1; i < curins_; ++i) {
+      if ((IR::mode(ir(i)->opcode()) & IR::IRM_S) == IR::IRM_S)
+        return false;
+    }
+  }
+  return true;
+}
+
+// An instruction without side effects whose result has not been
+// allocated a register or spill slot is never used (or has been fused
+// into its use site).  No need to generate code for it.
+bool Assembler::isDead(IR *ins) {
+  IR::IRMode mode = IR::mode(ins->opcode());
+  if ((mode & IR::IRM_S) == IR::IRM_S || (mode & IR::IRM_S) == IR::IRM_A ||
+      (mode & IR::IRM_G))
+    return false;
+  return !isReg(ins->reg()) && ins->spill() == 0;
+}
+
+// Try to emit an ADD as a LEA.  We handle the following cases:
+//
+//     ADD x k            ==>  lea dest, [x + k]
+//     ADD x y            ==>  lea dest, [x + y]
+//     ADD (ADD x y) k    ==>  lea dest, [x + y + k]
+//     ADD x (BSHL y s)   ==>  lea dest, [x + y * 2^s]   (1 <= s <= 3)
+//
+// In the first two cases LEA only pays off if x stays live after the
+// ADD; otherwise an in-place ADD is just as good.
+bool Assembler::leaAdd(IR *ins) {
+  IRRef lref = ins->op1();
+  IRRef rref = ins->op2();
+  IRRef baseref = lref;
+  IRRef idxref = 0;
+  x86Mode scale = XM_SCALE1;
+  int32_t k = 0;
+
+  if (irref_islit(lref))
+    return false;
+
+  if (is32BitLiteral(rref, &k)) {
+    IR *irl = ir(lref);
+    if (irl->opcode() == IR::kADD && !irref_islit(irl->op1()) &&
+        !irref_islit(irl->op2()) && canFuse(lref)) {
+      baseref = irl->op1();
+      idxref = irl->op2();
+    } else if (!isReg(irl->reg())) {
+      return false;
+    }
+  } else if (!irref_islit(rref)) {
+    if (ir(lref)->opcode() == IR::kBSHL && ir(rref)->opcode() != IR::kBSHL) {
+      baseref = rref;  // ADD is commutative.
+      rref = lref;
+      lref = baseref;
+    }
+    IR *irr = ir(rref);
+    int32_t shift;
+    idxref = rref;
+    if (irr->opcode() == IR::kBSHL && !irref_islit(irr->op1()) &&
+        is32BitLiteral(irr->op2(), &shift) && shift >= 1 && shift <= 3 &&
+        canFuse(rref)) {
+      idxref = irr->op1();
+      scale = (x86Mode)(shift << 6);
+    } else if (!isReg(ir(lref)->reg()) ||
+               canFuseLoad(lref) || canFuseLoad(rref)) {
+      // Prefer ADD with a memory operand.
+      return false;
+    }
+  } else {
+    return false;  // 64 bit literal.
+  }
+
+  Reg dest = destReg(ins, kGPR);
+  Reg base = alloc1(baseref, kGPR);
+  if (idxref == 0) {
+    emit_rmro(XO_LEA, dest | REX_64, base, k);
+  } else {
+    Reg idx = alloc1(idxref, kGPR.exclude(base));
+    emit_rmrxo(XO_LEA, dest | REX_64, base, idx, scale, k);
+  }
+  return true;
+}
+
 bool Assembler::is32BitLiteral(IRRef ref, int32_t *k) {
   if (irref_islit(ref) && ir(ref)->opcode() != IR::kKBASEO) {
     uint64_t k64 = buf_->literalValue(ref);
@@ -625,6 +876,14 @@ void Assembler::intArith(IR *ins, x86Arith xa) {
   IRRef lref = ins->op1();
   IRRef rref = ins->op2();
 
+  // Only the right operand can be a memory operand.
+  if (IR::isCommutative(ins->opcode()) && !irref_islit(rref) &&
+      !isReg(ir(rref)->reg()) && canFuseLoad(lref) && !canFuseLoad(rref)) {
+    IRRef tmp = lref;
+    lref = rref;
+    rref = tmp;
+  }
+
   Reg right = ir(rref)->reg();
   if (isReg(right)) {
     allow.clear(right);
@@ -965,7 +1224,6 @@ void Assembler::assemble(IRBuffer *buf, MachineCode *mcode) {
 
   setup(buf);
   setupMachineCode(mcode);
-  setupExitStubs(buf->numSnapshots(), mcode);
 
   curins_ = nins_;
   snapno_ = buf->numSnapshots() - 1;
@@ -990,8 +1248,14 @@ void Assembler::assemble(IRBuffer *buf, MachineCode *mcode) {
         snapshotAlloc(snap, buf->snapmap());
       emit(ins);
       --snapno_;
-    } else
+    } else if (!isDead(ins)) {
       emit(ins);
+    }
+    if (LC_UNLIKELY(mcp < mclim)) {
+      // MachineCode::ensureSpace() should make this impossible.
+      cerr << "FATAL: Machine code area overflow." << endl;
+      exit(2);
+    }
   }
 
   evictConstants();
@@ -1054,6 +1318,7 @@ void Assembler::assemble(IRBuffer *buf, MachineCode *mcode) {
   // TODO: Save to trace fragment
   LC_ASSERT_MSG(freeset_.raw() == kGPR.raw(),
                 "free = %x, gpr = %x\n", freeset_.raw(), kGPR.raw());
+  setupExitStubs(mcode);
   mcode->commit(mcp);
 
   RA_DBG_FLUSH();
@@ -1104,7 +1369,7 @@ void Assembler::itblGuard(IR *ins, bool inverted) {
     mrm_.idx = RID_NONE;
     emit_gmrmi(XG_ARITHi(XOg_CMP), RID_MRM | REX_64, imm);
   } else {
-    Reg right = alloc1(itblref, kGPR);
+    Reg right = alloc1(itblref, kGPR.exclude(closreg));
     mrm_.base = closreg;
     mrm_.ofs = 0;
     mrm_.idx = RID_NONE;
@@ -1124,10 +1389,9 @@ static const uint16_t asm_compmap[IR::kNE - IR::kLT + 1] = {
 };
 
 void Assembler::guardcc(int cc) {
-  MCode *target = exitstubAddr(snapno_);
   Snapshot &snap = buf_->snap(snapno_);
   MCode *p = mcp;
-  *(int32_t *)(p - 4) = jmprel(p, target);
+  *(int32_t *)(p - 4) = 0;  // Set by setupExitStubs.
   p[-5] = (MCode)(XI_JCCn + (cc & 15));
   p[-6] = 0x0f;
   mcp = p - 6;
@@ -1149,9 +1413,14 @@ void Assembler::patchGuard(Fragment *F, ExitNo exitno, MCode *target) {
   jit()->mcode()->patchFinish(area);
 }
 
-void Assembler::patchFallthrough(Fragment *parent, ExitNo exitno, Fragment *target) {
+bool Assembler::patchFallthrough(Fragment *parent, ExitNo exitno, Fragment *target) {
   MachineCode *mcode = jit()->mcode();
 
+  // Unlike a trace, the bridge is not preceded by ensureSpace(), and
+  // the area cannot be flushed while the parent trace is running.
+  if (mcode->available() < FALLTHROUGH_BRIDGE_SIZE + MCLIM_REDZONE)
+    return false;
+
   // Generate the short sequence that sets the target trace ID and
   // then jumps to the target fragment.
   setupMachineCode(mcode);
@@ -1161,6 +1430,7 @@ void Assembler::patchFallthrough(Fragment *parent, ExitNo exitno, Fragment *targ
   mcode->commit(mcp);
 
   patchGuard(parent, exitno, bridge_start);
+  return true;
 }
 
 void Assembler::compare(IR *ins, int cc) {
@@ -1172,9 +1442,9 @@ void Assembler::compare(IR *ins, int cc) {
     guardcc(cc);
     emit_gmrmi(XG_ARITHi(XOg_CMP), left | REX_64, imm);
   } else {
-    Reg right = alloc1(rref, kGPR);
+    Reg right = fuseLoad(rref, kGPR.exclude(left));
     guardcc(cc);
-    emit_mrm(XO_CMP, left | REX_64, right | REX_64);
+    emit_mrm(XO_CMP, left | REX_64, right == RID_MRM ? right : right | REX_64);
   }
 }
 
@@ -1202,6 +1472,76 @@ void Assembler::insPLOAD(IR *ins) {
   // TODO: add special case for irref_islit(ofsref)?
 }
 
+static inline x86Mode arrayScale(IRType ty) {
+  switch (ty) {
+  case IRT_U8:  return XM_SCALE1;
+  case IRT_U16: return XM_SCALE2;
+  case IRT_U32: return XM_SCALE4;
+  default:
+    LC_ASSERT(ty == IRT_U64);
+    return XM_SCALE8;
+  }
+}
+
+static inline int32_t arrayElemSize(IRType ty) {
+  return 1 << ((int)arrayScale(ty) >> 6);
+}
+
+// Set up mrm_ to point to the array element referenced by an AREF.
+// The address computation is always fused into the load/store:
+//
+//     [array + index * width + offsetof(payload_)]
+//
+// If the index is a constant it is folded into the displacement.
+void Assembler::arrayRef(IRRef aref, IRType ty, RegSet allow) {
+  IR *arefins = ir(aref);
+  LC_ASSERT(arefins->opcode() == IR::kAREF);
+  IRRef arrref = arefins->op1();
+  IRRef idxref = arefins->op2();
+  int32_t ofs = (int32_t)offsetof(ByteArrayClosure, payload_);
+  int32_t k;
+  if (is32BitLiteral(idxref, &k) &&
+      checki32((int64_t)k * arrayElemSize(ty) + ofs)) {
+    mrm_.base = alloc1(arrref, allow);
+    mrm_.idx = RID_NONE;
+    mrm_.ofs = k * arrayElemSize(ty) + ofs;
+  } else {
+    Reg arr = alloc1(arrref, allow);
+    mrm_.base = arr;
+    mrm_.idx = alloc1(idxref, allow.exclude(arr));
+    mrm_.scale = arrayScale(ty);
+    mrm_.ofs = ofs;
+  }
+}
+
+void Assembler::insALOAD(IR *ins) {
+  IRType ty = ins->type();
+  Reg dst = destReg(ins, kGPR);
+  arrayRef(ins->op1(), ty, kGPR);
+  x86Op xo;
+  switch (ty) {
+  case IRT_U8:  xo = XO_MOVZXb; break;
+  case IRT_U16: xo = XO_MOVZXw; break;
+  case IRT_U32: xo = XO_MOV; break;  // Implicitly zero-extends.
+  default:      xo = XO_MOV; dst |= REX_64; break;
+  }
+  emit_mrm(xo, dst, RID_MRM);
+}
+
+void Assembler::insASTORE(IR *ins) {
+  IRType ty = ins->type();
+  Reg src = alloc1(ins->op2(), kGPR);
+  arrayRef(ins->op1(), ty, kGPR.exclude(src));
+  x86Op xo;
+  switch (ty) {
+  case IRT_U8:  xo = XO_MOVtob; src |= FORCE_REX; break;  // sil, dil
+  case IRT_U16: xo = XO_MOVtow; break;
+  case IRT_U32: xo = XO_MOVto; break;
+  default:      xo = XO_MOVto; src |= REX_64; break;
+  }
+  emit_mrm(xo, src, RID_MRM);
+}
+
 // Increment or decrement the heap pointer by a number of bytes.
 //
 // We may want to decrement the heap pointer if the parent trace
@@ -1219,6 +1559,8 @@ void Assembler::heapCheck(IR *ins) {
   if (bytes == 0)
     return;
 
+  recordGCMap();
+
   if (mcQuickHeapCheck_ != NULL) {
 
     MCode *p = mcp;
@@ -1272,6 +1614,37 @@ void Assembler::insNew(IR *ins) {
 
 void Assembler::insUpdate(IR *ins) {
   Reg oldptr = alloc1(ins->op1(), kGPR);
+  Reg tmp = allocScratchReg(kGPR.exclude(oldptr));
+
+  // Write barrier.  If the updated object is in the old generation
+  // it must be added to the remembered set:
+  //
+  //     mov  tmp, oldptr
+  //     and  tmp, -RegionSize
+  //     cmp  qword [tmp + generationOffset], 0
+  //     je   skip
+  //     push oldptr
+  //     call asmWriteBarrier    ; preserves all registers and flags
+  //   skip:
+  //
+  MCode *skip = mcp;
+  *(int32_t *)(mcp - 4) = jmprel(mcp, (MCode *)(void *)&asmWriteBarrier);
+  mcp[-5] = XI_CALL;
+  mcp -= 5;
+  *--mcp = (MCode)(XI_PUSH + (oldptr & 7));
+  if (oldptr & 8)
+    *--mcp = 0x41;  // REX.B
+  mcp[-1] = (MCode)(skip - mcp);
+  mcp[-2] = (MCode)(XI_JCCs + CC_E);
+  mcp -= 2;
+  mrm_.base = tmp;
+  mrm_.ofs = Region::generationOffset();
+  mrm_.idx = RID_NONE;
+  emit_gmrmi(XG_ARITHi(XOg_CMP), RID_MRM | REX_64, 0);
+  emit_gri(XG_ARITHi(XOg_AND), tmp | REX_64,
+           -(int32_t)Region::kRegionSize);
+  move(tmp, oldptr);
+
   memstore(oldptr, sizeof(Word), ins->op2(), kGPR.exclude(oldptr));
   memstore(oldptr, 0, REF_IND, kGPR.exclude(oldptr));
 }
@@ -1282,7 +1655,8 @@ void Assembler::emit(IR *ins) {
     emitSLOAD(ins);
     break;
   case IR::kADD:
-    intArith(ins, XOg_ADD);
+    if (!leaAdd(ins))
+      intArith(ins, XOg_ADD);
     break;
   case IR::kSUB:
     intArith(ins, XOg_SUB);
@@ -1364,6 +1738,15 @@ void Assembler::emit(IR *ins) {
   case IR::kPLOAD:
     insPLOAD(ins);
     break;
+  case IR::kAREF:
+    // Always fused into its use sites.
+    break;
+  case IR::kALOAD:
+    insALOAD(ins);
+    break;
+  case IR::kASTORE:
+    insASTORE(ins);
+    break;
   case IR::kBSHL: bitshift(ins, XOg_SHL); break;
   case IR::kBSHR: bitshift(ins, XOg_SHR); break;
   case IR::kBSAR: bitshift(ins, XOg_SAR); break;
@@ -1375,6 +1758,59 @@ void Assembler::emit(IR *ins) {
   }
 }
 
+// Records where the live values are at the current heap check, so
+// that a GC can run without leaving the trace.  Registers are
+// allocated backwards, so a register that is in use here holds its
+// value from before the heap check, and a value that already has a
+// spill slot and is defined before the heap check is live across it.
+//
+// Each value must either be in the snapshot (the GC then finds it on
+// the stack) or be a closure.  Values of unknown type and internal
+// pointers (e.g., FREF) can't be updated by the GC, so we give up.
+void Assembler::recordGCMap() {
+  Snapshot &snap = buf_->snap(snapno_);
+  SnapshotData *snapmap = buf_->snapmap();
+  GCMap &map = gcmaps_[snapno_];
+  map.begin = gcroots_.size();
+  map.valid = true;
+
+  for (IRRef ref = REF_FIRST; ref < curins_ && map.valid; ++ref) {
+    IR *ins = ir(ref);
+    Reg r = ins->reg();
+    bool inReg = isReg(r) && !freeset_.test(r) && cost_[r].ref() == ref;
+    if (!inReg && ins->spill() == 0)
+      continue;
+
+    GCRoot root;
+    root.isClosure = ins->type() == IRT_CLOS;
+    root.slot = kNoStackSlot;
+    for (Snapshot::MapRef se = snap.begin(); se != snap.end(); ++se) {
+      if (snapmap->slotRef(se) == ref) {
+        root.slot = snapmap->slotId(se);
+        break;
+      }
+    }
+    if (root.slot == kNoStackSlot && !root.isClosure) {
+      IRType ty = ins->type();
+      if (ty == IRT_UNKNOWN || ty == IRT_PTR)
+        map.valid = false;
+      continue;  // Not a pointer.
+    }
+
+    if (inReg) {
+      root.loc.reg = r;
+      root.loc.spill = 0;
+      gcroots_.push_back(root);
+    }
+    if (ins->spill() != 0) {
+      root.loc.reg = RID_NONE;
+      root.loc.spill = ins->spill();
+      gcroots_.push_back(root);
+    }
+  }
+  map.end = gcroots_.size();
+}
+
 void Assembler::snapshotAlloc1(IRRef ref) {
   IR *ins = ir(ref);
   if (!ins->hasRegOrSpill()) {
@@ -1452,9 +1888,11 @@ void Assembler::emit_jmp(MCode *target) {
 }
 
 void Assembler::exitTo(SnapNo snapno) {
-  MCode *target = exitstubAddr(snapno);
   Snapshot &snap = buf_->snap(snapno);
-  emit_jmp(target);
+  MCode *p = mcp;
+  *(int32_t *)(p - 4) = 0;  // Set by setupExitStubs.
+  p[-5] = XI_JMP;
+  mcp = p - 5;
   snap.mcode_ = mcp;
 
   // For debugging.
@@ -1722,84 +2160,152 @@ Assembler::parallelAssign(ParAssign *assign, Reg optTmp)
 // Exit Stubs
 // ==========
 //
+// Every exit of a fragment gets its own stub:
+//
+//     push $<exitno>     // 32-bit immediate
+//     jmp  SAVE
+//
+// SAVE builds the ExitState on the C stack, but only stores the
+// registers that the snapshot of the exit restores from (see
+// Fragment::compileRestore), plus the base and heap pointer.  All
+// other register slots of the ExitState are undefined.  It then
+// jumps to asmExit with the exit number in edi.  There is one SAVE
+// sequence per register set; it is shared by all fragments until the
+// machine code is flushed.
+//
+// The registers of the snapshot entries are only known once the
+// whole trace is assembled, so the guards are emitted without a
+// target and patched by setupExitStubs.
+
+#define EXITSTUB_SIZE  (5 + 5)
+
+// The ExitState ends at the HpLim slot of the trace's stack frame.
+// The exit number pushed by the stub ends up in the slot of the last
+// register.
+#define EXIT_FRAME_SIZE  ((int32_t)offsetof(ExitState, hplim))
+#define EXIT_GPR_OFS(r) \
+  ((int32_t)(offsetof(ExitState, gpr) + (r) * sizeof(Word)))
+#define EXIT_NO_OFS  EXIT_GPR_OFS(RID_NUM_GPR - 1)
+
+RegSet Assembler::exitRegs(Snapshot &snap) {
+  RegSet regs = RegSet::fromReg(RID_BASE).include(RID_HP);
+  if (ir(snap.ref())->opcode() == IR::kSAVE)
+    return regs;  // Only uses base and hp.
+  SnapshotData *snapmap = buf_->snapmap();
+  for (Snapshot::MapRef se = snap.begin(); se != snap.end(); ++se) {
+    IRRef ref = snapmap->slotRef(se);
+    if (irref_islit(ref))
+      continue;
+    IR *ins = ir(ref);
+    if (ins->spill() == 0) {
+      LC_ASSERT(isReg(ins->reg()) && ins->reg() != RID_ESP);
+      regs.set(ins->reg());
+    }
+  }
+  return regs;
+}
 
-#define EXITSTUBS_PER_GROUP 32
-#define EXITSTUB_SPACING    (2+2)
-
-MCode *Assembler::exitstubAddr(ExitNo exitno) {
-  // Cast to char because we're calculating in bytes.
-  char **group = (char **)jit_->exitStubGroup_;
-  LC_ASSERT(group[exitno / EXITSTUBS_PER_GROUP] != NULL);
-  return (MCode *)(group[exitno / EXITSTUBS_PER_GROUP] +
-                   EXITSTUB_SPACING * (exitno % EXITSTUBS_PER_GROUP));
+static inline MCode *emitExitSave(MCode *p, Reg r, int32_t ofs) {
+  // mov [rsp + ofs], r
+  *p++ = (MCode)(0x48 | ((r & 8) ? 0x04 : 0));  // REX.W (+ REX.R)
+  *p++ = (MCode)(XO_MOVto >> 24);
+  *p++ = (MCode)(XM_OFS32 | ((r & 7) << 3) | RID_ESP);
+  *p++ = 0x24;  // SIB byte for [rsp]
+  *(int32_t *)p = ofs;
+  return p + 4;
 }
 
-MCode *Assembler::generateExitstubGroup(ExitNo group, MachineCode *mcode) {
-  ExitNo i;
-  ExitNo groupofs = (group * EXITSTUBS_PER_GROUP) & 0xff;
+MCode *Assembler::exitSaveCode(RegSet regs, MachineCode *mcode) {
+  EXIT_SAVE_MAP::iterator it = jit_->exitSaveCode_.find(regs.raw());
+  if (it != jit_->exitSaveCode_.end())
+    return it->second;
+
   MCode *mxp = mcbot;
   MCode *mxpstart = mxp;
-  if (mxp + (2 + 2) * EXITSTUBS_PER_GROUP + 8 + 5 >= mctop) {
+  if (mxp + 8 * (RID_NUM_GPR + 2) + 5 >= mcp) {
     cerr << "NYI: Overflow when generating exit stubs." << endl;
     exit(2);
   }
-  // For each ExitNo in the group generate:
-  //     push $(exitno)   // 8-bit immediate
-  //     jmp END      // 8-bit offset
-  *mxp++ = XI_PUSHi8;
-  *mxp++ = (MCode)groupofs;  // groupofs + 0
-  for (i = 1; i < EXITSTUBS_PER_GROUP; i++) {
-    // Branch for the previous exitno
-    *mxp++ = XI_JMPs;
-    *mxp++ = (MCode)((2 + 2) * (EXITSTUBS_PER_GROUP - i) - 2);
-    // The next exitno.
-    *mxp++ = XI_PUSHi8;
-    *mxp++ = (MCode)(groupofs + i);
-  }
-  // We don't need a jump for the final exit in the group.  It's just
-  // a fall-through.
-
-  // This is where where the END label occurs.
-
-  // Push the high byte of the exit no.
-  *mxp++ = XI_PUSHi8;
-  *mxp++ = (MCode)((group * EXITSTUBS_PER_GROUP) >> 8);
-
-  // Jump (relative) to exit handler.
+  // lea rsp, [rsp - (EXIT_FRAME_SIZE - 8)]  -- the stub pushed 8 bytes
+  *mxp++ = 0x48;
+  *mxp++ = (MCode)XI_LEA;
+  *mxp++ = (MCode)(XM_OFS32 | (RID_ESP << 3) | RID_ESP);
+  *mxp++ = 0x24;
+  *(int32_t *)mxp = -(EXIT_FRAME_SIZE - 8);
+  mxp += 4;
+
+  // Store the registers, but not yet the one whose slot holds the
+  // exit number.
+  for (RegSet work = regs.exclude(RID_R15D); !work.isEmpty(); ) {
+    Reg r = work.pickBot();
+    work.clear(r);
+    mxp = emitExitSave(mxp, r, EXIT_GPR_OFS(r));
+  }
+
+  // mov edi, [rsp + EXIT_NO_OFS]
+  *mxp++ = (MCode)(XO_MOV >> 24);
+  *mxp++ = (MCode)(XM_OFS32 | (RID_EDI << 3) | RID_ESP);
+  *mxp++ = 0x24;
+  *(int32_t *)mxp = EXIT_NO_OFS;
+  mxp += 4;
+
+  if (regs.test(RID_R15D))
+    mxp = emitExitSave(mxp, RID_R15D, EXIT_NO_OFS);
+
   *mxp++ = XI_JMP;
-  mxp += 4;   // The jump is relative to the *end* of the instruction.
+  mxp += 4;
   *((int32_t *)(mxp - 4)) = jmprel(mxp, (MCode *)(void *)asmExit);
 
-  // Commit code for this group (even if assembly fails later on).
   mcode->commitStub(mxp);
   mcbot = mxp;
   mclim = mcbot + MCLIM_REDZONE;
 
+  jit_->exitSaveCode_[regs.raw()] = mxpstart;
   return mxpstart;
 }
 
-void Assembler::setupExitStubs(ExitNo nexits, MachineCode *mcode) {
-  ExitNo i;
-  if (nexits >= EXITSTUBS_PER_GROUP * 16) {
-    cerr << "FATAL: Too many exit stubs! (" << nexits << ")" << endl;
-    exit(3);
-  }
-  ExitNo ngroups = (nexits + EXITSTUBS_PER_GROUP + 1) / EXITSTUBS_PER_GROUP;
-  for (i = 0; i < ngroups; ++i) {
-    if (jit_->exitStubGroup_[i] == NULL) {
-      jit_->exitStubGroup_[i] = generateExitstubGroup(i, mcode);
-      if (true) {
-        MCode *start = jit_->exitStubGroup_[i];
-        MCode *end = mcode->stubEnd();
-        ios_base::openmode mode = (i == 0) ? ios_base::trunc : ios_base::app;
-        ofstream out;
-        out.open("dump_exitstubs.s", ios_base::out | mode);
-        out << ".text\n" "stub_group_" << (int)i << ":\n";
-        mcode->dumpAsm(out, start, end);
-        out.close();
-      }
+void Assembler::setupExitStubs(MachineCode *mcode) {
+  MCode *start = mcbot;
+  for (SnapNo snapno = 0; snapno < buf_->numSnapshots(); ++snapno) {
+    Snapshot &snap = buf_->snap(snapno);
+    MCode *p = snap.mcode_;
+    if (p == NULL)
+      continue;  // Exits through asmHeapOverflow or never leaves.
+    MCode *save = exitSaveCode(exitRegs(snap), mcode);
+
+    MCode *mxp = mcbot;
+    if (mxp + EXITSTUB_SIZE >= mcp) {
+      cerr << "NYI: Overflow when generating exit stubs." << endl;
+      exit(2);
     }
-  }
+    *mxp++ = XI_PUSHi;
+    *(int32_t *)mxp = (int32_t)snapno;
+    mxp += 4;
+    *mxp++ = XI_JMP;
+    mxp += 4;
+    *((int32_t *)(mxp - 4)) = jmprel(mxp, save);
+    mcode->commitStub(mxp);
+    mcbot = mxp;
+    mclim = mcbot + MCLIM_REDZONE;
+
+    // Point the guard to the stub (see patchGuard).
+    MCode *stub = mxp - EXITSTUB_SIZE;
+    if (p[0] == (MCode)0x0f)
+      *(int32_t *)(p + 2) = jmprel(p + 6, stub);
+    else
+      *(int32_t *)(p + 1) = jmprel(p + 5, stub);
+  }
+#if (DEBUG_COMPONENTS & DEBUG_ASSEMBLER)
+  {
+    ofstream out;
+    out.open("dump_exitstubs.s", ios_base::out | ios_base::app);
+    out << ".text\n" "stubs_" << (void *)start << ":\n";
+    mcode->dumpAsm(out, start, mcbot);
+    out.close();
+  }
+#else
+  UNUSED(start);
+#endif
 }
 
 const char *regNames32[RID_NUM_GPR] = {
@@ -76,6 +76,17 @@ inline int32_t sps_scale(int ofs) { return 8 * ofs; }
 /// A proper investigation of good cost function design is probably
 /// warranted, although there are likely diminishing returns on
 /// architectures with many registers.
+///
+/// On top of that we use two cheap heuristics for non-constants:
+///
+///   - Each use adds a small weight (up to a limit).  Heavily used
+///     values are more likely to be needed in a register again soon.
+///
+///   - Values that already own a spill slot are cheaper to evict,
+///     because the store at the definition site is already paid for.
+///
+/// Constants always stay cheaper than any instruction, because they
+/// can be rematerialised without a spill slot.
 /// 
 class RegCost {
 public:
@@ -85,11 +96,26 @@ public:
       ((uint32_t)(t & IRT_ISPHI)) * (((uint32_t)kPhiWeight << 16) / IRT_ISPHI);
     cost_ = ((uint32_t)ref << 16) + (uint32_t)ref + other_cost;
   }
+  inline RegCost(uint16_t ref, IRType t, uint32_t uses, bool spilled) {
+    uint32_t cost = (uint32_t)ref +
+      ((uint32_t)(t & IRT_ISPHI)) * (kPhiWeight / IRT_ISPHI);
+    if (ref >= REF_BIAS) {
+      cost += kUseWeight * (uses < kMaxUses ? uses : kMaxUses);
+      if (spilled)
+        cost -= kSpilledDiscount;
+      if (cost < REF_BIAS) cost = REF_BIAS;
+      if (cost > 0xffff) cost = 0xffff;
+    }
+    cost_ = (cost << 16) + (uint32_t)ref;
+  }
   ~RegCost() {}
 
   static inline RegCost maxCost() { return RegCost(~(uint32_t)0); }
 
   static const uint32_t kPhiWeight = 64;
+  static const uint32_t kUseWeight = 4;
+  static const uint32_t kMaxUses = 16;
+  static const uint32_t kSpilledDiscount = 32;
 
   inline uint16_t ref() const { return (uint16_t)cost_; }
   inline uint16_t cost() const { return (uint16_t)(cost_ >> 16); }
@@ -182,11 +208,26 @@ public:
 
   // Make the given slot available again. Slot must not be 0;
   inline void free(uint32_t slot);
-  
+
+  // Release the slot of a value defined at `def`.  The slot may
+  // then be reused by any value whose live range ends before `def`.
+  inline void release(uint32_t slot, IRRef def);
+
+  // Return a spill slot for a value whose last use is at `lastuse`.
+  // Prefers a released slot that is not live at any point up to
+  // `lastuse` and otherwise falls back to a fresh slot.
+  uint32_t allocReuse(IRRef lastuse);
+
+  static const uint32_t kNumSlots = 256;
+
 private:
   uint32_t allocSpillHigh();
   // 1-bit means: slot is available
-  Word data_[(256 / 8) / sizeof(Word)];
+  Word data_[(kNumSlots / 8) / sizeof(Word)];
+  // 1-bit means: slot has been released and may be reused
+  Word reusable_[(kNumSlots / 8) / sizeof(Word)];
+  // Definition site of the last value that used this slot.
+  IRRef1 releasedAt_[kNumSlots];
 };
 
 inline void
@@ -195,6 +236,8 @@ SpillSet::reset()
   data_[0] = ~(Word)1; /* never use slot 0 */ 
   for (unsigned int i = 1; i < countof(data_); ++i)
     data_[i] = ~(Word)0;
+  for (unsigned int i = 0; i < countof(reusable_); ++i)
+    reusable_[i] = 0;
 }
 
 inline uint32_t
@@ -228,6 +271,16 @@ SpillSet::free(uint32_t slot)
   data_[i] |= mask;
 }
 
+inline void
+SpillSet::release(uint32_t slot, IRRef def)
+{
+  LC_ASSERT(slot > 0 && slot < kNumSlots);
+  uint32_t i = slot >> LC_ARCH_BITS_LOG2;
+  uint32_t bit = slot & ((1 << LC_ARCH_BITS_LOG2) - 1);
+  reusable_[i] |= (Word)1 << bit;
+  releasedAt_[slot] = (IRRef1)def;
+}
+
 /* Macros to construct variable-length x86 opcodes. -(len+1) is in LSB. */
 #define XO_(o)		((uint32_t)(0x0000fe + (0x##o<<24)))
 #define XO_FPU(a,b)	((uint32_t)(0x00fd + (0x##a<<16)+(0x##b<<24)))
@@ -259,6 +312,7 @@ typedef enum {
   XI_ARITHi =	0x81,
   XI_ARITHi8 =	0x83,
   XI_PUSHi8 =	0x6a,
+  XI_PUSHi =	0x68,
   XI_TEST =	0x85,
   XI_RET =      0xc3,
   XI_MOVmi =	0xc7,
@@ -417,6 +471,26 @@ inline bool hasSpill(RegSpill regsp) {
   return regsp.spill != 0;
 }
 
+/// A register or spill slot holding a live value at a heap check.  If
+/// the value is also in the heap check's snapshot, `slot` is one of
+/// its stack slots.  See Fragment::collectGarbage.
+typedef struct {
+  RegSpill loc;
+  uint8_t isClosure;  /* Known to be a pointer to a closure. */
+  int32_t slot;       /* Stack slot or kNoStackSlot. */
+} GCRoot;
+
+static const int32_t kNoStackSlot = 0x7fffffff;
+
+/// The GC roots of a heap check are entries [begin, end) of the
+/// fragment's GCRoot array.  If not valid, the trace must be left to
+/// perform a GC.
+typedef struct {
+  uint32_t begin;
+  uint32_t end;
+  bool valid;
+} GCMap;
+
 #define MAX_PAR_MOVE_SIZE 256
 
 typedef struct {
@@ -519,6 +593,16 @@ public:
   void setup(IRBuffer *);
   void setupMachineCode(MachineCode *);
   void setupRegAlloc();
+  void computeLiveness(IRBuffer *);
+  inline void noteUse(IRRef ref, IRRef at);
+  inline void extendLive(IRRef ref, IRRef at);
+  inline void extendLiveOperands(IR *ins, IRRef at);
+  bool canFuse(IRRef ref);
+  inline bool canFuseLoad(IRRef ref);
+  bool isDead(IR *ins);
+  bool leaAdd(IR *ins);
+  inline IRRef lastUse(IRRef ref) const { return lastuse_[ref - REF_BIAS]; }
+  inline RegCost spillCost(IRRef ref, IR *ins);
 
   bool is32BitLiteral(IRRef ref, int32_t *k);
   void intArith(IR *ins, x86Arith xa);
@@ -537,15 +621,19 @@ public:
   void fieldLoad(IR *ins);
   inline void adjustHeapPointer(int32_t bytes);
   void heapCheck(IR *ins);
+  void recordGCMap();
   void insNew(IR *ins);
   void insUpdate(IR *ins);
   void emit(IR *ins);
   void save(IR *ins);
   void memstore(Reg base, int32_t ofs, IRRef ref, RegSet allow);
   void patchGuard(Fragment *, ExitNo, MCode *target);
-  void patchFallthrough(Fragment *parent, ExitNo, Fragment *target);
+  bool patchFallthrough(Fragment *parent, ExitNo, Fragment *target);
   void adjustBase(int32_t relbase);
   void insPLOAD(IR *ins);
+  void arrayRef(IRRef aref, IRType ty, RegSet allow);
+  void insALOAD(IR *ins);
+  void insASTORE(IR *ins);
   void stackCheck(void);
 
   // Emits code to increment the value of the value at the target
@@ -565,9 +653,9 @@ public:
 private:
   inline int32_t spillOffset(uint8_t spillSlot) const;
   
-  MCode *generateExitstubGroup(ExitNo group, MachineCode *);
-  void setupExitStubs(ExitNo nexits, MachineCode *mcode);
-  MCode *exitstubAddr(ExitNo);
+  void setupExitStubs(MachineCode *mcode);
+  RegSet exitRegs(Snapshot &);
+  MCode *exitSaveCode(RegSet regs, MachineCode *mcode);
   void emitSLOAD(IR *);
   void exitTo(SnapNo);
   void prepareTail(IRBuffer *buf, IRRef saveref);
@@ -666,6 +754,9 @@ private:
 
   MCode *mcQuickHeapCheck_;
   uint32_t numHeapChecks_;
+  // Stack maps for heap checks, indexed by snapshot number.
+  std::vector<GCMap> gcmaps_;
+  std::vector<GCRoot> gcroots_;
 
   Jit *jit_;
   IR *ir_;
@@ -680,6 +771,11 @@ private:
   RegSet phiset_;   // PHI registers.
   RegCost cost_[RID_MAX];  // References and spill cost for registers.
   SpillSet spills_;
+  // Last use and number of uses of each non-constant instruction,
+  // indexed by (ref - REF_BIAS).  Used for spill slot reuse and
+  // for computing spill costs.
+  std::vector<IRRef1> lastuse_;
+  std::vector<uint16_t> nuses_;
   x86ModRM mrm_;
   //  RegSet weakset_;
 
@@ -4,6 +4,7 @@
 #include "objects.hh"
 #include "miscclosures.hh"
 #include "time.hh"
+#include "heapprofile.hh"
 
 #include <iomanip>
 #include <string.h>
@@ -30,10 +31,12 @@ Capability::Capability(MemoryManager *mm)
     reload_state_pc_(&reload_state_code[0]),
     counters_(HOT_THRESHOLD), // TODO: initialise from Options
     flags_() {
+  mm_->addAllocBuffer(&allocBuffer_);
   interpMsg(kModeInit);
 }
 
 Capability::~Capability() {
+  mm_->removeAllocBuffer(&allocBuffer_);
 }
 
 bool Capability::run(Thread *T) {
@@ -228,7 +231,7 @@ Capability::InterpExitCode Capability::interpMsg(InterpMode mode) {
   u4 opA, opB, opC, opcode;
   char *heap;
   char *heaplim;
-  mm_->getBumpAllocatorBounds(&heap, &heaplim);
+  mm_->getBumpAllocatorBounds(&allocBuffer_, &heap, &heaplim);
   // Technically, we only need a pointer to the literals.  But having
   // a pointer to the whole code segment can be useful for debugging.
   const Code *code = NULL;
@@ -567,7 +570,14 @@ op_ALLOC1:
   // C = payload[0]
   {
     DECODE_BC;
-    Closure *cl = (Closure *)heap;
+    Closure *cl = MiscClosures::sharedBox((InfoTable *)base[opB],
+                                          base[opC]);
+    if (cl != NULL) {
+      ++pc;
+      base[opA] = (Word)cl;
+      DISPATCH_NEXT;
+    }
+    cl = (Closure *)heap;
     BUMP_HEAP(1);
     ++pc;
     cl->setInfo((InfoTable *)base[opB]);
@@ -636,6 +646,8 @@ heapOverflow:
   // tried to allocate.
   T->sync(pc, base);
   DLOG("Heap Block Overflow: %p of %p\n", heap, heaplim);
+  if (LC_UNLIKELY(mm_->heapProfile() != NULL))
+    mm_->heapProfile()->recordAllocation(pc, Block::kBlockSize);
   mm_->bumpAllocatorFull(&heap, &heaplim, this);
   // re-dispatch last instruction
   DISPATCH_NEXT;
@@ -755,6 +767,8 @@ op_UPDATE: {
     if (info->type() == CAF) {
       oldnode->setPayload(1, (Word)static_roots_);
       static_roots_ = oldnode;
+    } else {
+      mm_->writeBarrier(oldnode);
     }
 
     DISPATCH_NEXT;
@@ -986,6 +1000,9 @@ op_INITF:
     DECODE_BC;
     Closure *cl = (Closure *)base[opA];
     cl->setPayload(opC - 1, base[opB]);
+    // A GC may have happened between allocating the object and
+    // initialising this field.
+    mm_->writeBarrier(cl);
     DISPATCH_NEXT;
   }
 
@@ -1067,6 +1084,9 @@ op_CASE_S:
       (sizeof(ByteArrayClosure) + payloadSizeWords * sizeof(Word));
     cl->header_.info_ = MiscClosures::stg_BYTEARR_info;
     cl->bytes_ = payloadSizeBytes;
+    if (LC_UNLIKELY(mm_->heapProfile() != NULL))
+      mm_->heapProfile()->recordAllocation(pc - 1, sizeof(ByteArrayClosure) +
+                                           payloadSizeWords * sizeof(Word));
 
     base[opA] = (Word)cl;
     DISPATCH_NEXT;
@@ -1116,17 +1136,17 @@ op_JRET:
   cerr << "\nERROR: Unimplemented instruction: " << (pc - 1)->name() << endl;
   // not_yet_implemented:
   T->sync(pc, base);
-  mm_->sync(heap, heaplim);
+  mm_->sync(&allocBuffer_, heap, heaplim);
   return kInterpUnimplemented;
 
 op_STOP:
   T->sync(pc, base);
-  mm_->sync(heap, heaplim);
+  mm_->sync(&allocBuffer_, heap, heaplim);
   return kInterpOk;
 
 stack_overflow:
   T->sync(pc, base);
-  mm_->sync(heap, heaplim);
+  mm_->sync(&allocBuffer_, heap, heaplim);
   cerr << "\nERROR: Stack overflow.\n";
   return kInterpStackOverflow;
 
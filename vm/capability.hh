@@ -36,8 +36,11 @@ public:
     return flags_.get(kRecording);
   }
   inline Jit *jit() { return &jit_; }
+  inline MemoryManager *mm() const { return mm_; }
+  inline AllocBuffer *allocBuffer() { return &allocBuffer_; }
 
   inline Word *traceExitHp() const { return traceExitHp_; }
+
   inline Word *traceExitHpLim() const { return traceExitHpLim_; }
 
   enum {
@@ -102,6 +105,8 @@ private:
   Word *traceExitHp_;
   Word *traceExitHpLim_;
 
+  AllocBuffer allocBuffer_;
+
   friend class Fragment;
   friend class BranchTargetBuffer;  // For resetting hot counters.
 };
@@ -109,7 +114,7 @@ private:
 inline int
 Capability::heapCheckFailQuick(char **heap, char **hplim)
 {
-  return mm_->bumpAllocatorFullNoGC(heap, hplim);
+  return mm_->bumpAllocatorFullNoGC(&allocBuffer_, heap, hplim);
 }
 
 extern uint64_t recordings_started;
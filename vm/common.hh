@@ -226,6 +226,7 @@ from separately compiled modules.
 
 #define LC_LIKELY(x)	__builtin_expect(!!(x), 1)
 #define LC_UNLIKELY(x)	__builtin_expect(!!(x), 0)
+#define LC_PREFETCH(p)	__builtin_prefetch((p))
 
 #else
 
@@ -290,7 +291,6 @@ INLINE_HEADER void sayonara(const char *last_words) {
 /* JIT compiler limits. */
 #define LC_MAX_JSLOTS	250		/* Max. # of stack slots for a trace. */
 #define LC_MAX_PHI	32		/* Max. # of PHIs for a loop. */
-#define LC_MAX_EXITSTUBGR	8	/* Max. # of exit stub groups. */
 
 /* Various macros. */
 #define i32ptr(p)	((int32_t)(intptr_t)(void *)(p))
@@ -0,0 +1,119 @@
+#include "heapprofile.hh"
+#include "loader.hh"
+
+#include <algorithm>
+#include <time.h>
+#include <vector>
+
+_START_LAMBDACHINE_NAMESPACE
+
+using namespace std;
+
+#define DEF_CLOS_TY_NAME(name, flags) #name,
+static const char *closureTypeNames[] = {
+  CTDEF(DEF_CLOS_TY_NAME)
+};
+#undef DEF_CLOS_TY_NAME
+
+HeapProfile::HeapProfile(const char *path, const char *job)
+  : path_(path), out_(NULL), start_(getProcessElapsedTime()), samples_(0) {
+  out_ = fopen(path, "w");
+  if (out_ == NULL) {
+    fprintf(stderr, "Could not open heap profile %s\n", path);
+    return;
+  }
+  char date[64];
+  time_t now = time(NULL);
+  strftime(date, sizeof(date), "%a %b %d %H:%M %Y", localtime(&now));
+  fprintf(out_, "JOB \"%s\"\n", job);
+  fprintf(out_, "DATE \"%s\"\n", date);
+  fprintf(out_, "SAMPLE_UNIT \"seconds\"\n");
+  fprintf(out_, "VALUE_UNIT \"bytes\"\n");
+  // hp2ps expects an empty first sample.
+  beginSample(start_);
+  endSample(start_);
+}
+
+HeapProfile::~HeapProfile() {
+  if (out_ != NULL) {
+    Time now = getProcessElapsedTime();
+    beginSample(now);
+    endSample(now);
+    fclose(out_);
+  }
+}
+
+void HeapProfile::beginSample(Time t) {
+  fprintf(out_, "BEGIN_SAMPLE %.2f\n", (double)(t - start_) / TIME_RESOLUTION);
+}
+
+void HeapProfile::endSample(Time t) {
+  fprintf(out_, "END_SAMPLE %.2f\n", (double)(t - start_) / TIME_RESOLUTION);
+}
+
+const char *HeapProfile::bandName(const InfoTable *info) {
+  if (info->name() != NULL)
+    return info->name();
+  if (info->type() < N_CLOSURE_TYPES)
+    return closureTypeNames[info->type()];
+  return "UNKNOWN";
+}
+
+void HeapProfile::addSample(WORD_MAP *census) {
+  if (out_ == NULL) {
+    census->clear();
+    return;
+  }
+  // Different info tables may have the same name (e.g., local
+  // functions in different modules), so merge them.
+  typedef HASH_NAMESPACE::HASH_MAP_CLASS<const char *, Word, hashstr, eqstr>
+    BandMap;
+  BandMap bands;
+  for (WORD_MAP::iterator it = census->begin(); it != census->end(); ++it)
+    bands[bandName((const InfoTable *)it->first)] += it->second;
+  census->clear();
+
+  Time now = getProcessElapsedTime();
+  beginSample(now);
+  for (BandMap::iterator it = bands.begin(); it != bands.end(); ++it)
+    fprintf(out_, "%s\t%" FMT_Word64 "\n", it->first, (uint64_t)it->second);
+  endSample(now);
+  fflush(out_);
+  ++samples_;
+}
+
+static bool moreBytes(const pair<Word, Word> &a, const pair<Word, Word> &b) {
+  return a.second > b.second;
+}
+
+bool HeapProfile::writeAllocationSites(Loader *loader) {
+  string path = path_ + ".alloc";
+  FILE *out = fopen(path.c_str(), "w");
+  if (out == NULL) {
+    fprintf(stderr, "Could not write allocation sites to %s\n",
+            path.c_str());
+    return false;
+  }
+  vector<pair<Word, Word> > sites(sites_.begin(), sites_.end());
+  sort(sites.begin(), sites.end(), moreBytes);
+  Word total = 0;
+  for (size_t i = 0; i < sites.size(); ++i)
+    total += sites[i].second;
+  fprintf(out, "# %" FMT_Word64 " bytes allocated (sampled)\n"
+          "#        bytes      %%  site\n", (uint64_t)total);
+  for (size_t i = 0; i < sites.size(); ++i) {
+    const BcIns *pc = (const BcIns *)sites[i].first;
+    const char *name = NULL;
+    const CodeInfoTable *info = loader->codeInfoTableContaining(pc, &name);
+    fprintf(out, "%14" FMT_Word64 " %6.2f  ", (uint64_t)sites[i].second,
+            total > 0 ? (sites[i].second * 100.0) / total : 0.0);
+    if (info != NULL)
+      fprintf(out, "%s+%d\n", name, (int)(pc - info->code()->code));
+    else
+      fprintf(out, "%p\n", pc);
+  }
+  fclose(out);
+  return true;
+}
+
+_END_LAMBDACHINE_NAMESPACE
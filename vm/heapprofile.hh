@@ -0,0 +1,72 @@
+#ifndef _HEAPPROFILE_H_
+#define _HEAPPROFILE_H_
+
+#include "common.hh"
+#include "objects.hh"
+#include "time.hh"
+
+#include <stdio.h>
+#include <string>
+#include HASH_MAP_H
+
+_START_LAMBDACHINE_NAMESPACE
+
+class Loader;
+
+#define WORD_MAP \
+  HASH_NAMESPACE::HASH_MAP_CLASS<Word,Word>
+
+/// Heap profiler (--heap-profile).
+///
+/// After every major GC the live heap is broken down by info table
+/// and appended as a sample to a file in the format of GHC's heap
+/// profiles, so it can be plotted with hp2ps.  Objects are listed by
+/// info table name, or by closure type if the info table has no name.
+/// Incremental major GCs only count objects marked or copied by the
+/// collector, not those promoted while marking was in progress.
+///
+/// Allocation is attributed to allocation sites by sampling.  Each
+/// time an allocation doesn't fit into the current nursery block, the
+/// whole block is charged to the allocating instruction.  For traces,
+/// that is the instruction at the failed heap check, i.e., the first
+/// allocation instruction covered by the check.  NEWBYTEA is charged
+/// exactly.  This costs nothing on the allocation fast path, so the
+/// profiler is cheap enough to leave on.  When the program exits, the
+/// sites are written to `<file>.alloc`, sorted by bytes allocated.
+class HeapProfile {
+public:
+  HeapProfile(const char *path, const char *job);
+  ~HeapProfile();
+
+  inline bool ok() const { return out_ != NULL; }
+  inline const std::string &path() const { return path_; }
+
+  /// Adds the counts of a census (live bytes per info table) as a new
+  /// sample.  The counts are reset.
+  void addSample(WORD_MAP *census);
+
+  inline void recordAllocation(const BcIns *pc, Word bytes) {
+    sites_[(Word)pc] += bytes;
+  }
+
+  /// Write the allocation sites to `<file>.alloc`.  The loader is
+  /// used to find the name of the function containing each site.
+  bool writeAllocationSites(Loader *loader);
+
+  inline uint32_t samples() const { return samples_; }
+
+private:
+  void beginSample(Time t);
+  void endSample(Time t);
+  static const char *bandName(const InfoTable *info);
+
+  std::string path_;
+  FILE *out_;
+  Time start_;
+  uint32_t samples_;
+  WORD_MAP sites_;
+};
+
+_END_LAMBDACHINE_NAMESPACE
+
+#endif /* _HEAPPROFILE_H_ */
@@ -0,0 +1,509 @@
+#include "image.hh"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+_START_LAMBDACHINE_NAMESPACE
+
+using namespace std;
+
+#define IMAGE_MAGIC    "LCIMAGE"
+#define IMAGE_VERSION  2
+
+static const size_t kPageSize = 4096;
+
+struct ImageHeader {
+  char magic[8];
+  u4 version;
+  u4 wordSize;
+  u4 blockSize;
+  u4 numBlocks;
+  uint64_t preferredBase;
+  u4 numRelocs;
+  u4 numSymbols;
+  uint64_t blocksOffset;    // File offset of the block data.
+  uint64_t trailerOffset;   // File offset of relocations, symbols, names.
+  uint64_t trailerSize;
+  u4 numBuckets;
+};
+
+struct ImageBlock {
+  u4 contents;
+  u4 used;                  // Bytes, starting at the block start.
+};
+
+struct ImageSymbol {
+  u2 kind;
+  u2 flags;
+  u4 name;                  // Offset into the name table.
+  uint64_t offset;          // Image offset, kNoOffset for modules.
+};
+
+static const uint64_t kNoOffset = ~(uint64_t)0;
+
+// Image offset of the start of the i-th block.  The first block of
+// each region is reserved for metadata.
+static inline Word blockOffset(u4 i) {
+  return (i / Image::kBlocksPerRegion) * Region::kRegionSize +
+    (1 + i % Image::kBlocksPerRegion) * Block::kBlockSize;
+}
+
+static inline size_t roundUpToPage(size_t n) {
+  return (n + kPageSize - 1) & ~(kPageSize - 1);
+}
+
+// Relocations are followed by the hash table and the symbols, which
+// need 8 byte alignment.  The hash table has at least two buckets, so
+// its size is a multiple of 8 bytes.
+static inline size_t relocsSize(u4 numRelocs) {
+  return (numRelocs * sizeof(u4) + 7) & ~(size_t)7;
+}
+
+// Each bucket holds a symbol index plus one, or 0 if it is empty.
+// Collisions are resolved by linear probing.  FNV-1a hash.
+static inline u4 hashName(const char *name) {
+  u4 h = 2166136261u;
+  for (const u1 *p = (const u1 *)name; *p != '\0'; ++p)
+    h = (h ^ *p) * 16777619u;
+  return h;
+}
+
+// At most half the buckets are used.
+static inline u4 bucketsFor(u4 numSymbols) {
+  u4 n = 2;
+  while (n < 2 * (uint64_t)numSymbols)
+    n *= 2;
+  return n;
+}
+
+char *Image::preferredBase() {
+  // Just above the addresses used for the heap (see
+  // memorymanager.cc).
+#if LC_ARCH_BITS == 64
+  return reinterpret_cast<char *>(1UL << 40);
+#else
+  return reinterpret_cast<char *>(1UL << 31);
+#endif
+}
+
+int Image::protection(u4 contents) {
+  switch (contents) {
+  case Block::kStaticClosures:
+  case Block::kBytecode:
+    return PROT_READ | PROT_WRITE;
+  default:
+    return PROT_READ;
+  }
+}
+
+Image *Image::map(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: Could not open image %s\n", path);
+    return NULL;
+  }
+
+  ImageHeader hdr;
+  struct stat st;
+  if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+      memcmp(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic)) != 0 ||
+      fstat(fd, &st) != 0) {
+    fprintf(stderr, "ERROR: %s is not an image.\n", path);
+    close(fd);
+    return NULL;
+  }
+  if (hdr.version != IMAGE_VERSION || hdr.wordSize != sizeof(Word) ||
+      hdr.blockSize != Block::kBlockSize ||
+      hdr.numBuckets != bucketsFor(hdr.numSymbols)) {
+    fprintf(stderr, "ERROR: Image '%s' was written by a different VM.\n",
+            path);
+    close(fd);
+    return NULL;
+  }
+  if (hdr.blocksOffset + (uint64_t)hdr.numBlocks * Block::kBlockSize >
+        (uint64_t)st.st_size ||
+      hdr.trailerOffset + hdr.trailerSize > (uint64_t)st.st_size) {
+    fprintf(stderr, "ERROR: Image '%s' is truncated.\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  Image *img = new Image();
+  img->preferredBase_ = (char *)hdr.preferredBase;
+  img->base_ = NULL;
+  img->size_ = 0;
+  img->numBlocks_ = hdr.numBlocks;
+  img->blocksOffset_ = hdr.blocksOffset;
+  img->blocks_ = new ImageBlock[hdr.numBlocks];
+  img->numRelocs_ = hdr.numRelocs;
+  img->relocs_ = NULL;
+  img->numBuckets_ = hdr.numBuckets;
+  img->buckets_ = NULL;
+  img->numSymbols_ = hdr.numSymbols;
+  img->symbols_ = NULL;
+  img->names_ = NULL;
+  img->trailer_ = NULL;
+  img->trailerSize_ = hdr.trailerSize;
+
+  size_t tableSize = hdr.numBlocks * sizeof(ImageBlock);
+  bool ok =
+    pread(fd, img->blocks_, tableSize, sizeof(hdr)) == (ssize_t)tableSize;
+
+  if (ok && img->trailerSize_ > 0) {
+    void *p = mmap(NULL, img->trailerSize_, PROT_READ, MAP_PRIVATE, fd,
+                   hdr.trailerOffset);
+    ok = p != MAP_FAILED;
+    if (ok) {
+      img->trailer_ = static_cast<char *>(p);
+      img->relocs_ = reinterpret_cast<const u4 *>(img->trailer_);
+      img->buckets_ = reinterpret_cast<const u4 *>
+        (img->trailer_ + relocsSize(img->numRelocs_));
+      img->symbols_ = reinterpret_cast<const ImageSymbol *>
+        (img->buckets_ + img->numBuckets_);
+      img->names_ = reinterpret_cast<const char *>
+        (img->symbols_ + img->numSymbols_);
+    }
+  }
+
+  ok = ok && img->mapBlocks(fd);
+  close(fd);
+  if (!ok) {
+    fprintf(stderr, "ERROR: Could not map image %s\n", path);
+    delete img;
+    return NULL;
+  }
+  return img;
+}
+
+Image::~Image() {
+  if (base_ != NULL)
+    munmap(base_, size_);
+  if (trailer_ != NULL)
+    munmap(trailer_, trailerSize_);
+  delete[] blocks_;
+}
+
+bool Image::mapBlocks(int fd) {
+  if (numBlocks_ == 0)
+    return true;
+
+  // Reserve address space for all regions.  The metadata blocks and
+  // unused blocks stay anonymous memory.
+  size_t size = idivCeil(numBlocks_, kBlocksPerRegion) * Region::kRegionSize;
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  char *ptr = static_cast<char *>
+    (mmap(preferredBase_, size, PROT_READ | PROT_WRITE, flags, -1, 0));
+  if (ptr == MAP_FAILED)
+    return false;
+  if (ptr != preferredBase_) {
+    // Map it anywhere, but aligned at a region boundary.
+    munmap(ptr, size);
+    size_t slop = Region::kRegionSize;
+    ptr = static_cast<char *>
+      (mmap(NULL, size + slop, PROT_READ | PROT_WRITE, flags, -1, 0));
+    if (ptr == MAP_FAILED)
+      return false;
+    char *aligned = Region::alignToRegionBoundary(ptr);
+    if (aligned > ptr)
+      munmap(ptr, aligned - ptr);
+    munmap(aligned + size, ptr + slop - aligned);
+    ptr = aligned;
+  }
+  base_ = ptr;
+  size_ = size;
+
+  for (u4 i = 0; i < numBlocks_; i += kBlocksPerRegion)
+    initRegion(base_ + blockOffset(i) - Block::kBlockSize, i);
+
+  // Map runs of blocks in the same region with the same protection
+  // with a single call.  If we have to relocate, everything is
+  // writable until we're done.
+  u4 i = 0;
+  while (i < numBlocks_) {
+    int prot = protection(blocks_[i].contents);
+    u4 j = i + 1;
+    while (j < numBlocks_ && j % kBlocksPerRegion != 0 &&
+           protection(blocks_[j].contents) == prot)
+      ++j;
+    if (relocated())
+      prot = PROT_READ | PROT_WRITE;
+    off_t offset = blocksOffset_ + (off_t)i * Block::kBlockSize;
+    void *p = mmap(base_ + blockOffset(i), (j - i) * Block::kBlockSize,
+                   prot, MAP_PRIVATE | MAP_FIXED, fd, offset);
+    if (p == MAP_FAILED)
+      return false;
+    i = j;
+  }
+
+  if (relocated())
+    relocate();
+  return true;
+}
+
+void Image::initRegion(char *ptr, u4 first) {
+  Region *region = reinterpret_cast<Region *>(ptr);
+  region->meta_.magic_ = REGION_MAGIC;
+  region->meta_.region_info_ = Region::kSmallObjectRegion;
+  region->meta_.region_link_ = NULL;
+  region->meta_.generation_ = Region::kYoungGeneration;
+  region->meta_.owner_ = NULL;
+  region->meta_.marks_ = NULL;
+
+  // Blocks not backed by the image are marked as unavailable, just
+  // like the metadata block.  The memory manager never allocates
+  // from image regions.
+  Region::SmallObjectRegionData *r = region->smallSelf();
+  for (Word k = 0; k < Region::kBlocksPerRegion; ++k) {
+    Block *b = &r->blocks_[k];
+    b->start_ = ptr + k * Block::kBlockSize;
+    b->end_ = b->start_ + Block::kBlockSize;
+    b->link_ = NULL;
+    b->dirty_ = 0;
+    u4 i = first + k - 1;
+    if (k == 0 || i >= numBlocks_) {
+      b->flags_ = Block::kMetadata;
+      b->free_ = b->end_;
+    } else {
+      b->flags_ = blocks_[i].contents;
+      b->free_ = b->start_ + blocks_[i].used;
+    }
+  }
+  r->next_free_ = NULL;
+}
+
+void Image::relocate() {
+  Word delta = (Word)(base_ - preferredBase_);
+  for (u4 i = 0; i < numRelocs_; ++i)
+    *(Word *)(base_ + relocs_[i]) += delta;
+  for (u4 i = 0; i < numBlocks_; ++i) {
+    if (protection(blocks_[i].contents) == PROT_READ)
+      mprotect(base_ + blockOffset(i), Block::kBlockSize, PROT_READ);
+  }
+}
+
+Image::SymbolKind Image::symbolKind(u4 i) const {
+  LC_ASSERT(i < numSymbols_);
+  return (SymbolKind)symbols_[i].kind;
+}
+
+u4 Image::symbolFlags(u4 i) const {
+  LC_ASSERT(i < numSymbols_);
+  return symbols_[i].flags;
+}
+
+const char *Image::symbolName(u4 i) const {
+  LC_ASSERT(i < numSymbols_);
+  return names_ + symbols_[i].name;
+}
+
+void *Image::symbolAddress(u4 i) const {
+  LC_ASSERT(i < numSymbols_);
+  if (symbols_[i].offset == kNoOffset)
+    return NULL;
+  return base_ + symbols_[i].offset;
+}
+
+u4 Image::findSymbol(SymbolKind kind, const char *name) const {
+  if (buckets_ == NULL)
+    return kNoSymbol;
+  u4 mask = numBuckets_ - 1;
+  for (u4 b = hashName(name) & mask; buckets_[b] != 0; b = (b + 1) & mask) {
+    u4 i = buckets_[b] - 1;
+    if (i < numSymbols_ && symbols_[i].kind == kind &&
+        strcmp(names_ + symbols_[i].name, name) == 0)
+      return i;
+  }
+  return kNoSymbol;
+}
+
+ImageWriter::ImageWriter() {
+}
+
+// Blocks are indexed by the address of their first byte divided by
+// the block size.  This also works for the first block of a region,
+// which starts after the region metadata.
+static inline Word blockKey(const void *p) {
+  return (Word)p >> Block::kBlockSizeLog2;
+}
+
+void ImageWriter::addBlock(const Block *b) {
+  if (b->free() == b->start())
+    return;
+  LC_ASSERT(blockIndex_.find(blockKey(b->start())) == blockIndex_.end());
+  blockIndex_[blockKey(b->start())] = blocks_.size();
+  blocks_.push_back(b);
+}
+
+void ImageWriter::addRelocation(const Word *slot) {
+  relocs_.push_back(slot);
+}
+
+void ImageWriter::addSymbol(Image::SymbolKind kind, const char *name,
+                            const void *addr, u4 flags) {
+  Symbol sym = { kind, flags, name, addr };
+  symbols_.push_back(sym);
+}
+
+// Modules first, then shared closures (see image.hh).
+static inline int symbolRank(Image::SymbolKind kind, u4 flags) {
+  if (kind == Image::kModule)
+    return 0;
+  return (flags & Image::kSharedClosure) ? 1 : 2;
+}
+
+bool ImageWriter::locate(const void *p, u4 *block, Word *offset) {
+  HASH_NAMESPACE::HASH_MAP_CLASS<Word, u4>::iterator it =
+    blockIndex_.find(blockKey(p));
+  if (it == blockIndex_.end())
+    return false;
+  const Block *b = blocks_[it->second];
+  if (p < b->start() || p >= b->free())
+    return false;
+  *block = it->second;
+  *offset = (const char *)p - b->start();
+  return true;
+}
+
+static bool writeBytes(FILE *out, const void *p, size_t n) {
+  return n == 0 || fwrite(p, 1, n, out) == n;
+}
+
+template<typename T>
+static inline const T *first(const vector<T> &v) {
+  return v.empty() ? NULL : &v[0];
+}
+
+bool ImageWriter::write(const char *path) {
+  u4 numBlocks = blocks_.size();
+  char *base = Image::preferredBase();
+  vector<char> data((size_t)numBlocks * Block::kBlockSize, 0);
+  for (u4 i = 0; i < numBlocks; ++i) {
+    const Block *b = blocks_[i];
+    memcpy(&data[(size_t)i * Block::kBlockSize], b->start(),
+           b->free() - b->start());
+  }
+
+  // Point all pointers at the image as mapped at the preferred base.
+  vector<u4> relocs;
+  for (size_t i = 0; i < relocs_.size(); ++i) {
+    const Word *slot = relocs_[i];
+    u4 slotBlock, targetBlock;
+    Word slotOffset, targetOffset;
+    if (!locate(slot, &slotBlock, &slotOffset)) {
+      fprintf(stderr, "ERROR: Pointer at %p is not part of the image.\n",
+              slot);
+      return false;
+    }
+    if (*slot == 0)
+      continue;
+    if (!locate((const void *)*slot, &targetBlock, &targetOffset)) {
+      fprintf(stderr, "ERROR: Pointer at %p to %p leaves the image.\n",
+              slot, (void *)*slot);
+      return false;
+    }
+    Word *dest = (Word *)&data[(size_t)slotBlock * Block::kBlockSize +
+                              slotOffset];
+    *dest = (Word)base + blockOffset(targetBlock) + targetOffset;
+    Word imageOffset = blockOffset(slotBlock) + slotOffset;
+    LC_ASSERT(imageOffset <= 0xffffffffUL);
+    relocs.push_back((u4)imageOffset);
+  }
+  // Apply them in address order when relocating.
+  sort(relocs.begin(), relocs.end());
+
+  vector<ImageSymbol> symbols;
+  string names;
+  vector<const Symbol *> order;
+  for (int rank = 0; rank <= 2; ++rank) {
+    for (size_t i = 0; i < symbols_.size(); ++i) {
+      if (symbolRank(symbols_[i].kind, symbols_[i].flags) == rank)
+        order.push_back(&symbols_[i]);
+    }
+  }
+  for (size_t i = 0; i < order.size(); ++i) {
+    ImageSymbol sym;
+    sym.kind = order[i]->kind;
+    sym.flags = order[i]->flags;
+    sym.name = names.size();
+    sym.offset = kNoOffset;
+    if (order[i]->addr != NULL) {
+      u4 block;
+      Word offset;
+      if (!locate(order[i]->addr, &block, &offset)) {
+        fprintf(stderr, "ERROR: Symbol %s is not part of the image.\n",
+                order[i]->name);
+        return false;
+      }
+      sym.offset = blockOffset(block) + offset;
+    }
+    names.append(order[i]->name);
+    names.push_back('\0');
+    symbols.push_back(sym);
+  }
+
+  u4 numBuckets = bucketsFor(symbols.size());
+  vector<u4> buckets(numBuckets, 0);
+  for (u4 i = 0; i < symbols.size(); ++i) {
+    u4 b = hashName(names.c_str() + symbols[i].name) & (numBuckets - 1);
+    while (buckets[b] != 0)
+      b = (b + 1) & (numBuckets - 1);
+    buckets[b] = i + 1;
+  }
+
+  ImageHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+  hdr.version = IMAGE_VERSION;
+  hdr.wordSize = sizeof(Word);
+  hdr.blockSize = Block::kBlockSize;
+  hdr.numBlocks = numBlocks;
+  hdr.preferredBase = (uint64_t)(Word)base;
+  hdr.numRelocs = relocs.size();
+  hdr.numSymbols = symbols.size();
+  hdr.blocksOffset =
+    roundUpToPage(sizeof(hdr) + numBlocks * sizeof(ImageBlock));
+  hdr.trailerOffset = hdr.blocksOffset + data.size();
+  hdr.numBuckets = numBuckets;
+  hdr.trailerSize = relocsSize(hdr.numRelocs) + numBuckets * sizeof(u4) +
+    symbols.size() * sizeof(ImageSymbol) + names.size();
+
+  vector<ImageBlock> table(numBlocks);
+  for (u4 i = 0; i < numBlocks; ++i) {
+    table[i].contents = blocks_[i]->contents();
+    table[i].used = blocks_[i]->free() - blocks_[i]->start();
+  }
+
+  FILE *out = fopen(path, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "ERROR: Could not write image %s\n", path);
+    return false;
+  }
+  vector<char> padding(hdr.blocksOffset -
+                       (sizeof(hdr) + numBlocks * sizeof(ImageBlock)), 0);
+  u4 zero = 0;
+  bool ok = writeBytes(out, &hdr, sizeof(hdr));
+  ok = ok && writeBytes(out, first(table), numBlocks * sizeof(ImageBlock));
+  ok = ok && writeBytes(out, first(padding), padding.size());
+  ok = ok && writeBytes(out, first(data), data.size());
+  ok = ok && writeBytes(out, first(relocs), relocs.size() * sizeof(u4));
+  if (relocs.size() % 2 != 0)
+    ok = ok && writeBytes(out, &zero, sizeof(zero));
+  ok = ok && writeBytes(out, first(buckets), numBuckets * sizeof(u4));
+  ok = ok && writeBytes(out, first(symbols),
+                        symbols.size() * sizeof(ImageSymbol));
+  ok = ok && writeBytes(out, names.c_str(), names.size());
+  ok = (fclose(out) == 0) && ok;
+  if (!ok) {
+    fprintf(stderr, "ERROR: Could not write image %s\n", path);
+    remove(path);
+  }
+  return ok;
+}
+
+_END_LAMBDACHINE_NAMESPACE
@@ -0,0 +1,157 @@
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#include "common.hh"
+#include "memorymanager.hh"
+
+#include <vector>
+#include HASH_MAP_H
+
+_START_LAMBDACHINE_NAMESPACE
+
+struct ImageBlock;   // Defined in image.cc
+struct ImageSymbol;
+
+/// Static images.
+///
+/// An image holds the static data of a set of loaded modules (info
+/// tables, static closures, bytecode and strings) in the same form
+/// as in memory, so that it can be mapped with mmap instead of being
+/// loaded.  Pages that are never written are shared by all processes
+/// that map the same image.
+///
+/// The blocks of the image are laid out in regions as usual, so the
+/// GC recognises their contents from the block descriptors.  The
+/// first block of each region holds the region header and block
+/// descriptors, which are built when the image is mapped; the
+/// remaining blocks are mapped from the file.  Info tables and
+/// strings are mapped read-only.  Static closures (CAFs get
+/// updated) and bytecode (the JIT writes JFUNC instructions) are
+/// mapped copy-on-write.
+///
+/// Pointers in the image assume that it is mapped at a fixed
+/// address.  If that address is taken, the image is mapped elsewhere
+/// and every pointer listed in the relocation table is adjusted,
+/// which makes the affected pages private to the process.
+///
+/// Symbols are looked up through a hash table stored in the image,
+/// so they need not be entered into the loader's symbol tables when
+/// the image is mapped.  Modules come first in the symbol table,
+/// followed by closures with the kSharedClosure flag, so that the
+/// symbols which must be processed at startup can be found without
+/// looking at the others.
+///
+/// File layout (all offsets are from the start of the file):
+///
+///     ImageHeader
+///     ImageBlock[numBlocks]        kind and size of each block
+///     (page aligned)
+///     block data                   Block::kBlockSize bytes each
+///     u4[numRelocs]                image offsets of pointers
+///     u4[numBuckets]               hash table of symbols
+///     ImageSymbol[numSymbols]
+///     names                        NUL-terminated strings
+///
+/// "Image offset" is an address minus the address of the image.
+class Image {
+public:
+  typedef enum {
+    kModule = 1,
+    kInfoTable,
+    kClosure
+  } SymbolKind;
+
+  typedef enum {
+    /// A nullary constructor, which is shared by all its occurrences
+    /// (see MiscClosures::addNullaryClosure).
+    kSharedClosure = 1
+  } SymbolFlags;
+
+  static const u4 kNoSymbol = ~(u4)0;
+
+  /// Maps the image stored in the given file.  Returns NULL and
+  /// prints a message if that fails.
+  static Image *map(const char *path);
+  ~Image();
+
+  /// True if the image could not be mapped at its preferred address.
+  inline bool relocated() const { return base_ != preferredBase_; }
+  inline char *base() const { return base_; }
+  inline u4 numBlocks() const { return numBlocks_; }
+
+  inline u4 numSymbols() const { return numSymbols_; }
+  SymbolKind symbolKind(u4 i) const;
+  u4 symbolFlags(u4 i) const;
+  const char *symbolName(u4 i) const;
+  /// NULL for modules.
+  void *symbolAddress(u4 i) const;
+  /// Returns the index of the symbol, or kNoSymbol.
+  u4 findSymbol(SymbolKind, const char *name) const;
+
+  /// Where images are mapped if possible.
+  static char *preferredBase();
+
+  static const u4 kBlocksPerRegion = Region::kBlocksPerRegion - 1;
+
+private:
+  Image() {}
+  bool mapBlocks(int fd);
+  void initRegion(char *region, u4 firstBlock);
+  void relocate();
+  static int protection(u4 contents);
+
+  char *preferredBase_;
+  char *base_;
+  size_t size_;       // The whole reservation, including metadata.
+  u4 numBlocks_;
+  uint64_t blocksOffset_;  // In the file.
+  ImageBlock *blocks_;
+  u4 numRelocs_;
+  const u4 *relocs_;
+  u4 numBuckets_;     // A power of two.
+  const u4 *buckets_;
+  u4 numSymbols_;
+  const ImageSymbol *symbols_;
+  const char *names_;
+  char *trailer_;     // Maps relocations, symbols and names.
+  size_t trailerSize_;
+};
+
+/// Collects blocks of static data, the locations of all pointers in
+/// them, and the symbols to be looked up after mapping, and writes
+/// them as an image.  Blocks are copied in the order they are added.
+class ImageWriter {
+public:
+  ImageWriter();
+
+  /// Adds the used part of a block.  Empty blocks are skipped.
+  void addBlock(const Block *);
+  /// The word at `slot` is a pointer into one of the blocks, or NULL.
+  void addRelocation(const Word *slot);
+  /// `addr` must point into one of the blocks (or be NULL for
+  /// modules).  `flags` is a combination of Image::SymbolFlags.
+  void addSymbol(Image::SymbolKind, const char *name, const void *addr,
+                 u4 flags = 0);
+
+  /// Returns false and prints a message if a relocation or symbol
+  /// does not point into one of the blocks, or writing fails.
+  bool write(const char *path);
+
+private:
+  bool locate(const void *p, u4 *block, Word *offset /* out */);
+
+  std::vector<const Block *> blocks_;
+  HASH_NAMESPACE::HASH_MAP_CLASS<Word, u4> blockIndex_;
+  std::vector<const Word *> relocs_;
+  struct Symbol {
+    Image::SymbolKind kind;
+    u4 flags;
+    const char *name;
+    const void *addr;
+  };
+  std::vector<Symbol> symbols_;
+};
+
+_END_LAMBDACHINE_NAMESPACE
+
+#endif /* _IMAGE_H_ */
@@ -719,6 +719,10 @@ const char *IR::regName(uint8_t r, IRType ty) {
     return regNames64[r];
   case IRT_I32:
   case IRT_U32:
+  case IRT_I16:
+  case IRT_U16:
+  case IRT_I8:
+  case IRT_U8:
   case IRT_CHR:
     LC_ASSERT(r < RID_MAX_GPR);
     return regNames32[r];
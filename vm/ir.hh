@@ -21,6 +21,14 @@ typedef u4 IRRef;               /* Used to pass around references */
 //     ref  FREF   base offs   ; reference to a field
 //     void FSTORE ref value
 //
+// Byte array accesses (GETA*/SETA*) work the same way, except that
+// the offset is an IR reference.  The element width is the type of
+// the ALOAD/ASTORE instruction (IRT_U8 .. IRT_U64):
+//
+//     ptr  AREF   array index
+//     u8   ALOAD  ref
+//     u8   ASTORE ref value
+//
 // Flags:
 //   N .. normal
 //   C .. commutative
@@ -85,8 +93,11 @@ typedef u4 IRRef;               /* Used to pass around references */
   _(ILOAD,   L,   ref, ___) \
   _(RLOAD,   L,   ___, ___) \
   _(PLOAD,   L,   ref, ref) \
+  _(AREF,    R,   ref, ref) \
+  _(ALOAD,   L,   ref, ___) \
   _(NEW,     A,   ref, lit) \
   _(FSTORE,  S,   ref, ref) \
+  _(ASTORE,  S,   ref, ref) \
   _(UPDATE,  S,   ref, ref) \
   _(SAVE,    S,   lit, lit)
 /*
@@ -211,6 +222,7 @@ enum {
 // Forward references, defined in this file.
 class IRBuffer;
 class AbstractHeap;
+class TraceCache;
 
 class IR {
 public:
@@ -480,6 +492,7 @@ private:
   friend class AbstractStack;
   friend class Assembler;  // Sets mcode_
   friend class IRBuffer;  // Sets steps_
+  friend class TraceCache;
 };
 
 typedef Snapshot::MapRef SnapmapRef;
@@ -503,6 +516,7 @@ public:
   inline IRRef1 slotRef(Snapshot::MapRef index) {
     return (IRRef1)data_.at(index);
   }
+  inline size_t size() const { return data_.size(); }
   void reset();
 private:
   std::vector<uint32_t> data_;
@@ -511,6 +525,7 @@ private:
   friend class AbstractStack;
   friend class Snapshot;
   friend class Jit;
+  friend class TraceCache;
 };
 
 
@@ -519,7 +534,10 @@ public:
   HeapSnapData();
   ~HeapSnapData();
   void reset();
-  inline IRRef1 at(int idx) { LC_ASSERT(idx < size_); return data_[idx]; }
+  inline IRRef1 at(int idx) {
+    LC_ASSERT((size_t)idx < size_);
+    return data_[idx];
+  }
 private:
   inline int push_back(IRRef1 ref);
   //  void compact();
@@ -534,6 +552,7 @@ private:
 
   friend class IRBuffer;
   friend class AbstractHeap;
+  friend class TraceCache;
 };
 
 
@@ -553,7 +572,7 @@ inline int HeapSnapData::reserve(int n) {
 }
 
 inline void HeapSnapData::set(int n, IRRef1 ref) {
-  LC_ASSERT(n < next_);  // Must call reserve first.
+  LC_ASSERT((size_t)n < next_);  // Must call reserve first.
   data_[n] = ref;
 }
 
@@ -581,6 +600,7 @@ private:
 
   friend class AbstractHeap;
   friend class IRBuffer;
+  friend class TraceCache;
 };
 
 
@@ -592,7 +612,7 @@ public:
   void reset();
   inline void heapCheck(int nwords) { reserved_ += nwords; }
   inline AbstractHeapEntry &entry(int n) {
-    LC_ASSERT(n < nextentry_);
+    LC_ASSERT((uint32_t)n < nextentry_);
     return entries_[n];
   }
 private:
@@ -604,6 +624,7 @@ private:
   int reserved_;
 
   friend class IRBuffer;
+  friend class TraceCache;
 };
 
 
@@ -676,6 +697,8 @@ private:
   unsigned int low_;  // lowest modified value
   unsigned int high_; // highest modified value
   Word *realOrigBase_;
+
+  friend class TraceCache;
 };
 
 typedef uint16_t StackNodeRef1;
@@ -979,6 +1002,7 @@ private:
 
   friend class Jit;
   friend class Assembler;
+  friend class TraceCache;
 };
 
 inline IRRef IRBuffer::nextIns() {
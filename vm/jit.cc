@@ -5,7 +5,9 @@
 #include "capability.hh"
 #include "miscclosures.hh"
 #include "time.hh"
+#include "tracecache.hh"
 
+#include <algorithm>
 #include <iostream>
 #include <string.h>
 #include <fstream>
@@ -20,7 +22,9 @@ _START_LAMBDACHINE_NAMESPACE
 using namespace std;
 
 uint64_t record_aborts = 0;
-uint64_t record_abort_reasons[AR__MAX] = { 0, 0, 0, 0, 0 };
+uint64_t record_abort_reasons[AR__MAX] = { 0, 0, 0, 0, 0, 0 };
+uint64_t trace_links = 0;
+uint64_t trace_gcs = 0;
 
 HotCounters::HotCounters(HotCount threshold)
   : threshold_(threshold) {
@@ -48,6 +52,20 @@ void Jit::resetFragments() {
   fragmentMap_.clear();
 }
 
+void Jit::flushFragments() {
+  for (size_t i = 0; i < fragments_.size(); ++i) {
+    Fragment *F = fragments_[i];
+    BcIns *pc = F->startPc();
+    if (pc != NULL && pc->opcode() == BcIns::kJFUNC &&
+        pc->d() == F->traceId()) {
+      *pc = F->startIns_;
+    }
+  }
+  resetFragments();
+  exitSaveCode_.clear();
+  mcode_.flush();
+}
+
 uint32_t
 Jit::numFragments()
 {
@@ -57,10 +75,9 @@ Jit::numFragments()
 Jit::Jit()
   : cap_(NULL),
     startPc_(NULL), startBase_(NULL), parent_(NULL),
-    flags_(), options_(), targets_(),
+    flags_(), options_(), targets_(), codes_(), traceCache_(NULL),
     prng_(), mcode_(&prng_), asm_(this) {
   Jit::resetFragments();
-  memset(exitStubGroup_, 0, sizeof(exitStubGroup_));
   resetRecorderState();
 #if (DEBUG_COMPONENTS & DEBUG_TRACE_PROGRESS)
   setDebugTrace(true);
@@ -783,6 +800,9 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
   }
   buf_.pc_ = ins;
   buf_.steps_++;
+  if (traceCache_ != NULL && (codes_.empty() || codes_.back() != code) &&
+      find(codes_.begin(), codes_.end(), code) == codes_.end())
+    codes_.push_back(code);
   DBG(cerr << "REC: " << ins << " " << ins->name() << endl);
 
   if (flags_.get(kLastInsWasBranch)) {
@@ -1198,6 +1218,37 @@ bool Jit::recordIns(BcIns *ins, Word *base, const Code *code) {
     break;
   }
 
+#define BYTEARRAY_GET(bcop, irtype) \
+  case BcIns::bcop: { \
+    TRef aref = buf_.emit(IR::kAREF, IRT_PTR, buf_.slot(ins->b()), \
+                          buf_.slot(ins->c())); \
+    TRef res = buf_.emit(IR::kALOAD, irtype, aref, 0); \
+    buf_.setSlot(ins->a(), res); \
+    break; \
+  }
+
+#define BYTEARRAY_SET(bcop, irtype) \
+  case BcIns::bcop: { \
+    TRef aref = buf_.emit(IR::kAREF, IRT_PTR, buf_.slot(ins->b()), \
+                          buf_.slot(ins->c())); \
+    buf_.emit(IR::kASTORE, irtype, aref, buf_.slot(ins->a())); \
+    break; \
+  }
+
+    // Byte array contents are mutable, so ALOADs are neither CSE'd
+    // nor forwarded from earlier stores.
+    BYTEARRAY_GET(kGETA1, IRT_U8);
+    BYTEARRAY_GET(kGETA2, IRT_U16);
+    BYTEARRAY_GET(kGETA4, IRT_U32);
+    BYTEARRAY_GET(kGETA8, IRT_U64);
+    BYTEARRAY_SET(kSETA1, IRT_U8);
+    BYTEARRAY_SET(kSETA2, IRT_U16);
+    BYTEARRAY_SET(kSETA4, IRT_U32);
+    BYTEARRAY_SET(kSETA8, IRT_U64);
+
+#undef BYTEARRAY_GET
+#undef BYTEARRAY_SET
+
   case BcIns::kALLOC1: {
     TRef itbl = buf_.slot(ins->b());
     TRef field = buf_.slot(ins->c());
@@ -1351,6 +1402,7 @@ abort_recording:
 inline void Jit::resetRecorderState() {
   flags_.clear();
   targets_.clear();
+  codes_.clear();
   cap_ = NULL;
   shouldAbort_ = false;
 }
@@ -1358,31 +1410,25 @@ inline void Jit::resetRecorderState() {
 void Jit::finishRecording() {
   Time compilestart = getProcessElapsedTime();
   DBG(cerr << "Recorded: " << endl);
-#ifdef LC_TRACE_STATS
-  uint32_t nStatCounters = 1 + buffer()->snaps_.size();
-  stats_ = new uint64_t[nStatCounters];
-  memset(stats_, 0, sizeof(uint64_t) * nStatCounters);
-#endif
-  asm_.assemble(buffer(), mcode());
-  if (DEBUG_COMPONENTS & DEBUG_ASSEMBLER)
-    buf_.debugPrint(cerr, Jit::numFragments());
-
-  int tno = fragments_.size();
-
-  Fragment *F = saveFragment();
-
-  registerFragment(startPc_, F, traceType_ == TT_SIDE);
 
-  if (parent_ != NULL) {
-    asm_.patchGuard(parent_, parentExitNo_, F->entry());
+  if (!mcode()->ensureSpace()) {
+    // Out of machine code space.  Throw away all traces.  The
+    // current trace may refer to the old ones (parent trace, links)
+    // so we drop it, too.  Hot code will quickly be recorded again.
+    flushFragments();
+    ++record_aborts;
+    ++record_abort_reasons[AR_MCODE_FULL];
+    resetRecorderState();
+    jit_time += getProcessElapsedTime() - compilestart;
+    return;
   }
 
-  if (traceType_ != TT_SIDE && !flags_.get(kIsReturnTrace)) {
-#if (DEBUG_COMPONENTS & DEBUG_TRACE_RECORDER)
-    cerr << "Writing JFUNC (isReturn=" << flags_.get(kIsReturnTrace) << ")\n";
-#endif
-    *startPc_ = BcIns::ad(BcIns::kJFUNC, 0, tno);
-  }
+  // The assembler modifies the IR, so it must be saved first.
+  if (traceCache_ != NULL && traceType_ == TT_ROOT)
+    traceCache_->add(this);
+
+  Fragment *F = assembleTrace();
+  int tno = F->traceId();
 
 #ifdef LC_CLEAR_DOM_COUNTERS
   // See Note "Reset Dominated Counters" below.
@@ -1413,10 +1459,60 @@ void Jit::finishRecording() {
   jit_time += getProcessElapsedTime() - compilestart;
 }
 
-void
+// Assembles the IR buffer and installs the new fragment.
+Fragment *Jit::assembleTrace() {
+#ifdef LC_TRACE_STATS
+  uint32_t nStatCounters = 1 + buffer()->snaps_.size();
+  stats_ = new uint64_t[nStatCounters];
+  memset(stats_, 0, sizeof(uint64_t) * nStatCounters);
+#endif
+  asm_.assemble(buffer(), mcode());
+  if (DEBUG_COMPONENTS & DEBUG_ASSEMBLER)
+    buf_.debugPrint(cerr, Jit::numFragments());
+
+  int tno = fragments_.size();
+
+  Fragment *F = saveFragment();
+
+  registerFragment(startPc_, F, traceType_ == TT_SIDE);
+
+  if (parent_ != NULL) {
+    asm_.patchGuard(parent_, parentExitNo_, F->entry());
+  }
+
+  if (traceType_ != TT_SIDE && !flags_.get(kIsReturnTrace)) {
+#if (DEBUG_COMPONENTS & DEBUG_TRACE_RECORDER)
+    cerr << "Writing JFUNC (isReturn=" << flags_.get(kIsReturnTrace) << ")\n";
+#endif
+    F->startIns_ = *startPc_;
+    *startPc_ = BcIns::ad(BcIns::kJFUNC, startPc_->a(), tno);
+  }
+  return F;
+}
+
+Fragment *Jit::assembleCachedTrace(BcIns *startPc, bool isReturn,
+                                   const std::vector<BcIns *> &targets) {
+  LC_ASSERT(!isRecording());
+  if (!mcode()->ensureSpace())
+    return NULL;
+  Time compilestart = getProcessElapsedTime();
+  startPc_ = startPc;
+  parent_ = NULL;
+  traceType_ = TT_ROOT;
+  flags_.clear();
+  if (isReturn)
+    flags_.set(kIsReturnTrace);
+  targets_ = targets;
+  Fragment *F = assembleTrace();
+  resetRecorderState();
+  jit_time += getProcessElapsedTime() - compilestart;
+  return F;
+}
+
+bool
 Jit::patchFallthrough(Fragment *parent, ExitNo exitno, Fragment *target)
 {
-  asm_.patchFallthrough(parent, exitno, target);
+  return asm_.patchFallthrough(parent, exitno, target);
 }
 
 /*
@@ -1452,7 +1548,9 @@ created.  It is not a 100% solution, but it shouldn't hurt either.
 */
 
 Fragment::Fragment()
-  : flags_(0), traceId_(0), startPc_(NULL), targets_(NULL) {
+  : flags_(0), traceId_(0), startPc_(NULL), targets_(NULL),
+    restore_(NULL), gcmaps_(NULL), gcroots_(NULL),
+    mcode_(NULL), sizemcode_(0) {
 #ifdef LC_TRACE_STATS
   stats_ = NULL;
 #endif
@@ -1461,6 +1559,12 @@ Fragment::Fragment()
 Fragment::~Fragment() {
   if (targets_ != NULL)
     delete[] targets_;
+  if (restore_ != NULL)
+    delete[] restore_;
+  if (gcmaps_ != NULL)
+    delete[] gcmaps_;
+  if (gcroots_ != NULL)
+    delete[] gcroots_;
 #ifdef LC_TRACE_STATS
   if (stats_ != NULL)
     delete[] stats_;
@@ -1510,8 +1614,18 @@ Fragment *Jit::saveFragment() {
   F->snapmap_.index_ = buf->snapmap_.data_.size();
 
   AbstractHeap::compactCopyInto(&F->heap_, &buf->heap_);
+  F->compileRestore();
+
+  LC_ASSERT(as->gcmaps_.size() == nsnaps);
+  F->gcmaps_ = new GCMap[nsnaps];
+  for (size_t i = 0; i < nsnaps; ++i)
+    F->gcmaps_[i] = as->gcmaps_[i];
+  F->gcroots_ = new GCRoot[as->gcroots_.size()];
+  for (size_t i = 0; i < as->gcroots_.size(); ++i)
+    F->gcroots_[i] = as->gcroots_[i];
 
   F->mcode_ = as->mcp;
+  F->sizemcode_ = as->mcend - as->mcp;
 #ifdef LC_TRACE_STATS
   F->stats_ = stats_;  // Transfers ownership.
   stats_ = NULL;
@@ -1583,6 +1697,40 @@ inline uint64_t Fragment::literalValue(IRRef ref, Word *base) {
   return 0;
 }
 
+void Fragment::compileRestore() {
+  size_t nentries = snapmap_.size();
+  restore_ = new RestoreEntry[nentries];
+  for (size_t i = 0; i < nsnaps_; ++i) {
+    Snapshot &sn = snaps_[i];
+    if (ir(sn.ref())->opcode() == IR::kSAVE)
+      continue;  // Restored by the trace itself.
+    for (Snapshot::MapRef j = sn.begin(); j < sn.end(); ++j) {
+      RestoreEntry &e = restore_[j];
+      IRRef ref = snapmap_.slotRef(j);
+      IR *ins = ir(ref);
+      e.slot = snapmap_.slotId(j);
+      e.src = 0;
+      e.value = 0;
+      if (irref_islit(ref)) {
+        if (ins->opcode() == IR::kKBASEO) {
+          e.kind = kRestoreBaseOffset;
+          e.value = (Word)(int64_t)ins->i32();
+        } else {
+          e.kind = kRestoreLiteral;
+          e.value = literalValue(ref, NULL);
+        }
+      } else if (ins->spill() != 0) {
+        e.kind = kRestoreSpill;
+        e.src = ins->spill();
+      } else {
+        LC_ASSERT(isReg(ins->reg()));
+        e.kind = kRestoreReg;
+        e.src = ins->reg();
+      }
+    }
+  }
+}
+
 static void printRegisters(ostream &out, Word *gpr) {
   for (RegSet work = kGPR; !work.isEmpty(); ) {
     Reg r = work.pickBot();
@@ -1609,8 +1757,26 @@ static void printExitState(ostream &out, ExitState *ex) {
 
 Word *traceDebugLastHp = NULL;
 
-void Fragment::restoreSnapshot(ExitNo exitno, ExitState *ex) {
+void Fragment::writeSnapshot(Snapshot &sn, ExitState *ex) {
   Word *spill = ex->spill;
+  Word *base = (Word *)ex->gpr[RID_BASE];
+  const RestoreEntry *e = &restore_[sn.begin()];
+  const RestoreEntry *eend = &restore_[sn.end()];
+  for ( ; e < eend; ++e) {
+    Word val;
+    switch (e->kind) {
+    case kRestoreLiteral: val = e->value; break;
+    case kRestoreBaseOffset: val = (Word)(base + (int32_t)e->value); break;
+    case kRestoreSpill: val = spill[e->src]; break;
+    default: val = ex->gpr[e->src]; break;
+    }
+    DBG(cerr << "    Restoring base[" << e->slot << "] = "
+        << hex << val << dec << endl);
+    base[e->slot] = val;
+  }
+}
+
+void Fragment::restoreSnapshot(ExitNo exitno, ExitState *ex) {
   LC_ASSERT(0 <= exitno && exitno < nsnaps_);
   DBG(cerr << "Restoring from snapshot " << (int)exitno
       << " of Trace " << traceId() << endl);
@@ -1625,29 +1791,7 @@ void Fragment::restoreSnapshot(ExitNo exitno, ExitState *ex) {
   if (snapins->opcode() != IR::kSAVE) {
     DBG(sn.debugPrint(cerr, &snapmap_, exitno));
     DBG(printExitState(cerr, ex));
-    for (Snapshot::MapRef i = sn.begin(); i < sn.end(); ++i) {
-      int slot = snapmap_.slotId(i);
-      int ref = snapmap_.slotRef(i);
-      IR *ins = ir(ref);
-      DBG(cerr << "    Restoring "; IR::printIRRef(cerr, ref));
-      DBG(cerr << ":  base[" << slot << "] = ");
-      if (irref_islit(ref)) {
-        uint64_t k = literalValue(ref, base);
-        DBG(cerr << "literal (" << hex << k << ")" << endl);
-        base[slot] = k;
-      } else if (ins->spill() != 0) {
-        DBG(cerr << "spill[" << (int)ins->spill() << "] ("
-            << hex << spill[ins->spill()] << "/"
-            << dec << spill[ins->spill()] << ")"
-            << endl);
-        base[slot] = spill[ins->spill()];
-      } else {
-        LC_ASSERT(isReg(ins->reg()));
-        DBG(cerr << IR::regName(ins->reg(), ins->type()) << " ("
-            << hex << ex->gpr[ins->reg()] << ")" << endl);
-        base[slot] = ex->gpr[ins->reg()];
-      }
-    }
+    writeSnapshot(sn, ex);
   }
   if (sn.relbase() != 0 && snapins->opcode() != IR::kSAVE) {
     DBG(cerr << "base + " << dec << (int)sn.relbase() << " => ");
@@ -1666,25 +1810,38 @@ void Fragment::restoreSnapshot(ExitNo exitno, ExitState *ex) {
   cap->traceExitHp_ = (Word *)ex->gpr[RID_HP];
   cap->traceExitHpLim_ = ex->hplim;
 
-  if (snapins->opcode() != IR::kHEAPCHK && sn.bumpExitCounter()) {
-    if (snapins->opcode() == IR::kSAVE && snapins->op1() == IR_SAVE_FALLTHROUGH) {
+  bool isFallthrough =
+    snapins->opcode() == IR::kSAVE && snapins->op1() == IR_SAVE_FALLTHROUGH;
+  bool linked = false;
+
+  if (isFallthrough) {
+    // If a trace already starts at the fall-through point, link to
+    // it right away instead of waiting for the exit to become hot.
+    // The next time around we then never leave machine code.  This
+    // also covers return traces, which are not marked by a JFUNC.
+    // If the bridge does not fit, the exit is treated as usual.
+    Fragment *target = cap->jit()->traceAt(sn.pc());
+    if (target != NULL && target != this) {
+      LC_ASSERT(sn.pc()->opcode() != BcIns::kJFUNC ||
+                target->traceId() == sn.pc()->d());
+      if (cap->jit()->patchFallthrough(this, exitno, target)) {
+        ++trace_links;
+        linked = true;
+      }
+    }
+  }
+
+  if (!linked && snapins->opcode() != IR::kHEAPCHK && sn.bumpExitCounter()) {
+    if (isFallthrough) {
       // If the parent trace falls back directly to the interpreter
       // then this new traces should be treated like a root trace.
       // The only difference is that the fallthrough branch should be
       // updated to jump directly to the entry of the new trace.
       BcIns *pc = sn.pc();
-      if (pc->opcode() == BcIns::kJFUNC) {
-        // A trace has been formed at the fall-through point before
-        // the side exit got hot.
-        Fragment *target = cap->jit()->lookupFragment(pc);
-        LC_ASSERT(target && target->traceId() == pc->d());
-        cap->jit()->patchFallthrough(this, exitno, target);
-      } else {
-        bool isReturn = !(pc->opcode() == BcIns::kFUNC || pc->opcode() == BcIns::kIFUNC);
-        cap->jit()->beginRecording(cap, pc, base, isReturn);
-        cap->jit()->setFallthroughParent(this, exitno);
-        cap->setState(Capability::STATE_RECORD);
-      }
+      bool isReturn = !(pc->opcode() == BcIns::kFUNC || pc->opcode() == BcIns::kIFUNC);
+      cap->jit()->beginRecording(cap, pc, base, isReturn);
+      cap->jit()->setFallthroughParent(this, exitno);
+      cap->setState(Capability::STATE_RECORD);
     } else {
       DBG(cerr << COL_RED "HOTSIDE" COL_RESET "\n");
       cap->jit()->beginSideTrace(cap, base, this, exitno);
@@ -1711,6 +1868,61 @@ void Fragment::restoreSnapshot(ExitNo exitno, ExitState *ex) {
   }
 }
 
+// The GC needs a consistent stack, so we first write the snapshot
+// back to the stack, as if we were leaving the trace.  The trace
+// never reads a stack slot after writing to it (that's what the
+// snapshot is for), so this does not affect it.  Values stored in a
+// slot that the GC treats as a root are read back after the GC.  All
+// other pointers recorded in the stack map are updated in place.
+bool Fragment::collectGarbage(ExitNo exitno, ExitState *ex) {
+  LC_ASSERT(0 <= exitno && exitno < nsnaps_);
+  const GCMap &map = gcmaps_[exitno];
+  Snapshot &sn = snap(exitno);
+  BcIns *pc = sn.pc();
+  if (!map.valid || pc == NULL)
+    return false;
+  // The GC finds the live slots of the top frame via the bitmask of
+  // the allocation instruction.
+  if (pc->opcode() != BcIns::kALLOC1 && pc->opcode() != BcIns::kALLOC &&
+      pc->opcode() != BcIns::kALLOCAP)
+    return false;
+
+  DBG(cerr << "GC at snapshot " << (int)exitno
+      << " of Trace " << traceId() << endl);
+  writeSnapshot(sn, ex);
+  Word *base = (Word *)ex->gpr[RID_BASE];
+  Thread *T = ex->T;
+  T->base_ = base + sn.relbase();
+  T->top_ = T->base_ + sn.framesize();
+  T->pc_ = pc;
+  Capability *cap = T->owner();
+  MemoryManager *mm = cap->mm_;
+
+  std::vector<Closure **> roots;
+  std::vector<std::pair<Word *, Word *> > reloads;
+  for (uint32_t i = map.begin; i < map.end; ++i) {
+    const GCRoot &root = gcroots_[i];
+    Word *loc = hasSpill(root.loc)
+      ? &ex->spill[root.loc.spill] : &ex->gpr[root.loc.reg];
+    if (root.slot != kNoStackSlot &&
+        mm->isStackRoot(T->base_, T->top_, pc, &base[root.slot])) {
+      reloads.push_back(std::make_pair(loc, &base[root.slot]));
+    } else if (root.isClosure) {
+      roots.push_back((Closure **)loc);
+    } else {
+      // Could be a pointer in a dead stack slot.
+      return false;
+    }
+  }
+
+  mm->performGCWithRoots(cap, roots.empty() ? NULL : &roots[0],
+                         roots.size(), (char **)&ex->gpr[RID_HP],
+                         (char **)&ex->hplim);
+  for (size_t i = 0; i < reloads.size(); ++i)
+    *reloads[i].first = *reloads[i].second;
+  return true;
+}
+
 #undef DBG
 
 #define SLOT_SIZE (LC_ARCH_BITS/8)
@@ -80,7 +80,15 @@ public:
   MachineCode(Prng *);
   ~MachineCode();
 
-  static const size_t kAreaSize = (size_t)1 << 22; // 512KB
+  static const size_t kAreaSize = (size_t)1 << 22; // 4MB
+
+  /// Default limit for the total size of all machine code areas.
+  static const size_t kDefaultLimit = (size_t)1 << 26;
+
+  /// A new area is started if the current one has less than this
+  /// many bytes free.  Trace length is bounded by the recorder, so
+  /// this is always enough to assemble a single trace.
+  static const size_t kMinFree = (size_t)1 << 16;
 
   /// Reserve the whole machine code area.  No code from the machine
   /// code area may be running at the same time.  (It will trigger a
@@ -97,6 +105,41 @@ public:
   void commitStub(MCode *bot);
   void abort();
 
+  /// Make sure that the next reserve() has at least kMinFree bytes
+  /// available.  Chains a new area if the current one is (nearly)
+  /// full.  All areas are within branch range of each other.
+  ///
+  /// @return false if that would exceed the size limit.  All
+  ///     fragments must then be flushed (see Jit::flushFragments).
+  bool ensureSpace();
+
+  /// Release all machine code areas.  No machine code may be running
+  /// and all references to it (exit stubs, fragments, JFUNC
+  /// instructions) must have been dropped.
+  void flush();
+
+  /// Limit the total size of all machine code areas.
+  inline void setLimit(size_t limit) {
+    limit_ = limit < kAreaSize ? kAreaSize : limit;
+  }
+  inline size_t limit() const { return limit_; }
+
+  /// Ask the OS to back new machine code areas with transparent
+  /// huge pages (where supported).
+  inline void setHugePages(bool enable) { hugePages_ = enable; }
+
+  /// Number of bytes of machine code (including stubs) in all areas.
+  size_t used() const;
+  inline uint32_t numAreas() const {
+    return retired_.size() + (area_ != NULL ? 1 : 0);
+  }
+  inline uint32_t numFlushes() const { return flushes_; }
+
+  /// Free bytes in the current area.
+  inline size_t available() const {
+    return area_ != NULL ? (size_t)(top_ - bottom_) : 0;
+  }
+
   /// Reserves the machine code area containing the given pointer.
   /// Used to modify existing machine code (e.g., for trace linking).
   ///
@@ -131,6 +174,16 @@ private:
   void allocArea();
   void protect(int prot);
 
+  /// A full machine code area.  Code in it is still live, but no new
+  /// code is allocated from it.
+  struct Area {
+    MCode *start;
+    size_t size;
+    size_t used;
+  };
+
+  Area *findRetired(MCode *ptr);
+
   Prng *prng_;
   int protection_;
   MCode *area_;
@@ -138,17 +191,27 @@ private:
   MCode *bottom_;
   size_t size_;
   size_t sizeTotal_;
+  size_t limit_;
+  uint32_t flushes_;
+  bool hugePages_;
+  std::vector<Area> retired_;
 };
 
 
 // Forward declarations.
 class Capability;
 class Fragment;
+class TraceCache;
 
 #define FRAGMENT_MAP \
   HASH_NAMESPACE::HASH_MAP_CLASS<Word,TraceId>
 
-#define TRACE_ID_NONE  (~0)
+// Maps a register set to the exit code that saves it (see
+// Assembler::exitSaveCode).
+#define EXIT_SAVE_MAP \
+  HASH_NAMESPACE::HASH_MAP_CLASS<uint32_t,MCode*>
+
+#define TRACE_ID_NONE  (~(TraceId)0)
 
 typedef enum {
   TT_ROOT,
@@ -200,6 +263,8 @@ public:
   }
 
   inline MachineCode *mcode() { return &mcode_; }
+  /// Number of distinct register sets saved by exit stubs.
+  inline size_t numExitSaveCodes() const { return exitSaveCode_.size(); }
   inline IRBuffer *buffer() { return &buf_; }
   inline Assembler *assembler() { return &asm_; }
 
@@ -212,16 +277,43 @@ public:
   inline void setDebugTrace(bool val) { options_.set(kOptDebugTrace, val); }
   static inline void registerFragment(BcIns *startPc, Fragment *F, bool isSideTrace);
   static void resetFragments();
+
+  /// Throw away all fragments and their machine code.  Restores the
+  /// original instruction at the start of each root trace.
+  void flushFragments();
   static uint32_t numFragments();
 
+  /// Serialise root traces into the given cache as they are
+  /// recorded.  NULL (the default) disables this.
+  inline void setTraceCache(TraceCache *cache) { traceCache_ = cache; }
+
+  /// Assembles a root trace whose IR the trace cache has put into
+  /// buffer(), as if it had just been recorded at startPc.  Returns
+  /// NULL if there is no room for it.
+  Fragment *assembleCachedTrace(BcIns *startPc, bool isReturn,
+                                const std::vector<BcIns *> &targets);
+
+  // State of the trace being recorded.  Used by the trace cache.
+  inline BcIns *startPc() const { return startPc_; }
+  inline bool isReturnTrace() const { return flags_.get(kIsReturnTrace); }
+  inline const std::vector<BcIns *> &targets() const { return targets_; }
+  /// The bytecode of each function the current trace was recorded
+  /// from.  Only kept if there is a trace cache.
+  inline const std::vector<const Code *> &recordedCode() const {
+    return codes_;
+  }
+
   void setFallthroughParent(Fragment *parent, SnapNo snapno);
-  void patchFallthrough(Fragment *parent, ExitNo exitno, Fragment *target);
+  /// Links a fall-through exit to an existing trace.  Returns false
+  /// if there is no room for the bridge in the machine code area.
+  bool patchFallthrough(Fragment *parent, ExitNo exitno, Fragment *target);
 
 private:
   void initRecording(Capability *cap, Word *base, BcIns *startPc);
   Word *pushFrame(Word *base, BcIns *returnPc, TRef noderef,
                   uint32_t framesize);
   void finishRecording();
+  Fragment *assembleTrace();
   void resetRecorderState();
   void replaySnapshot(Fragment *parent, SnapNo snapno, Word *base);
   int32_t checkFreeHeapAvail(Fragment *F, SnapNo snapno);
@@ -238,13 +330,15 @@ private:
   Flags32 options_; // configuration options
   TraceType traceType_;
   std::vector<BcIns*> targets_;
+  std::vector<const Code *> codes_;
+  TraceCache *traceCache_;
   Prng prng_;
   MachineCode mcode_;
   IRBuffer buf_;
   Assembler asm_;
   CallStack callStack_;
   BranchTargetBuffer btb_;
-  MCode *exitStubGroup_[16];
+  EXIT_SAVE_MAP exitSaveCode_;
   bool shouldAbort_;
 #ifdef LC_TRACE_STATS
   uint64_t *stats_;
@@ -288,11 +382,23 @@ public:
   inline uint16_t frameSize() const { return frameSize_; }
 
   inline BcIns *startPc() const { return startPc_; }
+
+  /// The instruction that the JFUNC at startPc() replaced.
+  inline BcIns startIns() const { return startIns_; }
   
+  /// Size of the fragment's machine code in bytes (excluding shared
+  /// exit stubs).
+  inline size_t mcodeSize() const { return sizemcode_; }
+
   inline MCode *entry() { return mcode_; }
   uint64_t literalValue(IRRef, Word* base);
   void restoreSnapshot(ExitNo, ExitState *);
 
+  /// Performs a GC at the failed heap check of the given exit, and
+  /// updates all pointers held by the trace.  Returns false if this
+  /// is not possible and the trace has to be left instead.
+  bool collectGarbage(ExitNo, ExitState *);
+
   ~Fragment();
 
   inline Snapshot &snap(SnapNo n) {
@@ -302,6 +408,12 @@ public:
 
   inline uint32_t numExits() const { return nsnaps_; }
 
+  inline const GCMap &gcMap(SnapNo n) const {
+    LC_ASSERT(n < nsnaps_);
+    return gcmaps_[n];
+  }
+  inline const GCRoot &gcRoot(uint32_t i) const { return gcroots_[i]; }
+
 #ifdef LC_TRACE_STATS
   inline uint64_t traceCompletions() const { return stats_[0]; }
   inline uint64_t traceExitsAt(ExitNo n) const {
@@ -321,8 +433,31 @@ private:
 
   inline IR *ir(IRRef ref) { return &buffer_[ref]; }
 
+  /// Pre-decode all snapshot entries into restore_.  Must be called
+  /// after register allocation, i.e., once the fragment is complete.
+  void compileRestore();
+
+  /// Writes the values of all snapshot entries back to the stack.
+  void writeSnapshot(Snapshot &, ExitState *);
+
   static const int kIsCompiled = 1;
 
+  /// A snapshot entry in a form that can be written back to the
+  /// stack without inspecting the IR.  Indexed by Snapshot::MapRef.
+  struct RestoreEntry {
+    int32_t slot;
+    uint8_t kind;
+    uint8_t src;       // Register or spill slot.
+    Word value;        // Literal value, or offset from base (in words).
+  };
+
+  enum {
+    kRestoreLiteral,
+    kRestoreBaseOffset,
+    kRestoreSpill,
+    kRestoreReg
+  };
+
   Flags32 flags_;
   uint32_t traceId_;
   BcIns *startPc_;
@@ -340,10 +475,14 @@ private:
   uint16_t nsnaps_;
   Snapshot *snaps_;      
   SnapshotData snapmap_;
+  RestoreEntry *restore_;
+  GCMap *gcmaps_;        // Indexed by snapshot number.
+  GCRoot *gcroots_;
   AbstractHeap heap_;
   
   MCode *mcode_;
-  //  size_t sizemcode_;
+  size_t sizemcode_;
+  BcIns startIns_;       // Instruction overwritten by JFUNC.
 
 #ifdef LC_TRACE_STATS
   uint64_t *stats_;
@@ -378,7 +517,7 @@ struct _ExitState {
   Word     gpr[RID_NUM_GPR];    /* General-purpose registers. */
   Word     *hplim;              /* Heap Limit */
   Word     *stacklim;           /* Stack Limit */
-  Word     unused1;
+  Word     retaddr;             /* Used by asmHeapOverflow */
   Thread   *T;                  /* Currently executing thread */
   TraceId  F_id;                /* Fragment under execution */
   uint32_t unused2;             // Padding
@@ -391,11 +530,14 @@ typedef enum {
   AR_TRACE_TOO_LONG,
   AR_INTERPRETER_REQUEST,
   AR_NYI,
+  AR_MCODE_FULL,
   AR__MAX
 } AbortReason;
 
 extern uint64_t record_aborts;
 extern uint64_t record_abort_reasons[AR__MAX];
+extern uint64_t trace_links;
+extern uint64_t trace_gcs;
 
 #define HPLIM_SP_OFFS  0
 #define SPLIM_SP_OFFS  8
@@ -410,6 +552,9 @@ extern "C" void asmExit(int);
 extern "C" void asmHeapOverflow(void);
 extern "C" void asmStackOverflow(void);
 extern "C" void asmTrace(void);
+// Adds the closure pushed onto the stack to the remembered set.
+// Preserves all registers and flags.
+extern "C" void asmWriteBarrier(void);
 extern "C" void debugTrace(ExitState *);
 
 _END_LAMBDACHINE_NAMESPACE
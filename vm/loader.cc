@@ -1,5 +1,6 @@
 #include "loader.hh"
 #include "fileutils.hh"
+#include "image.hh"
 #include "miscclosures.hh"
 #include "time.hh"
 
@@ -8,6 +9,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <pthread.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -20,29 +27,65 @@ _START_LAMBDACHINE_NAMESPACE
 Time loader_time = 0;
 
 BytecodeFile::BytecodeFile(const char *filename)
-  : name_(filename), f_(NULL) {
+  : name_(filename), start_(NULL), cur_(NULL), end_(NULL), mapped_(false) {
   LC_ASSERT(filename != NULL);
 }
 
+BytecodeFile::~BytecodeFile() {
+  close();
+}
+
+// The whole file is mapped at once.  If that's not possible (e.g.,
+// the file is empty or on a file system without mmap support), it is
+// read into memory instead.
 bool BytecodeFile::open() {
-  f_ = fopen(name_, "rb");
-  if (!f_) {
+  int fd = ::open(name_, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
     fprintf(stderr, "ERROR: Could not open file %s\n", name_);
+    if (fd >= 0) ::close(fd);
     return false;
   }
+  size_t size = (size_t)st.st_size;
+  void *p = size > 0
+    ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  if (p != MAP_FAILED) {
+    mapped_ = true;
+    madvise(p, size, MADV_SEQUENTIAL);
+  } else {
+    mapped_ = false;
+    p = malloc(size > 0 ? size : 1);
+    size_t got = 0;
+    ssize_t n = 1;
+    while (p != NULL && got < size &&
+           (n = read(fd, (char *)p + got, size - got)) > 0)
+      got += n;
+    if (p == NULL || got < size) {
+      fprintf(stderr, "ERROR: Could not read file %s\n", name_);
+      free(p);
+      ::close(fd);
+      return false;
+    }
+  }
+  ::close(fd);
+  start_ = cur_ = static_cast<const uint8_t *>(p);
+  end_ = start_ + size;
   return true;
 }
 
 void BytecodeFile::close() {
-  fclose(f_);
+  if (start_ == NULL)
+    return;
+  if (mapped_)
+    munmap(const_cast<uint8_t *>(start_), end_ - start_);
+  else
+    free(const_cast<uint8_t *>(start_));
+  start_ = cur_ = end_ = NULL;
 }
 
-uint32_t BytecodeFile::get_u4() {
-  uint32_t hh = get_u1();
-  uint32_t hl = get_u1();
-  uint32_t lh = get_u1();
-  uint32_t ll = get_u1();
-  return MSB_u4(hh, hl, lh, ll);
+void BytecodeFile::truncated() {
+  fprintf(stderr, "ERROR: Unexpected end of file %s\n", name_);
+  exit(1);
 }
 
 // Decode an unsigned variable length integer.
@@ -59,10 +102,10 @@ Word BytecodeFile::get_varuint_slow(Word i) {
 }
 
 bool BytecodeFile::magic(const char *bytes) {
-  for (const char *p = bytes; *p != '\0'; ++p) {
-    char c = get_u1();
-    if (c != *p) return false;
-  }
+  size_t len = strlen(bytes);
+  if ((size_t)(end_ - cur_) < len || memcmp(cur_, bytes, len) != 0)
+    return false;
+  cur_ += len;
   return true;
 }
 
@@ -70,11 +113,21 @@ bool BytecodeFile::magic(const char *bytes) {
 #define VERSION_MAJOR  0
 #define VERSION_MINOR  1
 
+// Static closures and bytecode first, so that blocks that are
+// mapped copy-on-write come before the read-only ones in images.
+const Block::Flags Loader::staticDataKinds_[] = {
+  Block::kStaticClosures, Block::kBytecode,
+  Block::kInfoTables, Block::kStrings
+};
+
 Loader::Loader(MemoryManager *mm, const char *basepaths)
   : mm_(mm), loadedModules_(10), infoTables_(100), closures_(100),
-    basepaths_(NULL) {
+    basepaths_(NULL), threads_(1), image_(NULL) {
   initBasePath(basepaths);
   MiscClosures::init(mm);
+  for (int i = 0; i < kStaticDataKinds; ++i)
+    staticMark_[i] = mm->staticBlocks(staticDataKinds_[i]);
+  mm->startStaticBlocks();
 }
 
 Loader::~Loader() {
@@ -83,12 +136,122 @@ Loader::~Loader() {
        it != loadedModules_.end(); ++it) {
     delete it->second;
   }
+  delete image_;
+}
+
+bool Loader::saveImage(const char *path) {
+  if (image_ != NULL) {
+    fprintf(stderr, "ERROR: Cannot save an image after loading one.\n");
+    return false;
+  }
+  ImageWriter w;
+  for (int i = 0; i < kStaticDataKinds; ++i) {
+    std::vector<Block *> blocks;
+    for (Block *b = mm_->staticBlocks(staticDataKinds_[i]);
+         b != staticMark_[i]; b = b->link())
+      blocks.push_back(b);
+    // Oldest first.
+    for (size_t j = blocks.size(); j > 0; --j)
+      w.addBlock(blocks[j - 1]);
+  }
+  for (size_t i = 0; i < relocs_.size(); ++i)
+    w.addRelocation(relocs_[i]);
+
+  for (STRING_MAP(Module *)::iterator it = loadedModules_.begin();
+       it != loadedModules_.end(); ++it) {
+    if (it->second != NULL)
+      w.addSymbol(Image::kModule, it->first, NULL);
+  }
+  for (STRING_MAP(InfoTable *)::iterator it = infoTables_.begin();
+       it != infoTables_.end(); ++it) {
+    w.addSymbol(Image::kInfoTable, it->first, it->second);
+  }
+  for (STRING_MAP(Closure *)::iterator it = closures_.begin();
+       it != closures_.end(); ++it) {
+    const InfoTable *info = it->second->info();
+    u4 flags = info->type() == CONSTR && info->size() == 0
+      ? Image::kSharedClosure : 0;
+    w.addSymbol(Image::kClosure, it->first, it->second, flags);
+  }
+  return w.write(path);
+}
+
+bool Loader::loadImage(const char *path) {
+  if (image_ != NULL || !infoTables_.empty() || !closures_.empty()) {
+    fprintf(stderr, "ERROR: Images must be loaded before any modules.\n");
+    return false;
+  }
+  Time starttime = getProcessElapsedTime();
+  image_ = Image::map(path);
+  if (image_ == NULL)
+    return false;
+
+  // Only the modules and shared closures, which come first, are
+  // needed now.  Other symbols are looked up on demand.
+  for (u4 i = 0; i < image_->numSymbols(); ++i) {
+    const char *name = image_->symbolName(i);
+    if (image_->symbolKind(i) == Image::kModule) {
+      Module *mdl = new Module();
+      mdl->name_ = name;
+      mdl->flags_ = 0;
+      mdl->numInfoTables_ = mdl->numClosures_ = 0;
+      mdl->numStrings_ = mdl->numImports_ = 0;
+      mdl->strings_ = NULL;
+      mdl->imports_ = NULL;
+      loadedModules_[name] = mdl;
+    } else if (image_->symbolFlags(i) & Image::kSharedClosure) {
+      nullaryClosures_.push_back
+        (static_cast<Closure *>(image_->symbolAddress(i)));
+    } else {
+      break;
+    }
+  }
+  initSharedClosures();
+  loader_time += getProcessElapsedTime() - starttime;
+  return true;
+}
+
+// Registers the closures that MiscClosures shares between all
+// occurrences of small Ints and Chars and of nullary constructors.
+void Loader::initSharedClosures() {
+  for (size_t i = 0; i < nullaryClosures_.size(); ++i) {
+    Closure *cl = nullaryClosures_[i];
+    if (cl->info()->type() == CONSTR)
+      MiscClosures::addNullaryClosure(cl);
+  }
+  nullaryClosures_.clear();
+
+  if (MiscClosures::stg_Izh_info != NULL)
+    return;
+  InfoTable *izh = infoTable("GHC.Types.I#`con_info");
+  InfoTable *czh = infoTable("GHC.Types.C#`con_info");
+  if (!isFullyLoadedInfoTable(izh) || !isFullyLoadedInfoTable(czh))
+    return;
+  MiscClosures::initSmallBoxes(mm_, izh, czh);
+  for (WordInt n = MiscClosures::kMinIntLike;
+       n <= MiscClosures::kMaxIntLike; ++n)
+    addRelocation(&MiscClosures::intLike(n)->header_.info_);
+  for (Word c = 0; c <= MiscClosures::kMaxCharLike; ++c)
+    addRelocation(&MiscClosures::charLike(c)->header_.info_);
+}
+
+Closure *Loader::imageClosure(const char *name) const {
+  u4 i = image_ != NULL ? image_->findSymbol(Image::kClosure, name)
+                        : Image::kNoSymbol;
+  return i != Image::kNoSymbol
+    ? static_cast<Closure *>(image_->symbolAddress(i)) : NULL;
+}
+
+InfoTable *Loader::imageInfoTable(const char *name) const {
+  u4 i = image_ != NULL ? image_->findSymbol(Image::kInfoTable, name)
+                        : Image::kNoSymbol;
+  return i != Image::kNoSymbol
+    ? static_cast<InfoTable *>(image_->symbolAddress(i)) : NULL;
 }
 
 bool Loader::loadWiredInModules() {
-  AllocInfoTableHandle h(*mm_); // Prevent lots of mprotect calls
-  bool result = loadModule("GHC.Types") && loadModule("Control.Exception.Base");
-  return result;
+  const char *wiredIn[] = { "GHC.Types", "Control.Exception.Base" };
+  return loadModules(wiredIn, countof(wiredIn));
 }
 
 // Linked list of strings
@@ -254,61 +417,194 @@ char *Loader::findModule(const char *moduleName) {
   return NULL;
 }
 
+// A module that has been opened but not yet linked.  Decoding fills
+// in the lists of info tables and closures the module defines and of
+// the places that refer to other info tables and closures.  Those
+// references get filled in by linking.
+struct LoadingModule {
+  LoadingModule(char *filename, StaticArena *arena)
+    : file(filename), filename(filename), mdl(NULL), arena(arena) {}
+  ~LoadingModule() { delete[] filename; }
+
+  inline void addRelocation(void *slot) {
+    relocs.push_back(static_cast<Word *>(slot));
+  }
+
+  BytecodeFile file;
+  char *filename;
+  Module *mdl;
+  StaticArena *arena;  // Of the thread that decodes the module.
+
+  struct DecodedClosure {
+    const char *name;
+    const char *infoName;
+    Closure *closure;
+    u4 payloadSize;
+  };
+  std::vector<std::pair<const char *, InfoTable *> > infoTables;
+  std::vector<DecodedClosure> closures;
+  std::vector<std::pair<const char *, InfoTable **> > infoTableRefs;
+  std::vector<std::pair<const char *, Word *> > closureRefs;
+  std::vector<Word *> relocs;
+  std::vector<Closure *> nullaryClosures;
+};
+
 bool Loader::loadModule(const char *moduleName) {
+  return loadModules(&moduleName, 1);
+}
+
+// Loading works in three phases:
+//
+//  1. Starting with the requested modules, we open each module and
+//     read its header to find the modules it imports.  This gives
+//     the import graph, which we put in an order where imports come
+//     first (apart from import cycles).
+//
+//  2. We decode the module bodies.  Decoding a module does not look
+//     at any other module: its static data is allocated in the
+//     decoding thread's StaticArena, and references to info tables
+//     and closures are only recorded.  Hence all modules can be
+//     decoded in parallel.
+//
+//  3. A single thread links the modules.  It first adds the info
+//     tables and closures of all modules to the symbol tables, and
+//     then fills in the recorded references.  References to symbols
+//     that are still missing become forward references (see below).
+bool Loader::loadModules(const char *const *moduleNames, int count) {
   Time starttime = getProcessElapsedTime();
-  bool ans = false;
-  {
-    AllocInfoTableHandle h(*mm_); // Prevent lots of mprotect calls
-    ans = loadModule(moduleName, 0) && checkNoForwardRefs();
+  std::vector<LoadingModule *> modules;
+  std::vector<StaticArena *> arenas;
+  arenas.push_back(new StaticArena(mm_));
+  bool ans = true;
+
+  for (int i = 0; i < count; ++i) {
+    if (!openModule(moduleNames[i], arenas[0], &modules, 0))
+      ans = false;
   }
+
+  decodeModules(modules, arenas);
+  for (size_t i = 0; i < arenas.size(); ++i) {
+    mm_->commitStaticArena(arenas[i]);
+    delete arenas[i];
+  }
+
+  for (size_t i = 0; i < modules.size(); ++i)
+    linkModule(*modules[i]);
+  resolveReferences(modules);
+  for (size_t i = 0; i < modules.size(); ++i)
+    delete modules[i];
+
+  ans = ans && checkNoForwardRefs();
+  if (ans)
+    initSharedClosures();
   loader_time += getProcessElapsedTime() - starttime;
   return ans;
 }
 
-bool Loader::loadModule(const char *moduleName, int level) {
-  char *filename;
-  Module *mdl;
-
-  mdl = loadedModules_[moduleName];
-
-  if (mdl != NULL) {            // Already loaded
+// Opens the module and the modules it imports (recursively) and
+// appends them to `modules`, imports first.  Modules that have
+// already been opened are skipped.
+bool Loader::openModule(const char *moduleName, StaticArena *arena,
+                        std::vector<LoadingModule *> *modules,
+                        int level) {
+  STRING_MAP(Module *)::const_iterator it = loadedModules_.find(moduleName);
+  if (it != loadedModules_.end() && it->second != NULL) {
     DLOG("[%d] Already loaded: %s\n", level, moduleName);
     return true;
   }
 
-  filename = findModule(moduleName);
+  char *filename = findModule(moduleName);
   if (!filename)
     return false;
 
-  DLOG("[%d] Loading %s ... (%s)\n", level, moduleName, filename);
+  DLOG("[%d] Opening %s ... (%s)\n", level, moduleName, filename);
 
-  BytecodeFile f(filename);
-  if (!f.open())
+  LoadingModule *m = new LoadingModule(filename, arena);
+  if (!m->file.open() || (m->mdl = loadModuleHeader(*m)) == NULL) {
+    delete m;
     return false;
+  }
 
-  mdl = loadModuleHeader(f);
-  if (!mdl)
-    return false;
+  if (level == 0) {
+    // The name of an import is kept by its importer, but this one
+    // belongs to our caller.
+    char *name = arena->allocString(strlen(moduleName));
+    strcpy(name, moduleName);
+    moduleName = name;
+  }
+  loadedModules_[moduleName] = m->mdl;
 
-  loadedModules_[moduleName] = mdl;
+  // A missing import shows up as unresolved references.
+  for (uint32_t i = 0; i < m->mdl->numImports_; i++)
+    openModule(m->mdl->imports_[i], arena, modules, level + 1);
 
-  // Load dependencies first.  This avoids creating many forward
-  // references.  The downside is that we keep more file descriptors
-  // open.
-  for (uint32_t i = 0; i < mdl->numImports_; i++)
-    loadModule(mdl->imports_[i], level + 1);
+  modules->push_back(m);
+  return true;
+}
 
-  loadModuleBody(f, mdl);
+struct DecodeThread {
+  Loader *loader;
+  const std::vector<LoadingModule *> *modules;
+  size_t *next;  // Index of the next module to decode.
+  StaticArena *arena;
+  pthread_t thread;
+};
 
-  f.close();
-  DLOG("[%d] DONE (%s)\n", level, moduleName);
-  delete[] filename;
-  return true;
+static bool largerFile(LoadingModule *a, LoadingModule *b) {
+  return a->file.size() > b->file.size();
+}
+
+// Runs up to threads_ threads (including the current one), each with
+// its own arena.  The threads take the largest modules first, so that
+// no thread gets left with a big module at the end.
+void Loader::decodeModules(std::vector<LoadingModule *> &modules,
+                           std::vector<StaticArena *> &arenas) {
+  std::vector<LoadingModule *> queue(modules);
+  std::sort(queue.begin(), queue.end(), largerFile);
+
+  size_t nthreads = std::min((size_t)threads_, queue.size());
+  if (nthreads == 0)
+    return;
+  while (arenas.size() < nthreads)
+    arenas.push_back(new StaticArena(mm_));
+
+  size_t next = 0;
+  std::vector<DecodeThread> threads(nthreads);
+  for (size_t i = 0; i < nthreads; ++i) {
+    threads[i].loader = this;
+    threads[i].modules = &queue;
+    threads[i].next = &next;
+    threads[i].arena = arenas[i];
+  }
+  size_t started = 1;
+  for (; started < nthreads; ++started) {
+    if (pthread_create(&threads[started].thread, NULL,
+                       decodeThreadMain, &threads[started]) != 0) {
+      fprintf(stderr, "WARNING: Could not start loader thread.\n");
+      break;
+    }
+  }
+  decodeThreadMain(&threads[0]);
+  for (size_t i = 1; i < started; ++i)
+    pthread_join(threads[i].thread, NULL);
+}
+
+void *Loader::decodeThreadMain(void *arg) {
+  DecodeThread *self = static_cast<DecodeThread *>(arg);
+  for (;;) {
+    size_t i = __sync_fetch_and_add(self->next, 1);
+    if (i >= self->modules->size())
+      break;
+    LoadingModule *m = (*self->modules)[i];
+    m->arena = self->arena;
+    self->loader->loadModuleBody(*m);
+  }
+  return NULL;
 }
 
 void Loader::loadStringTabEntry(BytecodeFile &f, StringTabEntry *e /*out*/) {
   e->len = f.get_varuint();
-  e->str = f.get_string(e->len);
+  e->str = f.get_bytes(e->len);
 }
 
 #define MAX_PARTS  255
@@ -320,8 +616,9 @@ void Loader::loadStringTabEntry(BytecodeFile &f, StringTabEntry *e /*out*/) {
 //
 // TODO: There is currently some duplication when loading IDs,
 // because each module has its own string table.
-const char *Loader::loadId(BytecodeFile &f, const StringTabEntry *strings,
-                           const char *sep) {
+const char *Loader::loadId(LoadingModule &m, const char *sep) {
+  BytecodeFile &f = m.file;
+  const StringTabEntry *strings = m.mdl->strings_;
   u4 numparts;
   u4 parts[MAX_PARTS];
   size_t seplen = strlen(sep);
@@ -338,7 +635,7 @@ const char *Loader::loadId(BytecodeFile &f, const StringTabEntry *strings,
   }
   len -= seplen;
 
-  ident = mm_->allocString(len);
+  ident = m.arena->allocString(len);
   p = ident;
   for (i = 0; i < numparts; i++) {
     len = strings[parts[i]].len;
@@ -356,7 +653,8 @@ const char *Loader::loadId(BytecodeFile &f, const StringTabEntry *strings,
 }
 
 
-Module *Loader::loadModuleHeader(BytecodeFile &f) {
+Module *Loader::loadModuleHeader(LoadingModule &m) {
+  BytecodeFile &f = m.file;
   Module *mdl;
   u2 major, minor;
   u4 secmagic;
@@ -369,6 +667,7 @@ Module *Loader::loadModuleHeader(BytecodeFile &f) {
   }
 
   mdl = new Module();
+  m.mdl = mdl;
 
   major = f.get_u2();
   minor = f.get_u2();
@@ -401,12 +700,12 @@ Module *Loader::loadModuleHeader(BytecodeFile &f) {
 
   //printStringTable(mdl->strings, mdl->numStrings);
 
-  mdl->name_ = loadId(f, mdl->strings_, ".");
+  mdl->name_ = loadId(m, ".");
   // printf("mdl name = %s\n", mdl->name);
 
   mdl->imports_ = new const char*[mdl->numImports_];
   for (i = 0; i < mdl->numImports_; i++) {
-    mdl->imports_[i] = loadId(f, mdl->strings_, ".");
+    mdl->imports_[i] = loadId(m, ".");
     // printf("import: %s\n", mdl->imports[i]);
   }
 
@@ -437,7 +736,9 @@ bool Loader::checkNoForwardRefs() {
   return errors == 0;
 }
 
-void Loader::loadModuleBody(BytecodeFile &f, Module *mdl) {
+// Decodes the module and closes its file.
+void Loader::loadModuleBody(LoadingModule &m) {
+  BytecodeFile &f = m.file;
   if (!f.magic("BCCL")) {
     fprintf(stderr, "Wrong magic for module body\n");
     exit(1);
@@ -445,12 +746,79 @@ void Loader::loadModuleBody(BytecodeFile &f, Module *mdl) {
 
   DLOG("Loading module body...");
 
-  for (u4 i = 0; i < mdl->numInfoTables_; ++i) {
-    loadInfoTable(f, mdl->strings_);
+  for (u4 i = 0; i < m.mdl->numInfoTables_; ++i) {
+    loadInfoTable(m);
+  }
+
+  for (u4 i = 0; i < m.mdl->numClosures_; ++i) {
+    loadClosure(m);
+  }
+
+  f.close();
+  // The string table pointed into the file.
+  delete[] m.mdl->strings_;
+  m.mdl->strings_ = NULL;
+}
+
+// Adds the module's info tables and closures to the symbol tables.
+// This fixes up forward references to them from modules loaded
+// earlier.
+void Loader::linkModule(LoadingModule &m) {
+  for (size_t i = 0; i < m.infoTables.size(); ++i) {
+    const char *name = m.infoTables[i].first;
+    InfoTable *info = m.infoTables[i].second;
+    if (isFullyLoadedInfoTable(infoTable(name))) {
+      fprintf(stderr, "ERROR: Duplicate info table: %s\n", name);
+      exit(1);
+    }
+    fixInfoTableForwardReference(name, info);
+    DLOG("loadInfoTable: %s " COLOURED(COL_YELLOW, "%p") "\n",
+         name, info);
+    infoTables_[name] = info;
+  }
+
+  for (size_t i = 0; i < m.closures.size(); ++i) {
+    const char *name = m.closures[i].name;
+    Closure *cl = m.closures[i].closure;
+    fixClosureForwardReference(name, cl);
+    DLOG("loadClosure: %s " COLOURED(COL_GREEN, "%p") "\n", name, cl);
+    closures_[name] = cl;
+  }
+
+  relocs_.insert(relocs_.end(), m.relocs.begin(), m.relocs.end());
+  nullaryClosures_.insert(nullaryClosures_.end(),
+                          m.nullaryClosures.begin(),
+                          m.nullaryClosures.end());
+}
+
+// Fills in the references recorded while decoding the modules.
+// Info tables come first: until a closure's info table has been
+// filled in, the closure looks like a forward reference.
+void Loader::resolveReferences(std::vector<LoadingModule *> &modules) {
+  for (size_t j = 0; j < modules.size(); ++j) {
+    LoadingModule &m = *modules[j];
+    for (size_t i = 0; i < m.infoTableRefs.size(); ++i)
+      loadInfoTableReference(m.infoTableRefs[i].first,
+                             m.infoTableRefs[i].second);
   }
 
-  for (u4 i = 0; i < mdl->numClosures_; ++i) {
-    loadClosure(f, mdl->strings_);
+  for (size_t j = 0; j < modules.size(); ++j) {
+    LoadingModule &m = *modules[j];
+    for (size_t i = 0; i < m.closureRefs.size(); ++i)
+      loadClosureReference(m.closureRefs[i].first,
+                           m.closureRefs[i].second);
+
+#ifndef NDEBUG
+    for (size_t i = 0; i < m.closures.size(); ++i) {
+      InfoTable *info = infoTable(m.closures[i].infoName);
+      if (isFullyLoadedInfoTable(info)) {
+        // If the info table is missing, checkNoForwardRefs reports it.
+        u4 payloadsize = m.closures[i].payloadSize;
+        LC_ASSERT((info->type() != CAF && payloadsize == info->size()) ||
+                  (info->type() == CAF && payloadsize == 2));
+      }
+    }
+#endif
   }
 }
 
@@ -458,32 +826,24 @@ void Loader::loadModuleBody(BytecodeFile &f, Module *mdl) {
 #define FMT_FWD_PTR   COLOURED(COL_RED, "%p")
 #define FMT_CLOS_PTR  COLOURED(COL_GREEN, "%p")
 
-InfoTable *Loader::loadInfoTable(BytecodeFile &f,
-                                 const StringTabEntry *strings) {
+InfoTable *Loader::loadInfoTable(LoadingModule &m) {
+  BytecodeFile &f = m.file;
   if (!f.magic("ITBL")) {
     fprintf(stderr, "Wrong magic for info table\n");
     exit(1);
   }
 
-  const char *itbl_name = loadId(f, strings, ".");
+  const char *itbl_name = loadId(m, ".");
   u2 cl_type = f.get_varuint();
   InfoTable *new_itbl = NULL;
-  FwdRefInfoTable *old_itbl =
-    static_cast<FwdRefInfoTable *>(infoTables_[itbl_name]);
-
-  if (isFullyLoadedInfoTable(old_itbl)) {
-    fprintf(stderr, "ERROR: Duplicate info table: %s\n", itbl_name);
-    exit(1);
-  }
 
   switch (cl_type) {
   case CONSTR:
     // A statically allocated constructor
   {
-    AllocInfoTableHandle h(*mm_);
     DLOG("itbl.CONSTR %s\n", itbl_name);
     ConInfoTable *info = static_cast<ConInfoTable *>
-      (mm_->allocInfoTable(h, wordsof(ConInfoTable)));
+      (m.arena->allocInfoTable(wordsof(ConInfoTable)));
     info->type_ = cl_type;
     info->tagOrBitmap_ = f.get_varuint();  // tag
     Word sz = f.get_varuint();
@@ -492,25 +852,26 @@ InfoTable *Loader::loadInfoTable(BytecodeFile &f,
     info->layout_.bitmap = sz > 0 ? f.get_u4() : 0;
     // info->i.layout.payload.ptrs = fget_varuint(f);
     // info->i.layout.payload.nptrs = fget_varuint(f);
-    info->name_ = loadId(f, strings, ".");
+    info->name_ = loadId(m, ".");
+    m.addRelocation(&info->name_);
     new_itbl = (InfoTable *)info;
   }
   break;
   case CAF:
   case THUNK:
   case FUN: {
-    AllocInfoTableHandle h(*mm_);
     DLOG("itbl.FUN/CAF/THK %s\n", itbl_name);
     CodeInfoTable *info = static_cast<CodeInfoTable *>
-      (mm_->allocInfoTable(h, wordsof(CodeInfoTable)));
+      (m.arena->allocInfoTable(wordsof(CodeInfoTable)));
     info->type_ = cl_type;
     info->tagOrBitmap_ = 0; // TODO: anything useful to put in here?
     Word sz = f.get_varuint();
     assert(sz <= 32);
     info->size_ = sz;
     info->layout_.bitmap = sz > 0 ? f.get_u4() : 0;
-    info->name_ = loadId(f, strings, ".");
-    loadCode(f, &info->code_, strings);
+    info->name_ = loadId(m, ".");
+    m.addRelocation(&info->name_);
+    loadCode(m, &info->code_);
     new_itbl = (InfoTable *)info;
   }
   break;
@@ -519,17 +880,12 @@ InfoTable *Loader::loadInfoTable(BytecodeFile &f,
     exit(1);
   }
 
-  fixInfoTableForwardReference(itbl_name, new_itbl);
-
-  DLOG("loadInfoTable: %s " COLOURED(COL_YELLOW, "%p") "\n",
-       itbl_name, new_itbl);
-  infoTables_[itbl_name] = new_itbl;
-
+  m.infoTables.push_back(std::make_pair(itbl_name, new_itbl));
   return new_itbl;
 }
 
-void Loader::loadCode(BytecodeFile &f, Code *code /* out */,
-                      const StringTabEntry *strings) {
+void Loader::loadCode(LoadingModule &m, Code *code /* out */) {
+  BytecodeFile &f = m.file;
   u2 *bitmaps = NULL;
   DLOG("loadCode: %p\n", code);
   code->framesize = f.get_varuint();
@@ -537,13 +893,21 @@ void Loader::loadCode(BytecodeFile &f, Code *code /* out */,
   code->sizelits = f.get_varuint();
   code->sizecode = f.get_u2();
   code->sizebitmaps = f.get_u2();
-  code->lits = new Word[code->sizelits];
-  code->littypes = new u1[code->sizelits];
+  if (code->sizelits > 0) {
+    code->lits = m.arena->allocLiterals(code->sizelits);
+    code->littypes = reinterpret_cast<u1 *>(&code->lits[code->sizelits]);
+  } else {
+    code->lits = NULL;
+    code->littypes = NULL;
+  }
+  m.addRelocation(&code->lits);
+  m.addRelocation(&code->littypes);
   for (u2 i = 0; i < code->sizelits; ++i) {
-    loadLiteral(f, &code->littypes[i], &code->lits[i], strings);
+    loadLiteral(m, &code->littypes[i], &code->lits[i]);
   }
   code->code = static_cast<BcIns *>
-               (mm_->allocCode(code->sizecode, code->sizebitmaps));
+               (m.arena->allocCode(code->sizecode, code->sizebitmaps));
+  m.addRelocation(&code->code);
   for (u2 i = 0; i < code->sizecode; ++i) {
     code->code[i] = f.get_u4();
   }
@@ -554,9 +918,9 @@ void Loader::loadCode(BytecodeFile &f, Code *code /* out */,
   }
 }
 
-void Loader::loadLiteral(BytecodeFile &f,
-                         u1 *littype, Word *literal,
-                         const StringTabEntry *strings) {
+void Loader::loadLiteral(LoadingModule &m, u1 *littype, Word *literal) {
+  BytecodeFile &f = m.file;
+  const StringTabEntry *strings = m.mdl->strings_;
   u4 i;
   *littype = f.get_u1();
   switch (*littype) {
@@ -572,18 +936,30 @@ void Loader::loadLiteral(BytecodeFile &f,
   case LIT_FLOAT:
     *literal = (Word)f.get_u4();
     break;
-  case LIT_STRING:
+  case LIT_STRING: {
+    // Copied, so that all static data is in the memory manager's
+    // blocks (and hence can be saved as an image).
     i = f.get_varuint();
-    *literal = (Word)strings[i].str;
-    break;
+    char *str = m.arena->allocString(strings[i].len);
+    memcpy(str, strings[i].str, strings[i].len);
+    str[strings[i].len] = '\0';
+    *literal = (Word)str;
+    m.addRelocation(literal);
+  }
+  break;
   case LIT_CLOSURE: {
-    const char *clname = loadId(f, strings, ".");
-    loadClosureReference(clname, literal);
+    const char *clname = loadId(m, ".");
+    *literal = (Word)NULL;
+    m.closureRefs.push_back(std::make_pair(clname, literal));
+    m.addRelocation(literal);
   }
   break;
   case LIT_INFO: {
-    const char *infoname = loadId(f, strings, ".");
-    loadInfoTableReference(infoname, (InfoTable **)literal);
+    const char *infoname = loadId(m, ".");
+    *literal = (Word)NULL;
+    m.infoTableRefs.push_back(std::make_pair(infoname,
+                                             (InfoTable **)literal));
+    m.addRelocation(literal);
   }
   break;
   default:
@@ -656,7 +1032,10 @@ void Loader::loadLiteral(BytecodeFile &f,
 //
 
 void Loader::loadClosureReference(const char *name, Word *literal /* out */) {
-  Closure *cl = closures_[name];
+  Closure *&entry = closures_[name];
+  if (entry == NULL)
+    entry = imageClosure(name);
+  Closure *cl = entry;
   if (cl == NULL) {
     // 1st forward ref, create the link
     cl = reinterpret_cast<Closure *>
@@ -697,7 +1076,10 @@ void Loader::fixClosureForwardReference(const char *name, Closure *cl) {
 }
 
 void Loader::loadInfoTableReference(const char *name, InfoTable **dest) {
-  InfoTable *info = infoTables_[name];
+  InfoTable *&entry = infoTables_[name];
+  if (entry == NULL)
+    entry = imageInfoTable(name);
+  InfoTable *info = entry;
   FwdRefInfoTable *info2;
   if (info == NULL) {
     // 1st forward ref
@@ -737,42 +1119,33 @@ void Loader::fixInfoTableForwardReference(const char *name, InfoTable *info) {
 }
 
 
-void Loader::loadClosure(BytecodeFile &f,
-                         const StringTabEntry *strings) {
+void Loader::loadClosure(LoadingModule &m) {
+  BytecodeFile &f = m.file;
   if (!f.magic("CLOS")) {
     fprintf(stderr, "Wrong magic for closure\n");
     exit(2);
   }
-  const char *clos_name = loadId(f, strings, ".");
+  const char *clos_name = loadId(m, ".");
   u4 payloadsize = f.get_varuint();
-  const char *itbl_name = loadId(f, strings, ".");
-  InfoTable *info = infoTables_[itbl_name];
+  const char *itbl_name = loadId(m, ".");
 
-  if (isFullyLoadedInfoTable(info)) {
-    // If we haven't loaded the info table yet we cannot check this.
-    // This can happen when loading recursive groups of modules.
-    LC_ASSERT((info->type() != CAF && payloadsize == info->size()) ||
-              (info->type() == CAF && payloadsize == 2));
-  }
-
-  Closure *cl = mm_->allocStaticClosure(payloadsize);
-
-  loadInfoTableReference(itbl_name, &cl->header_.info_);
+  Closure *cl = m.arena->allocStaticClosure(payloadsize);
 
-  // Fill in closure payload.  May create forward references to the
-  // current closure.
+  cl->header_.info_ = NULL;
+  m.infoTableRefs.push_back(std::make_pair(itbl_name, &cl->header_.info_));
+  m.addRelocation(&cl->header_.info_);
 
   for (u4 i = 0; i < payloadsize; i++) {
     DLOG("Loading payload for: %s [%d]\n", clos_name, i);
     u1 dummy;
-    loadLiteral(f, &dummy, &cl->payload_[i], strings);
+    loadLiteral(m, &dummy, &cl->payload_[i]);
   }
 
-  fixClosureForwardReference(clos_name, cl);
-
-  DLOG("loadClosure: %s " COLOURED(COL_GREEN, "%p") "\n",
-       clos_name, cl);
-  closures_[clos_name] = cl;
+  LoadingModule::DecodedClosure decoded =
+    { clos_name, itbl_name, cl, payloadsize };
+  m.closures.push_back(decoded);
+  if (payloadsize == 0)
+    m.nullaryClosures.push_back(cl);
 }
 
 void Loader::printInfoTables(ostream &out) {
@@ -781,6 +1154,65 @@ void Loader::printInfoTables(ostream &out) {
        it != infoTables_.end(); ++it) {
     it->second->debugPrint(out);
   }
+  if (image_ == NULL)
+    return;
+  for (u4 i = 0; i < image_->numSymbols(); ++i) {
+    if (image_->symbolKind(i) == Image::kInfoTable &&
+        infoTables_.find(image_->symbolName(i)) == infoTables_.end())
+      static_cast<InfoTable *>(image_->symbolAddress(i))->debugPrint(out);
+  }
+}
+
+const CodeInfoTable *
+Loader::codeInfoTableContaining(const BcIns *pc, const char **name) {
+  STRING_MAP(InfoTable *)::iterator it;
+  for (it = infoTables_.begin(); it != infoTables_.end(); ++it) {
+    InfoTable *info = it->second;
+    if (!isFullyLoadedInfoTable(info) || !info->hasCode())
+      continue;
+    const Code *code = static_cast<CodeInfoTable *>(info)->code();
+    if (code->code <= pc && pc < code->code + code->sizecode) {
+      *name = it->first;
+      return static_cast<CodeInfoTable *>(info);
+    }
+  }
+  if (image_ == NULL)
+    return NULL;
+  // Info tables from the image are only in infoTables_ once they
+  // have been looked up.
+  for (u4 i = 0; i < image_->numSymbols(); ++i) {
+    if (image_->symbolKind(i) != Image::kInfoTable)
+      continue;
+    InfoTable *info = static_cast<InfoTable *>(image_->symbolAddress(i));
+    if (!info->hasCode())
+      continue;
+    const Code *code = static_cast<CodeInfoTable *>(info)->code();
+    if (code->code <= pc && pc < code->code + code->sizecode) {
+      *name = image_->symbolName(i);
+      return static_cast<CodeInfoTable *>(info);
+    }
+  }
+  return NULL;
+}
+
+const char *Loader::symbolName(const void *p) const {
+  STRING_MAP(InfoTable *)::const_iterator it;
+  for (it = infoTables_.begin(); it != infoTables_.end(); ++it) {
+    if (it->second == p)
+      return it->first;
+  }
+  STRING_MAP(Closure *)::const_iterator it2;
+  for (it2 = closures_.begin(); it2 != closures_.end(); ++it2) {
+    if (it2->second == p)
+      return it2->first;
+  }
+  if (image_ == NULL)
+    return NULL;
+  for (u4 i = 0; i < image_->numSymbols(); ++i) {
+    if (image_->symbolAddress(i) == p)
+      return image_->symbolName(i);
+  }
+  return NULL;
 }
 
 void Loader::printClosures(ostream &out) {
@@ -792,6 +1224,17 @@ void Loader::printClosures(ostream &out) {
     out << '[' << cl << "] " COL_GREEN << name << COL_RESET << ": ";
     printClosure(out, cl, false);
   }
+  if (image_ == NULL)
+    return;
+  for (u4 i = 0; i < image_->numSymbols(); ++i) {
+    const char *name = image_->symbolName(i);
+    if (image_->symbolKind(i) != Image::kClosure ||
+        closures_.find(name) != closures_.end())
+      continue;
+    Closure *cl = static_cast<Closure *>(image_->symbolAddress(i));
+    out << '[' << cl << "] " COL_GREEN << name << COL_RESET << ": ";
+    printClosure(out, cl, false);
+  }
 }
 
 void Loader::printMiscClosures(std::ostream &out) {
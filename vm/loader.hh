@@ -9,6 +9,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <iostream>
+#include <vector>
 #include HASH_MAP_H
 
 _START_LAMBDACHINE_NAMESPACE
@@ -18,9 +19,11 @@ _START_LAMBDACHINE_NAMESPACE
 #define INFO_MAGIC              MSB_u4('I','T','B','L') 
 #define CLOSURE_MAGIC           MSB_u4('C','L','O','S')
 
+// Strings point into the mapped bytecode file and are not
+// NUL-terminated.  They are only valid while the module is loaded.
 typedef struct _StringTabEntry {
   Word len;
-  char *str;
+  const char *str;
 } StringTabEntry;
 
   // If only C++ had type classes.  Or concepts...
@@ -68,18 +71,35 @@ private:
 };
 
 typedef struct _BasePathEntry BasePathEntry;  // Defined in loader.cc
+struct LoadingModule;                          // Ditto
 
+class Image;
+
+// A bytecode file is mapped into memory and decoded using a cursor.
+// Reading past the end of the file is a fatal error.
 class BytecodeFile {
 public:
   BytecodeFile(const char *filename);
+  ~BytecodeFile();
   bool open();
   void close();
   inline const char *filename() const { return name_; }
-  inline uint8_t get_u1() { return (uint8_t)fgetc(f_); }
+  inline uint8_t get_u1() {
+    if (LC_UNLIKELY(cur_ >= end_))
+      truncated();
+    return *cur_++;
+  }
   inline uint16_t get_u2() {
-    uint16_t hi = get_u1();
-    uint16_t lo = get_u1();
-    return hi << 8 | lo;
+    need(2);
+    uint16_t x = (uint16_t)(cur_[0] << 8 | cur_[1]);
+    cur_ += 2;
+    return x;
+  }
+  inline uint32_t get_u4() {
+    need(4);
+    uint32_t x = MSB_u4(cur_[0], cur_[1], cur_[2], cur_[3]);
+    cur_ += 4;
+    return x;
   }
   inline Word get_varuint() {
     Word b = get_u1();
@@ -93,24 +113,34 @@ public:
     return zigZagDecode(get_varuint());
   }
 
-  inline char *get_string(size_t len) {
-    char *p = new char[len + 1];
-    fread(p, 1, len, f_);
-    p[len] = '\0';
+  // Returns the next `len` bytes without copying them.  They stay
+  // valid until the file is closed.
+  inline const char *get_bytes(size_t len) {
+    need(len);
+    const char *p = reinterpret_cast<const char *>(cur_);
+    cur_ += len;
     return p;
   }
   // Require the file to contain the exact byte sequence.
-  inline bool magic(const char *bytes);
+  bool magic(const char *bytes);
   inline void get_string(char *buf, size_t len) {
-    fread(buf, 1, len, f_);
+    memcpy(buf, get_bytes(len), len);
   }
-  uint32_t get_u4();
-  inline long offset() { return ftell(f_); }
+  inline long offset() { return cur_ - start_; }
+  inline size_t size() const { return end_ - start_; }
 private:
   Word get_varuint_slow(Word first);
+  inline void need(size_t bytes) {
+    if (LC_UNLIKELY((size_t)(end_ - cur_) < bytes))
+      truncated();
+  }
+  void truncated();
 
   const char *name_;
-  FILE *f_;
+  const uint8_t *start_;
+  const uint8_t *cur_;
+  const uint8_t *end_;
+  bool mapped_;  // Otherwise start_ was allocated with malloc.
 };
 
 typedef const StringTabEntry *StringTable;
@@ -123,47 +153,102 @@ public:
   const char *basePath(unsigned int index) const;
   char *findModule(const char *moduleName);
   bool loadModule(const char *moduleName);
+  /// Loads the given modules and everything they import.  Module
+  /// bodies are decoded on up to threads() threads.
+  bool loadModules(const char *const *moduleNames, int count);
   bool loadWiredInModules();
+  inline int threads() const { return threads_; }
+  inline void setThreads(int n) { threads_ = n > 0 ? n : 1; }
   inline const Module *module(const char *moduleName) {
     return loadedModules_[moduleName];
   }
+  inline unsigned int numModules() const { return loadedModules_.size(); }
   void printInfoTables(std::ostream&);
   void printClosures(std::ostream&);
   void printMiscClosures(std::ostream&);
-  inline Closure *closure(const char *name) {
-    Closure *cl = closures_[name];
-    return cl;
+  inline Closure *closure(const char *name) const {
+    STRING_MAP(Closure*)::const_iterator it = closures_.find(name);
+    return it != closures_.end() ? it->second : imageClosure(name);
+  }
+  inline InfoTable *infoTable(const char *name) const {
+    STRING_MAP(InfoTable*)::const_iterator it = infoTables_.find(name);
+    return it != infoTables_.end() ? it->second : imageInfoTable(name);
   }
 
+  /// Write the static data of all modules loaded so far to an image
+  /// (see image.hh).  Fails if an image has been loaded.
+  bool saveImage(const char *path);
+
+  /// Map an image written by saveImage.  Its modules are then
+  /// treated as loaded.  Must be called before loading any modules.
+  /// The symbols of the image are looked up in the image itself, so
+  /// this takes about the same time for any size of image.
+  bool loadImage(const char *path);
+  inline const Image *image() const { return image_; }
+
+  /// Find the info table whose bytecode contains the given PC.
+  /// Returns NULL if the PC is not part of any loaded module.
+  const CodeInfoTable *codeInfoTableContaining(const BcIns *pc,
+                                               const char **name /* out */);
+
+  /// Find the name of a loaded info table or closure.  Returns NULL
+  /// if the pointer is neither.  Like codeInfoTableContaining this is
+  /// a linear search.
+  const char *symbolName(const void *p) const;
+
 private:
   void initBasePath(const char *);
   void addBasePath(const char *);
   void appendBasePathEntry(BasePathEntry *entry);
 
   void loadStringTabEntry(BytecodeFile&, StringTabEntry *e /*out*/);
-  const char *loadId(BytecodeFile&, const StringTabEntry *strings,
-                     const char* sep);
-  bool loadModule(const char *moduleName, int);
-  Module *loadModuleHeader(BytecodeFile&);
-  void loadModuleBody(BytecodeFile &f, Module *mdl);
-  InfoTable *loadInfoTable(BytecodeFile &f, const StringTabEntry *strings);
-  void loadCode(BytecodeFile &, Code * /* out */,
-                const StringTabEntry *strings);
-  void loadLiteral(BytecodeFile &, u1 *littypes, Word *lits,
-                   const StringTabEntry *strings);
-  void loadClosure(BytecodeFile &, const StringTabEntry *strings);
+  const char *loadId(LoadingModule &, const char* sep);
+  bool openModule(const char *moduleName, StaticArena *,
+                  std::vector<LoadingModule *> *modules /* out */, int);
+  Module *loadModuleHeader(LoadingModule &);
+  void decodeModules(std::vector<LoadingModule *> &modules,
+                     std::vector<StaticArena *> &arenas);
+  static void *decodeThreadMain(void *);
+  void loadModuleBody(LoadingModule &);
+  InfoTable *loadInfoTable(LoadingModule &);
+  void loadCode(LoadingModule &, Code * /* out */);
+  void loadLiteral(LoadingModule &, u1 *littype, Word *literal);
+  void loadClosure(LoadingModule &);
+  void linkModule(LoadingModule &);
+  void resolveReferences(std::vector<LoadingModule *> &modules);
   void loadClosureReference(const char *name, Word *literal /* out */);
   void fixClosureForwardReference(const char *name, Closure *cl);
   inline bool isFullyLoadedInfoTable(InfoTable *);
   void loadInfoTableReference(const char *name, InfoTable **dest /* out */);
   void fixInfoTableForwardReference(const char *name, InfoTable *info);
   bool checkNoForwardRefs();
+  void initSharedClosures();
+  Closure *imageClosure(const char *name) const;
+  InfoTable *imageInfoTable(const char *name) const;
+  inline void addRelocation(void *slot) {
+    relocs_.push_back(static_cast<Word *>(slot));
+  }
 
   MemoryManager *mm_;
   STRING_MAP(Module*) loadedModules_;
   STRING_MAP(InfoTable*) infoTables_;
   STRING_MAP(Closure*) closures_;
   BasePathEntry *basepaths_;
+  int threads_;
+
+  // For saveImage: the locations of all pointers in static data, and
+  // the blocks that were current before we started loading (they
+  // contain the MiscClosures).
+  std::vector<Word *> relocs_;
+  static const int kStaticDataKinds = 4;
+  static const Block::Flags staticDataKinds_[kStaticDataKinds];
+  Block *staticMark_[kStaticDataKinds];
+  Image *image_;
+
+  // Static closures without payload loaded since the last call to
+  // initSharedClosures.  Only once all forward references have been
+  // resolved can we tell which of them are nullary constructors.
+  std::vector<Closure *> nullaryClosures_;
 };
 
 inline bool Loader::isFullyLoadedInfoTable(InfoTable *info) {
@@ -30,11 +30,15 @@ MachineCode::MachineCode(Prng *prng)
   : prng_(prng),
     protection_(0),
     area_(NULL), top_(NULL), bottom_(NULL),
-    size_(0), sizeTotal_(0) {
+    size_(0), sizeTotal_(0), limit_(kDefaultLimit), flushes_(0),
+    hugePages_(false) {
 }
 
 MachineCode::~MachineCode() {
-  this->free(area_, size_);
+  for (size_t i = 0; i < retired_.size(); ++i)
+    this->free(retired_[i].start, retired_[i].size);
+  if (area_ != NULL)
+    this->free(area_, size_);
 }
 
 static inline bool isValidMachineCodePtr(void *p) {
@@ -42,21 +46,21 @@ static inline bool isValidMachineCodePtr(void *p) {
 }
 
 void *MachineCode::alloc(size_t size) {
-  // TODO: If there we have an existing machine code area, allocate
-  // a new one within jump-range of any existing areas.  For now, we just
-  // allocate a large area and then fail if we need more.
-
-  // The exit handler must be reachable from the generated code.
+  // The exit handler must be reachable from the generated code.  All
+  // areas are placed within half the jump range of the exit handler,
+  // so that code in any area can also branch to any other area
+  // (e.g., to the shared exit stubs or for trace linking).
   uintptr_t target = (uintptr_t)(void *)&asmExit & ~(uintptr_t)0xffff;
   const uintptr_t range = (1u << LC_TARGET_JUMPRANGE) - (1u << 21);
+  const uintptr_t halfrange = range >> 1;
   uintptr_t hint = 0;
   for (int i = 0; i < 32; ++i) {
     if (isValidMachineCodePtr((void *)hint)) {
       void *p = allocAt(hint, size, MCPROT_GEN);
       if (isValidMachineCodePtr(p)) {
         // See if it's in range.
-        if ((uintptr_t)p + size - target < range ||
-            target - (uintptr_t)p < range)
+        if ((uintptr_t)p + size - target < halfrange ||
+            target - (uintptr_t)p < halfrange)
           return p;
         this->free(p, size);
       }
@@ -66,7 +70,7 @@ void *MachineCode::alloc(size_t size) {
     do {
       hint = (0x78fb ^ prng_->bits(15)) << 16;  /* 64K aligned. */
     } while (!(hint + size < range));
-    hint = target + hint - (range >> 1);
+    hint = target + (hint >> 1) - (halfrange >> 1);
   }
   cerr << "FATAL: Could not allocate memory for machine code." << endl;
   return NULL;
@@ -99,19 +103,77 @@ MCode *MachineCode::reserve(MCode **limit) {
 }
 
 void MachineCode::allocArea() {
-  // TODO: We only create one large machine code area.  In the future
-  // it would be nice to have a linked list of areas.
   size_t size = kAreaSize;
   // Round up to page size.
   size = (size + LC_PAGESIZE - 1) & ~(size_t)(LC_PAGESIZE - 1);
   area_ = (MCode *)alloc(size);
+  if (area_ == NULL)
+    exit(23);
+#ifdef MADV_HUGEPAGE
+  // Only the parts of the area that cover a whole (aligned) huge page
+  // can actually use one.
+  if (hugePages_)
+    madvise(area_, size, MADV_HUGEPAGE);
+#endif
   size_ = size;
-  sizeTotal_ = size;
+  sizeTotal_ += size;
   protection_ = MCPROT_GEN;
   bottom_ = area_;
   top_ = (MCode *)((char *)area_ + size_);
 }
 
+bool MachineCode::ensureSpace() {
+  if (area_ == NULL) {
+    return sizeTotal_ + kAreaSize <= limit_;
+  }
+  if ((size_t)(top_ - bottom_) >= kMinFree)
+    return true;
+  if (sizeTotal_ + kAreaSize > limit_)
+    return false;
+
+  // Retire the current area.  The code in it stays live.
+  protect(MCPROT_RUN);
+  Area full;
+  full.start = area_;
+  full.size = size_;
+  full.used = size_ - (top_ - bottom_);
+  retired_.push_back(full);
+  area_ = NULL;
+  allocArea();
+  protect(MCPROT_RUN);
+  return true;
+}
+
+void MachineCode::flush() {
+  for (size_t i = 0; i < retired_.size(); ++i)
+    this->free(retired_[i].start, retired_[i].size);
+  retired_.clear();
+  if (area_ != NULL)
+    this->free(area_, size_);
+  area_ = top_ = bottom_ = NULL;
+  size_ = sizeTotal_ = 0;
+  protection_ = 0;
+  ++flushes_;
+}
+
+size_t MachineCode::used() const {
+  size_t n = 0;
+  for (size_t i = 0; i < retired_.size(); ++i)
+    n += retired_[i].used;
+  if (area_ != NULL)
+    n += size_ - (top_ - bottom_);
+  return n;
+}
+
+MachineCode::Area *MachineCode::findRetired(MCode *ptr) {
+  for (size_t i = 0; i < retired_.size(); ++i) {
+    Area *a = &retired_[i];
+    if (a->start <= ptr && ptr < a->start + a->size)
+      return a;
+  }
+  return NULL;
+}
+
 void MachineCode::commit(MCode *top) {
   LC_ASSERT(top <= (char *)area_ + size_);
   LC_ASSERT(bottom_ <= top);
@@ -137,14 +199,24 @@ void MachineCode::protect(int prot) {
 }
 
 MCode *MachineCode::patchBegin(MCode *ptr) {
-  LC_ASSERT(area_ <= ptr && ptr < area_ + size_);
-  protect(MCPROT_GEN);
-  return area_;
+  if (area_ <= ptr && ptr < area_ + size_) {
+    protect(MCPROT_GEN);
+    return area_;
+  }
+  Area *a = findRetired(ptr);
+  LC_ASSERT(a != NULL);
+  setProtection(a->start, a->size, MCPROT_GEN);
+  return a->start;
 }
 
 void MachineCode::patchFinish(MCode *area) {
-  LC_ASSERT(area == area_);
-  protect(MCPROT_RUN);
+  if (area == area_) {
+    protect(MCPROT_RUN);
+    return;
+  }
+  Area *a = findRetired(area);
+  LC_ASSERT(a != NULL);
+  setProtection(a->start, a->size, MCPROT_RUN);
 }
 
 void MachineCode::syncCache(void *start, void *end) {
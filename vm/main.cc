@@ -4,10 +4,13 @@
 #include "capability.hh"
 #include "thread.hh"
 #include "time.hh"
+#include "tracecache.hh"
+#include "heapprofile.hh"
 
 
 #include <iostream>
 #include <memory>
+#include <sys/resource.h>
 
 using namespace std;
 _USE_LAMBDACHINE_NAMESPACE
@@ -17,6 +20,7 @@ void formatWithThousands(char *str, uint64_t n);
 void printGCStats(FILE *out, MemoryManager *mm, Time mut_time);
 void printTraceStats(FILE *out);
 void printStats(FILE *out, MemoryManager *mm, Capability *cap,
+                TraceCache *traceCache, const Loader *loader,
                 Time startup_time, Time start_time, Time stop_time);
 
 inline double percent(double num, double denom) {
@@ -33,9 +37,30 @@ int main(int argc, char *argv[]) {
 
   initializeTimer();
   Time startup_time = getProcessElapsedTime();
+  Region::setHugePages(opts->hugePages());
+  Region::setNumaPlacement(opts->numa());
   MemoryManager mm;
   mm.setMinHeapSize(1UL * 1024 * 1024);
+  mm.setGCThreads(opts->gcThreads());
+  mm.setMaxHeapSize(opts->maxHeapSize());
+  mm.setGCSlice((Time)(opts->gcSlice() * (TIME_RESOLUTION / 1000)));
+  mm.setGrowthFactor(opts->gcGrowthFactor());
+  mm.setGCTarget(opts->gcTarget() / 100);
+  HeapProfile *heapProfile = NULL;
+  if (opts->heapProfile()) {
+    string file = opts->heapProfileFile();
+    if (file.empty())
+      file = opts->inputModule(0) + ".hp";
+    heapProfile = new HeapProfile(file.c_str(),
+                                  opts->inputModule(0).c_str());
+    if (heapProfile->ok())
+      mm.setHeapProfile(heapProfile);
+  }
   Loader loader(&mm, opts->basePath().c_str());
+  loader.setThreads(opts->loaderThreads());
+
+  if (!opts->image().empty() && !loader.loadImage(opts->image().c_str()))
+    return 1;
 
   if (!loader.loadWiredInModules())
     return 1;
@@ -56,6 +81,17 @@ int main(int argc, char *argv[]) {
     loader.printClosures(cout);
   }
 
+  if (!opts->saveImage().empty() &&
+      !loader.saveImage(opts->saveImage().c_str()))
+    return 1;
+
+  if (opts->link()) {
+    string file = opts->linkFile();
+    if (file.empty())
+      file = opts->inputModule(0) + ".lcimg";
+    return loader.saveImage(file.c_str()) ? 0 : 1;
+  }
+
   if (opts->entry().empty()) {
     return 0;
   }
@@ -72,6 +108,17 @@ int main(int argc, char *argv[]) {
   Thread *T = Thread::createThread(&cap, opts->stackSize() / sizeof(Word));
 
   cap.jit()->setOption(Jit::kOptFastHeapCheckFail, true);
+  if (opts->maxMachineCode() > 0)
+    cap.jit()->mcode()->setLimit(opts->maxMachineCode());
+  cap.jit()->mcode()->setHugePages(opts->hugePages());
+
+  TraceCache *traceCache = NULL;
+  if (!opts->traceCacheDir().empty()) {
+    traceCache = new TraceCache(opts->traceCacheDir().c_str(),
+                                opts->inputModule(0).c_str(), &loader);
+    traceCache->load(cap.jit());
+    cap.jit()->setTraceCache(traceCache);
+  }
 
   if (opts->traceInterpreter()) {
     cap.enableBytecodeTracing();
@@ -93,10 +140,21 @@ int main(int argc, char *argv[]) {
 
   delete T;
 
+  if (traceCache != NULL)
+    traceCache->save();
+
+  if (heapProfile != NULL && heapProfile->ok()) {
+    heapProfile->writeAllocationSites(&loader);
+    mm.setHeapProfile(NULL);
+  }
+
   if (opts->printStats()) {
-    printStats(stdout, &mm, &cap, startup_time, start_time, stop_time);
+    printStats(stdout, &mm, &cap, traceCache, &loader,
+               startup_time, start_time, stop_time);
   }
 
+  delete traceCache;
+  delete heapProfile;
   return 0;
 }
 
@@ -124,6 +182,22 @@ void formatTime(FILE *out, const char *label, Time time) {
   fprintf(out, "%s %7.2fs  (%20s ns)\n", label, seconds, buf);
 }
 
+// Anonymous memory of the process that is backed by transparent huge
+// pages.  Zero if unknown.
+static uint64_t hugePageBytes() {
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  if (f == NULL)
+    return 0;
+  char line[256];
+  unsigned long long kb = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "AnonHugePages: %llu kB", &kb) == 1)
+      break;
+  }
+  fclose(f);
+  return (uint64_t)kb * 1024;
+}
+
 void printGCStats(FILE *out, MemoryManager *mm, Time mut_time) {
   char buf[30];
   uint64_t total_alloc = mm->allocated();
@@ -134,7 +208,78 @@ void printGCStats(FILE *out, MemoryManager *mm, Time mut_time) {
   uint64_t alloc_rate = (uint64_t)(total_alloc / mut_seconds);
   formatWithThousands(buf, alloc_rate);
   fprintf(out, "   (%18s bytes per MUT second)\n", buf);
-  fprintf(out, "    %18d collections\n\n", mm->numGCs());
+  fprintf(out, "    %18d collections\n", mm->numGCs());
+  Time gc_mut = mut_time + gc_time;
+  fprintf(out, "    %17.1f%% GC overhead (of MUT+GC time)",
+          gc_mut > 0 ? percent(gc_time, gc_mut) : 0.0);
+  if (mm->gcTarget() > 0)
+    fprintf(out, ", target %.1f%%", mm->gcTarget() * 100);
+  fprintf(out, "\n");
+  formatWithThousands(buf, (uint64_t)mm->nurseryBlocks() * Block::kBlockSize);
+  fprintf(out, "  %20s bytes nursery at exit", buf);
+  formatWithThousands(buf,
+                      (uint64_t)mm->peakNurseryBlocks() * Block::kBlockSize);
+  fprintf(out, " (%s max)\n\n", buf);
+
+  formatWithThousands(buf, mm->promoted());
+  fprintf(out, "    Gen 0: %10" FMT_Word64 " collections %8.2fs"
+          "  %20s bytes promoted\n",
+          mm->numMinorGCs(), (double)mm->minorGCTime() / TIME_RESOLUTION,
+          buf);
+  formatWithThousands(buf, mm->copiedMajor());
+  fprintf(out, "    Gen 1: %10" FMT_Word64 " collections %8.2fs"
+          "  %20s bytes copied\n",
+          mm->numMajorGCs(), (double)mm->majorGCTime() / TIME_RESOLUTION,
+          buf);
+  formatWithThousands(buf, mm->markedMajor());
+  fprintf(out, "    %61s bytes marked\n\n", buf);
+
+  fprintf(out, "    %18.4fs max gen 0 pause\n",
+          (double)mm->maxMinorGCPause() / TIME_RESOLUTION);
+  fprintf(out, "    %18.4fs max gen 1 pause\n",
+          (double)mm->maxMajorGCPause() / TIME_RESOLUTION);
+  for (int i = 0; i < MemoryManager::kPauseBuckets; ++i) {
+    if (mm->pauses(i) == 0)
+      continue;
+    Time limit = MemoryManager::pauseBucketLimit(i);
+    if (limit != 0)
+      fprintf(out, "    %18" FMT_Word64 " pauses <= %gms\n", mm->pauses(i),
+              (double)limit / (TIME_RESOLUTION / 1000));
+    else
+      fprintf(out, "    %18" FMT_Word64 " pauses longer\n", mm->pauses(i));
+  }
+  formatWithThousands(buf, (uint64_t)mm->peakHeapBlocks() * Block::kBlockSize);
+  fprintf(out, "  %20s bytes maximum heap size\n", buf);
+  formatWithThousands(buf, mm->peakCommittedBytes());
+  fprintf(out, "  %20s bytes maximum committed\n", buf);
+  formatWithThousands(buf, mm->committedBytes());
+  fprintf(out, "  %20s bytes committed at exit", buf);
+  formatWithThousands(buf, mm->usedBytes());
+  fprintf(out, " (%s bytes used)\n", buf);
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    // ru_maxrss is in kilobytes on Linux.
+    formatWithThousands(buf, (uint64_t)usage.ru_maxrss * 1024);
+    fprintf(out, "  %20s bytes maximum resident set size\n", buf);
+  }
+  if (Region::hugePages()) {
+    formatWithThousands(buf, hugePageBytes());
+    fprintf(out, "  %20s bytes in huge pages at exit\n", buf);
+  }
+  fprintf(out, "\n");
+
+  if (mm->gcThreads() > 1) {
+    // Work balance: 1.0 means every thread copied the same amount.
+    uint64_t total = 0, most = 0;
+    for (u4 i = 0; i < mm->gcThreads(); ++i) {
+      uint64_t copied = mm->gcThreadCopied(i);
+      total += copied;
+      if (copied > most) most = copied;
+    }
+    fprintf(out, "    %18u GC threads (work balance %4.2f)\n\n",
+            mm->gcThreads(),
+            most > 0 ? (double)total / (most * mm->gcThreads()) : 1.0);
+  }
 }
 
 void
@@ -193,23 +338,29 @@ printBasicStats(FILE *out, Capability *cap,
           "      trace too long         %10" FMT_Word64 "\n"
           "      always failing guard   %10" FMT_Word64 "\n"
           "      interrupted (e.g. GC)  %10" FMT_Word64 "\n"
-          "      unimplemented feature  %10" FMT_Word64 "\n\n",
+          "      unimplemented feature  %10" FMT_Word64 "\n"
+          "      machine code full      %10" FMT_Word64 "\n\n",
           record_abort_reasons[AR_ABSTRACT_STACK_OVERFLOW],
           record_abort_reasons[AR_TRACE_TOO_LONG],
           record_abort_reasons[AR_KNOWN_TO_FAIL_GUARD],
           record_abort_reasons[AR_INTERPRETER_REQUEST],
-          record_abort_reasons[AR_NYI]);
+          record_abort_reasons[AR_NYI],
+          record_abort_reasons[AR_MCODE_FULL]);
   
   fprintf(out,
           "  Interpreter->MCode Switches         %" FMT_Word64
-          " (%5.1f per MUT second)\n\n",
+          " (%5.1f per MUT second)\n"
+          "  Trace->Trace Links                  %" FMT_Word64 "\n"
+          "  GCs inside Traces                   %" FMT_Word64 "\n\n",
           switch_interp_to_asm,
-          (double)switch_interp_to_asm / ((double)mut_time / 1000000000));
+          (double)switch_interp_to_asm / ((double)mut_time / 1000000000),
+          trace_links, trace_gcs);
 
   MachineCode *mcode = cap->jit()->mcode();
   char buf[50];
-  formatWithThousands(buf, (uint64_t)(mcode->end() - mcode->start()));
-  fprintf(out, "  Compiled code: %20s bytes \n\n", buf);
+  formatWithThousands(buf, (uint64_t)mcode->used());
+  fprintf(out, "  Compiled code: %20s bytes  (%u areas, %u flushes)\n\n",
+          buf, mcode->numAreas(), mcode->numFlushes());
 
   formatTime(out, "  Startup ", start_time - startup_time);
   formatTime(out, "    LOAD  ", loader_time);
@@ -226,6 +377,7 @@ printBasicStats(FILE *out, Capability *cap,
 
 void
 printStats(FILE *out, MemoryManager *mm, Capability *cap,
+           TraceCache *traceCache, const Loader *loader,
            Time startup_time, Time start_time, Time stop_time)
 {
     printf("\n\n");
@@ -244,4 +396,16 @@ printStats(FILE *out, MemoryManager *mm, Capability *cap,
 
     printBasicStats(out, cap, startup_time, start_time, stop_time);
 
+    fprintf(out, "  Loaded %u modules using %d loader threads\n\n",
+            loader->numModules(), loader->threads());
+
+    if (traceCache != NULL) {
+      fprintf(out, "  Trace cache %s\n"
+              "    %5u entries  (%u assembled, %u stale)\n"
+              "    %5u new traces  (%u not cacheable)\n\n",
+              traceCache->path().c_str(), traceCache->entries(),
+              traceCache->hits(), traceCache->stale(),
+              traceCache->added(), traceCache->uncacheable());
+    }
+
 }
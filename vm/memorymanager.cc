@@ -1,4 +1,5 @@
 #include "memorymanager.hh"
+#include "heapprofile.hh"
 #include "utils.hh"
 #include "miscclosures.hh"
 #include "capability.hh"
@@ -7,7 +8,16 @@
 
 #include <sys/mman.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#if defined(__linux__)
+# include <sys/syscall.h>
+#endif
+#include <deque>
+#include <algorithm>
 
 _START_LAMBDACHINE_NAMESPACE
 
@@ -48,19 +58,135 @@ static void outOfMemory() {
 const int kMMapProtection = PROT_READ | PROT_WRITE;
 const int kMMapFlags = MAP_PRIVATE | MAP_ANONYMOUS;
 
-Region *Region::newRegion(RegionType regionType) {
+// Addresses of regions that have been given back to the OS.  New
+// regions are mapped there first, so that we don't run out of
+// address space by mapping ever higher addresses.
+static std::vector<char *> unmappedRegions;
+
+static bool useHugePages = false;
+// Standard size regions inside a huge page that has been mapped but
+// not handed out yet.
+static std::vector<char *> hugePageRegions;
+
+// Number of NUMA nodes if regions are placed explicitly, else 0.
+static int numaNodes = 0;
+
+void Region::setHugePages(bool enable) {
+#ifdef MADV_HUGEPAGE
+  useHugePages = enable;
+#else
+  if (enable)
+    fprintf(stderr, "Huge pages are not supported on this platform.\n");
+#endif
+}
+
+bool Region::hugePages() {
+  return useHugePages;
+}
+
+void Region::setNumaPlacement(bool enable) {
+  numaNodes = 0;
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_getcpu)
+  if (!enable)
+    return;
+  DIR *dir = opendir("/sys/devices/system/node");
+  if (dir == NULL)
+    return;
+  int nodes = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (strncmp(ent->d_name, "node", 4) == 0 &&
+        ent->d_name[4] >= '0' && ent->d_name[4] <= '9')
+      ++nodes;
+  }
+  closedir(dir);
+  // Explicit placement is pointless with a single node.
+  if (nodes > 1)
+    numaNodes = nodes;
+#else
+  UNUSED(enable);
+#endif
+}
+
+// Prefer the node of the calling thread for all pages of the given
+// range.  MPOL_PREFERRED (rather than MPOL_BIND) falls back to other
+// nodes if that node runs out of memory.
+static void placeOnCurrentNode(char *ptr, size_t size) {
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_getcpu)
+  const int kMPolPreferred = 1;  // See <linux/mempolicy.h>
+  unsigned cpu, node;
+  if (numaNodes == 0 ||
+      syscall(SYS_getcpu, &cpu, &node, NULL) != 0 ||
+      node >= 8 * sizeof(unsigned long))
+    return;
+  unsigned long mask = 1UL << node;
+  syscall(SYS_mbind, ptr, size, kMPolPreferred, &mask,
+          8 * sizeof(mask), 0);
+#else
+  UNUSED(ptr); UNUSED(size);
+#endif
+}
+
+// Maps one huge page worth of memory, aligned to the huge page size,
+// and hands out its first region.  The others are kept for later.
+// Returns NULL if that failed.
+static char *mapHugePageRegion(char **alloc_hint) {
+#ifdef MADV_HUGEPAGE
+  if (!hugePageRegions.empty()) {
+    char *ptr = hugePageRegions.back();
+    hugePageRegions.pop_back();
+    return ptr;
+  }
+  size_t size = 2 * Region::kHugePageSize;
+  char *ptr = static_cast<char *>(mmap(*alloc_hint, size, kMMapProtection,
+                                       kMMapFlags, -1, 0));
+  if (ptr == MAP_FAILED)
+    return NULL;
+  char *start = reinterpret_cast<char *>
+    (roundUpToPowerOf2(Region::kHugePageSizeLog2, reinterpret_cast<Word>(ptr)));
+  char *end = start + Region::kHugePageSize;
+  if (start > ptr)
+    munmap(ptr, start - ptr);
+  if (ptr + size > end)
+    munmap(end, ptr + size - end);
+  madvise(start, Region::kHugePageSize, MADV_HUGEPAGE);
+  placeOnCurrentNode(start, Region::kHugePageSize);
+  *alloc_hint = end;
+  for (char *r = end - Region::kRegionSize; r > start;
+       r -= Region::kRegionSize)
+    hugePageRegions.push_back(r);
+  return start;
+#else
+  UNUSED(alloc_hint);
+  return NULL;
+#endif
+}
+
+Region *Region::newRegion(RegionType regionType, size_t regionSize) {
   // TODO: Grab a lock.
-  //
-  // TODO: This won't work if we allow giving back memory to the OS
-  // (because alloc_hint increases monotonically, so eventually we run
-  // out of address space.)  Solution: Maintain a list of munmapped
-  // regions and try to re-mmap them before trying to allocate at
-  // alloc_hint.
   static char *alloc_hint = alignToRegionBoundary(kMMapRegionStart);
-  size_t size = kRegionSize;
-  char *ptr;
+  LC_ASSERT(regionSize >= kRegionSize && (regionSize & kRegionMask) == 0);
+  size_t size = regionSize;
+  char *ptr = NULL;
   uint32_t attempts = 0;
 
+  if (useHugePages && regionSize == kRegionSize) {
+    ptr = mapHugePageRegion(&alloc_hint);
+    if (ptr != NULL)
+      goto initialise;
+  }
+
+  while (regionSize == kRegionSize && !unmappedRegions.empty()) {
+    char *hint = unmappedRegions.back();
+    unmappedRegions.pop_back();
+    ptr = static_cast<char *>(mmap(hint, size, kMMapProtection,
+                                   kMMapFlags, -1, 0));
+    if (ptr == hint)
+      goto mapped;
+    if (ptr != MAP_FAILED)
+      munmap(ptr, size);
+  }
+
   for (;;) {
     DLOG("Trying mmap(%p-%p, %ld, ...)\n", alloc_hint, alloc_hint + size, size);
 
@@ -69,12 +195,17 @@ Region *Region::newRegion(RegionType regionType) {
 
     if (ptr != MAP_FAILED) {
       if (isAlignedAtPowerOf2(kRegionSizeLog2, ptr)) {   // Success!
+        if (size > regionSize) {
+          // We asked for extra room for alignment, but didn't need it.
+          munmap(ptr + regionSize, size - regionSize);
+          size = regionSize;
+        }
         alloc_hint += size;
         break;
       } else {
         // Check if we have enough room to make it aligned.
         char *next_aligned = alignToRegionBoundary(ptr);
-        char *region_end = next_aligned + kRegionSize;
+        char *region_end = next_aligned + regionSize;
         char *alloc_end = ptr + size;
 
         if (region_end <= alloc_end) {
@@ -114,14 +245,24 @@ Region *Region::newRegion(RegionType regionType) {
     }
   }
 
+mapped:
   DLOG("Allocated region %p-%p\n", ptr, ptr + size);
+#ifdef MADV_HUGEPAGE
+  if (useHugePages)
+    madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+  placeOnCurrentNode(ptr, size);
 
+initialise:
   Region *region = reinterpret_cast<Region *>(ptr);
 
   // Need to initialise header first (otherwise some assertions may fail).
   region->meta_.magic_ = REGION_MAGIC;
   region->meta_.region_info_ = regionType;
   region->meta_.region_link_ = NULL;
+  region->meta_.generation_ = kYoungGeneration;
+  region->meta_.owner_ = NULL;
+  region->meta_.marks_ = NULL;
 
   switch (regionType) {
   case kSmallObjectRegion: {
@@ -132,7 +273,7 @@ Region *Region::newRegion(RegionType regionType) {
   case kLargeObjectRegion: {
     LargeObjectRegionData *r = region->largeSelf();
     r->free_ = ((char *)region) + sizeof(LargeObjectRegionData);
-    r->end_ = r->free_ + kRegionSize;
+    r->end_ = ((char *)region) + regionSize;
     break;
   }
   default:
@@ -162,6 +303,7 @@ void Region::initBlocks(SmallObjectRegionData *r) {
     r->blocks_[i].end_ = metadata;
     r->blocks_[i].free_ = metadata;
     r->blocks_[i].link_ = NULL;
+    r->blocks_[i].dirty_ = 0;
   }
   for (Word i = first_avail; i < kBlocksPerRegion; i++) {
     r->blocks_[i].flags_ = Block::kUninitialized;
@@ -170,6 +312,7 @@ void Region::initBlocks(SmallObjectRegionData *r) {
     ptr = alignToBlockBoundary(ptr + 1);
     r->blocks_[i].end_ = ptr;
     r->blocks_[i].link_ = &r->blocks_[i + 1];
+    r->blocks_[i].dirty_ = 0;  // Fresh memory from mmap is zeroed.
   }
   r->blocks_[kBlocksPerRegion - 1].link_ = NULL; // Overwrite last link
   r->next_free_ = &r->blocks_[first_avail];
@@ -181,9 +324,25 @@ void Region::operator delete(void *) {
 
 Region::~Region() {
   char *ptr = reinterpret_cast<char *>(this);
-  DLOG("Freeing region %p-%p\n", ptr, ptr + kRegionSize);
+  size_t size = isLargeObjectRegion()
+    ? static_cast<size_t>(largeSelf()->end_ - ptr) : kRegionSize;
+  DLOG("Freeing region %p-%p\n", ptr, ptr + size);
+
+  free(meta_.marks_);
 
-  munmap(ptr, kRegionSize);
+  munmap(ptr, size);
+  if (size == kRegionSize)
+    unmappedRegions.push_back(ptr);
+}
+
+bool Region::allBlocksFree() const {
+  const SmallObjectRegionData *r = smallSelf();
+  for (Word i = 0; i < kBlocksPerRegion; ++i) {
+    Block::Flags contents = r->blocks_[i].contents();
+    if (contents != Block::kUninitialized && contents != Block::kMetadata)
+      return false;
+  }
+  return true;
 }
 
 Block *Region::grabFreeBlock() {
@@ -199,51 +358,123 @@ Block *Region::grabFreeBlock() {
   return b;
 }
 
+inline bool isPageAligned(const void *ptr) {
+  return ((Word)ptr & 0xfff) == 0;
+}
+
+Block *Region::grabFreeAlignedBlock() {
+  SmallObjectRegionData *r = smallSelf();
+  Block **prev = &r->next_free_;
+  while (*prev != NULL && !isPageAligned((*prev)->start()))
+    prev = &(*prev)->link_;
+  Block *b = *prev;
+  if (b == NULL) return NULL;
+
+  *prev = b->link_;
+  b->link_ = NULL;
+  return b;
+}
+
 Time gc_time = 0;
 
 MemoryManager::MemoryManager()
-  : largeObjectRegion_(NULL),
-    free_(NULL), old_heap_(NULL), topOfStackMask_(kNoMask),
+  : oldRegion_(NULL), largeObjectRegion_(NULL),
+    free_(NULL), oldFree_(NULL), closures_(NULL), old_heap_(NULL),
+    allocBuffers_(NULL),
+    oldBlocks_(NULL), oldGenBlocks_(0), oldGenLimit_(2), majorGC_(false),
+    marking_(false), gcSlice_(0), heapProfile_(NULL),
+    extraRoots_(NULL), numExtraRoots_(0),
+    gcThreads_(1), workers_(NULL), threads_(NULL),
+    gcEpoch_(0), gcThreadsDone_(0), gcShutdown_(false), idleWorkers_(0),
+    topOfStackMask_(kNoMask),
     beginAllocInfoTableLevel_(0),
     largeObjects_(NULL),
     evacuatedLargeObjects_(NULL),
     scavengedLargeObjects_(NULL),
-    freeLargeRegions_(NULL),
-    minHeapSize_(2), 
-    nextGC_(minHeapSize_),
-    allocated_(0), num_gcs_(0)
+    largeAllocated_(0), largeLive_(0),
+    minHeapSize_(2), maxHeapSize_(0), nurseryBlocks_(minHeapSize_),
+    growthFactor_(2.0), gcTarget_(0), gcOverhead_(0), lastGCEnd_(0),
+    decommittedBlocks_(0), nextGC_(minHeapSize_),
+    allocated_(0), num_gcs_(0), num_major_gcs_(0),
+    promoted_(0), copied_major_(0), marked_major_(0),
+    peak_heap_blocks_(0), peak_nursery_blocks_(0), peak_committed_(0),
+    minor_gc_time_(0), major_gc_time_(0),
+    max_minor_pause_(0), max_major_pause_(0)
 {
+  pthread_mutex_init(&allocLock_, NULL);
+  pthread_mutex_init(&gcLock_, NULL);
+  pthread_cond_init(&gcStart_, NULL);
+  pthread_cond_init(&gcDone_, NULL);
+  for (int i = 0; i < kLargeObjectBins; ++i)
+    freeLargeObjects_[i] = NULL;
+  for (int i = 0; i < kPauseBuckets; ++i)
+    pauses_[i] = 0;
   region_ = Region::newRegion(Region::kSmallObjectRegion);
   static_closures_ = grabFreeBlock(Block::kStaticClosures);
-  info_tables_ = grabFreeBlock(Block::kInfoTables);
+  info_tables_ = grabInfoTableBlock();
   bool ok = markBlockReadOnly(info_tables_);
   LC_ASSERT(ok);
-  closures_ = grabFreeBlock(Block::kClosures);
   strings_ = grabFreeBlock(Block::kStrings);
   bytecode_ = grabFreeBlock(Block::kBytecode);
+  addAllocBuffer(&buffer_);
 }
 
+static void deleteGCWorker(GCWorker *w);  // GCWorker is defined below.
+
 MemoryManager::~MemoryManager() {
+  if (threads_ != NULL)
+    stopGCThreads();
+  if (workers_ != NULL) {
+    for (u4 i = 0; i < gcThreads_; ++i)
+      deleteGCWorker(workers_[i]);
+    delete[] workers_;
+  }
+  pthread_cond_destroy(&gcDone_);
+  pthread_cond_destroy(&gcStart_);
+  pthread_mutex_destroy(&gcLock_);
+  pthread_mutex_destroy(&allocLock_);
+
   Region *r = region_;
   while (r != NULL) {
     Region *next = r->meta_.region_link_;
     delete r;
     r = next;
   }
+  r = oldRegion_;
+  while (r != NULL) {
+    Region *next = r->meta_.region_link_;
+    delete r;
+    r = next;
+  }
+  r = largeObjectRegion_;
+  while (r != NULL) {
+    Region *next = r->meta_.region_link_;
+    delete r;
+    r = next;
+  }
   MiscClosures::reset();
 }
 
+// May be called by several mutators at once.  Blocks are only ever
+// pushed onto free_ during GC, when no mutator is running, so popping
+// with a compare-and-swap cannot suffer from the ABA problem.
 Block *MemoryManager::grabFreeBlock(Block::Flags flags) {
   // 1. Try to grab a block from the free block list (very likely).
-  Block *b = NULL;
-  if (free_ != NULL) {
+  Block *b = free_;
+  while (b != NULL) {
+    if (__sync_bool_compare_and_swap(&free_, b, b->link_)) {
+      b->link_ = NULL;
+      if (b->getFlag(Block::kDecommitted))
+        __sync_fetch_and_sub(&decommittedBlocks_, 1);
+      b->zeroDirty();
+      b->flags_ = static_cast<uint32_t>(flags);
+      return b;
+    }
     b = free_;
-    free_ = b->link_;
-    b->link_ = NULL;
-    b->flags_ = static_cast<uint32_t>(flags);
-    return b;
   }
 
+  pthread_mutex_lock(&allocLock_);
+
   // 2. Try to grab the free block from the most recently allocated
   // region.
   b = region_->grabFreeBlock();
@@ -256,13 +487,194 @@ Block *MemoryManager::grabFreeBlock(Block::Flags flags) {
     b = r->grabFreeBlock();
   }
 
+  pthread_mutex_unlock(&allocLock_);
+
   b->flags_ = static_cast<uint32_t>(flags);
   return b;
 }
 
+// Info tables are marked read-only, which only works for whole pages.
+// The first block of a region is not page aligned (it follows the
+// block descriptors), so it is left for other kinds of data.  It is
+// only lost if info tables use up all other blocks of the region
+// before anything else asks for one.  Blocks on free_ are not
+// considered: only its head can be taken without a lock.
+Block *MemoryManager::grabInfoTableBlock() {
+  pthread_mutex_lock(&allocLock_);
+
+  Block *b = region_->grabFreeAlignedBlock();
+  while (b == NULL) {
+    Region *r = Region::newRegion(Region::kSmallObjectRegion);
+    r->meta_.region_link_ = region_;
+    region_ = r;
+    b = r->grabFreeAlignedBlock();
+  }
+
+  pthread_mutex_unlock(&allocLock_);
+
+  b->flags_ = static_cast<uint32_t>(Block::kInfoTables);
+  return b;
+}
+
+// Old generation blocks come from their own regions so that the
+// write barrier only needs to look at the region header.
+Block *MemoryManager::grabOldBlock() {
+  Block *b = NULL;
+  if (oldFree_ != NULL) {
+    b = oldFree_;
+    oldFree_ = b->link_;
+    if (b->getFlag(Block::kDecommitted))
+      --decommittedBlocks_;
+    b->zeroDirty();
+  } else {
+    if (oldRegion_ != NULL)
+      b = oldRegion_->grabFreeBlock();
+
+    while (b == NULL) {
+      Region *r = Region::newRegion(Region::kSmallObjectRegion);
+      r->meta_.generation_ = Region::kOldGeneration;
+      r->meta_.owner_ = this;
+      r->meta_.marks_ =
+        static_cast<uint8_t *>(calloc(Region::kMarkTableSize, 1));
+      if (r->meta_.marks_ == NULL)
+        outOfMemory();
+      r->meta_.region_link_ = oldRegion_;
+      oldRegion_ = r;
+      b = r->grabFreeBlock();
+    }
+  }
+
+  b->link_ = NULL;
+  b->flags_ = static_cast<uint32_t>(Block::kClosures);
+  return b;
+}
+
+// Return a list of blocks to the free list of their generation.
+void MemoryManager::freeBlocks(Block *block) {
+  while (block != NULL) {
+    Block *next = block->link_;
+    block->markAsFree();
+    if (Region::regionFromPointer(block->start())->isOldGeneration()) {
+      block->link_ = oldFree_;
+      oldFree_ = block;
+    } else {
+      block->link_ = free_;
+      free_ = block;
+    }
+    block = next;
+  }
+}
+
+// Called after a major GC.  Regions without any used blocks are given
+// back to the OS.  Of the remaining free blocks we keep as many as we
+// expect to need before the next major GC.  The memory of all others
+// is given back to the OS using madvise.
+void MemoryManager::releaseFreeMemory() {
+  releaseFreeRegions(&region_, &free_);
+  releaseFreeRegions(&oldRegion_, &oldFree_);
+  decommitFreeBlocks(free_, nurseryBlocks_);
+  decommitFreeBlocks(oldFree_, oldGenLimit_ - oldGenBlocks_);
+}
+
+void MemoryManager::releaseFreeRegions(Region **regions, Block **freeList) {
+  std::vector<Region *> released;
+  Region **link = regions;
+  while (*link != NULL) {
+    Region *r = *link;
+    if (r->allBlocksFree()) {
+      *link = r->meta_.region_link_;
+      released.push_back(r);
+    } else {
+      link = &r->meta_.region_link_;
+    }
+  }
+  if (released.empty())
+    return;
+
+  // Remove the blocks of these regions from the free list.
+  Block **b = freeList;
+  while (*b != NULL) {
+    Region *r = Region::regionFromPointer((*b)->start());
+    if (std::find(released.begin(), released.end(), r) != released.end()) {
+      if ((*b)->getFlag(Block::kDecommitted))
+        --decommittedBlocks_;
+      *b = (*b)->link_;
+    } else {
+      b = &(*b)->link_;
+    }
+  }
+
+  for (size_t i = 0; i < released.size(); ++i)
+    delete released[i];
+}
+
+void MemoryManager::decommitFreeBlocks(Block *block, Word keep) {
+  for ( ; block != NULL; block = block->link_) {
+    if (keep > 0) {
+      --keep;
+      continue;
+    }
+    if (block->getFlag(Block::kDecommitted))
+      continue;
+    // The first block of a region is not page aligned.
+    char *start = reinterpret_cast<char *>
+      (roundUpToPowerOf2(12, reinterpret_cast<Word>(block->start())));
+    if (madvise(start, block->end() - start, MADV_DONTNEED) != 0)
+      return;
+    // The OS hands back zeroed pages.
+    block->dirty_ = std::min(block->dirty_, (u4)(start - block->start()));
+    block->setFlag(Block::kDecommitted);
+    ++decommittedBlocks_;
+  }
+}
+
+uint64_t MemoryManager::committedBytes() const {
+  uint64_t bytes = 0;
+  for (Region *r = region_; r != NULL; r = r->meta_.region_link_)
+    bytes += Region::kRegionSize;
+  for (Region *r = oldRegion_; r != NULL; r = r->meta_.region_link_)
+    bytes += Region::kRegionSize;
+  for (Region *r = largeObjectRegion_; r != NULL; r = r->meta_.region_link_)
+    bytes += r->largeSelf()->end_ - (char *)r;
+  return bytes - (uint64_t)decommittedBlocks_ * Block::kBlockSize;
+}
+
+uint64_t MemoryManager::usedBytes() const {
+  uint64_t blocks = 0;
+  for (int gen = 0; gen < 2; ++gen) {
+    for (Region *r = gen == 0 ? region_ : oldRegion_; r != NULL;
+         r = r->meta_.region_link_) {
+      Region::SmallObjectRegionData *rd = r->smallSelf();
+      for (Word i = 0; i < Region::kBlocksPerRegion; ++i) {
+        if (rd->blocks_[i].contents() != Block::kUninitialized &&
+            rd->blocks_[i].contents() != Block::kMetadata)
+          ++blocks;
+      }
+    }
+  }
+  return blocks * Block::kBlockSize + largeLive_;
+}
+
+// The size of the heap as limited by --max-heap.  We count a full
+// nursery, since that is what we'll need before the next GC.
+uint64_t MemoryManager::heapSize() const {
+  return (uint64_t)(oldGenBlocks_ + nurseryBlocks_) * Block::kBlockSize
+    + largeLive_;
+}
+
+void MemoryManager::heapExhausted(uint64_t needed) {
+  fprintf(stderr, "FATAL: Heap exhausted (%" FMT_Word64 " bytes needed, "
+          "limit is %" FMT_Word64 " bytes).\n"
+          "Use --max-heap=SIZE to increase the limit.\n",
+          needed, (uint64_t)maxHeapSize_);
+  exit(1);
+}
+
 void MemoryManager::blockFull(Block **block) {
   Block *fullBlock = *block;
-  Block *emptyBlock = grabFreeBlock(fullBlock->contents());
+  Block *emptyBlock =
+    Region::regionFromPointer(fullBlock->start())->isOldGeneration()
+    ? grabOldBlock() : grabFreeBlock(fullBlock->contents());
   dout << "BLOCK_FULL" << endl;
   emptyBlock->link_ = *block;
   *block = emptyBlock;
@@ -287,10 +699,6 @@ MemoryManager::markBlockReadWrite(const Block *block)
   return mprotect(from, size, PROT_READ | PROT_WRITE) == 0;
 }
 
-inline bool isPageAligned(const void *ptr) {
-  return ((Word)ptr & 0xfff) == 0;
-}
-
 InfoTable *
 MemoryManager::allocInfoTable(AllocInfoTableHandle&, Word nwords)
 {
@@ -303,15 +711,12 @@ MemoryManager::allocInfoTable(AllocInfoTableHandle&, Word nwords)
   while (LC_UNLIKELY(ptr == NULL)) {
     bool ok = markBlockReadOnly(info_tables_);
     LC_ASSERT(ok && "Failed to mark block R/O");
-    blockFull(&info_tables_);
-    if (!isPageAligned(info_tables_->start())) {
-      cerr << "TODO: Need API to request page-aligned memory.\n";
-      // Just grab another block.
-      continue;
-    }
+    Block *b = grabInfoTableBlock();
+    b->link_ = info_tables_;
+    info_tables_ = b;
     ptr = info_tables_->alloc(bytes);
   }
-  allocated_ += bytes;
+  countAllocation(bytes);
   return (InfoTable *)ptr;
 }
 
@@ -335,272 +740,1216 @@ MemoryManager::endAllocInfoTable()
   }
 }
 
+void MemoryManager::addAllocBuffer(AllocBuffer *buf) {
+  LC_ASSERT(buf->block_ == NULL);
+  pthread_mutex_lock(&allocLock_);
+  buf->next_ = allocBuffers_;
+  allocBuffers_ = buf;
+  pthread_mutex_unlock(&allocLock_);
+}
+
+// The buffer's block stays in the nursery until the next GC.
+void MemoryManager::removeAllocBuffer(AllocBuffer *buf) {
+  pthread_mutex_lock(&allocLock_);
+  AllocBuffer **link = &allocBuffers_;
+  while (*link != buf) {
+    LC_ASSERT(*link != NULL);
+    link = &(*link)->next_;
+  }
+  *link = buf->next_;
+  buf->next_ = NULL;
+  buf->block_ = NULL;
+  pthread_mutex_unlock(&allocLock_);
+}
+
+void MemoryManager::refill(AllocBuffer *buf) {
+  Block *b = grabFreeBlock(Block::kClosures);
+  Block *head;
+  do {
+    head = closures_;
+    b->link_ = head;
+  } while (!__sync_bool_compare_and_swap(&closures_, head, b));
+  buf->block_ = b;
+  dout << "BLOCK_FULL" << endl;
+}
+
+bool MemoryManager::takeNurseryBlock() {
+  u4 n;
+  do {
+    n = nextGC_;
+    if (n <= 1)
+      return false;
+  } while (!__sync_bool_compare_and_swap(&nextGC_, n, n - 1));
+  return true;
+}
+
+void MemoryManager::refillNoGC(AllocBuffer *buf) {
+  takeNurseryBlock();
+  refill(buf);
+}
+
+// Called at the end of each GC.  The nursery is empty now.
+void MemoryManager::resetAllocBuffers() {
+  for (AllocBuffer *buf = allocBuffers_; buf != NULL; buf = buf->next_)
+    buf->block_ = NULL;
+  closures_ = NULL;
+}
+
 // Returns non-zero if GC is necessary.
 int
-MemoryManager::bumpAllocatorFullNoGC(char **heap, char **heaplim)
+MemoryManager::bumpAllocatorFullNoGC(AllocBuffer *buf,
+                                     char **heap, char **heaplim)
 {
-  sync(*heap, *heaplim);
-  --nextGC_;
-  if (LC_UNLIKELY(nextGC_ == 0)) {
-    ++nextGC_;
+  sync(buf, *heap, *heaplim);
+  if (LC_UNLIKELY(!takeNurseryBlock()))
     return 1;
-  }
-  
-  blockFull(&closures_);
-  getBumpAllocatorBounds(heap, heaplim);
+
+  refill(buf);
+  getBumpAllocatorBounds(buf, heap, heaplim);
   return 0;
 }
 
+void MemoryManager::performGCWithRoots(Capability *cap,
+                                       Closure ***roots, u4 nroots,
+                                       char **heap, char **heaplim) {
+  LC_ASSERT(extraRoots_ == NULL);
+  extraRoots_ = roots;
+  numExtraRoots_ = nroots;
+  performGC(cap);
+  extraRoots_ = NULL;
+  numExtraRoots_ = 0;
+  getBumpAllocatorBounds(cap->allocBuffer(), heap, heaplim);
+}
+
 void MemoryManager::bumpAllocatorFull(char **heap, char **heaplim,
                                       Capability *cap) {
-  sync(*heap, *heaplim);
-  --nextGC_;
-  if (LC_UNLIKELY(nextGC_ == 0)) {
+  AllocBuffer *buf = cap->allocBuffer();
+  sync(buf, *heap, *heaplim);
+  if (LC_UNLIKELY(!takeNurseryBlock())) {
+    nextGC_ = 0;
     performGC(cap);
   } else {
-    blockFull(&closures_);
+    refill(buf);
   }
-  getBumpAllocatorBounds(heap, heaplim);
+  getBumpAllocatorBounds(buf, heap, heaplim);
   dout << "MM: heap=" << (void *)*heap
        << " heaplim=" << (void *)*heaplim
        << " nextGC=" << nextGC_
        << endl;
 }
 
-// TODO: We really want binning.  E.g., bin sizes: 512, 576, 640, ...
+// Large object regions are a sequence of chunks.  The first chunk
+// starts right after the region header, and the last chunk ends at
+// the region's free_ pointer.  Each chunk starts with a LargeObject
+// header and is either a live object or free.  Free chunks are kept
+// on size-segregated free lists.  The sweep phase of a major GC
+// coalesces adjacent free chunks and returns regions that no longer
+// contain any objects to the OS.
+
+static inline Word largeChunkSize(const LargeObject *obj) {
+  return sizeof(LargeObject) + obj->payloadSize_;
+}
+
+static inline int largeObjectBin(Word bytes) {
+  int bin = 0;
+  while (bytes > 1) {
+    bytes >>= 1;
+    ++bin;
+  }
+  return bin;
+}
+
+// Maximum number of free chunks we look at in the first bin that may
+// contain a suitable chunk.
+static const int kLargeObjectLookAhead = 8;
 
 Closure *
 MemoryManager::allocLarge(Word nbytes)
 {
-  Word maxObjectSize = Region::maxLargeObjectSize();
-  if (nbytes > maxObjectSize) {
-    fprintf(stderr,
-            "NYI: Cannot allocate objects larger than %" FMT_Word " bytes",
-            maxObjectSize);
-    exit(1);
+  Word chunkBytes =
+    sizeof(LargeObject) + roundUpBytesToWords(nbytes) * sizeof(Word);
+  if (maxHeapSize_ != 0 && chunkBytes > maxHeapSize_)
+    heapExhausted(chunkBytes);
+
+  LargeObject *obj = allocLargeFromFreeList(chunkBytes);
+  if (obj == NULL)
+    obj = allocLargeFromRegion(chunkBytes);
+
+  // Initialise and link onto large object list.
+  obj->flags_ = 0;
+  if (marking_) {
+    // Objects allocated during incremental marking are live (black).
+    obj->setMark();
+    obj->next_ = scavengedLargeObjects_;
+    scavengedLargeObjects_ = obj;
+  } else {
+    linkLargeObject(obj, &largeObjects_);
+  }
+  countAllocation(chunkBytes);
+  largeAllocated_ += chunkBytes;
+  largeLive_ += chunkBytes;
+
+  return closureFromLargeObject(obj);
+}
+
+// Best-fit with bounded look-ahead.  All chunks in the bins above the
+// first candidate bin are big enough, so we just take the first one.
+LargeObject *
+MemoryManager::allocLargeFromFreeList(Word chunkBytes)
+{
+  for (int bin = largeObjectBin(chunkBytes); bin < kLargeObjectBins; ++bin) {
+    LargeObject *best = NULL;
+    LargeObject *p = freeLargeObjects_[bin];
+    for (int i = 0; p != NULL && i < kLargeObjectLookAhead;
+         p = p->next_, ++i) {
+      Word size = largeChunkSize(p);
+      if (size >= chunkBytes &&
+          (best == NULL || size < largeChunkSize(best))) {
+        best = p;
+        if (size == chunkBytes)
+          break;
+      }
+    }
+    if (best == NULL)
+      continue;
+
+    unlinkLargeObject(best, &freeLargeObjects_[bin]);
+
+    // Split off the rest unless it is too small to hold a header.
+    Word rest = largeChunkSize(best) - chunkBytes;
+    if (rest >= sizeof(LargeObject)) {
+      LargeObject *tail = (LargeObject *)((char *)best + chunkBytes);
+      tail->setFree();
+      tail->payloadSize_ = rest - sizeof(LargeObject);
+      linkLargeObject(tail, &freeLargeObjects_[largeObjectBin(rest)]);
+      best->payloadSize_ = chunkBytes - sizeof(LargeObject);
+    }
+    return best;
   }
+  return NULL;
+}
 
-  char *result = NULL;
-  Word nbytesWithMeta = sizeof(LargeObject) + nbytes;
+LargeObject *
+MemoryManager::allocLargeFromRegion(Word chunkBytes)
+{
+  // 1. Try to fit into the unused end of existing large regions
+  // (using first fit).
+  for (Region *large = largeObjectRegion_; large != NULL;
+       large = large->meta_.region_link_) {
+    Region::LargeObjectRegionData *rd = large->largeSelf();
+    if ((Word)(rd->end_ - rd->free_) >= chunkBytes) {
+      LargeObject *obj = (LargeObject *)rd->free_;
+      rd->free_ += chunkBytes;
+      obj->payloadSize_ = chunkBytes - sizeof(LargeObject);
+      return obj;
+    }
+  }
 
-  // 1. Try to find a free'd large object using best-fit with bounded
-  // look-ahead.
-  // if (freeLargeRegions_) { ... }
+  // 2. We couldn't find any space in the existing regions.  Allocate
+  // a new region.  Objects larger than maxLargeObjectSize() get a
+  // region spanning several region sizes.  Such a region holds just
+  // that object, because only objects starting in the first
+  // kRegionSize bytes can find their region header.
+  size_t size = Region::kRegionSize;
+  Word needed = sizeof(Region::LargeObjectRegionData) + chunkBytes;
+  if (needed > size) {
+    size = idivCeil(needed, (Word)Region::kRegionSize) * Region::kRegionSize;
+    chunkBytes = size - sizeof(Region::LargeObjectRegionData);
+  }
+  Region *large = Region::newRegion(Region::kLargeObjectRegion, size);
+  large->meta_.region_link_ = largeObjectRegion_;
+  largeObjectRegion_ = large;
 
-  Region *large = largeObjectRegion_;
+  Region::LargeObjectRegionData *rd = large->largeSelf();
+  LargeObject *obj = (LargeObject *)rd->free_;
+  rd->free_ += chunkBytes;
+  obj->payloadSize_ = chunkBytes - sizeof(LargeObject);
+  return obj;
+}
 
-  // 2. Try to fit into existing large regions (using first fit).
-  while (large) {
-    char *start = large->largeSelf()->free_;
-    char *end = start + nbytesWithMeta;
 
-    if (end <= largeObjectRegion_->largeSelf()->end_) {
-      largeObjectRegion_->largeSelf()->free_ = end;
-      // TODO: If remaining space is less than minimum large objects
-      // size, mark whole object as full?  Or keep as large object gap
-      // and try to merge later when the adjacent region gets free'd.
+unsigned int MemoryManager::infoTables() {
+  Block *b = info_tables_;
+  unsigned int n = 0;
+  do {
+    n++;
+    b = b->link_;
+  } while (b != NULL);
+  return n;
+}
+
+Block *MemoryManager::staticBlocks(Block::Flags contents) const {
+  switch (contents) {
+  case Block::kInfoTables: return info_tables_;
+  case Block::kStaticClosures: return static_closures_;
+  case Block::kStrings: return strings_;
+  case Block::kBytecode: return bytecode_;
+  default:
+    LC_ASSERT(false && "Not a kind of static data");
+    return NULL;
+  }
+}
 
-      result = start;
-      goto found;
+void MemoryManager::startStaticBlocks() {
+  LC_ASSERT(beginAllocInfoTableLevel_ == 0);
+  blockFull(&info_tables_);
+  bool ok = markBlockReadOnly(info_tables_);
+  LC_ASSERT(ok);
+  blockFull(&static_closures_);
+  blockFull(&strings_);
+  blockFull(&bytecode_);
+}
+
+// Arenas grab blocks concurrently, but grabFreeBlock is thread-safe.
+void MemoryManager::arenaBlockFull(Block **block, Block::Flags kind) {
+  Block *emptyBlock = kind == Block::kInfoTables
+    ? grabInfoTableBlock() : grabFreeBlock(kind);
+  emptyBlock->link_ = *block;
+  *block = emptyBlock;
+}
+
+// Links the blocks in `blocks` in after `current`, so that `current`
+// stays the block that is allocated into.
+void MemoryManager::spliceStaticBlocks(Block *current, Block *blocks) {
+  if (blocks == NULL)
+    return;
+  Block *oldest = blocks;
+  while (oldest->link() != NULL)
+    oldest = oldest->link();
+  oldest->link_ = current->link_;
+  current->link_ = blocks;
+}
+
+void MemoryManager::commitStaticArena(StaticArena *arena) {
+  for (Block *b = arena->infoTables_; b != NULL; b = b->link()) {
+    bool ok = markBlockReadOnly(b);
+    LC_ASSERT(ok && "Failed to mark block R/O");
+  }
+  spliceStaticBlocks(info_tables_, arena->infoTables_);
+  spliceStaticBlocks(static_closures_, arena->staticClosures_);
+  spliceStaticBlocks(strings_, arena->strings_);
+  spliceStaticBlocks(bytecode_, arena->bytecode_);
+  countAllocation(arena->allocated_);
+  arena->infoTables_ = arena->staticClosures_ = NULL;
+  arena->strings_ = arena->bytecode_ = NULL;
+  arena->allocated_ = 0;
+}
+
+StaticArena::~StaticArena() {
+  LC_ASSERT(infoTables_ == NULL && staticClosures_ == NULL &&
+            strings_ == NULL && bytecode_ == NULL);
+}
+
+bool MemoryManager::looksLikeInfoTable(void *p) {
+  Block *block = Region::blockFromPointer(p);
+  return block->contents() == Block::kInfoTables;
+}
+
+void MemoryManager::debugPrint() {
+  cerr << *this << endl;
+}
+
+bool MemoryManager::looksLikeClosure(void *p) {
+  Region *r = Region::regionFromPointer(p);
+  if (r->isLargeObjectRegion())
+    return true;
+
+  Block *block = Region::blockFromPointer(p);
+  if (!(block->contents() == Block::kStaticClosures ||
+        block->contents() == Block::kClosures))
+    return false;
+
+  Closure *cl = (Closure *)p;
+  return cl->info() != NULL && looksLikeInfoTable(cl->info());
+}
+
+static char blockContentShortname[][Block::kMaxContentType] = {
+#define DEF_CONTENT_STR(name, shortname) #shortname,
+  DEFINE_CONTENT_TYPE(DEF_CONTENT_STR)
+#undef DEF_CONTENT_STR
+};
+
+// Useful mainly for debugging.
+
+std::ostream &operator<<(std::ostream &out, const Block &b) {
+  out << blockContentShortname[b.contents()]
+      << " [" << (void *)b.start() << '-' << (void *)b.end();
+  size_t blockSize = static_cast<size_t>(b.end() - b.start());
+  size_t blockFull = static_cast<size_t>(b.free() - b.start());
+  cout << " full:" << (100 * blockFull + (blockSize / 2)) / blockSize
+       << "% link:" << (void *)(b.link_ != NULL ? b.link_->start() : NULL) << "]";
+  return out;
+}
+
+std::ostream &operator<<(std::ostream &out, const Region &r) {
+
+  if (r.isSmallObjectRegion()) {
+    Region::SmallObjectRegionData *rd = r.smallSelf();
+    const char *ptr = r.regionId();
+    out << "Region [" << (void *)ptr << "-"
+        << (void *)(ptr + Region::kRegionSize) << "]" << endl;
+    for (Word i = 0; i < Region::kBlocksPerRegion; i++) {
+      out << "  " << rd->blocks_[i] << endl;
     }
+  } else {
+    out << "LargeObjectRegion[]" << endl;
+  }
+  return out;
+}
 
-    large = large->largeSelf()->header_.region_link_;
+std::ostream &operator<<(std::ostream &out, const MemoryManager &mm) {
+  Region *r = mm.region_;
+  while (r != NULL) {
+    out << *r;
+    r = r->meta_.region_link_;
+  }
+  r = mm.oldRegion_;
+  while (r != NULL) {
+    out << "(old) " << *r;
+    r = r->meta_.region_link_;
   }
+  return out;
+}
 
-  LC_ASSERT(large == NULL);
+//= Garbage Collection Stuff =========================================
 
-  // 3. We couldn't find any space in the existing regions.  Allocate
-  // a new region.
-  large = Region::newRegion(Region::kLargeObjectRegion);
-  result = large->largeSelf()->free_;
-  large->largeSelf()->free_ += nbytesWithMeta;
-  large->largeSelf()->header_.region_link_ = largeObjectRegion_;
+// The heap is split into two generations.  New objects are allocated
+// in the nursery (closures_), each mutator into the block of its own
+// AllocBuffer.  A minor GC copies all live nursery
+// objects straight into the old generation, so after every GC the
+// nursery is empty.  Consequently, the only pointers from old objects
+// into the nursery are those created by mutating an old object
+// (UPDATE and INITF).  These are recorded by the write barrier in the
+// remembered set, which is an extra set of roots for minor GCs.
+//
+// The old generation is managed as a mark-region (Immix-style) space.
+// Old generation regions are divided into 128 byte lines, and each
+// old region has a mark table with one byte per line and one mark
+// bit per word.  A line is in use if it overlaps with an object that
+// was live at the last major GC or was copied there since.  Objects
+// are copied into "holes", i.e., runs of free lines.
+//
+// If the old generation grows beyond oldGenLimit_ blocks, we instead
+// perform a major GC.  It copies the nursery into empty old
+// generation blocks, but marks old objects in place, so long-lived
+// data is neither copied nor does it need to-space.  Only blocks
+// where less than a quarter of the lines were in use are evacuated
+// (defragmented).  Afterwards, blocks without any marked lines are
+// freed and blocks with some free lines are reused by minor GCs.
+// Major GCs can also be done incrementally (see startMarking).
+//
+// Both kinds of GC may use several threads.  Each GC thread (a
+// GCWorker) copies objects into its own hole.  When it moves on to
+// another hole, the objects in the old hole that still need to be
+// scavenged are pushed onto the worker's deque.  Idle workers steal
+// these ranges from the deques of other workers.  Objects marked in
+// place are scavenged by the worker that marked them.  Since two
+// workers may try to evacuate the same object at the same time,
+// forwarding pointers are installed with a compare-and-swap, and
+// mark bits are set atomically.  The roots are always evacuated by
+// the thread that triggered the GC (worker 0).
+void MemoryManager::performGC(Capability *cap) {
+  Time gc_start = getProcessElapsedTime();
 
-  largeObjectRegion_ = large;
+  if (DEBUG_COMPONENTS & DEBUG_SANITY_CHECK_GC) {
+    cerr << ">>> GC " << num_gcs_ << endl;
+    // This ensures that the mutator hasn't introduced any corrupt
+    // state.
+    sanityCheckHeap(cap);
+  }
 
- found:
-  LC_ASSERT(result != NULL);
+  ++num_gcs_;
 
-  // Initialise and link onto large object list.
-  LargeObject *obj = (LargeObject*)result;
-  obj->prev_ = NULL;
-  obj->next_ = largeObjects_;
-  obj->flags_ = 0;
-  obj->payloadSize_ = nbytes;
-  largeObjects_ = obj;
+  u4 heapBlocks = oldGenBlocks_;
+  for (Block *b = closures_; b != NULL; b = b->link_)
+    ++heapBlocks;
+  if (heapBlocks > peak_heap_blocks_)
+    peak_heap_blocks_ = heapBlocks;
+
+  // Large objects count towards the old generation, since only major
+  // GCs free them.
+  bool major = false;
+  if (!marking_ &&
+      oldGenBlocks_ + largeAllocated_ / Block::kBlockSize >= oldGenLimit_) {
+    if (gcSlice_ == 0) {
+      major = true;
+      performMajorGC(cap);
+    } else {
+      startMarking();
+    }
+  }
+  if (!major) {
+    uint64_t promoted_before = promoted_;
+    performMinorGC(cap);
+    if (marking_) {
+      // Scan at least twice as much as was just promoted, so marking
+      // finishes before the old generation has grown too much.  If
+      // it grew too much anyway, finish now.
+      bool behind = oldGenBlocks_ >= 2 * oldGenLimit_;
+      major = markSlice(behind ? 0 : gc_start + gcSlice_,
+                        2 * (promoted_ - promoted_before));
+    }
+    if (heapTooBig()) {
+      // Maybe a major GC can free enough memory.
+      major = true;
+      if (marking_) {
+        markSlice(0, 0);
+      } else {
+        ++num_gcs_;
+        performMajorGC(cap);
+      }
+    }
+  }
+  if (heapTooBig())
+    heapExhausted(heapSize());
+
+  if (DEBUG_COMPONENTS & DEBUG_SANITY_CHECK_GC) {
+    cerr << ">>> GC " << num_gcs_ - 1 << (major ? " (major)" : " (minor)")
+         << " DONE (old blocks = " << oldGenBlocks_ << ")\n";
+    // This ensures that the collector itself hasn't introduced any
+    // corrupt state.
+    sanityCheckHeap(cap);
+  }
+
+  Time t = getProcessElapsedTime() - gc_start;
+  if (major) {
+    major_gc_time_ += t;
+    if (t > max_major_pause_) max_major_pause_ = t;
+  } else {
+    minor_gc_time_ += t;
+    if (t > max_minor_pause_) max_minor_pause_ = t;
+  }
+  gc_time += t;
+  int bucket = 0;
+  while (bucket < kPauseBuckets - 1 && t > pauseBucketLimit(bucket))
+    ++bucket;
+  ++pauses_[bucket];
+
+  uint64_t committed = committedBytes();
+  if (committed > peak_committed_)
+    peak_committed_ = committed;
+
+  resizeNursery(gc_start, gc_start + t);
+}
+
+// With a fixed nursery, the GC frequency is proportional to the
+// allocation rate, while each minor GC costs about the same (it
+// depends on the amount of surviving data).  To keep the GC overhead
+// near gcTarget_ we therefore scale the nursery by the ratio of the
+// measured overhead and the target.  The overhead is smoothed and the
+// nursery changes by at most a factor of two per GC to avoid
+// oscillation.
+void MemoryManager::resizeNursery(Time gcStart, Time gcEnd) {
+  Time mut = lastGCEnd_ != 0 ? gcStart - lastGCEnd_ : 0;
+  Time gc = gcEnd - gcStart;
+  lastGCEnd_ = gcEnd;
+  if (mut + gc > 0) {
+    double overhead = (double)gc / (double)(mut + gc);
+    gcOverhead_ = num_gcs_ > 1 ? (gcOverhead_ + overhead) / 2 : overhead;
+  }
+
+  if (gcTarget_ > 0 && mut > 0) {
+    double ratio = gcOverhead_ / gcTarget_;
+    if (ratio > 2) ratio = 2;
+    if (ratio < 0.5) ratio = 0.5;
+    // Don't bother for small deviations.
+    if (ratio < 0.8 || ratio > 1.25) {
+      uint64_t blocks = (uint64_t)(nurseryBlocks_ * ratio);
+      uint64_t maxBlocks = kMaxNurseryBlocks;
+      if (maxHeapSize_ != 0) {
+        // Leave room for the old generation to grow.
+        uint64_t used =
+          heapSize() - (uint64_t)nurseryBlocks_ * Block::kBlockSize;
+        uint64_t avail = maxHeapSize_ > used ? maxHeapSize_ - used : 0;
+        avail = avail / 2 / Block::kBlockSize;
+        if (avail < maxBlocks) maxBlocks = avail;
+      }
+      if (blocks > maxBlocks) blocks = maxBlocks;
+      if (blocks < minHeapSize_) blocks = minHeapSize_;
+      nurseryBlocks_ = (u4)blocks;
+    }
+  }
+  if (nurseryBlocks_ > peak_nursery_blocks_)
+    peak_nursery_blocks_ = nurseryBlocks_;
+  nextGC_ = nurseryBlocks_;
+}
+
+void MemoryManager::performMinorGC(Capability *cap) {
+  Thread *T = cap->currentThread();
+  BcIns *pc = T->pc();
+  Word *base = T->base();
+  Word *top = T->top();
+
+  LC_ASSERT(old_heap_ == NULL);
+  old_heap_ = closures_;
+  closures_ = NULL;
+  majorGC_ = false;
+
+  GCWorker *w = beginCollection();
+  scavengeStack(w, base, top, pc);
+  scavengeStaticRoots(w, cap->staticRoots());
+  scavengeExtraRoots(w);
+  scavengeRememberedSet(w);
+  scavengeToSpace();
+
+  uint64_t copied, marked;
+  endCollection(&copied, &marked);
+  promoted_ += copied;
+  marked_major_ += marked;  // Only during incremental marking.
+
+  freeBlocks(old_heap_);
+  old_heap_ = NULL;
+
+  resetAllocBuffers();
+  nextGC_ = nurseryBlocks_;
+}
+
+void MemoryManager::performMajorGC(Capability *cap) {
+  Thread *T = cap->currentThread();
+  BcIns *pc = T->pc();
+  Word *base = T->base();
+  Word *top = T->top();
+
+  ++num_major_gcs_;
+
+  LC_ASSERT(old_heap_ == NULL);
+  old_heap_ = closures_;
+  closures_ = NULL;
+  majorGC_ = true;
+
+  // The remembered set only matters for minor GCs.  All objects
+  // reachable from old objects are reachable from the roots, too.
+  remembered_.clear();
+
+  // Line marks are recomputed from scratch, so we must not copy into
+  // holes found using the old marks.  Objects are only copied into
+  // empty blocks during a major GC.
+  recyclable_.clear();
+  selectEvacuationCandidates();
+  clearMarks();
+
+  GCWorker *w = beginCollection();
+
+  // Traverse the roots.
+  scavengeStack(w, base, top, pc);
+  scavengeStaticRoots(w, cap->staticRoots());
+  scavengeExtraRoots(w);
+
+  // Large objects don't contain pointers (they are all byte arrays),
+  // so they need not be scavenged along with the other objects.
+  scavengeToSpace();
+  scavengeLarge();
+
+  uint64_t copied, marked;
+  endCollection(&copied, &marked);
+  copied_major_ += copied;
+  marked_major_ += marked;
+
+  freeBlocks(old_heap_);
+  old_heap_ = NULL;
+  majorGC_ = false;
+
+  // TODO: Add sanity check.  Everything reachable from the roots must
+  // be in a k[Static]Closures block now.
+
+  finishMajorGC();
+
+  resetAllocBuffers();
+  nextGC_ = nurseryBlocks_;
+}
+
+// Frees everything that wasn't marked by the major GC and decides
+// when to do the next one.
+void MemoryManager::finishMajorGC() {
+  if (heapProfile_ != NULL)
+    takeCensus();
+  sweepOldBlocks();
+  sweepLargeObjects();
+  largeAllocated_ = 0;
+
+  oldGenLimit_ = (u4)(growthFactor_ * oldGenBlocks_);
+  if (oldGenLimit_ < minHeapSize_)
+    oldGenLimit_ = minHeapSize_;
+  if (maxHeapSize_ != 0) {
+    // Collect more often as we get close to the limit.
+    u4 maxOldBlocks = (u4)(maxHeapSize_ / Block::kBlockSize) - nurseryBlocks_;
+    if (oldGenLimit_ > maxOldBlocks && maxOldBlocks > oldGenBlocks_)
+      oldGenLimit_ = maxOldBlocks;
+  }
+
+  releaseFreeMemory();
+}
+
+Time MemoryManager::pauseBucketLimit(int i) {
+  static const Time limits[kPauseBuckets - 1] = {
+    100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000,
+    100000, 200000, 500000  // in microseconds
+  };
+  return i < kPauseBuckets - 1
+    ? limits[i] * (TIME_RESOLUTION / 1000000) : 0;
+}
+
+void MemoryManager::remember(Closure *cl) {
+  remembered_.push_back(cl);
+}
+
+// Called from the JIT write barrier stub (asmWriteBarrier).
+extern "C" void LC_USED
+rememberClosure(Closure *cl) {
+  Region *r = Region::regionFromPointer(cl);
+  LC_ASSERT(r->isOldGeneration() && r->owner() != NULL);
+  r->owner()->remember(cl);
+}
+
+void MemoryManager::scavengeRememberedSet(GCWorker *w) {
+  dout << "MM: Scavenging remembered set (" << remembered_.size()
+       << " objects)" << endl;
+  // An object may be in the remembered set more than once.  That is
+  // harmless: after the first visit its fields point to old objects.
+  for (size_t i = 0; i < remembered_.size(); ++i) {
+    scavengeClosure(w, remembered_[i]);
+  }
+  remembered_.clear();
+}
+
+// Size of an object in words.
+static u4 closureWords(Closure *cl) {
+  InfoTable *info = cl->info();
+  switch (info->type()) {
+  case CONSTR:
+  case THUNK:
+  case FUN:
+    return wordsof(ClosureHeader) + info->size();
+  case PAP:
+    return wordsof(PapClosure) + ((PapClosure *)cl)->info_.nargs_;
+  case IND:
+    return wordsof(ClosureHeader) + 1;
+  default:
+    cerr << "FATAL: Unknown size of object type: " << info->type()
+         << " at " << cl << endl;
+    exit(43);
+  }
+}
+
+//--- Parallel Scavenging ---------------------------------------------
+
+// Ranges of copied objects that still need to be scavenged.  The
+// owning worker pushes and pops at the back, other workers steal
+// from the front.
+class RangeDeque {
+public:
+  RangeDeque() : size_(0) { pthread_mutex_init(&lock_, NULL); }
+  ~RangeDeque() { pthread_mutex_destroy(&lock_); }
+
+  // May be out of date by the time the caller looks at the result.
+  inline bool looksEmpty() const { return size_ == 0; }
+
+  void push(char *start, char *end) {
+    pthread_mutex_lock(&lock_);
+    ranges_.push_back(std::make_pair(start, end));
+    ++size_;
+    pthread_mutex_unlock(&lock_);
+  }
+
+  bool pop(bool fromFront, char **start, char **end) {
+    if (looksEmpty())
+      return false;
+    bool found = false;
+    pthread_mutex_lock(&lock_);
+    if (!ranges_.empty()) {
+      std::pair<char *, char *> range;
+      if (fromFront) {
+        range = ranges_.front();
+        ranges_.pop_front();
+      } else {
+        range = ranges_.back();
+        ranges_.pop_back();
+      }
+      --size_;
+      *start = range.first;
+      *end = range.second;
+      found = true;
+    }
+    pthread_mutex_unlock(&lock_);
+    return found;
+  }
+
+private:
+  pthread_mutex_t lock_;
+  std::deque<std::pair<char *, char *> > ranges_;
+  volatile int size_;
+};
+
+struct GCWorker {
+  MemoryManager *mm;
+  u4 id;
+  // The block we copy into, or NULL.
+  Block *block;
+  // The hole we copy into starts at `hole`.  Objects are allocated
+  // at `hp` up to `hplim`.  Objects in [scan, hp) have not been
+  // scavenged, yet.
+  char *hole;
+  char *hp;
+  char *hplim;
+  char *scan;
+  // Old objects that were marked but not scavenged, yet.
+  std::vector<Closure *> markStack;
+  // Old objects marked by a minor GC during incremental marking.
+  std::vector<Closure *> grey;
+  // Live bytes per info table found by the current major GC (only
+  // if heap profiling).
+  WORD_MAP census;
+  // Set while copying first children (see copyFirstChildren).
+  bool eager;
+  Closure *lastCopy;
+  RangeDeque todo;
+  uint64_t copied;       // Bytes copied during the current GC.
+  uint64_t marked;       // Bytes marked in place during the current GC.
+  uint64_t totalCopied;  // Bytes copied during all GCs.
+};
+
+static void deleteGCWorker(GCWorker *w) {
+  delete w;
+}
 
-  return closureFromLargeObject(obj);
+void MemoryManager::setGCThreads(u4 n) {
+  LC_ASSERT(workers_ == NULL);
+  gcThreads_ = n < 1 ? 1 : n;
 }
 
+uint64_t MemoryManager::gcThreadCopied(u4 i) const {
+  LC_ASSERT(i < gcThreads_);
+  return workers_ != NULL ? workers_[i]->totalCopied : 0;
+}
 
-unsigned int MemoryManager::infoTables() {
-  Block *b = info_tables_;
-  unsigned int n = 0;
-  do {
-    n++;
-    b = b->link_;
-  } while (b != NULL);
-  return n;
+GCWorker *MemoryManager::beginCollection() {
+  if (workers_ == NULL) {
+    workers_ = new GCWorker*[gcThreads_];
+    for (u4 i = 0; i < gcThreads_; ++i) {
+      GCWorker *w = new GCWorker();
+      w->mm = this;
+      w->id = i;
+      w->totalCopied = 0;
+      workers_[i] = w;
+    }
+    if (gcThreads_ > 1)
+      startGCThreads();
+  }
+  for (u4 i = 0; i < gcThreads_; ++i) {
+    GCWorker *w = workers_[i];
+    LC_ASSERT(w->todo.looksEmpty() && w->markStack.empty());
+    w->block = NULL;
+    w->hole = w->hp = w->hplim = w->scan = NULL;
+    w->eager = false;
+    w->lastCopy = NULL;
+    w->copied = 0;
+    w->marked = 0;
+  }
+  return workers_[0];
 }
 
-bool MemoryManager::looksLikeInfoTable(void *p) {
-  Block *block = Region::blockFromPointer(p);
-  return block->contents() == Block::kInfoTables;
+void MemoryManager::endCollection(uint64_t *copied, uint64_t *marked) {
+  *copied = 0;
+  *marked = 0;
+  for (u4 i = 0; i < gcThreads_; ++i) {
+    GCWorker *w = workers_[i];
+    LC_ASSERT(w->scan == w->hp);
+    gcCloseHole(w);
+    // The rest of the block can be used by the next minor GC.
+    if (w->block != NULL)
+      recyclable_.push_back(w->block);
+    w->block = NULL;
+    *copied += w->copied;
+    *marked += w->marked;
+    w->totalCopied += w->copied;
+    greyStack_.insert(greyStack_.end(), w->grey.begin(), w->grey.end());
+    w->grey.clear();
+  }
 }
 
-void MemoryManager::debugPrint() {
-  cerr << *this << endl;
+// Everything marked or copied by this major GC is live.  So are the
+// large objects that were reached.
+void MemoryManager::takeCensus() {
+  WORD_MAP &census = workers_[0]->census;
+  for (u4 i = 1; i < gcThreads_; ++i) {
+    WORD_MAP &c = workers_[i]->census;
+    for (WORD_MAP::iterator it = c.begin(); it != c.end(); ++it)
+      census[it->first] += it->second;
+    c.clear();
+  }
+  for (LargeObject *p = scavengedLargeObjects_; p != NULL; p = p->next_) {
+    census[(Word)closureFromLargeObject(p)->info()] +=
+      largeChunkSize(p) - sizeof(LargeObject) + sizeof(ClosureHeader);
+  }
+  heapProfile_->addSample(&census);
 }
 
-bool MemoryManager::looksLikeClosure(void *p) {
-  Region *r = Region::regionFromPointer(p);
-  if (r->isLargeObjectRegion())
-    return true;
+char *MemoryManager::gcAlloc(GCWorker *w, size_t bytes) {
+  if (LC_UNLIKELY(w->hp + bytes > w->hplim))
+    gcNextHole(w, bytes);
+  char *ptr = w->hp;
+  w->hp += bytes;
+  return ptr;
+}
 
-  Block *block = Region::blockFromPointer(p);
-  if (!(block->contents() == Block::kStaticClosures ||
-        block->contents() == Block::kClosures))
-    return false;
+void MemoryManager::gcCloseHole(GCWorker *w) {
+  // If we're in the middle of scavenging this hole, let anyone
+  // scavenge the rest.
+  if (w->scan < w->hp)
+    w->todo.push(w->scan, w->hp);
+  if (w->hole < w->hp) {
+    markLines(w->hole, w->hp);
+    // Old blocks are filled hole by hole, so their free pointer
+    // doesn't tell how much was written.
+    w->block->noteDirty(w->hp);
+  }
+  w->hole = w->hp = w->hplim = w->scan = NULL;
+}
 
-  Closure *cl = (Closure *)p;
-  return cl->info() != NULL && looksLikeInfoTable(cl->info());
+void MemoryManager::gcNextHole(GCWorker *w, size_t bytes) {
+  Block *block = w->block;
+  char *from = w->hplim;
+  char *start, *end;
+  gcCloseHole(w);
+  while (block == NULL || !findHole(block, from, bytes, &start, &end)) {
+    block = gcTakeBlock();
+    from = block->start();
+  }
+  w->block = block;
+  w->hole = w->hp = w->scan = start;
+  w->hplim = end;
 }
 
-static char blockContentShortname[][Block::kMaxContentType] = {
-#define DEF_CONTENT_STR(name, shortname) #shortname,
-  DEFINE_CONTENT_TYPE(DEF_CONTENT_STR)
-#undef DEF_CONTENT_STR
-};
+// Minor GCs copy into the free lines of recyclable blocks first.
+Block *MemoryManager::gcTakeBlock() {
+  if (gcThreads_ > 1) pthread_mutex_lock(&gcLock_);
+  Block *block;
+  if (!majorGC_ && !recyclable_.empty()) {
+    block = recyclable_.back();
+    recyclable_.pop_back();
+  } else {
+    block = grabOldBlock();
+    block->link_ = oldBlocks_;
+    oldBlocks_ = block;
+    ++oldGenBlocks_;
+  }
+  if (gcThreads_ > 1) pthread_mutex_unlock(&gcLock_);
+  return block;
+}
 
-// Useful mainly for debugging.
+void MemoryManager::scavengeToSpace() {
+  if (gcThreads_ > 1) {
+    pthread_mutex_lock(&gcLock_);
+    idleWorkers_ = 0;
+    gcThreadsDone_ = 0;
+    ++gcEpoch_;
+    pthread_cond_broadcast(&gcStart_);
+    pthread_mutex_unlock(&gcLock_);
+  }
 
-std::ostream &operator<<(std::ostream &out, const Block &b) {
-  out << blockContentShortname[b.contents()]
-      << " [" << (void *)b.start() << '-' << (void *)b.end();
-  size_t blockSize = static_cast<size_t>(b.end() - b.start());
-  size_t blockFull = static_cast<size_t>(b.free() - b.start());
-  cout << " full:" << (100 * blockFull + (blockSize / 2)) / blockSize
-       << "% link:" << (void *)(b.link_ != NULL ? b.link_->start() : NULL) << "]";
-  return out;
+  scavengeLoop(workers_[0]);
+
+  if (gcThreads_ > 1) {
+    pthread_mutex_lock(&gcLock_);
+    while (gcThreadsDone_ < gcThreads_ - 1)
+      pthread_cond_wait(&gcDone_, &gcLock_);
+    pthread_mutex_unlock(&gcLock_);
+  }
 }
 
-std::ostream &operator<<(std::ostream &out, const Region &r) {
+void MemoryManager::scavengeLoop(GCWorker *w) {
+  for (;;) {
+    // Scavenge the objects we have just copied.  The current hole may
+    // fill up while we do this, in which case the unscavenged rest is
+    // pushed onto our deque and we continue in the new hole.
+    while (w->scan < w->hp) {
+      Closure *cl = (Closure *)w->scan;
+      LC_ASSERT(cl->info()->type() != IND);
+      w->scan += closureWords(cl) * sizeof(Word);
+      scavengeClosure(w, cl);
+    }
 
-  if (r.isSmallObjectRegion()) {
-    Region::SmallObjectRegionData *rd = r.smallSelf();
-    const char *ptr = r.regionId();
-    out << "Region [" << (void *)ptr << "-"
-        << (void *)(ptr + Region::kRegionSize) << "]" << endl;
-    for (Word i = 0; i < Region::kBlocksPerRegion; i++) {
-      out << "  " << rd->blocks_[i] << endl;
+    if (!w->markStack.empty()) {
+      Closure *cl = w->markStack.back();
+      w->markStack.pop_back();
+      scavengeClosure(w, cl);
+      continue;
+    }
+
+    char *start, *end;
+    if (w->todo.pop(false, &start, &end) || stealRange(w, &start, &end)) {
+      scavengeRange(w, start, end);
+      continue;
+    }
+
+    if (gcThreads_ == 1)
+      return;
+
+    // We have no more work.  We're done if all other workers are
+    // idle, too.  Only the owner of a deque pushes onto it and it
+    // does so only while busy, so at that point all deques are empty.
+    __sync_fetch_and_add(&idleWorkers_, 1);
+    for (;;) {
+      if (idleWorkers_ == (int)gcThreads_)
+        return;
+      if (anyStealableRanges()) {
+        __sync_fetch_and_sub(&idleWorkers_, 1);
+        break;
+      }
+      sched_yield();
     }
-  } else {
-    out << "LargeObjectRegion[]" << endl;
   }
-  return out;
 }
 
-std::ostream &operator<<(std::ostream &out, const MemoryManager &mm) {
-  Region *r = mm.region_;
-  while (r != NULL) {
-    out << *r;
-    r = r->meta_.region_link_;
+bool MemoryManager::stealRange(GCWorker *w, char **start, char **end) {
+  for (u4 i = 1; i < gcThreads_; ++i) {
+    GCWorker *victim = workers_[(w->id + i) % gcThreads_];
+    if (victim->todo.pop(true, start, end))
+      return true;
   }
-  return out;
+  return false;
 }
 
-//= Garbage Collection Stuff =========================================
+bool MemoryManager::anyStealableRanges() {
+  for (u4 i = 0; i < gcThreads_; ++i) {
+    if (!workers_[i]->todo.looksEmpty())
+      return true;
+  }
+  return false;
+}
 
-void MemoryManager::performGC(Capability *cap) {
-  Time gc_start = getProcessElapsedTime();
-  Thread *T = cap->currentThread();
-  BcIns *pc = T->pc();
-  Word *base = T->base();
-  Word *top = T->top();
+void *MemoryManager::gcThreadMain(void *arg) {
+  GCWorker *w = static_cast<GCWorker *>(arg);
+  MemoryManager *mm = w->mm;
+  u4 epoch = 0;
+  pthread_mutex_lock(&mm->gcLock_);
+  for (;;) {
+    while (mm->gcEpoch_ == epoch && !mm->gcShutdown_)
+      pthread_cond_wait(&mm->gcStart_, &mm->gcLock_);
+    if (mm->gcShutdown_)
+      break;
+    epoch = mm->gcEpoch_;
+    pthread_mutex_unlock(&mm->gcLock_);
 
-  if (DEBUG_COMPONENTS & DEBUG_SANITY_CHECK_GC) {
-    cerr << ">>> GC " << num_gcs_ << endl;
-    // This ensures that the mutator hasn't introduced any corrupt
-    // state.
-    sanityCheckHeap(cap);
+    mm->scavengeLoop(w);
+
+    pthread_mutex_lock(&mm->gcLock_);
+    ++mm->gcThreadsDone_;
+    pthread_cond_signal(&mm->gcDone_);
   }
+  pthread_mutex_unlock(&mm->gcLock_);
+  return NULL;
+}
 
-  ++num_gcs_;
+void MemoryManager::startGCThreads() {
+  threads_ = new pthread_t[gcThreads_];
+  for (u4 i = 1; i < gcThreads_; ++i) {
+    if (pthread_create(&threads_[i], NULL, gcThreadMain, workers_[i]) != 0) {
+      fprintf(stderr, "FATAL: Could not create GC thread.\n");
+      exit(1);
+    }
+  }
+}
 
-  LC_ASSERT(old_heap_ == NULL);
-  old_heap_ = closures_;
+void MemoryManager::stopGCThreads() {
+  pthread_mutex_lock(&gcLock_);
+  gcShutdown_ = true;
+  pthread_cond_broadcast(&gcStart_);
+  pthread_mutex_unlock(&gcLock_);
+  for (u4 i = 1; i < gcThreads_; ++i)
+    pthread_join(threads_[i], NULL);
+  delete[] threads_;
+  threads_ = NULL;
+}
 
-  closures_ = grabFreeBlock(closures_->contents());
-  closures_->link_ = NULL;
+//--- Mark-Region Old Generation --------------------------------------
 
-  // Traverse the roots.
-  // TODO: Traverse updated CAFs
-  scavengeStack(base, top, pc);
-  scavengeStaticRoots(cap->staticRoots());
+// Number of lines of a block, including partial lines.
+static inline Word blockLines(const Block *block) {
+  return Region::lineIndex(block->end() - 1)
+    - Region::lineIndex(block->start()) + 1;
+}
 
-  // TODO: We need to alternate scavenge a block and scavenging large blocks until both have no more work left.
+void MemoryManager::markLines(char *from, char *to) {
+  LC_ASSERT(from < to);
+  uint8_t *lines = Region::regionFromPointer(from)->lineMarks();
+  Word last = Region::lineIndex(to - 1);
+  for (Word l = Region::lineIndex(from); l <= last; ++l)
+    lines[l] = 1;
+}
 
-  // Scavenging allocates into closures_ and pushes filled blocks onto
-  // the front of the list.  So we repeatedly traverse closures_ until
-  // we reach the end of a list or a block that we've already
-  // processed.
-  for (;;) {
-    Block *block = closures_;
-    if (block == NULL || block->getFlag(Block::kScavenged)) {
-      break;  // we're done
-    } else {
-      // If the block we are evacuating into and the block we're
-      // scavanging is the same then it definitely must be the last
-      // block.  Otherwise, we may finish scavenging the block
-      // and then continue to evacuate into it again.  Those newly
-      // evacuated objects will then never get scavenged.  Ouch!
-      //
-      // To avoid this problem, we only scavenge the first block if
-      // there is no second block.
-      if (block == closures_ && block->link_ &&
-          !block->link_->getFlag(Block::kScavenged))
-        block = block->link_;
-
-      while (block != NULL && !block->getFlag(Block::kScavenged)) {
-        scavengeBlock(block);
-        block = block->link_;
-      }
+Word MemoryManager::usedLines(Block *block) {
+  const uint8_t *lines = Region::regionFromPointer(block->start())->lineMarks();
+  Word last = Region::lineIndex(block->end() - 1);
+  Word used = 0;
+  for (Word l = Region::lineIndex(block->start()); l <= last; ++l)
+    used += lines[l];
+  return used;
+}
+
+// Find the first run of free lines in the block at or after `from`
+// that can hold `bytes` bytes.
+bool MemoryManager::findHole(Block *block, char *from, size_t bytes,
+                             char **start, char **end) {
+  if (from >= block->end())
+    return false;
+  char *base = reinterpret_cast<char *>(Region::regionFromPointer(from));
+  const uint8_t *lines = Region::regionFromPointer(from)->lineMarks();
+  Word line = Region::lineIndex(from);
+  Word last = Region::lineIndex(block->end() - 1);
+  while (line <= last) {
+    while (line <= last && lines[line])
+      ++line;
+    if (line > last)
+      break;
+    char *holeStart = base + (line << Region::kLineSizeLog2);
+    if (holeStart < from) holeStart = from;
+    while (line <= last && !lines[line])
+      ++line;
+    char *holeEnd = base + (line << Region::kLineSizeLog2);
+    if (holeEnd > block->end()) holeEnd = block->end();
+    if ((size_t)(holeEnd - holeStart) >= bytes) {
+      *start = holeStart;
+      *end = holeEnd;
+      return true;
     }
   }
+  return false;
+}
+
+// Mark an old object that stays in place and queue it for
+// scavenging.
+void MemoryManager::markObject(GCWorker *w, Closure *q) {
+  Region *r = Region::regionFromPointer(q);
+  Word bit = ((Word)q & Region::kRegionMask) / sizeof(Word);
+  uint8_t *marks = &r->objectMarks()[bit / 8];
+  uint8_t mask = (uint8_t)(1 << (bit % 8));
+  if (*marks & mask)
+    return;
+  if (gcThreads_ == 1) {
+    *marks |= mask;
+  } else if (__sync_fetch_and_or(marks, mask) & mask) {
+    return;  // Another worker got there first.
+  }
+  size_t bytes = closureWords(q) * sizeof(Word);
+  markLines((char *)q, (char *)q + bytes);
+  w->marked += bytes;
+  if (heapProfile_ != NULL)
+    w->census[(Word)q->info()] += bytes;
+  if (majorGC_)
+    w->markStack.push_back(q);
+  else
+    w->grey.push_back(q);  // Scanned by a later mark slice.
+}
 
-  // Mark blocks as no longer scavenged.
-  // TODO: Would it help much to not do this?
-  u4 fullBlocks = 0;
-  for (Block *block = closures_; block != NULL; block = block->link_) {
-    block->clearFlag(Block::kScavenged);
-    ++fullBlocks;
+// Sparse blocks are evacuated rather than marked in place.  We only
+// know how sparse a block was after the previous major GC (plus what
+// has been promoted into it since), so this is just a guess.
+void MemoryManager::selectEvacuationCandidates() {
+  for (Block *b = oldBlocks_; b != NULL; b = b->link_) {
+    if (usedLines(b) * 4 < blockLines(b))
+      b->setFlag(Block::kEvacuate);
   }
+}
 
-  // O
-  for (Block *block = old_heap_; block != NULL; ) {
-    block->markAsFree();
-    Block *next = block->link_;
-    block->link_ = free_;
-    free_ = block;
-    block = next;
+void MemoryManager::clearMarks() {
+  for (Region *r = oldRegion_; r != NULL; r = r->meta_.region_link_)
+    memset(r->meta_.marks_, 0, Region::kMarkTableSize);
+}
+
+// Free all old blocks without live objects and collect those with
+// free lines for reuse.
+void MemoryManager::sweepOldBlocks() {
+  recyclable_.clear();
+  u4 used = 0;
+  Block **link = &oldBlocks_;
+  while (*link != NULL) {
+    Block *b = *link;
+    b->clearFlag(Block::kEvacuate);
+    Word lines = usedLines(b);
+    if (lines == 0) {
+      *link = b->link_;
+      b->markAsFree();
+      b->link_ = oldFree_;
+      oldFree_ = b;
+      continue;
+    }
+    if (lines < blockLines(b))
+      recyclable_.push_back(b);
+    ++used;
+    link = &b->link_;
   }
-  old_heap_ = NULL;
+  oldGenBlocks_ = used;
+}
 
-  // TODO: Add sanity check.  Everything reachable from the roots must
-  // be in a k[Static]Closures block now.
+//--- Incremental Marking ---------------------------------------------
 
-  // TODO: Is this correct?
-  nextGC_ = (fullBlocks > minHeapSize_ ? fullBlocks : minHeapSize_) + 1;
+// With a GC slice set, a major GC only clears the marks and lets the
+// mutator continue.  Each following minor GC marks the old objects
+// it comes across (roots and fields of promoted and remembered
+// objects) grey, and then spends the rest of its time slice
+// scanning grey objects.  Once no grey objects are left, the old
+// generation is swept as after a normal major GC.
+//
+// This is incremental-update marking.  The mutator can only create a
+// pointer from an already scanned (black) old object to an unmarked
+// old object by writing to the black object, and the write barrier
+// puts it into the remembered set, which the next minor GC scans.
+// Objects promoted during marking are in fresh blocks whose lines are
+// marked when they're copied into, and their fields are scanned
+// during promotion.  Since marking only finishes right after a minor
+// GC, nothing can be missed.  Old objects are not moved during an
+// incremental cycle, so the mutator needs no read barrier.
+
+void MemoryManager::startMarking() {
+  LC_ASSERT(!marking_);
+  marking_ = true;
+  // Lines in old blocks are free only once marking is complete, so
+  // minor GCs must promote into fresh blocks for now.
+  recyclable_.clear();
+  clearMarks();
+}
 
-  if (DEBUG_COMPONENTS & DEBUG_SANITY_CHECK_GC) {
-    cerr << ">>> GC " << num_gcs_ - 1 << " DONE (full blocks = "
-         << fullBlocks << ")\n";
-    // This ensures that the collector itself hasn't introduced any
-    // corrupt state.
-    sanityCheckHeap(cap);
+// Scans grey objects until there are none left, or until the deadline
+// (zero means none) has passed and at least minBytes worth of objects
+// have been scanned.  Returns true if marking is complete and the old
+// generation has been swept.
+bool MemoryManager::markSlice(Time deadline, uint64_t minBytes) {
+  LC_ASSERT(marking_ && old_heap_ == NULL);
+  // Make some progress even if the minor GC used up the whole slice.
+  static const uint64_t kMinSliceBytes = 16 * 1024;
+  if (minBytes < kMinSliceBytes)
+    minBytes = kMinSliceBytes;
+  GCWorker *w = workers_[0];
+  majorGC_ = true;
+  w->marked = 0;
+  w->markStack.swap(greyStack_);
+  uint64_t scanned = 0;
+  u4 objects = 0;
+  while (!w->markStack.empty()) {
+    if (deadline != 0 && scanned >= minBytes && (++objects & 63) == 0 &&
+        getProcessElapsedTime() >= deadline)
+      break;
+    Closure *cl = w->markStack.back();
+    w->markStack.pop_back();
+    scanned += scavengeClosure(w, cl) * sizeof(Word);
   }
+  greyStack_.swap(w->markStack);
+  majorGC_ = false;
+  marked_major_ += w->marked;
+
+  if (!greyStack_.empty())
+    return false;
 
-  gc_time += getProcessElapsedTime() - gc_start;
+  // Large objects don't contain pointers, see performMajorGC.
+  scavengeLarge();
+  marking_ = false;
+  finishMajorGC();
+  // The pause also did a minor GC, which performGC has counted
+  // already.
+  ++num_gcs_;
+  ++num_major_gcs_;
+  return true;
 }
 
 static inline bool isForwardingPointer(const InfoTable *p) {
@@ -615,20 +1964,87 @@ static inline InfoTable *makeForwardingPointer(Closure *p) {
   return cast (InfoTable *, (Word)p | 1);
 }
 
-static inline void copy(MemoryManager *mm, Closure **src,
-                        InfoTable *info, u4 payloadSize) {
+void MemoryManager::copy(GCWorker *w, Closure **src,
+                         InfoTable *info, u4 payloadSize) {
   Closure *from = *src;
-  Closure *to = mm->allocClosure(info, payloadSize);
-  *src = to;
+  size_t bytes = (wordsof(ClosureHeader) + payloadSize) * sizeof(Word);
+  Closure *to = reinterpret_cast<Closure *>(gcAlloc(w, bytes));
+  Closure::initHeader(to, info);
   for (u4 i = 0; i < payloadSize; ++i) {
     to->setPayload(i, from->payload(i));
   }
   dout << "(fwd@" << from << ")";
-  from->setInfo(makeForwardingPointer(to));
+  if (gcThreads_ == 1) {
+    from->setInfo(makeForwardingPointer(to));
+  } else if (!__sync_bool_compare_and_swap(&from->header_.info_, info,
+                                           makeForwardingPointer(to))) {
+    // Another worker copied the object first.  Our copy is the last
+    // object in our hole, so we can just take it back.
+    w->hp = reinterpret_cast<char *>(to);
+    *src = getForwardingPointer(from->info());
+    dout << COL_YELLOW << *src << COL_RESET << endl;
+    return;
+  }
+  *src = to;
+  w->copied += bytes;
+  if (heapProfile_ != NULL && majorGC_)
+    w->census[(Word)info] += bytes;
   dout << COL_GREEN << to << COL_RESET << endl;
+  if (w->eager)
+    w->lastCopy = to;
+  else
+    copyFirstChildren(w, to);
+}
+
+static const int kEagerCopyDepth = 16;
+
+static inline Closure **firstPointerField(Closure *cl) {
+  InfoTable *info = cl->info();
+  switch (info->type()) {
+  case CONSTR:
+  case THUNK:
+  case FUN: {
+    u4 bitmap = info->layout().bitmap;
+    if (bitmap == 0)
+      return NULL;
+    return (Closure **)&cl->payload_[__builtin_ctz(bitmap)];
+  }
+  case PAP:
+    return &((PapClosure *)cl)->fun_;
+  default:
+    return NULL;
+  }
+}
+
+// Cheney's algorithm copies objects in breadth-first order, which
+// separates parents from their children, e.g., the nodes of a tree.
+// After copying an object, we therefore also copy its first child,
+// that child's first child, and so on (up to kEagerCopyDepth
+// objects).  They end up right next to each other, so this is an
+// approximately depth-first order.
+//
+// The copied children are scavenged as usual when the scan pointer
+// reaches them.  We don't update the parent's field, though: it gets
+// updated via the forwarding pointer when the parent is scavenged.
+// Thus every field still points to from-space until its object is
+// scavenged, just as without eager copying.
+void MemoryManager::copyFirstChildren(GCWorker *w, Closure *cl) {
+  w->eager = true;
+  for (int depth = 0; depth < kEagerCopyDepth; ++depth) {
+    Closure **field = firstPointerField(cl);
+    if (field == NULL)
+      break;
+    Closure *child = *field;
+    w->lastCopy = NULL;
+    evacuate(w, &child);
+    if (w->lastCopy == NULL)
+      break;  // Not copied by us (old, static, large, or already copied).
+    cl = w->lastCopy;
+  }
+  w->eager = false;
 }
 
-void MemoryManager::evacuate(Closure **p) {
+void MemoryManager::evacuate(GCWorker *w, Closure **p) {
   Closure *q;
   InfoTable *info;
   Block *block;
@@ -649,6 +2065,14 @@ loop:
 
   dout << ' ' << info->name();
 
+  if (Region::regionFromPointer(q)->isLargeObjectRegion()) {
+    // Large objects are never copied and only collected by major GCs.
+    dout << " -L-> " COL_YELLOW "large object" COL_RESET << endl;
+    if (majorGC_ || marking_)
+      evacuateLarge(q);
+    return;
+  }
+
   block = Region::blockFromPointer(q);
   if (block->contents() != Block::kClosures) {
     // TODO: Need to follow indirections from static closures into
@@ -657,12 +2081,43 @@ loop:
     return;
   }
 
+  if (Region::regionFromPointer(q)->isOldGeneration()) {
+    if (!majorGC_) {
+      dout << " -O-> " COL_YELLOW "old object" COL_RESET << endl;
+      if (marking_)
+        markObject(w, q);
+      return;
+    }
+    if (info->type() == IND) {
+      q = (Closure *)q->payload(0);
+      dout << " -I-> " << q;
+      *p = q;
+      goto loop;
+    }
+    if (!block->getFlag(Block::kEvacuate)) {
+      dout << " -M-> " COL_YELLOW "marked in place" COL_RESET << endl;
+      markObject(w, q);
+      return;
+    }
+  }
+
   switch (info->type()) {
   case CONSTR:
+    if (info->size() <= 1) {
+      // Small Ints and Chars, and nullary constructors, are replaced
+      // by their shared static closure (if any) instead of copied.
+      Closure *shared = MiscClosures::sharedClosure(info, q->payload_);
+      if (shared != NULL) {
+        dout << " -C-> " COL_YELLOW "shared " << shared << COL_RESET << endl;
+        *p = shared;
+        return;
+      }
+    }
+    // Fall through.
   case THUNK:
   case FUN:
     dout << " -CTF(" << info->size() << ")-> ";
-    copy(this, p, info, info->size());
+    copy(w, p, info, info->size());
     break;
 
   case IND:
@@ -676,13 +2131,7 @@ loop:
     u4 size = pap->info_.nargs_ + wordsof(PapClosure)
               - wordsof(ClosureHeader);
     dout << " -PAP(" << pap->info_.nargs_ << ")-> " << pap;
-    copy(this, p, info, size);
-    break;
-  }
-
-    // Don't copy large objects.  Just mark them.
-  case LARGE: {
-    evacuateLarge(q);
+    copy(w, p, info, size);
     break;
   }
 
@@ -708,6 +2157,14 @@ MemoryManager::evacuateLarge(Closure *c)
     return;
   }
 
+  if (gcThreads_ > 1) {
+    pthread_mutex_lock(&gcLock_);
+    if (q->getMark()) {
+      pthread_mutex_unlock(&gcLock_);
+      return;
+    }
+  }
+
   q->setMark();
 
   // Remove from large objects list.
@@ -718,6 +2175,9 @@ MemoryManager::evacuateLarge(Closure *c)
   q->next_ = evacuatedLargeObjects_;
   q->prev_ = NULL;
   evacuatedLargeObjects_ = q;
+
+  if (gcThreads_ > 1)
+    pthread_mutex_unlock(&gcLock_);
 }
 
 void
@@ -748,43 +2208,68 @@ MemoryManager::scavengeLarge()
 void
 MemoryManager::sweepLargeObjects()
 {
-  // TODO: We need much better free list management.  Look at what
-  // modern malloc implementations do.
-
-  // All objects remaining in the large objects after evacuation and
-  // scavenging are free.  Add to existing free list.
-  if (largeObjects_) {
-    if (freeLargeRegions_) {
-      // Append both lists.  Let's assume the newly-freed object list
-      // is a bit shorter than the existing free regions.
-      LargeObject *p = largeObjects_;
-      while (p->next_ != NULL) {
-        p = p->next_;
-      }
-      freeLargeRegions_->prev_ = p;
-      p->next_ = freeLargeRegions_;
-      freeLargeRegions_ = p;
-    } else {
-      freeLargeRegions_ = largeObjects_;
-    }
-    largeObjects_ = NULL;
+  // All objects remaining in the large objects list after evacuation
+  // and scavenging are dead.
+  for (LargeObject *p = largeObjects_; p != NULL; p = p->next_) {
+    p->setFree();
   }
+  largeObjects_ = NULL;
 
   // Traverse the scavenged large objects. Re-enlist them in the
   // largeObjects_ list and clear their mark bits.
+  largeLive_ = 0;
   LargeObject *p = scavengedLargeObjects_;
   while (p != NULL) {
     LargeObject *n = p->next_;
     linkLargeObject(p, &largeObjects_);
     p->clearMark();
+    largeLive_ += largeChunkSize(p);
     p = n;
   }
+  scavengedLargeObjects_ = NULL;
+
+  // Rebuild the free lists, merging adjacent free chunks.  A free
+  // chunk at the end of a region is given back to the region's unused
+  // end, and empty regions are given back to the OS.
+  for (int i = 0; i < kLargeObjectBins; ++i)
+    freeLargeObjects_[i] = NULL;
+
+  Region **link = &largeObjectRegion_;
+  while (*link != NULL) {
+    Region *large = *link;
+    Region::LargeObjectRegionData *rd = large->largeSelf();
+    char *chunk = large->firstLargeChunk();
+    while (chunk < rd->free_) {
+      LargeObject *obj = (LargeObject *)chunk;
+      char *next = chunk + largeChunkSize(obj);
+      if (obj->isFree()) {
+        while (next < rd->free_ && ((LargeObject *)next)->isFree())
+          next += largeChunkSize((LargeObject *)next);
+        if (next == rd->free_) {
+          rd->free_ = chunk;
+          break;
+        }
+        obj->payloadSize_ = (Word)(next - chunk) - sizeof(LargeObject);
+        linkLargeObject(obj,
+                        &freeLargeObjects_[largeObjectBin(next - chunk)]);
+      }
+      chunk = next;
+    }
+
+    if (rd->free_ == large->firstLargeChunk()) {
+      *link = large->meta_.region_link_;
+      delete large;
+    } else {
+      link = &large->meta_.region_link_;
+    }
+  }
 }
 
-void MemoryManager::scavengeFrame(Word *base, Word *top, const u2 *bitmaps) {
+void MemoryManager::scavengeFrame(GCWorker *w, Word *base, Word *top,
+                                  const u2 *bitmaps) {
   dout << "Scavenging frame " << base << '-' << top << endl;
   dout << "-1:";
-  evacuate((Closure **)&base[-1]); // The frame node
+  evacuate(w, (Closure **)&base[-1]); // The frame node
   if (bitmaps == NULL)
     return;
   u2 bitmap;
@@ -797,7 +2282,7 @@ void MemoryManager::scavengeFrame(Word *base, Word *top, const u2 *bitmaps) {
       if (bitmap & 1) {
         LC_ASSERT(slot < slots);
         dout << slot << ": ";
-        evacuate((Closure **)&base[slot]);
+        evacuate(w, (Closure **)&base[slot]);
       }
     }
   } while (bitmap != 0);
@@ -818,7 +2303,8 @@ static inline const u2 *topFrameBitmask(const BcIns *pc) {
   }
 }
 
-void MemoryManager::scavengeStack(Word *base, Word *top, const BcIns *pc) {
+void MemoryManager::scavengeStack(GCWorker *w, Word *base, Word *top,
+                                  const BcIns *pc) {
   u2 dummy_mask[3];
   const u2 *bitmask;
   if (topOfStackMask_ != kNoMask) {
@@ -834,93 +2320,143 @@ void MemoryManager::scavengeStack(Word *base, Word *top, const BcIns *pc) {
   } else {
     bitmask = topFrameBitmask(pc);
   }
-  scavengeFrame(base, top, bitmask);
+  scavengeFrame(w, base, top, bitmask);
   top = base - 3;
   pc = (BcIns *)base[-2];
   base = (Word *)base[-3];
 
   while (base) {
-    scavengeFrame(base, top, BcIns::offsetToBitmask(pc - 1));
+    scavengeFrame(w, base, top, BcIns::offsetToBitmask(pc - 1));
     top = base - 3;
     pc = (BcIns *)base[-2];
     base = (Word *)base[-3];
   }
 }
 
-void MemoryManager::scavengeStaticRoots(Closure *cl) {
+void MemoryManager::scavengeStaticRoots(GCWorker *w, Closure *cl) {
   dout << "MM: Scavenging static roots" << endl;
   while (cl) {
-    evacuate((Closure **)&cl->payload_[0]);
+    evacuate(w, (Closure **)&cl->payload_[0]);
     cl = (Closure *)cl->payload_[1];
   }
 }
 
-void MemoryManager::scavengeBlock(Block *block) {
-  dout << "MM: Scavenging block: " << (void *)block->start()
-       << '-' << (void *)block->end() << endl;
+// Must walk the stack exactly like scavengeStack.
+bool MemoryManager::isStackRoot(Word *base, Word *top, const BcIns *pc,
+                                Word *p) {
+  LC_ASSERT(topOfStackMask_ == kNoMask);
+  const u2 *bitmask = topFrameBitmask(pc);
+  for (;;) {
+    if (p == &base[-1])
+      return true;  // The frame node
+    if (p >= base && p < top) {
+      if (bitmask == NULL)
+        return false;
+      ptrdiff_t slot = p - base;
+      // Each bitmask word covers 15 slots, and the top bit says
+      // whether more words follow.
+      for (;;) {
+        u2 bitmap = *bitmask;
+        if (slot < 15)
+          return (bitmap >> slot) & 1;
+        if (!(bitmap & 0x8000))
+          return false;
+        slot -= 15;
+        ++bitmask;
+      }
+    }
+    top = base - 3;
+    pc = (BcIns *)base[-2];
+    base = (Word *)base[-3];
+    if (base == NULL)
+      return false;
+    bitmask = BcIns::offsetToBitmask(pc - 1);
+  }
+}
 
-  char *p = block->start();
+void MemoryManager::scavengeExtraRoots(GCWorker *w) {
+  for (u4 i = 0; i < numExtraRoots_; ++i)
+    evacuate(w, extraRoots_[i]);
+}
 
-  // We might be evacuating into the same block that we're scavenging.
-  // That is `bd->free` might change during the loop, so recheck here.
-  while ((char *)p < block->free()) {
+void MemoryManager::scavengeRange(GCWorker *w, char *start, char *end) {
+  dout << "MM: Scavenging range: " << (void *)start
+       << '-' << (void *)end << endl;
+  char *p = start;
+  while (p < end) {
     Closure *cl = (Closure *)p;
-    InfoTable *info = cl->info();
-    LC_ASSERT(!isForwardingPointer(info));
-    switch (info->type()) {
-    case CONSTR:
-    case THUNK:
-    case FUN: {
-      u4 bitmap = info->layout().bitmap;
-      u4 size = info->size();
-      dout << "MM: * Scav " << (void *)cl
-           << ' ' << info->name() << ' ';
-      IFDBG(InfoTable::printPayload(dout, bitmap, size));
-      dout << endl;
+    // Indirections are only created by updating a thunk in place, so
+    // they never occur in freshly copied objects.  (An IND may be
+    // smaller than the thunk it replaced, so we couldn't step over it
+    // anyway.)
+    LC_ASSERT(cl->info()->type() != IND);
+    p += scavengeClosure(w, cl) * sizeof(Word);
+  }
+}
 
-      LC_ASSERT(bitmap < (1UL << size));
-      for (u4 i = 0; bitmap != 0 && i < size; ++i, bitmap >>= 1) {
-        if (bitmap & 1) {
-          evacuate((Closure **)&cl->payload_[i]);
-        }
+// Evacuate all objects referenced by the given object.  Returns the
+// size of the object in words.
+u4 MemoryManager::scavengeClosure(GCWorker *w, Closure *cl) {
+  InfoTable *info = cl->info();
+  LC_ASSERT(!isForwardingPointer(info));
+  switch (info->type()) {
+  case CONSTR:
+  case THUNK:
+  case FUN: {
+    u4 bitmap = info->layout().bitmap;
+    u4 size = info->size();
+    dout << "MM: * Scav " << (void *)cl
+         << ' ' << info->name() << ' ';
+    IFDBG(InfoTable::printPayload(dout, bitmap, size));
+    dout << endl;
+
+    LC_ASSERT(bitmap < (1UL << size));
+    // Start loading the children's info tables before we need them.
+    for (u4 i = 0, b = bitmap; b != 0 && i < size; ++i, b >>= 1) {
+      if (b & 1)
+        LC_PREFETCH((void *)cl->payload_[i]);
+    }
+    for (u4 i = 0; bitmap != 0 && i < size; ++i, bitmap >>= 1) {
+      if (bitmap & 1) {
+        evacuate(w, (Closure **)&cl->payload_[i]);
       }
-      p += (wordsof(ClosureHeader) + size) * sizeof(Word);
     }
-    break;
-
-    case PAP: {
-      PapClosure *pap = (PapClosure *)cl;
-      // In principle we could get the bitmap from the function
-      // argument itself.  That would require following a few more
-      // pointers, though, so let's not do that if we can avoid it.
-      u4 bitmap = pap->info_.pointerMask_;
-      u4 size = pap->info_.nargs_;
-      dout << "MM: * Scav " << (void *)cl << " PAP";
-      IFDBG(InfoTable::printPayload(dout, bitmap, size));
-      dout << endl;
-
-      evacuate(&pap->fun_);
+    return wordsof(ClosureHeader) + size;
+  }
 
-      LC_ASSERT(bitmap < (1UL << size));
-      for (u4 i = 0; bitmap != 0 && i < size; ++i, bitmap >>= 1) {
-        if (bitmap & 1) {
-          evacuate((Closure **)&pap->payload_[i]);
-        }
+  case PAP: {
+    PapClosure *pap = (PapClosure *)cl;
+    // In principle we could get the bitmap from the function
+    // argument itself.  That would require following a few more
+    // pointers, though, so let's not do that if we can avoid it.
+    u4 bitmap = pap->info_.pointerMask_;
+    u4 size = pap->info_.nargs_;
+    dout << "MM: * Scav " << (void *)cl << " PAP";
+    IFDBG(InfoTable::printPayload(dout, bitmap, size));
+    dout << endl;
+
+    evacuate(w, &pap->fun_);
+
+    LC_ASSERT(bitmap < (1UL << size));
+    for (u4 i = 0; bitmap != 0 && i < size; ++i, bitmap >>= 1) {
+      if (bitmap & 1) {
+        evacuate(w, (Closure **)&pap->payload_[i]);
       }
-      p += (wordsof(PapClosure) + size) * sizeof(Word);
     }
-    break;
+    return wordsof(PapClosure) + size;
+  }
 
-    default:
-      cerr << "Can't scavenge object type, yet: " << info->type()
-           << " at " << cl << " " << info->name()
-           << endl;
-      exit(43);
-    }
+  case IND:
+    dout << "MM: * Scav " << (void *)cl << " IND" << endl;
+    evacuate(w, (Closure **)&cl->payload_[0]);
+    return wordsof(ClosureHeader) + 1;
+
+  default:
+    cerr << "Can't scavenge object type, yet: " << info->type()
+         << " at " << cl << " " << info->name()
+         << endl;
+    exit(43);
   }
-  block->setFlag(Block::kScavenged);
-  dout << "MM: DONE Scavenging block: " << (void *)block->start()
-       << '-' << (void *)block->end() << endl;
 }
 
 // --- Sanity Checking ----------------------------------------
@@ -1130,6 +2666,13 @@ MemoryManager::inRegions(void *p)
     r = r->meta_.region_link_;
   }
 
+  r = oldRegion_;
+  while (r) {
+    if (r->inRegion(p))
+      return true;
+    r = r->meta_.region_link_;
+  }
+
   r = largeObjectRegion_;
   while (r) {
     if (r->inRegion(p))
@@ -4,8 +4,11 @@
 #include "common.hh"
 #include "utils.hh"
 #include "objects.hh"
+#include "time.hh"
 #include <iostream>
+#include <vector>
 #include <string.h>
+#include <pthread.h>
 
 #include HASH_SET_H
 
@@ -13,6 +16,8 @@ _START_LAMBDACHINE_NAMESPACE
 
 class MemoryManager;
 class Capability;
+class HeapProfile;
+struct GCWorker;
 
 // Only one OS thread should allocate to each block.
 
@@ -64,6 +69,12 @@ public:
     kContentsMask = 0xff,
     kScavenged = 0x100,
     kFull = 0x200,
+    // A sparse old generation block whose live objects get copied out
+    // during the current major GC instead of being marked in place.
+    kEvacuate = 0x400,
+    // A free block whose memory has been given back to the OS using
+    // madvise.  It is transparently re-committed when touched.
+    kDecommitted = 0x800,
   } Flags;
 
   inline Flags flags() const {
@@ -76,22 +87,38 @@ public:
     return static_cast<Flags>(flags_ & kContentsMask);
   }
 
+  // Next block in whichever list this block is on.
+  inline Block *link() const { return link_; }
+
   friend std::ostream& operator<<(std::ostream&, const Block&);
 
 private:
   friend class Region;
   friend class MemoryManager;
+  friend class Image;
   Block() {}; // Hidden
   ~Block() {};
   
   inline void setFlag(Flags flag) { flags_ |= (uint32_t)flag; }
   inline void clearFlag(Flags flag) { flags_ &= ~((uint32_t)flag); }
+  // In debug builds, blocks are zeroed before they are reused.  To
+  // keep that cheap we remember how much of the block may have been
+  // written to and only clear that part, and only once the block is
+  // actually needed again.
   inline void markAsFree() {
     flags_ = (uint32_t)Block::kUninitialized;
+    noteDirty(free_);
     free_ = start_;
+  }
+  inline void noteDirty(const char *p) {
+    u4 bytes = static_cast<u4>(p - start_);
+    if (bytes > dirty_) dirty_ = bytes;
+  }
+  inline void zeroDirty() {
 #if !defined(NDEBUG)
-    memset(free_, 0, end_ - free_);
+    memset(start_, 0, dirty_);
 #endif
+    dirty_ = 0;
   }
   void operator delete(void *) {}; // Forbid deleting Blocks
 
@@ -100,9 +127,7 @@ private:
   char *free_;
   Block *link_;
   uint32_t flags_;
-#if LC_ARCH_BITS == 64
-  uint32_t padding;
-#endif
+  u4 dirty_;  // Bytes from start_ that may be non-zero.
 };
 
 
@@ -113,13 +138,48 @@ public:
     kLargeObjectRegion	// The region contains large objects.
   } RegionType;
 
+  // Blocks of a region all belong to the same generation.  The JIT
+  // write barrier tests the generation by masking the address of the
+  // updated object, so this must be stored in the region header.
+  typedef enum {
+    kYoungGeneration = 0,
+    kOldGeneration = 1
+  } Generation;
+
   static const int kRegionSizeLog2 = 20; /* 1MB */
   static const size_t kRegionSize = 1UL << kRegionSizeLog2;
   static const Word kBlocksPerRegion = kRegionSize / Block::kBlockSize;
   static const Word kRegionMask = kRegionSize - 1;
 
-  // Allocate a new memory region from the OS.
-  static Region *newRegion(RegionType);
+  // Old generation regions are divided into lines for the purpose of
+  // mark-region collection.  A line is in use if it overlaps with a
+  // live object.
+  static const int kLineSizeLog2 = 7; /* 128 bytes */
+  static const size_t kLineSize = 1UL << kLineSizeLog2;
+  static const Word kLinesPerRegion = kRegionSize >> kLineSizeLog2;
+  // One byte per line plus one mark bit per word.
+  static const size_t kMarkTableSize =
+    kLinesPerRegion + (kRegionSize / sizeof(Word)) / 8;
+
+  // Allocate a new memory region from the OS.  A large object region
+  // may be bigger than kRegionSize if it is meant for a single object
+  // larger than maxLargeObjectSize().  `size` must be a multiple of
+  // kRegionSize.
+  static Region *newRegion(RegionType, size_t size = kRegionSize);
+
+  // If enabled, regions are backed by transparent huge pages where
+  // the OS supports them.  Standard size regions are then mapped in
+  // groups that fill one huge page each, so that the huge page can be
+  // used as soon as the first region is touched.
+  static const int kHugePageSizeLog2 = 21; /* 2MB */
+  static const size_t kHugePageSize = 1UL << kHugePageSizeLog2;
+  static void setHugePages(bool enable);
+  static bool hugePages();
+
+  // If enabled, new regions are placed on the NUMA node of the thread
+  // that requests them (rather than wherever their pages happen to be
+  // touched first).  Has no effect on machines with a single node.
+  static void setNumaPlacement(bool enable);
 
   static inline char* alignToRegionBoundary(char *ptr) {
     Word w = reinterpret_cast<Word>(ptr);
@@ -152,6 +212,33 @@ public:
   // Returns NULL if this region has no more free blocks.
   Block *grabFreeBlock();
 
+  // Like grabFreeBlock, but only returns a block whose start is page
+  // aligned.  Other blocks are left for later calls of grabFreeBlock.
+  Block *grabFreeAlignedBlock();
+
+  inline bool isOldGeneration() const {
+    return meta_.generation_ == kOldGeneration;
+  }
+
+  // The memory manager owning an old generation region.
+  inline MemoryManager *owner() const { return meta_.owner_; }
+
+  static inline Word lineIndex(const void *p) {
+    return ((Word)p & kRegionMask) >> kLineSizeLog2;
+  }
+
+  // Line marks (one byte per line) followed by object mark bits (one
+  // bit per word).  Only old generation regions have a mark table.
+  inline uint8_t *lineMarks() const { return meta_.marks_; }
+  inline uint8_t *objectMarks() const {
+    return meta_.marks_ + kLinesPerRegion;
+  }
+
+  // Offset of the generation field from the start of the region.
+  static inline int32_t generationOffset() {
+    return (int32_t)offsetof(RegionHeader, generation_);
+  }
+
   static void operator delete(void *p);
   ~Region();
 
@@ -160,6 +247,7 @@ public:
 
   inline const char *regionId() const { return (const char*)this; }
 
+  // Largest object that fits into a standard size large object region.
   static inline Word maxLargeObjectSize() {
     return kRegionSize - sizeof(LargeObjectRegionData) - sizeof(LargeObject);
   }
@@ -171,6 +259,9 @@ private:
     Word magic_;
     Word region_info_;
     Region *region_link_;
+    Word generation_;
+    MemoryManager *owner_;  // Only set for old generation regions.
+    uint8_t *marks_;        // Ditto.  See lineMarks().
   } RegionHeader;
 
   typedef struct _SmallObjectRegionData {
@@ -185,6 +276,11 @@ private:
     char *free_;
   } LargeObjectRegionData;
 
+  // Large objects and free chunks (see allocLarge) start here.
+  inline char *firstLargeChunk() const {
+    return (char *)this + sizeof(LargeObjectRegionData);
+  }
+
   inline bool isSmallObjectRegion() const {
     return meta_.region_info_ == kSmallObjectRegion;
   }
@@ -195,6 +291,9 @@ private:
 
   static void initBlocks(SmallObjectRegionData *);
 
+  // True if none of the blocks of this small object region is in use.
+  bool allBlocksFree() const;
+
   inline bool inRegion(void *p) {
     return (void *)this <= p &&
       p < (void *)((char *)this + kRegionSize);
@@ -216,9 +315,36 @@ private:
   RegionHeader meta_;
 
   friend class MemoryManager;
+  friend class Image;
+  friend class GCTest;  // In unittest.cc
 };
 
 class AllocInfoTableHandle; // forward decl
+class StaticArena;
+
+// A thread-local allocation buffer.  Each mutator bump-allocates
+// closures into the nursery block owned by its buffer, so the fast
+// path needs no synchronisation.  Only getting a fresh block (a
+// refill) touches shared state, and that is lock-free unless a new
+// region must be requested from the OS.
+//
+// All blocks handed out to buffers form the nursery.  After a GC,
+// every registered buffer is empty and gets refilled on its next
+// allocation.  A GC requires all mutators to be stopped.
+class AllocBuffer
+{
+public:
+  AllocBuffer() : block_(NULL), next_(NULL) {}
+
+  // The block currently allocated into, or NULL.
+  inline Block *block() const { return block_; }
+
+private:
+  Block *block_;
+  AllocBuffer *next_;  // Next registered buffer.
+
+  friend class MemoryManager;
+};
 
 class MemoryManager
 {
@@ -235,23 +361,90 @@ public:
 
   inline Closure *allocStaticClosure(size_t payloadSize) {
     return static_cast<Closure*>
-      (allocInto(&static_closures_,
-                 (wordsof(ClosureHeader) + payloadSize) * sizeof(Word)));
+      (allocInto(&static_closures_, staticClosureBytes(payloadSize)));
   }
 
   inline void *allocCode(size_t instrs, size_t bitmaps) {
-    return allocInto(&bytecode_,
-                     sizeof(BcIns) * instrs + sizeof(u2) * bitmaps);
+    return allocInto(&bytecode_, codeBytes(instrs, bitmaps));
+  }
+
+  // The literals of a code object: `n` words followed by `n` type
+  // bytes.
+  inline Word *allocLiterals(size_t n) {
+    return static_cast<Word*>(allocInto(&bytecode_, literalsBytes(n)));
+  }
+
+  static inline size_t staticClosureBytes(size_t payloadSize) {
+    return (wordsof(ClosureHeader) + payloadSize) * sizeof(Word);
+  }
+  // Rounded up to whole words, so that literals can follow.
+  static inline size_t codeBytes(size_t instrs, size_t bitmaps) {
+    return roundUpBytesToWords(sizeof(BcIns) * instrs +
+                               sizeof(u2) * bitmaps) * sizeof(Word);
+  }
+  static inline size_t literalsBytes(size_t n) {
+    return roundUpBytesToWords(n * (sizeof(Word) + 1)) * sizeof(Word);
   }
 
   inline Closure *allocClosure(InfoTable *info, size_t payloadWords) {
-    Closure *cl = reinterpret_cast<Closure*>
-      (allocInto(&closures_,
-                 (wordsof(ClosureHeader) + payloadWords) * sizeof(Word)));
+    size_t bytes = (wordsof(ClosureHeader) + payloadWords) * sizeof(Word);
+    if (LC_UNLIKELY(buffer_.block_ == NULL))
+      refillNoGC(&buffer_);
+    char *ptr = buffer_.block_->alloc(bytes);
+    while (LC_UNLIKELY(ptr == NULL)) {
+      refillNoGC(&buffer_);
+      ptr = buffer_.block_->alloc(bytes);
+    }
+    countAllocation(bytes);
+    Closure *cl = reinterpret_cast<Closure*>(ptr);
     Closure::initHeader(cl, info);
     return cl;
   }
 
+  // Every buffer used for allocating closures must be registered, and
+  // must be removed again before it is destroyed.
+  void addAllocBuffer(AllocBuffer *);
+  void removeAllocBuffer(AllocBuffer *);
+
+  // Only the owner of the buffer may allocate into its block.
+  inline void getBumpAllocatorBounds(AllocBuffer *buf,
+                                     char **heap, char **heaplim) {
+    if (LC_UNLIKELY(buf->block_ == NULL))
+      refillNoGC(buf);
+    *heap = buf->block_->free();
+    *heaplim = buf->block_->end();
+    LC_ASSERT(isWordAligned(*heap));
+    LC_ASSERT(isWordAligned(*heaplim));
+  }
+
+  inline void sync(AllocBuffer *buf, char *heap, char *heaplim) {
+    Block *b = buf->block_;
+    // heaplim == NULL can happen if we want to force a thread to
+    // yield.
+    LC_ASSERT(heaplim == NULL || heaplim == b->end());
+    LC_ASSERT(b->free() <= heap && heap <= b->end());
+    countAllocation(static_cast<uint64_t>(heap - b->free()));
+    b->free_ = heap;
+  }
+
+  // Returns non-zero if GC is necessary.  If result is 0, then *heap
+  // and *heaplim point to a new block.
+  int bumpAllocatorFullNoGC(AllocBuffer *buf, char **heap, char **heaplim);
+
+  // Static data of each kind (info tables, static closures, strings
+  // and bytecode) is allocated into its own list of blocks.  Returns
+  // the block currently allocated into; older blocks follow via
+  // Block::link().
+  Block *staticBlocks(Block::Flags contents) const;
+
+  // Start new blocks for all kinds of static data, so that data
+  // allocated from now on doesn't share blocks with older data.
+  void startStaticBlocks();
+
+  // Adds the blocks of the arena to the static data and empties the
+  // arena.  Must not be called while another thread uses an arena.
+  void commitStaticArena(StaticArena *);
+
   bool looksLikeInfoTable(void *p);
   bool looksLikeClosure(void *p);
 
@@ -262,6 +455,61 @@ public:
 
   inline uint64_t allocated() const { return allocated_; }
   inline uint32_t numGCs() const { return num_gcs_; };
+  inline uint64_t numMinorGCs() const { return num_gcs_ - num_major_gcs_; }
+  inline uint64_t numMajorGCs() const { return num_major_gcs_; }
+  inline Time minorGCTime() const { return minor_gc_time_; }
+  inline Time majorGCTime() const { return major_gc_time_; }
+  inline Time maxMinorGCPause() const { return max_minor_pause_; }
+  inline Time maxMajorGCPause() const { return max_major_pause_; }
+
+  // Histogram of GC pause times.  Bucket i counts pauses of at most
+  // pauseBucketLimit(i); the last bucket has no limit (returns 0).
+  static const int kPauseBuckets = 13;
+  static Time pauseBucketLimit(int i);
+  inline uint64_t pauses(int i) const { return pauses_[i]; }
+
+  // Bytes copied into the old generation by minor GCs, and bytes
+  // copied by major GCs, respectively.
+  inline uint64_t promoted() const { return promoted_; }
+  inline uint64_t copiedMajor() const { return copied_major_; }
+
+  // Bytes of old objects marked in place by major GCs.
+  inline uint64_t markedMajor() const { return marked_major_; }
+
+  // Largest number of blocks in use (both generations) at the start
+  // of any GC.
+  inline u4 peakHeapBlocks() const { return peak_heap_blocks_; }
+
+  // Must be called after storing a pointer into a field of an
+  // existing object (i.e., not during initialisation of a freshly
+  // allocated object).  If the object has already been promoted it
+  // may now point into the nursery and must be added to the
+  // remembered set.
+  inline void writeBarrier(Closure *cl) {
+    if (LC_UNLIKELY(Region::regionFromPointer(cl)->isOldGeneration()))
+      remember(cl);
+  }
+
+  void remember(Closure *cl);
+  inline size_t rememberedSetSize() const { return remembered_.size(); }
+
+  // Performs a GC after bumpAllocatorFullNoGC returned non-zero.
+  // Besides the usual roots, the given locations are treated as
+  // roots, too.  Used to collect garbage from inside a trace.
+  void performGCWithRoots(Capability *cap, Closure ***roots, u4 nroots,
+                          char **heap, char **heaplim);
+
+  // Returns true if the GC treats the stack slot p as a root, given
+  // the stack state of a thread that is about to allocate at pc.
+  bool isStackRoot(Word *base, Word *top, const BcIns *pc, Word *p);
+
+  // Sets the number of threads used for garbage collection.  Must be
+  // called before the first GC.
+  void setGCThreads(u4 n);
+  inline u4 gcThreads() const { return gcThreads_; }
+
+  // Total number of bytes copied by the given GC thread.
+  uint64_t gcThreadCopied(u4 i) const;
 
   static const u4 kNoMask = ~0;
 
@@ -270,6 +518,7 @@ public:
   };
 
   static const u4 kDefaultGCTrigger = 2;  // blocks
+  static const u4 kMaxNurseryBlocks = 8192;  // 256MB
 
   inline bool gcInProgress() const { return nextGC_ == 0; }
 
@@ -282,8 +531,58 @@ public:
   inline void setMinHeapSize(size_t bytes) {
     minHeapSize_ = idivCeil(bytes, Block::kBlockSize);
     if (minHeapSize_ < 2) minHeapSize_ = 2;
+    if (oldGenLimit_ < minHeapSize_) oldGenLimit_ = minHeapSize_;
+    if (nurseryBlocks_ < minHeapSize_) nurseryBlocks_ = minHeapSize_;
   }
 
+  // After a major GC, the next one is triggered once the old
+  // generation has grown to this many times the size of its live
+  // data (default: 2).  Must be at least 1.
+  inline void setGrowthFactor(double factor) {
+    LC_ASSERT(factor >= 1.0);
+    growthFactor_ = factor;
+  }
+  inline double growthFactor() const { return growthFactor_; }
+
+  // If non-zero, the nursery is resized after each GC so that about
+  // this fraction of the time is spent in the GC.  The cost of a
+  // minor GC depends on the amount of live data, not the nursery
+  // size, so a bigger nursery means fewer GCs for the same work.
+  // The nursery is never smaller than the minimum heap size.
+  inline void setGCTarget(double fraction) { gcTarget_ = fraction; }
+  inline double gcTarget() const { return gcTarget_; }
+
+  // The fraction of time recently spent in the GC (smoothed over the
+  // last few GCs).
+  inline double gcOverhead() const { return gcOverhead_; }
+
+  // If set, a heap census is taken during every major GC and added
+  // to the profile.  The interpreter and JIT record allocation sites
+  // in it, too.
+  inline void setHeapProfile(HeapProfile *prof) { heapProfile_ = prof; }
+  inline HeapProfile *heapProfile() const { return heapProfile_; }
+  inline u4 nurseryBlocks() const { return nurseryBlocks_; }
+  inline u4 peakNurseryBlocks() const { return peak_nursery_blocks_; }
+
+  // If non-zero, major GCs are performed incrementally: old objects
+  // are marked in slices of about this length, each following a minor
+  // GC.  Zero means that major GCs stop the world until they're done.
+  inline void setGCSlice(Time slice) { gcSlice_ = slice; }
+  inline Time gcSlice() const { return gcSlice_; }
+  inline bool markingInProgress() const { return marking_; }
+
+  // Limit the size of the heap (nursery, old generation and large
+  // objects).  Zero means no limit.  If the heap is still too big
+  // after a major GC, the program is terminated.
+  inline void setMaxHeapSize(size_t bytes) { maxHeapSize_ = bytes; }
+
+  // Memory currently obtained from the OS (minus memory given back
+  // using madvise), and the part of it used by blocks and large
+  // objects, respectively.
+  uint64_t committedBytes() const;
+  uint64_t usedBytes() const;
+  inline uint64_t peakCommittedBytes() const { return peak_committed_; }
+
 private:
   inline void *allocInto(Block **block, size_t bytes) {
     char *ptr = (*block)->alloc(bytes);
@@ -291,55 +590,102 @@ private:
       blockFull(block);
       ptr = (*block)->alloc(bytes);
     }
-    allocated_ += bytes;
+    countAllocation(bytes);
     return ptr;
   }
 
+  // Mutator threads sync their allocation buffers concurrently.
+  inline void countAllocation(uint64_t bytes) {
+    __sync_fetch_and_add(&allocated_, bytes);
+  }
+
   inline bool isGCd(Block *block) const {
     return block->contents() == Block::kClosures;
   }
 
   friend class Capability;
 
-  // There must not be any other allocation occurring to this block.
-  inline void getBumpAllocatorBounds(char **heap, char **heaplim) {
-    *heap = closures_->free();
-    *heaplim = closures_->end();
-    LC_ASSERT(isWordAligned(*heap));
-    LC_ASSERT(isWordAligned(*heaplim));
-  }
-
-  inline void sync(char *heap, char *heaplim) {
-    // heaplim == NULL can happen if we want to force a thread to
-    // yield.
-    LC_ASSERT(heaplim == NULL || heaplim == closures_->end());
-    LC_ASSERT(closures_->free() <= heap && heap <= closures_->end());
-    allocated_ += static_cast<uint64_t>(heap - closures_->free());
-    closures_->free_ = heap;
-  }
-
   void bumpAllocatorFull(char **heap, char **heaplim, Capability *cap);
 
-  // Returns non-zero if GC is necessary.  If result is 0, then *heap
-  // and *heaplim point to a new block.
-  int bumpAllocatorFullNoGC(char **heap, char **heaplim);
+  // Gives the buffer a fresh nursery block.
+  void refill(AllocBuffer *buf);
+  // Uses up one block of the nursery.  Returns false if the nursery
+  // is full, i.e., a GC is due.
+  bool takeNurseryBlock();
+  // Refills the buffer where we cannot GC.  The block is taken even
+  // if the nursery is full, in which case the next refill that can
+  // GC will.
+  void refillNoGC(AllocBuffer *buf);
+  void resetAllocBuffers();
 
   bool markBlockReadOnly(const Block *block);
   bool markBlockReadWrite(const Block *block);
 
   Block *grabFreeBlock(Block::Flags);
+  Block *grabInfoTableBlock();
+  void arenaBlockFull(Block **, Block::Flags);
+  static void spliceStaticBlocks(Block *current, Block *blocks);
+  Block *grabOldBlock();
+  void freeBlocks(Block *);
+  void releaseFreeMemory();
+  void releaseFreeRegions(Region **regions, Block **freeList);
+  void decommitFreeBlocks(Block *freeList, Word keep);
+  uint64_t heapSize() const;
+  inline bool heapTooBig() const {
+    return maxHeapSize_ != 0 && heapSize() > maxHeapSize_;
+  }
+  void heapExhausted(uint64_t needed);
   void blockFull(Block **);
   void performGC(Capability *cap);
-  void scavengeStack(Word *base, Word *top, const BcIns *pc);
-  void scavengeFrame(Word *base, Word *top, const u2 *bitmask);
-  void scavengeBlock(Block *);
-  void scavengeStaticRoots(Closure *);
+  void performMinorGC(Capability *cap);
+  void performMajorGC(Capability *cap);
+  void finishMajorGC();
+  void takeCensus();
+  void resizeNursery(Time gcStart, Time gcEnd);
+  void startMarking();
+  bool markSlice(Time deadline, uint64_t minBytes);
+  void scavengeStack(GCWorker *, Word *base, Word *top, const BcIns *pc);
+  void scavengeFrame(GCWorker *, Word *base, Word *top, const u2 *bitmask);
+  void scavengeRange(GCWorker *, char *start, char *end);
+  u4 scavengeClosure(GCWorker *, Closure *);
+  void scavengeRememberedSet(GCWorker *);
+  void scavengeStaticRoots(GCWorker *, Closure *);
+  void scavengeExtraRoots(GCWorker *);
   void scavengeLarge();
   void sweepLargeObjects();
 
   Closure *allocLarge(Word nbytes);
-  void evacuate(Closure **);
+  LargeObject *allocLargeFromFreeList(Word chunkBytes);
+  LargeObject *allocLargeFromRegion(Word chunkBytes);
+  void evacuate(GCWorker *, Closure **);
   void evacuateLarge(Closure *);
+  void copy(GCWorker *, Closure **src, InfoTable *info, u4 payloadSize);
+  void copyFirstChildren(GCWorker *, Closure *);
+
+  // Mark-region old generation.  See the comment above performGC.
+  void markObject(GCWorker *, Closure *);
+  void markLines(char *from, char *to);
+  bool findHole(Block *, char *from, size_t bytes,
+                char **start, char **end);
+  Word usedLines(Block *);
+  void selectEvacuationCandidates();
+  void clearMarks();
+  void sweepOldBlocks();
+
+  // Parallel collection.  See the comment above performGC.
+  GCWorker *beginCollection();
+  void endCollection(uint64_t *copied, uint64_t *marked);
+  char *gcAlloc(GCWorker *, size_t bytes);
+  void gcNextHole(GCWorker *, size_t bytes);
+  void gcCloseHole(GCWorker *);
+  Block *gcTakeBlock();
+  void scavengeToSpace();
+  void scavengeLoop(GCWorker *);
+  bool stealRange(GCWorker *, char **start, char **end);
+  bool anyStealableRanges();
+  void startGCThreads();
+  void stopGCThreads();
+  static void *gcThreadMain(void *);
 
 # define SEEN_SET_TYPE HASH_NAMESPACE::HASH_SET_CLASS<void*>
 
@@ -356,22 +702,76 @@ private:
   void endAllocInfoTable();
 
   Region *region_;
+  Region *oldRegion_;
   Region *largeObjectRegion_;
   Block *free_;
+  Block *oldFree_;
   Block *info_tables_;
   Block *static_closures_;
-  Block *closures_;
+  Block *closures_;  // The nursery, i.e., all blocks given to buffers.
   Block *strings_;
   Block *bytecode_;
   Block *old_heap_; // Only non-NULL during GC
+  AllocBuffer buffer_;  // Used by allocClosure.
+  AllocBuffer *allocBuffers_;
+  // Protects allocBuffers_ and the list of regions.  Free blocks are
+  // taken from free_ without a lock.
+  pthread_mutex_t allocLock_;
+
+  // All blocks of the old generation (linked via link_), and those
+  // that had free lines after the last major GC.  Minor GCs promote
+  // into the free lines of the latter.
+  Block *oldBlocks_;
+  std::vector<Block *> recyclable_;
+  u4 oldGenBlocks_;
+  u4 oldGenLimit_;  // A major GC is triggered if exceeded.
+  bool majorGC_;    // If false, evacuate leaves old objects alone.
+  bool marking_;    // An incremental major GC is in progress.
+  Time gcSlice_;
+  // Old objects marked during incremental marking, but not scanned.
+  std::vector<Closure *> greyStack_;
+  std::vector<Closure *> remembered_;
+  HeapProfile *heapProfile_;
+  Closure ***extraRoots_;  // See performGCWithRoots.
+  u4 numExtraRoots_;
+
+  u4 gcThreads_;
+  GCWorker **workers_;      // gcThreads_ entries, allocated on first GC.
+  pthread_t *threads_;      // Helper threads (workers_[1..]).
+  pthread_mutex_t gcLock_;  // Protects block and large object lists
+                            // during parallel GC.
+  pthread_cond_t gcStart_;
+  pthread_cond_t gcDone_;
+  u4 gcEpoch_;
+  u4 gcThreadsDone_;
+  bool gcShutdown_;
+  volatile int idleWorkers_;
+
   u4 topOfStackMask_;
   int beginAllocInfoTableLevel_;
   LargeObject *largeObjects_;
   LargeObject *evacuatedLargeObjects_;
   LargeObject *scavengedLargeObjects_;
-  LargeObject *freeLargeRegions_;
+
+  // Free chunks of large object regions, segregated by size.  Bin i
+  // holds chunks of size [2^i, 2^(i+1)) bytes (including the
+  // LargeObject header).
+  static const int kLargeObjectBins = 8 * sizeof(Word);
+  LargeObject *freeLargeObjects_[kLargeObjectBins];
+  // Bytes allocated in large objects since the last major GC.
+  Word largeAllocated_;
+  // Bytes in live large objects (as of the last major GC) plus those
+  // allocated since.
+  Word largeLive_;
 
   uint64_t minHeapSize_;  // in blocks
+  size_t maxHeapSize_;    // in bytes, 0 = unlimited
+  u4 nurseryBlocks_;      // A minor GC happens after this many blocks.
+  double growthFactor_;
+  double gcTarget_;       // 0 = fixed nursery size
+  double gcOverhead_;
+  Time lastGCEnd_;
+  u4 decommittedBlocks_;
   u4 nextGC_;  // if zero, a GC gets triggered.
 
   // Assuming an allocation rate of 16GB/s (pretty high), this counter
@@ -379,8 +779,80 @@ private:
   // to be fine for now (it's for statistical purposes only).
   uint64_t allocated_;
   uint64_t num_gcs_;
+  uint64_t num_major_gcs_;
+  uint64_t promoted_;
+  uint64_t copied_major_;
+  uint64_t marked_major_;
+  u4 peak_heap_blocks_;
+  u4 peak_nursery_blocks_;
+  uint64_t peak_committed_;
+  Time minor_gc_time_;
+  Time major_gc_time_;
+  Time max_minor_pause_;
+  Time max_major_pause_;
+  uint64_t pauses_[kPauseBuckets];
 
   friend class AllocInfoTableHandle;
+  friend class StaticArena;
+  friend class GCTest;  // In unittest.cc
+};
+
+// Allocates static data for a thread other than the one that uses
+// the memory manager, e.g., a loader thread.  Any number of arenas
+// may be used in parallel, but each one only by a single thread.
+// Info tables stay writable until the arena is committed.
+class StaticArena
+{
+public:
+  StaticArena(MemoryManager *mm)
+    : mm_(mm), infoTables_(NULL), staticClosures_(NULL),
+      strings_(NULL), bytecode_(NULL), allocated_(0) {}
+  // All data must have been committed.
+  ~StaticArena();
+
+  inline InfoTable *allocInfoTable(Word nwords) {
+    return static_cast<InfoTable *>
+      (allocInto(&infoTables_, Block::kInfoTables, nwords * sizeof(Word)));
+  }
+  inline char *allocString(size_t length) {
+    return static_cast<char *>
+      (allocInto(&strings_, Block::kStrings, length + 1));
+  }
+  inline Closure *allocStaticClosure(size_t payloadSize) {
+    return static_cast<Closure *>
+      (allocInto(&staticClosures_, Block::kStaticClosures,
+                 MemoryManager::staticClosureBytes(payloadSize)));
+  }
+  inline void *allocCode(size_t instrs, size_t bitmaps) {
+    return allocInto(&bytecode_, Block::kBytecode,
+                     MemoryManager::codeBytes(instrs, bitmaps));
+  }
+  inline Word *allocLiterals(size_t n) {
+    return static_cast<Word *>
+      (allocInto(&bytecode_, Block::kBytecode,
+                 MemoryManager::literalsBytes(n)));
+  }
+
+private:
+  inline void *allocInto(Block **block, Block::Flags kind, size_t bytes) {
+    char *ptr = *block != NULL ? (*block)->alloc(bytes) : NULL;
+    while (LC_UNLIKELY(ptr == NULL)) {
+      mm_->arenaBlockFull(block, kind);
+      ptr = (*block)->alloc(bytes);
+    }
+    __sync_fetch_and_add(&allocated_, (uint64_t)bytes);
+    return ptr;
+  }
+
+  MemoryManager *mm_;
+  // Most recent block first, as in the memory manager.
+  Block *infoTables_;
+  Block *staticClosures_;
+  Block *strings_;
+  Block *bytecode_;
+  uint64_t allocated_;
+
+  friend class MemoryManager;
 };
 
 // Utility to avoid lots of system calls during load time.
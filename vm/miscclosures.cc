@@ -20,6 +20,12 @@ InfoTable **MiscClosures::smallApInfos = NULL;
 APMAP *MiscClosures::otherApInfos = NULL;
 Closure *MiscClosures::stg_BLACKHOLE_closure_addr = NULL;
 InfoTable *MiscClosures::stg_BYTEARR_info = NULL;
+InfoTable *MiscClosures::stg_Izh_info = NULL;
+InfoTable *MiscClosures::stg_Czh_info = NULL;
+Closure **MiscClosures::intLikeClosures = NULL;
+Closure **MiscClosures::charLikeClosures = NULL;
+HASH_MAP_CLASS<const InfoTable *, Closure *>
+  *MiscClosures::nullaryClosures = NULL;
 
 void MiscClosures::initStopClosure(MemoryManager &mm) {
   AllocInfoTableHandle hdl(mm);
@@ -400,6 +406,195 @@ InfoTable *MiscClosures::getApInfo(u4 nargs, u4 pointerMask) {
   }
 }
 
+Closure **MiscClosures::buildSmallBoxes(MemoryManager *mm, InfoTable *info,
+                                        WordInt from, WordInt to) {
+  Closure **closures = new Closure*[to - from + 1];
+  for (WordInt n = from; n <= to; ++n) {
+    Closure *cl = mm->allocStaticClosure(1);
+    cl->setInfo(info);
+    cl->setPayload(0, (Word)n);
+    closures[n - from] = cl;
+  }
+  return closures;
+}
+
+void MiscClosures::initSmallBoxes(MemoryManager *mm, InfoTable *izh,
+                                  InfoTable *czh) {
+  LC_ASSERT(izh->type() == CONSTR && izh->size() == 1);
+  LC_ASSERT(czh->type() == CONSTR && czh->size() == 1);
+  intLikeClosures = buildSmallBoxes(mm, izh, kMinIntLike, kMaxIntLike);
+  charLikeClosures = buildSmallBoxes(mm, czh, 0, (WordInt)kMaxCharLike);
+  stg_Izh_info = izh;
+  stg_Czh_info = czh;
+}
+
+void MiscClosures::addNullaryClosure(Closure *cl) {
+  LC_ASSERT(cl->info()->type() == CONSTR && cl->info()->size() == 0);
+  if (nullaryClosures == NULL)
+    nullaryClosures = new HASH_MAP_CLASS<const InfoTable *, Closure *>();
+  (*nullaryClosures)[cl->info()] = cl;
+}
+
+Closure *MiscClosures::nullaryClosure(const InfoTable *info) {
+  if (nullaryClosures == NULL)
+    return NULL;
+  HASH_MAP_CLASS<const InfoTable *, Closure *>::const_iterator it =
+    nullaryClosures->find(info);
+  return it != nullaryClosures->end() ? it->second : NULL;
+}
+
+bool MiscClosures::fromApContIndex(u4 index, u4 *nargs, u4 *pointerMask) {
+  u4 n = 1;
+  while (n <= 8 && apContIndex(n + 1, 0) <= index)
+    ++n;
+  if (n > 8)  // See buildApCont.
+    return false;
+  *nargs = n;
+  *pointerMask = index - apContIndex(n, 0);
+  return true;
+}
+
+InfoTable *MiscClosures::fixedInfoTable(u4 kind) {
+  switch (kind) {
+  case kSymSTOP: return stg_STOP_closure_addr->info();
+  case kSymBLACKHOLE: return stg_BLACKHOLE_closure_addr->info();
+  case kSymUPD: return stg_UPD_closure_addr->info();
+  case kSymIND: return stg_IND_info;
+  case kSymPAP: return stg_PAP_info;
+  case kSymBYTEARR: return stg_BYTEARR_info;
+  default: return NULL;
+  }
+}
+
+bool MiscClosures::symbolOf(const InfoTable *info, u4 *sym) {
+  for (u4 kind = kSymSTOP; kind <= kSymBYTEARR; ++kind) {
+    if (fixedInfoTable(kind) == info) {
+      *sym = symbol(kind, 0);
+      return true;
+    }
+  }
+  u4 nsmall = apContIndex(kMaxSmallArity + 1, 0);
+  for (u4 i = 0; i < nsmall; ++i) {
+    if (smallApConts[i].closure->info() == info) {
+      *sym = symbol(kSymApCont, i);
+      return true;
+    }
+    if (smallApInfos[i] == info) {
+      *sym = symbol(kSymApInfo, i);
+      return true;
+    }
+  }
+  for (APKMAP::const_iterator it = otherApConts->begin();
+       it != otherApConts->end(); ++it) {
+    if (it->second.closure->info() == info) {
+      *sym = symbol(kSymApCont, it->first);
+      return true;
+    }
+  }
+  for (APMAP::const_iterator it = otherApInfos->begin();
+       it != otherApInfos->end(); ++it) {
+    if (it->second == info) {
+      *sym = symbol(kSymApInfo, it->first);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool MiscClosures::symbolOf(const Closure *cl, u4 *sym) {
+  const InfoTable *info = cl->info();
+  if (cl == stg_STOP_closure_addr || cl == stg_BLACKHOLE_closure_addr ||
+      cl == stg_UPD_closure_addr)
+    return symbolOf(info, sym);
+  if (info != NULL && info->type() == AP_CONT) {
+    // There is exactly one closure per continuation info table.
+    return symbolOf(info, sym);
+  }
+  if (info == stg_Izh_info && intLike((WordInt)cl->payload(0)) == cl) {
+    *sym = symbol(kSymIntLike, (u4)((WordInt)cl->payload(0) - kMinIntLike));
+    return true;
+  }
+  if (info == stg_Czh_info && charLike(cl->payload(0)) == cl) {
+    *sym = symbol(kSymCharLike, (u4)cl->payload(0));
+    return true;
+  }
+  return false;
+}
+
+InfoTable *MiscClosures::infoTableFor(u4 sym) {
+  u4 kind = sym >> 16, index = sym & 0xffff;
+  u4 nargs, pointerMask;
+  if (kind <= kSymBYTEARR)
+    return index == 0 ? fixedInfoTable(kind) : NULL;
+  if (kind == kSymApCont) {
+    Closure *cl = closureFor(sym);
+    return cl != NULL ? cl->info() : NULL;
+  }
+  if (kind == kSymApInfo && fromApContIndex(index, &nargs, &pointerMask))
+    return getApInfo(nargs, pointerMask);
+  return NULL;
+}
+
+Closure *MiscClosures::closureFor(u4 sym) {
+  u4 kind = sym >> 16, index = sym & 0xffff;
+  u4 nargs, pointerMask;
+  switch (kind) {
+  case kSymSTOP:
+    return index == 0 ? stg_STOP_closure_addr : NULL;
+  case kSymBLACKHOLE:
+    return index == 0 ? stg_BLACKHOLE_closure_addr : NULL;
+  case kSymUPD:
+    return index == 0 ? stg_UPD_closure_addr : NULL;
+  case kSymApCont:
+    if (fromApContIndex(index, &nargs, &pointerMask)) {
+      Closure *cl;
+      BcIns *returnAddr;
+      getApCont(&cl, &returnAddr, nargs, pointerMask);
+      return cl;
+    }
+    return NULL;
+  case kSymIntLike:
+    return intLike((WordInt)index + kMinIntLike);
+  case kSymCharLike:
+    return charLike(index);
+  default:
+    return NULL;
+  }
+}
+
+static inline bool codeContains(const InfoTable *info, const BcIns *pc) {
+  if (info == NULL || !info->hasCode())
+    return false;
+  const Code *code = static_cast<const CodeInfoTable *>(info)->code();
+  return code->code <= pc && pc < code->code + code->sizecode;
+}
+
+const CodeInfoTable *MiscClosures::codeInfoTableContaining(const BcIns *pc) {
+  const InfoTable *found = NULL;
+  for (u4 kind = kSymSTOP; kind <= kSymBYTEARR && !found; ++kind) {
+    if (codeContains(fixedInfoTable(kind), pc))
+      found = fixedInfoTable(kind);
+  }
+  u4 nsmall = apContIndex(kMaxSmallArity + 1, 0);
+  for (u4 i = 0; i < nsmall && !found; ++i) {
+    if (codeContains(smallApConts[i].closure->info(), pc))
+      found = smallApConts[i].closure->info();
+    else if (codeContains(smallApInfos[i], pc))
+      found = smallApInfos[i];
+  }
+  for (APKMAP::const_iterator it = otherApConts->begin();
+       it != otherApConts->end() && !found; ++it) {
+    if (codeContains(it->second.closure->info(), pc))
+      found = it->second.closure->info();
+  }
+  for (APMAP::const_iterator it = otherApInfos->begin();
+       it != otherApInfos->end() && !found; ++it) {
+    if (codeContains(it->second, pc))
+      found = it->second;
+  }
+  return static_cast<const CodeInfoTable *>(found);
+}
+
 void MiscClosures::init(MemoryManager *mm) {
   AllocInfoTableHandle h(*mm); // Prevent lots of mprotect calls
   MiscClosures::initStopClosure(*mm);
@@ -428,6 +623,14 @@ void MiscClosures::reset() {
   delete MiscClosures::otherApInfos;
   MiscClosures::smallApInfos = NULL;
   MiscClosures::otherApInfos = NULL;
+  MiscClosures::stg_Izh_info = NULL;
+  MiscClosures::stg_Czh_info = NULL;
+  delete[] MiscClosures::intLikeClosures;
+  delete[] MiscClosures::charLikeClosures;
+  delete MiscClosures::nullaryClosures;
+  MiscClosures::intLikeClosures = NULL;
+  MiscClosures::charLikeClosures = NULL;
+  MiscClosures::nullaryClosures = NULL;
 }
 
 _END_LAMBDACHINE_NAMESPACE
@@ -40,6 +40,66 @@ public:
 
   static InfoTable *stg_BYTEARR_info;
 
+  /// Shared static closures for small boxed Ints and Chars (like
+  /// GHC's INTLIKE and CHARLIKE closures) and for nullary
+  /// constructors.  The interpreter uses them instead of allocating,
+  /// and the GC replaces heap objects equal to one of them when it
+  /// evacuates them.  The loader sets them up once GHC.Types has
+  /// been loaded; until then, all lookups return NULL.
+  static const WordInt kMinIntLike = -16;
+  static const WordInt kMaxIntLike = 255;
+  static const Word kMaxCharLike = 255;
+
+  static InfoTable *stg_Izh_info;  // GHC.Types.I#
+  static InfoTable *stg_Czh_info;  // GHC.Types.C#
+
+  static void initSmallBoxes(MemoryManager *mm, InfoTable *izh,
+                             InfoTable *czh);
+  static void addNullaryClosure(Closure *cl);
+
+  static inline Closure *intLike(WordInt n) {
+    return (intLikeClosures != NULL && kMinIntLike <= n && n <= kMaxIntLike)
+      ? intLikeClosures[n - kMinIntLike] : NULL;
+  }
+  static inline Closure *charLike(Word c) {
+    return (charLikeClosures != NULL && c <= kMaxCharLike)
+      ? charLikeClosures[c] : NULL;
+  }
+
+  /// Returns the shared static closure for the constructor with the
+  /// given info table and payload, or NULL if there is none.
+  static inline Closure *sharedClosure(const InfoTable *info,
+                                       const Word *payload) {
+    if (info->size() == 0)
+      return nullaryClosure(info);
+    return sharedBox(info, payload[0]);
+  }
+
+  /// Like sharedClosure, for constructors with a single field.  Only
+  /// compares the info table pointer, so it works for any pointer.
+  static inline Closure *sharedBox(const InfoTable *info, Word value) {
+    if (info == stg_Izh_info)
+      return intLike((WordInt)value);
+    if (info == stg_Czh_info)
+      return charLike(value);
+    return NULL;
+  }
+
+  /// Stable names for the info tables and closures built here, whose
+  /// addresses differ from run to run (see TraceCache).  Returns
+  /// false if the object was not built here.
+  static bool symbolOf(const InfoTable *info, u4 *sym /* out */);
+  static bool symbolOf(const Closure *cl, u4 *sym /* out */);
+
+  /// The inverses of symbolOf.  Application continuations and infos
+  /// are built on demand.  Return NULL for invalid symbols.
+  static InfoTable *infoTableFor(u4 sym);
+  static Closure *closureFor(u4 sym);
+
+  /// Find the info table built here whose bytecode contains the
+  /// given PC.  Returns NULL if there is none.
+  static const CodeInfoTable *codeInfoTableContaining(const BcIns *pc);
+
 private:
   typedef struct {
     Closure *closure;
@@ -56,10 +116,28 @@ private:
   static MemoryManager *allocMM;
   static InfoTable **smallApInfos;
   static APMAP *otherApInfos;
+  static Closure **intLikeClosures;
+  static Closure **charLikeClosures;
+  static HASH_NAMESPACE::HASH_MAP_CLASS<const InfoTable *, Closure *>
+    *nullaryClosures;
+
+  static Closure *nullaryClosure(const InfoTable *info);
+  static Closure **buildSmallBoxes(MemoryManager *mm, InfoTable *info,
+                                   WordInt from, WordInt to);
 
   static inline u4 apContIndex(u4 nargs, u4 pointerMask) {
     return (1u << nargs) - 2 + pointerMask;
   }
+  static bool fromApContIndex(u4 index, u4 *nargs, u4 *pointerMask);
+
+  // A symbol is (kind << 16) | index.  The first kinds name the
+  // fixed info tables (and their closures) with index 0.
+  enum {
+    kSymSTOP, kSymBLACKHOLE, kSymUPD, kSymIND, kSymPAP, kSymBYTEARR,
+    kSymApCont, kSymApInfo, kSymIntLike, kSymCharLike
+  };
+  static inline u4 symbol(u4 kind, u4 index) { return (kind << 16) | index; }
+  static InfoTable *fixedInfoTable(u4 kind);
   static void initStopClosure(MemoryManager &mm);
   static void initBlackholeClosure(MemoryManager &mm);
   static void initUpdateClosure(MemoryManager &mm);
@@ -210,6 +210,10 @@ public:
   inline bool getMark() const { return flags_ & 1; }
   inline void setMark() { flags_ |= 1L; }
   inline void clearMark() { flags_ &= ~1L; }
+
+  // A free chunk of a large object region.
+  inline bool isFree() const { return flags_ & 2; }
+  inline void setFree() { flags_ = 2L; }
 } LargeObject;
 
 inline Closure *
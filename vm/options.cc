@@ -1,6 +1,7 @@
 #include "options.hh"
 #include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 #include <limits.h>
 
@@ -9,7 +10,20 @@ _START_LAMBDACHINE_NAMESPACE
 typedef enum {
   OPT_PRINT_LOADER_STATE = 0x1000,
   OPT_TRACE_INTERPRETER,
-  OPT_PRINT_STATS
+  OPT_PRINT_STATS,
+  OPT_MAX_MCODE,
+  OPT_TRACE_CACHE,
+  OPT_GC_THREADS,
+  OPT_MAX_HEAP,
+  OPT_GC_SLICE,
+  OPT_GC_TARGET,
+  OPT_HEAP_PROFILE,
+  OPT_IMAGE,
+  OPT_SAVE_IMAGE,
+  OPT_HUGE_PAGES,
+  OPT_NUMA,
+  OPT_LOADER_THREADS,
+  OPT_LINK
 } OptionFlags;
 
 #define MAX_CLOSURE_NAME_LEN 512
@@ -24,7 +38,18 @@ Options::Options()
     traceInterpreter_(false),
     printStats_(false),
     enableAsm_(1),
-    stackSize_(MIN_STACK_SIZE)
+    stackSize_(MIN_STACK_SIZE),
+    maxMachineCode_(0),
+    gcThreads_(1),
+    loaderThreads_(1),
+    maxHeapSize_(0),
+    gcSlice_(0),
+    gcGrowthFactor_(2.0),
+    gcTarget_(0),
+    heapProfile_(false),
+    link_(false),
+    hugePages_(false),
+    numa_(false)
 {
 }
 
@@ -50,12 +75,26 @@ Options *OptionParser::parse(int argc, char *argv[]) {
     {"stack",              required_argument, 0, 's'},
     {"trace",              no_argument, NULL, OPT_TRACE_INTERPRETER},
     {"print-stats",        no_argument, NULL, OPT_PRINT_STATS},
+    {"max-mcode",          required_argument, NULL, OPT_MAX_MCODE},
+    {"trace-cache",        required_argument, NULL, OPT_TRACE_CACHE},
+    {"gc-threads",         required_argument, NULL, OPT_GC_THREADS},
+    {"max-heap",           required_argument, NULL, OPT_MAX_HEAP},
+    {"gc-slice",           required_argument, NULL, OPT_GC_SLICE},
+    {"gc-factor",          required_argument, NULL, 'F'},
+    {"gc-target",          required_argument, NULL, OPT_GC_TARGET},
+    {"heap-profile",       optional_argument, NULL, OPT_HEAP_PROFILE},
+    {"image",              required_argument, NULL, OPT_IMAGE},
+    {"save-image",         required_argument, NULL, OPT_SAVE_IMAGE},
+    {"link",               optional_argument, NULL, OPT_LINK},
+    {"huge-pages",         no_argument, NULL, OPT_HUGE_PAGES},
+    {"numa",               no_argument, NULL, OPT_NUMA},
+    {"loader-threads",     required_argument, NULL, OPT_LOADER_THREADS},
     {0, 0, 0, 0}
   };
 
   while (1) {
     int option_index = 0;
-    c = getopt_long(argc, argv, "he:B:O:", long_options, &option_index);
+    c = getopt_long(argc, argv, "he:B:O:F:", long_options, &option_index);
 
     if (c == -1)
       break;
@@ -93,6 +132,82 @@ Options *OptionParser::parse(int argc, char *argv[]) {
         opts()->stackSize_ = MIN_STACK_SIZE;
       }
       break;
+    case OPT_MAX_MCODE:
+      opts()->maxMachineCode_ = parseMemorySize(optarg);
+      if (opts()->maxMachineCode_ < 0) {
+        fprintf(stderr, "Could not parse machine code limit.  Using default.\n");
+        opts()->maxMachineCode_ = 0;
+      }
+      break;
+    case OPT_TRACE_CACHE:
+      opts()->traceCacheDir_ = optarg;
+      break;
+    case OPT_GC_THREADS:
+      opts()->gcThreads_ = atoi(optarg);
+      if (opts()->gcThreads_ < 1) {
+        fprintf(stderr, "Invalid number of GC threads.  Using 1.\n");
+        opts()->gcThreads_ = 1;
+      }
+      break;
+    case OPT_MAX_HEAP:
+      opts()->maxHeapSize_ = parseMemorySize(optarg);
+      if (opts()->maxHeapSize_ < 0) {
+        fprintf(stderr, "Could not parse heap size limit.  Using default.\n");
+        opts()->maxHeapSize_ = 0;
+      }
+      break;
+    case OPT_GC_SLICE:
+      opts()->gcSlice_ = atof(optarg);
+      if (opts()->gcSlice_ < 0) {
+        fprintf(stderr, "Invalid GC time slice.  Using 0.\n");
+        opts()->gcSlice_ = 0;
+      }
+      break;
+    case 'F':
+      opts()->gcGrowthFactor_ = atof(optarg);
+      if (opts()->gcGrowthFactor_ < 1) {
+        fprintf(stderr, "Invalid heap growth factor.  Using 2.\n");
+        opts()->gcGrowthFactor_ = 2.0;
+      }
+      break;
+    case OPT_HEAP_PROFILE:
+      opts()->heapProfile_ = true;
+      if (optarg != NULL) {
+        opts()->heapProfileFile_ = optarg;
+      }
+      break;
+    case OPT_IMAGE:
+      opts()->image_ = optarg;
+      break;
+    case OPT_SAVE_IMAGE:
+      opts()->saveImage_ = optarg;
+      break;
+    case OPT_LINK:
+      opts()->link_ = true;
+      if (optarg != NULL) {
+        opts()->linkFile_ = optarg;
+      }
+      break;
+    case OPT_HUGE_PAGES:
+      opts()->hugePages_ = true;
+      break;
+    case OPT_NUMA:
+      opts()->numa_ = true;
+      break;
+    case OPT_LOADER_THREADS:
+      opts()->loaderThreads_ = atoi(optarg);
+      if (opts()->loaderThreads_ < 1) {
+        fprintf(stderr, "Invalid number of loader threads.  Using 1.\n");
+        opts()->loaderThreads_ = 1;
+      }
+      break;
+    case OPT_GC_TARGET:
+      opts()->gcTarget_ = atof(optarg);
+      if (opts()->gcTarget_ < 0 || opts()->gcTarget_ >= 100) {
+        fprintf(stderr, "Invalid GC overhead target.  Using 0.\n");
+        opts()->gcTarget_ = 0;
+      }
+      break;
       // case 'S':
       //   opts()->step_opts = optarg;
       //   break;
@@ -120,6 +235,42 @@ Options *OptionParser::parse(int argc, char *argv[]) {
              "  -B --base       Set loader base dir (default: cwd).\n"
              "                  Separate multiple paths with \":\""
              "     --stack=SIZE Specify the stack size in bytes, valid units are K,M,b,G.\n"
+             "     --max-mcode=SIZE\n"
+             "                  Limit the size of compiled code.  All traces are\n"
+             "                  discarded when the limit is reached.\n"
+             "     --trace-cache=DIR\n"
+             "                  Keep the IR of compiled root traces in DIR and\n"
+             "                  assemble it when the next run starts.\n"
+             "     --gc-threads=N\n"
+             "                  Use N threads for garbage collection (default: 1).\n"
+             "     --max-heap=SIZE\n"
+             "                  Limit the heap size (default: unlimited).\n"
+             "     --gc-slice=MS\n"
+             "                  Do major GCs incrementally, pausing for about MS\n"
+             "                  milliseconds at a time (default: 0, don't).\n"
+             "  -F --gc-factor=F\n"
+             "                  Do a major GC when the old generation has grown\n"
+             "                  to F times its live size (default: 2).\n"
+             "     --gc-target=PCT\n"
+             "                  Resize the nursery to spend about PCT percent of\n"
+             "                  the time in the GC (default: 0, fixed size).\n"
+             "     --heap-profile[=FILE]\n"
+             "                  Write a heap census after each major GC to FILE\n"
+             "                  (default: MODULE.hp) and allocation sites to\n"
+             "                  FILE.alloc.\n"
+             "     --image=FILE Map the modules in the image FILE instead of\n"
+             "                  loading them.  Other modules are loaded as usual.\n"
+             "     --save-image=FILE\n"
+             "                  Save all modules to the image FILE after loading.\n"
+             "     --link[=FILE]\n"
+             "                  Load the program, save it to the image FILE\n"
+             "                  (default: MODULE.lcimg) and exit without running it.\n"
+             "     --huge-pages Back the heap and machine code with transparent\n"
+             "                  huge pages if the OS supports them.\n"
+             "     --numa       Place heap memory on the NUMA node of the thread\n"
+             "                  that allocates it.\n"
+             "     --loader-threads=N\n"
+             "                  Decode modules on N threads (default: 1).\n"
              "\n",
              argv[0]);
       res = NULL;
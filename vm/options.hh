@@ -15,6 +15,24 @@ public:
   inline const std::string entry() const { return entry_; }
   inline const std::string basePath() const { return basePath_; }
   inline long stackSize() const { return stackSize_; }
+  inline long maxMachineCode() const { return maxMachineCode_; }
+  inline const std::string traceCacheDir() const { return traceCacheDir_; }
+  inline int gcThreads() const { return gcThreads_; }
+  inline int loaderThreads() const { return loaderThreads_; }
+  inline long maxHeapSize() const { return maxHeapSize_; }
+  inline double gcSlice() const { return gcSlice_; }
+  inline double gcGrowthFactor() const { return gcGrowthFactor_; }
+  inline double gcTarget() const { return gcTarget_; }
+  inline bool heapProfile() const { return heapProfile_; }
+  inline const std::string heapProfileFile() const {
+    return heapProfileFile_;
+  }
+  inline const std::string image() const { return image_; }
+  inline const std::string saveImage() const { return saveImage_; }
+  inline bool link() const { return link_; }
+  inline const std::string linkFile() const { return linkFile_; }
+  inline bool hugePages() const { return hugePages_; }
+  inline bool numa() const { return numa_; }
   inline bool printLoaderState() const { return printLoaderState_; }
   inline bool printStats() const { return printStats_; }
   inline bool traceInterpreter() const { return traceInterpreter_; }
@@ -33,6 +51,22 @@ private:
   std::string printLoaderStateFile_;
   int enableAsm_;
   long stackSize_;
+  long maxMachineCode_;
+  std::string traceCacheDir_;
+  int gcThreads_;
+  int loaderThreads_;
+  long maxHeapSize_;
+  double gcSlice_;  // in milliseconds
+  double gcGrowthFactor_;
+  double gcTarget_;  // in percent, 0 = fixed nursery size
+  bool heapProfile_;
+  std::string heapProfileFile_;
+  std::string image_;
+  std::string saveImage_;
+  bool link_;
+  std::string linkFile_;
+  bool hugePages_;
+  bool numa_;
 
   friend class OptionParser;
 };
@@ -0,0 +1,745 @@
+#include "tracecache.hh"
+#include "loader.hh"
+#include "miscclosures.hh"
+#include "jit.hh"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+_START_LAMBDACHINE_NAMESPACE
+
+using namespace std;
+
+#define TRACE_CACHE_MAGIC "lambdachine-trace-cache 1"
+
+static const uint32_t kFnvInit = 0x811c9dc5;
+
+static inline uint32_t fnv(uint32_t hval, uint32_t data, int bytes) {
+  for (int b = 0; b < bytes; ++b) {
+    hval ^= (data >> (b * 8)) & 0xff;
+    hval *= 0x01000193;
+  }
+  return hval;
+}
+
+static uint32_t fnvString(uint32_t hval, const char *s, size_t len) {
+  for (size_t i = 0; i < len; ++i)
+    hval = fnv(hval, (uint8_t)s[i], 1);
+  return hval;
+}
+
+static uint32_t fileHash(const char *path) {
+  ifstream in(path, ios_base::in | ios_base::binary);
+  uint32_t hval = kFnvInit;
+  char buf[4096];
+  while (in.read(buf, sizeof(buf)) || in.gcount() > 0)
+    hval = fnvString(hval, buf, in.gcount());
+  return hval;
+}
+
+// Names are written as a single word.
+static bool isSymbolName(const char *name) {
+  if (*name == '\0')
+    return false;
+  for (; *name != '\0'; ++name) {
+    if (isspace((unsigned char)*name))
+      return false;
+  }
+  return true;
+}
+
+static inline bool isPointerType(IRType ty) {
+  return ty == IRT_CLOS || ty == IRT_INFO || ty == IRT_PC || ty == IRT_PTR;
+}
+
+static string startLine(const string &text) {
+  size_t start = text.find("\nstart ");
+  if (start == string::npos)
+    return string();
+  size_t end = text.find('\n', start + 1);
+  return text.substr(start + 1, end - start - 1);
+}
+
+TraceCache::TraceCache(const char *dir, const char *module, Loader *loader)
+  : path_(dir), moduleHash_(0), loader_(loader), loaded_(0), hits_(0),
+    stale_(0), added_(0), uncacheable_(0) {
+  if (!path_.empty() && path_[path_.size() - 1] != '/')
+    path_ += '/';
+  path_ += module;
+  path_ += ".lctrace";
+  // A module loaded from an image need not exist as a file.  Traces
+  // are still checked against all the code they use.
+  if (loader->image() == NULL) {
+    char *file = loader->findModule(module);
+    if (file != NULL) {
+      moduleHash_ = fileHash(file);
+      delete[] file;
+    }
+  }
+}
+
+uint32_t TraceCache::codeHash(const Code *code) {
+  uint32_t hval = kFnvInit;
+  for (u2 i = 0; i < code->sizecode; ++i) {
+    BcIns ins = code->code[i];
+    // The JIT overwrites the first instruction of a root trace with
+    // JFUNC.  Other words in the code (e.g., bitmap offsets) may look
+    // like a JFUNC, too.
+    if (ins.opcode() == BcIns::kJFUNC && ins.d() < Jit::numFragments() &&
+        Jit::traceById(ins.d())->startPc() == &code->code[i])
+      ins = Jit::traceById(ins.d())->startIns();
+    hval = fnv(hval, ins.raw(), 4);
+  }
+  return hval;
+}
+
+uint32_t TraceCache::infoHash(const InfoTable *info) {
+  uint32_t hval = fnv(kFnvInit, info->type(), 1);
+  hval = fnv(hval, info->size(), 4);
+  hval = fnv(hval, info->layout().bitmap, 4);
+  if (info->name() != NULL)
+    hval = fnvString(hval, info->name(), strlen(info->name()));
+  if (info->hasCode())
+    hval = fnv(hval,
+               codeHash(static_cast<const CodeInfoTable *>(info)->code()), 4);
+  return hval;
+}
+
+void TraceCache::load(Jit *jit) {
+  ifstream in(path_.c_str());
+  if (!in.good())
+    return;  // First run.
+
+  string line;
+  if (!getline(in, line) || line != TRACE_CACHE_MAGIC) {
+    cerr << "Ignoring trace cache " << path_ << ": unknown format." << endl;
+    return;
+  }
+  string word;
+  uint32_t moduleHash = 0;
+  if (getline(in, line)) {
+    istringstream fields(line);
+    fields >> word >> hex >> moduleHash;
+  }
+  bool sameModule = word == "module" && moduleHash == moduleHash_;
+
+  string text;
+  bool full = false;
+  while (getline(in, line)) {
+    if (line.compare(0, 4, "end ") != 0) {
+      text += line;
+      text += '\n';
+      continue;
+    }
+    ++loaded_;
+    uint32_t checksum = 0;
+    istringstream(line.substr(4)) >> hex >> checksum;
+    Record r;
+    r.text = text;
+    r.key = startLine(text);
+    text.clear();
+    if (!sameModule ||
+        fnvString(kFnvInit, r.text.data(), r.text.size()) != checksum) {
+      ++stale_;
+      continue;
+    }
+    if (full) {
+      addRecord(r);  // Still valid, just no room this time.
+      continue;
+    }
+    switch (readTrace(r.text, jit)) {
+    case kLoaded:
+      ++hits_;
+      addRecord(r);
+      break;
+    case kNoSpace:
+      full = true;
+      addRecord(r);
+      break;
+    case kStale:
+      ++stale_;
+      break;
+    }
+  }
+}
+
+void TraceCache::add(Jit *jit) {
+  ostringstream out;
+  if (!writeTrace(out, jit)) {
+    ++uncacheable_;
+    return;
+  }
+  Record r;
+  r.text = out.str();
+  r.key = startLine(r.text);
+  if (addRecord(r))
+    ++added_;
+}
+
+bool TraceCache::save() {
+  ofstream out(path_.c_str(), ios_base::out | ios_base::trunc);
+  if (!out.good()) {
+    cerr << "Could not write trace cache " << path_ << endl;
+    return false;
+  }
+  out << TRACE_CACHE_MAGIC << '\n'
+      << "module " << hex << moduleHash_ << dec << '\n';
+  for (size_t i = 0; i < records_.size(); ++i) {
+    const string &text = records_[i].text;
+    out << text << "end " << hex
+        << fnvString(kFnvInit, text.data(), text.size()) << dec << '\n';
+  }
+  return out.good();
+}
+
+bool TraceCache::addRecord(const Record &r) {
+  for (size_t i = 0; i < records_.size(); ++i) {
+    if (records_[i].key == r.key)
+      return false;
+  }
+  records_.push_back(r);
+  return true;
+}
+
+// Serialisation
+
+bool TraceCache::writeTrace(ostream &out, Jit *jit) {
+  IRBuffer *buf = jit->buffer();
+  const vector<const Code *> &codes = jit->recordedCode();
+  LC_ASSERT(buf->parent_ == NULL && buf->stopins_ == REF_FIRST);
+
+  out << "trace " << (jit->isReturnTrace() ? 1 : 0) << ' '
+      << buf->slots_.highestSlot() << '\n';
+  out << "start ";
+  if (!writePc(out, jit->startPc()))
+    return false;
+  out << '\n';
+  for (size_t i = 0; i < codes.size(); ++i) {
+    out << "code ";
+    if (!writePc(out, codes[i]->code))
+      return false;
+    out << '\n';
+  }
+  for (size_t i = 0; i < jit->targets().size(); ++i) {
+    out << "target ";
+    if (!writePc(out, jit->targets()[i]))
+      return false;
+    out << '\n';
+  }
+
+  out << "ir " << buf->bufmin_ << ' ' << buf->bufmax_ << '\n';
+  for (IRRef ref = buf->bufmin_; ref < buf->bufmax_; ++ref) {
+    IR *ins = buf->ir(ref);
+    out << ins->ot() << ' ' << ins->op1() << ' ' << ins->op2() << ' '
+        << ins->prev() << '\n';
+  }
+  for (IRRef ref = buf->bufmin_; ref < REF_BIAS; ++ref) {
+    IR *ins = buf->ir(ref);
+    if ((ins->opcode() == IR::kKINT || ins->opcode() == IR::kKWORD) &&
+        isPointerType(ins->type())) {
+      out << "lit " << ref << ' ';
+      if (!writePointer(out, ins->type(), buf->literalValue(ref), codes))
+        return false;
+      out << '\n';
+    }
+  }
+  for (IRRef ref = REF_FIRST; ref < buf->bufmax_; ++ref) {
+    IR *ins = buf->ir(ref);
+    if (ins->opcode() == IR::kSAVE && ins->op1() == IR_SAVE_LINK) {
+      out << "link " << ref << ' ';
+      if (!writePc(out, Jit::traceById(ins->op2())->startPc()))
+        return false;
+      out << '\n';
+    }
+  }
+
+  for (size_t i = 0; i < buf->snaps_.size(); ++i) {
+    Snapshot &sn = buf->snaps_[i];
+    out << "snap " << sn.ref_ << ' ' << sn.mapofs_ << ' ' << sn.relbase_
+        << ' ' << (int)sn.entries_ << ' ' << (int)sn.framesize_ << ' '
+        << sn.steps_ << ' ' << sn.lastHeapEntry_ << ' ';
+    if (!writePc(out, sn.pc()))
+      return false;
+    out << '\n';
+  }
+  const vector<uint32_t> &map = buf->snapmap_.data_;
+  out << "map";
+  for (size_t i = 0; i < map.size(); ++i)
+    out << ' ' << map[i];
+  out << '\n';
+
+  AbstractHeap &heap = buf->heap_;
+  for (uint32_t i = 0; i < heap.nextentry_; ++i) {
+    AbstractHeapEntry &e = heap.entries_[i];
+    out << "heap " << e.ref_ << ' ' << e.size_ << ' ' << e.ofs_ << ' '
+        << e.hpofs_ << ' ' << e.overallocated_ << ' ' << e.fwdref_ << '\n';
+  }
+  out << "fields";
+  for (size_t i = 0; i < heap.data_.next_; ++i)
+    out << ' ' << heap.data_.data_[i];
+  out << '\n';
+  return true;
+}
+
+const CodeInfoTable *TraceCache::findCode(const BcIns *pc, const char **name) {
+  for (size_t i = 0; i < codeNames_.size(); ++i) {
+    const Code *code = codeNames_[i].info->code();
+    if (code->code <= pc && pc < code->code + code->sizecode) {
+      *name = codeNames_[i].name;
+      return codeNames_[i].info;
+    }
+  }
+  CodeName cn;
+  cn.name = NULL;
+  cn.info = loader_->codeInfoTableContaining(pc, &cn.name);
+  if (cn.info == NULL) {
+    cn.info = MiscClosures::codeInfoTableContaining(pc);
+    cn.name = NULL;
+  }
+  if (cn.info == NULL)
+    return NULL;
+  codeNames_.push_back(cn);
+  *name = cn.name;
+  return cn.info;
+}
+
+// A PC is written as
+//
+//     pc <info table name> <code hash> <offset>
+//     misc-pc <MiscClosures symbol> <code hash> <offset>
+//
+bool TraceCache::writePc(ostream &out, const BcIns *pc) {
+  if (pc == NULL) {
+    out << "null";
+    return true;
+  }
+  const char *name;
+  const CodeInfoTable *info = findCode(pc, &name);
+  u4 sym;
+  if (info == NULL) {
+    return false;  // E.g., Thread::stopCode_.
+  } else if (name != NULL) {
+    if (!isSymbolName(name))
+      return false;
+    out << "pc " << name;
+  } else if (MiscClosures::symbolOf(info, &sym)) {
+    out << "misc-pc " << sym;
+  } else {
+    return false;
+  }
+  const Code *code = info->code();
+  out << ' ' << hex << codeHash(code) << dec << ' ' << (pc - code->code);
+  return true;
+}
+
+// A string literal is written as the PC of the code it belongs to,
+// followed by its index in that code's literals.
+bool TraceCache::writeString(ostream &out, Word p,
+                             const vector<const Code *> &codes) {
+  for (size_t i = 0; i < codes.size(); ++i) {
+    const Code *code = codes[i];
+    for (u2 k = 0; k < code->sizelits; ++k) {
+      if (code->littypes[k] == LIT_STRING && code->lits[k] == p) {
+        out << "string ";
+        if (!writePc(out, code->code))
+          return false;
+        out << ' ' << k;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool TraceCache::writePointer(ostream &out, IRType ty, Word p,
+                              const vector<const Code *> &codes) {
+  if (p == 0) {
+    out << "null";
+    return true;
+  }
+  const char *name;
+  u4 sym;
+  switch (ty) {
+  case IRT_PC:
+    return writePc(out, (const BcIns *)p);
+  case IRT_PTR:
+    return writeString(out, p, codes);
+  case IRT_INFO: {
+    const InfoTable *info = (const InfoTable *)p;
+    if (MiscClosures::symbolOf(info, &sym))
+      out << "misc-info " << sym;
+    else if ((name = loader_->symbolName(info)) != NULL &&
+             isSymbolName(name))
+      out << "info " << name;
+    else
+      return false;
+    out << ' ' << hex << infoHash(info) << dec;
+    return true;
+  }
+  case IRT_CLOS: {
+    // Only the name is checked.  The info table of a closure may
+    // change at runtime (e.g., when a CAF is updated).
+    const Closure *cl = (const Closure *)p;
+    if (MiscClosures::symbolOf(cl, &sym))
+      out << "misc-closure " << sym;
+    else if ((name = loader_->symbolName(cl)) != NULL && isSymbolName(name))
+      out << "closure " << name;
+    else
+      return false;
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+// Deserialisation
+
+const CodeInfoTable *
+TraceCache::readCode(const string &kind, istream &in, u4 *offset) {
+  const InfoTable *info = NULL;
+  string name;
+  u4 sym;
+  uint32_t hash;
+  if (kind == "pc") {
+    if (in >> name)
+      info = loader_->infoTable(name.c_str());
+  } else if (kind == "misc-pc") {
+    if (in >> sym)
+      info = MiscClosures::infoTableFor(sym);
+  }
+  if (!(in >> hex >> hash >> dec >> *offset) ||
+      info == NULL || !info->hasCode())
+    return NULL;
+  const Code *code = static_cast<const CodeInfoTable *>(info)->code();
+  if (*offset >= code->sizecode || codeHash(code) != hash)
+    return NULL;
+  return static_cast<const CodeInfoTable *>(info);
+}
+
+bool TraceCache::readPc(const string &kind, istream &in, BcIns **pc) {
+  if (kind == "null") {
+    *pc = NULL;
+    return true;
+  }
+  u4 offset;
+  const CodeInfoTable *info = readCode(kind, in, &offset);
+  if (info == NULL)
+    return false;
+  *pc = &info->code()->code[offset];
+  return true;
+}
+
+bool TraceCache::readPointer(istream &in, IRType ty, Word *p) {
+  string kind, name;
+  u4 sym, index;
+  uint32_t hash;
+  const InfoTable *info = NULL;
+  const Closure *cl = NULL;
+  if (!(in >> kind))
+    return false;
+  if (kind == "null") {
+    *p = 0;
+    return true;
+  }
+  switch (ty) {
+  case IRT_PC: {
+    BcIns *pc;
+    if (!readPc(kind, in, &pc))
+      return false;
+    *p = (Word)pc;
+    return true;
+  }
+  case IRT_PTR: {
+    u4 offset;
+    const CodeInfoTable *owner;
+    if (kind != "string" || !(in >> kind) ||
+        (owner = readCode(kind, in, &offset)) == NULL || offset != 0 ||
+        !(in >> index))
+      return false;
+    const Code *code = owner->code();
+    if (index >= code->sizelits || code->littypes[index] != LIT_STRING)
+      return false;
+    *p = code->lits[index];
+    return true;
+  }
+  case IRT_INFO:
+    if (kind == "info" && in >> name)
+      info = loader_->infoTable(name.c_str());
+    else if (kind == "misc-info" && in >> sym)
+      info = MiscClosures::infoTableFor(sym);
+    if (info == NULL || !(in >> hex >> hash) || infoHash(info) != hash)
+      return false;
+    *p = (Word)info;
+    return true;
+  case IRT_CLOS:
+    if (kind == "closure" && in >> name)
+      cl = loader_->closure(name.c_str());
+    else if (kind == "misc-closure" && in >> sym)
+      cl = MiscClosures::closureFor(sym);
+    if (cl == NULL || cl->info() == NULL)  // Missing or forward ref.
+      return false;
+    *p = (Word)cl;
+    return true;
+  default:
+    return false;
+  }
+}
+
+TraceCache::LoadResult TraceCache::readTrace(const string &text, Jit *jit) {
+  IRBuffer *buf = jit->buffer();
+  buf->reset(NULL, NULL);
+  istringstream in(text);
+  string line, word, kind;
+  int isReturn = -1, frameSize = -1;
+  BcIns *startPc = NULL, *pc;
+  vector<BcIns *> targets;
+  vector<AbstractHeapEntry> heap;
+  vector<IRRef1> fields;
+  vector<IRRef> linked;
+  bool haveIR = false;
+
+  while (getline(in, line)) {
+    istringstream f(line);
+    if (!(f >> word))
+      return kStale;
+    if (word == "trace") {
+      if (!(f >> isReturn >> frameSize))
+        return kStale;
+    } else if (word == "start") {
+      if (!(f >> kind) || !readPc(kind, f, &startPc) || startPc == NULL)
+        return kStale;
+    } else if (word == "code") {
+      // Only checks that the code is unchanged.
+      if (!(f >> kind) || !readPc(kind, f, &pc))
+        return kStale;
+    } else if (word == "target") {
+      if (!(f >> kind) || !readPc(kind, f, &pc) || pc == NULL)
+        return kStale;
+      targets.push_back(pc);
+    } else if (word == "ir") {
+      IRRef bufmin, bufmax;
+      if (haveIR || !(f >> bufmin >> bufmax) ||
+          bufmin < buf->bufstart_ || bufmin > REF_BIAS ||
+          bufmax <= REF_BASE || bufmax > buf->bufend_)
+        return kStale;
+      buf->bufmin_ = bufmin;
+      buf->bufmax_ = bufmax;
+      for (IRRef ref = bufmin; ref < bufmax; ++ref) {
+        u4 ot, op1, op2, prev;
+        if (!getline(in, line))
+          return kStale;
+        istringstream ins(line);
+        if (!(ins >> ot >> op1 >> op2 >> prev))
+          return kStale;
+        IR *ir = buf->ir(ref);
+        ir->setOt(ot);
+        ir->setOp1(op1);
+        ir->setOp2(op2);
+        ir->setPrev(prev);
+      }
+      haveIR = true;
+    } else if (word == "lit") {
+      IRRef ref;
+      Word p;
+      if (!haveIR || !(f >> ref) || ref < buf->bufmin_ || ref >= REF_BIAS)
+        return kStale;
+      IR *ins = buf->ir(ref);
+      if (!isPointerType(ins->type()) || !readPointer(f, ins->type(), &p))
+        return kStale;
+      // The literal must keep its encoding.
+      if (ins->opcode() == IR::kKINT && p < ((Word)1 << 31)) {
+        ins->setOp1((IRRef1)p);
+        ins->setOp2((IRRef1)(p >> 16));
+      } else if (ins->opcode() == IR::kKWORD && ref > buf->bufmin_ &&
+                 buf->ir(ref - 1)->opcode() == IR::kKWORDHI) {
+        ins->setOp1((IRRef1)p);
+        ins->setOp2((IRRef1)(p >> 16));
+        buf->ir(ref - 1)->setOp1((IRRef1)(p >> 32));
+        buf->ir(ref - 1)->setOp2((IRRef1)(p >> 48));
+      } else {
+        return kStale;
+      }
+    } else if (word == "link") {
+      IRRef ref;
+      if (!haveIR || !(f >> ref >> kind) || ref < REF_FIRST ||
+          ref >= buf->bufmax_ || !readPc(kind, f, &pc) || pc == NULL)
+        return kStale;
+      Fragment *target = jit->traceAt(pc);
+      if (target == NULL)
+        return kStale;  // The target trace was stale.
+      buf->ir(ref)->setOp2(target->traceId());
+      linked.push_back(ref);
+    } else if (word == "snap") {
+      int ref, mapofs, relbase, entries, framesize, steps, lastHeapEntry;
+      if (!(f >> ref >> mapofs >> relbase >> entries >> framesize >> steps
+            >> lastHeapEntry >> kind) ||
+          ref < 0 || ref > 0xffff || mapofs < 0 || mapofs > 0xffff ||
+          relbase != (int16_t)relbase || entries < 0 || entries > 0xff ||
+          framesize < 0 || framesize > 0xff || steps < 0 || steps > 0xffff ||
+          lastHeapEntry != (int16_t)lastHeapEntry ||
+          !readPc(kind, f, &pc))
+        return kStale;
+      Snapshot sn;
+      sn.ref_ = ref;
+      sn.mapofs_ = mapofs;
+      sn.relbase_ = relbase;
+      sn.entries_ = entries;
+      sn.framesize_ = framesize;
+      sn.steps_ = steps;
+      sn.lastHeapEntry_ = lastHeapEntry;
+      sn.pc_ = pc;
+      sn.mcode_ = NULL;
+      buf->snaps_.push_back(sn);
+    } else if (word == "map") {
+      uint32_t entry;
+      while (f >> entry)
+        buf->snapmap_.data_.push_back(entry);
+      buf->snapmap_.index_ = buf->snapmap_.data_.size();
+    } else if (word == "heap") {
+      int ref, size, ofs, hpofs, overallocated, fwdref;
+      if (!(f >> ref >> size >> ofs >> hpofs >> overallocated >> fwdref) ||
+          ref < 0 || ref > 0xffff || size < 0 || size > 0xffff ||
+          ofs < 0 || ofs > 0xffff || hpofs != (int16_t)hpofs ||
+          overallocated < 0 || overallocated > 0xffff ||
+          fwdref < 0 || fwdref > 0xffff)
+        return kStale;
+      AbstractHeapEntry e(ref, size, ofs, hpofs);
+      e.overallocated_ = overallocated;
+      e.fwdref_ = fwdref;
+      heap.push_back(e);
+    } else if (word == "fields") {
+      u4 field;
+      while (f >> field)
+        fields.push_back(field);
+    } else {
+      return kStale;
+    }
+  }
+
+  if (!haveIR || startPc == NULL || isReturn < 0 || isReturn > 1 ||
+      frameSize < 0 ||
+      frameSize >= (int)(AbstractStack::kSlots - AbstractStack::kInitialBase))
+    return kStale;
+  buf->slots_.high_ = AbstractStack::kInitialBase + frameSize;
+
+  AbstractHeap &h = buf->heap_;
+  if (!heap.empty()) {
+    h.entries_ = static_cast<AbstractHeapEntry *>
+      (malloc(sizeof(AbstractHeapEntry) * heap.size()));
+    memcpy(h.entries_, &heap[0], sizeof(AbstractHeapEntry) * heap.size());
+    h.nentries_ = h.nextentry_ = heap.size();
+  }
+  if (!fields.empty()) {
+    h.data_.data_ = static_cast<IRRef1 *>(malloc(sizeof(IRRef1) * fields.size()));
+    memcpy(h.data_.data_, &fields[0], sizeof(IRRef1) * fields.size());
+    h.data_.size_ = h.data_.next_ = fields.size();
+  }
+
+  if (!validate(buf))
+    return kStale;
+  // The assembler finds some instructions through the chains.
+  memset(buf->chain_, 0, sizeof(buf->chain_));
+  for (IRRef ref = REF_BIAS - 1; ref >= buf->bufmin_; --ref)
+    buf->chain_[buf->ir(ref)->opcode()] = ref;
+  for (IRRef ref = REF_BASE; ref < buf->bufmax_; ++ref)
+    buf->chain_[buf->ir(ref)->opcode()] = ref;
+  // Every link must have been pointed at the new trace id.
+  for (IRRef ref = REF_FIRST; ref < buf->bufmax_; ++ref) {
+    IR *ins = buf->ir(ref);
+    if (ins->opcode() == IR::kSAVE && ins->op1() == IR_SAVE_LINK &&
+        find(linked.begin(), linked.end(), ref) == linked.end())
+      return kStale;
+  }
+  if (jit->traceAt(startPc) != NULL)
+    return kStale;  // Duplicate.
+
+  if (jit->assembleCachedTrace(startPc, isReturn, targets) == NULL)
+    return kNoSpace;
+  return kLoaded;
+}
+
+bool TraceCache::isValidRef(IRRef ref, IRBuffer *buf) {
+  return buf->bufmin_ <= ref && ref < buf->bufmax_;
+}
+
+// Checks everything that the assembler relies on.
+bool TraceCache::validate(IRBuffer *buf) {
+  uint32_t nheap = buf->heap_.nextentry_;
+  bool haveSave = false;
+  for (IRRef ref = buf->bufmin_; ref < buf->bufmax_; ++ref) {
+    IR *ins = buf->ir(ref);
+    int op = ins->opcode();
+    if (op >= IR::k_MAX)
+      return false;
+    bool isConst = op == IR::kKINT || op == IR::kKWORD ||
+      op == IR::kKWORDHI || op == IR::kKBASEO;
+    if (ref < REF_BIAS) {
+      if (!isConst ||
+          (op == IR::kKWORD && (ref == buf->bufmin_ ||
+                                buf->ir(ref - 1)->opcode() != IR::kKWORDHI)))
+        return false;
+      continue;
+    }
+    if ((ref == REF_BASE) != (op == IR::kBASE) || isConst)
+      return false;
+    if (ref == REF_BASE)
+      continue;
+    IR::IRMode mode = IR::mode((IR::Opcode)op);
+    if ((irmode_left(mode) == IR::IRMref && !isValidRef(ins->op1(), buf)) ||
+        (irmode_right(mode) == IR::IRMref && !isValidRef(ins->op2(), buf)) ||
+        ins->prev() >= ref)
+      return false;
+    if ((op == IR::kNEW && ins->op2() >= nheap) ||
+        (op == IR::kSAVE && (ins->op1() > IR_SAVE_LINK ||
+                             (ins->op1() == IR_SAVE_LINK &&
+                              ins->op2() >= Jit::numFragments()))))
+      return false;
+    haveSave = haveSave || op == IR::kSAVE;
+  }
+  if (!haveSave)
+    return false;
+
+  const vector<uint32_t> &map = buf->snapmap_.data_;
+  for (size_t i = 0; i < buf->snaps_.size(); ++i) {
+    Snapshot &sn = buf->snaps_[i];
+    if (sn.ref_ < REF_FIRST || sn.ref_ > buf->bufmax_ ||
+        (size_t)sn.mapofs_ + sn.entries_ > map.size() ||
+        sn.lastHeapEntry_ < -1 || sn.lastHeapEntry_ >= (int)nheap)
+      return false;
+    for (size_t j = sn.mapofs_; j < (size_t)sn.mapofs_ + sn.entries_; ++j) {
+      IRRef1 r = (IRRef1)map[j];
+      if (r != 0 && !isValidRef(r, buf))
+        return false;
+    }
+  }
+  // Each guard has its own snapshot (see Assembler::assemble).
+  int snapno = (int)buf->snaps_.size() - 1;
+  for (IRRef ref = buf->bufmax_ - 1; ref >= REF_FIRST; --ref) {
+    if (buf->ir(ref)->isGuard()) {
+      if (snapno < 0 || buf->snaps_[snapno].ref_ != ref)
+        return false;
+      --snapno;
+    }
+  }
+
+  AbstractHeap &heap = buf->heap_;
+  for (uint32_t i = 0; i < nheap; ++i) {
+    AbstractHeapEntry &e = heap.entries_[i];
+    if (!isValidRef(e.ref_, buf) ||
+        (size_t)e.ofs_ + e.size_ > heap.data_.next_)
+      return false;
+  }
+  for (size_t i = 0; i < heap.data_.next_; ++i) {
+    IRRef1 r = heap.data_.data_[i];
+    if (r != 0 && !isValidRef(r, buf))
+      return false;
+  }
+  return true;
+}
+
+_END_LAMBDACHINE_NAMESPACE
@@ -0,0 +1,113 @@
+#ifndef _TRACECACHE_H_
+#define _TRACECACHE_H_
+
+#include "common.hh"
+#include "objects.hh"
+#include "ir.hh"
+
+#include <string>
+#include <vector>
+#include <iosfwd>
+
+_START_LAMBDACHINE_NAMESPACE
+
+class Loader;
+class Jit;
+
+/// Keeps the IR of root traces across process runs.
+///
+/// When a root trace has been recorded and optimised, its IR buffer,
+/// snapshots and abstract heap are serialised before the assembler
+/// gets to modify them.  save() writes them to
+/// `<dir>/<module>.lctrace`.  On startup, load() reads them back,
+/// checks them against the loaded code and assembles them, so the
+/// traces of the previous run are installed before any code runs.
+/// Side traces are not cached; they are recorded again once their
+/// exits get hot.
+///
+/// Pointers in the IR are stored symbolically: info tables and
+/// closures by name, bytecode addresses as an offset into the code of
+/// a named info table, and objects built by MiscClosures by their
+/// symbol.  Info tables and bytecode are checked against a hash when
+/// they are read back, and so is every function the trace was
+/// recorded from.  If the bytecode file of the main module has
+/// changed, the whole file is ignored.  A trace that fails a check is
+/// stale and dropped; it is simply recorded again.  A trace with a
+/// pointer that has no symbolic form (e.g., into a thread's stack
+/// code) is not cached at all.
+///
+/// The file is text.  Each trace is a sequence of lines from `trace`
+/// to `end <checksum>`.
+class TraceCache {
+public:
+  TraceCache(const char *dir, const char *module, Loader *loader);
+
+  /// Read the file and assemble all traces that still match the
+  /// loaded code.  Must be called before any code runs.
+  void load(Jit *);
+
+  /// Serialise the root trace that the JIT has just recorded.  Must
+  /// be called before it is assembled.
+  void add(Jit *);
+
+  /// Write all traces that were loaded or added.
+  bool save();
+
+  inline uint32_t entries() const { return loaded_; }
+  inline uint32_t hits() const { return hits_; }
+  inline uint32_t stale() const { return stale_; }
+  inline uint32_t added() const { return added_; }
+  inline uint32_t uncacheable() const { return uncacheable_; }
+  inline const std::string &path() const { return path_; }
+
+  /// Hash of the bytecode of the given code object.  A JFUNC written
+  /// by the JIT hashes like the instruction it replaced.
+  static uint32_t codeHash(const Code *code);
+
+  /// Hash of an info table's layout, name and code.
+  static uint32_t infoHash(const InfoTable *info);
+
+private:
+  struct Record {
+    std::string key;   // The start PC.
+    std::string text;  // Excluding the final `end` line.
+  };
+
+  struct CodeName {
+    const CodeInfoTable *info;
+    const char *name;  // NULL for info tables built by MiscClosures.
+  };
+
+  enum LoadResult { kLoaded, kStale, kNoSpace };
+
+  bool writeTrace(std::ostream &, Jit *);
+  bool writePointer(std::ostream &, IRType, Word,
+                    const std::vector<const Code *> &);
+  bool writePc(std::ostream &, const BcIns *);
+  bool writeString(std::ostream &, Word, const std::vector<const Code *> &);
+  const CodeInfoTable *findCode(const BcIns *, const char **name);
+
+  LoadResult readTrace(const std::string &text, Jit *);
+  bool readPointer(std::istream &, IRType, Word *);
+  bool readPc(const std::string &kind, std::istream &, BcIns **);
+  const CodeInfoTable *readCode(const std::string &kind, std::istream &,
+                                u4 *offset);
+  static bool validate(IRBuffer *);
+  static bool isValidRef(IRRef, IRBuffer *);
+  bool addRecord(const Record &);
+
+  std::string path_;
+  uint32_t moduleHash_;
+  Loader *loader_;
+  std::vector<Record> records_;
+  std::vector<CodeName> codeNames_;  // Cache for findCode.
+  uint32_t loaded_;
+  uint32_t hits_;
+  uint32_t stale_;
+  uint32_t added_;
+  uint32_t uncacheable_;
+};
+
+_END_LAMBDACHINE_NAMESPACE
+
+#endif /* _TRACECACHE_H_ */
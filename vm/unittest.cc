@@ -8,10 +8,15 @@
 #include "miscclosures.hh"
 #include "jit.hh"
 #include "time.hh"
+#include "tracecache.hh"
+#include "heapprofile.hh"
+#include "image.hh"
 
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <set>
+#include <pthread.h>
 
 using namespace std;
 _USE_LAMBDACHINE_NAMESPACE
@@ -51,6 +56,461 @@ TEST(MMTest, AllocBasic2) {
   ASSERT_GT(m.infoTables(), sizeof(Word));
 }
 
+TEST(MMTest, WriteBarrierNursery) {
+  MemoryManager m;
+  Loader l(&m, NULL);
+  Closure *cl = m.allocClosure(MiscClosures::stg_IND_info, 1);
+  ASSERT_FALSE(Region::regionFromPointer(cl)->isOldGeneration());
+  m.writeBarrier(cl);
+  ASSERT_EQ((size_t)0, m.rememberedSetSize());
+  ASSERT_EQ((uint64_t)0, m.numMinorGCs());
+  ASSERT_EQ((uint64_t)0, m.numMajorGCs());
+}
+
+struct AllocBufferTestArgs {
+  MemoryManager *mm;
+  std::vector<Block *> blocks;
+};
+
+static void *allocBufferTestThread(void *p) {
+  AllocBufferTestArgs *args = static_cast<AllocBufferTestArgs *>(p);
+  MemoryManager *mm = args->mm;
+  AllocBuffer buf;
+  mm->addAllocBuffer(&buf);
+  char *heap, *heaplim;
+  mm->getBumpAllocatorBounds(&buf, &heap, &heaplim);
+  args->blocks.push_back(buf.block());
+  for (int i = 0; i < 20; ++i) {
+    // Use up the block, word by word.
+    while (heap < heaplim) {
+      *(Word *)heap = (Word)i;
+      heap += sizeof(Word);
+    }
+    if (mm->bumpAllocatorFullNoGC(&buf, &heap, &heaplim) != 0)
+      break;
+    args->blocks.push_back(buf.block());
+  }
+  mm->sync(&buf, heap, heaplim);
+  mm->removeAllocBuffer(&buf);
+  return NULL;
+}
+
+TEST(MMTest, AllocBuffersInParallel) {
+  const int kThreads = 4;
+  MemoryManager m;
+  m.setNextGC(1000);
+  uint64_t allocated = m.allocated();
+  pthread_t threads[kThreads];
+  AllocBufferTestArgs args[kThreads];
+  for (int i = 0; i < kThreads; ++i) {
+    args[i].mm = &m;
+    ASSERT_EQ(0, pthread_create(&threads[i], NULL,
+                                allocBufferTestThread, &args[i]));
+  }
+  for (int i = 0; i < kThreads; ++i)
+    pthread_join(threads[i], NULL);
+
+  // Every thread got its own blocks, and no block was handed out
+  // twice.
+  std::set<Block *> seen;
+  for (int i = 0; i < kThreads; ++i) {
+    ASSERT_EQ((size_t)21, args[i].blocks.size());
+    for (size_t j = 0; j < args[i].blocks.size(); ++j) {
+      Block *b = args[i].blocks[j];
+      EXPECT_EQ((int)Block::kClosures, (int)b->contents());
+      EXPECT_TRUE(seen.insert(b).second);
+      // All but the last block were filled up.
+      if (j + 1 < args[i].blocks.size())
+        allocated += b->size();
+    }
+  }
+  EXPECT_EQ(allocated, m.allocated());
+  EXPECT_EQ((uint64_t)0, m.numMinorGCs());
+}
+
+TEST(MMTest, EveryRefillUsesUpNursery) {
+  MemoryManager m;
+  Loader l(&m, NULL);
+  m.setNextGC(4);
+  AllocBuffer buf;
+  m.addAllocBuffer(&buf);
+  char *heap, *heaplim;
+  m.getBumpAllocatorBounds(&buf, &heap, &heaplim);
+  // Fill the first block of the memory manager's own buffer.
+  Closure *cl = m.allocClosure(MiscClosures::stg_IND_info, 1);
+  Block *first = Region::blockFromPointer(cl);
+  while (Region::blockFromPointer(cl) == first)
+    cl = m.allocClosure(MiscClosures::stg_IND_info, 1);
+  // That took three blocks, so the nursery is full.
+  EXPECT_NE(0, m.bumpAllocatorFullNoGC(&buf, &heap, &heaplim));
+  m.removeAllocBuffer(&buf);
+}
+
+_START_LAMBDACHINE_NAMESPACE
+
+// Drives the garbage collector directly.  Test objects are nodes with
+// two pointer fields and a data word, using the info table of an AP
+// thunk.  The only roots are those passed to collect().  Declared a
+// friend by MemoryManager and Region.
+class GCTest : public ::testing::Test {
+protected:
+  MemoryManager mm;
+  Loader loader;
+  Capability cap;
+  Thread *T;
+  InfoTable *node;
+  Closure *end;  // A static closure, which the GC leaves alone.
+
+public:
+  GCTest() : mm(), loader(&mm, NULL), cap(&mm),
+             T(NULL), node(NULL), end(NULL) {
+  }
+
+  virtual void SetUp() {
+    T = Thread::createThread(&cap, 1000);
+    node = MiscClosures::getApInfo(2, 1);
+    end = MiscClosures::stg_STOP_closure_addr;
+    // Makes T the current thread.  Its frame holds no roots.
+    ASSERT_TRUE(cap.eval(T, end));
+    mm.setTopOfStackMask(0);
+  }
+
+  virtual void TearDown() {
+    delete T;
+    T = NULL;
+  }
+
+  Closure *newNode(Closure *next, Word value) {
+    Closure *cl = mm.allocClosure(node, 3);
+    cl->setPayload(0, (Word)next);
+    cl->setPayload(1, (Word)end);
+    cl->setPayload(2, value);
+    return cl;
+  }
+
+  // A list of n nodes holding the values 0 to n - 1.
+  Closure *newList(Word n) {
+    Closure *cl = end;
+    while (n > 0)
+      cl = newNode(cl, --n);
+    return cl;
+  }
+
+  static Closure *next(Closure *cl) { return (Closure *)cl->payload(0); }
+
+  static Closure *nth(Closure *cl, Word n) {
+    while (n-- > 0)
+      cl = next(cl);
+    return cl;
+  }
+
+  static bool isOld(Closure *cl) {
+    return Region::regionFromPointer(cl)->isOldGeneration();
+  }
+
+  // Performs a minor GC, or a major GC if the old generation has
+  // grown too much.  The roots are passed in the top stack frame of
+  // T, and pointers to moved closures are updated.
+  void collect(Closure ***roots, u4 nroots) {
+    Word *top = T->top_;
+    T->top_ = T->base_ + nroots;
+    for (u4 i = 0; i < nroots; ++i)
+      T->base_[i] = (Word)*roots[i];
+    mm.setTopOfStackMask((1u << nroots) - 1);
+    mm.performGC(&cap);
+    mm.setTopOfStackMask(0);
+    for (u4 i = 0; i < nroots; ++i)
+      *roots[i] = (Closure *)T->base_[i];
+    T->top_ = top;
+  }
+
+  void collectMajor(Closure ***roots, u4 nroots) {
+    mm.oldGenLimit_ = 0;
+    collect(roots, nroots);
+  }
+
+  // Starts an incremental major GC.  The first mark slice follows
+  // the minor GC.
+  void startMarking(Closure ***roots, u4 nroots) {
+    mm.setGCSlice(1);
+    mm.oldGenLimit_ = mm.oldGenBlocks_;
+    collect(roots, nroots);
+  }
+
+  // What happens to the nursery size after a GC from gcStart to
+  // gcEnd.
+  void resizeNursery(Time gcStart, Time gcEnd) {
+    mm.resizeNursery(gcStart, gcEnd);
+  }
+
+  static bool isMarked(Closure *cl) {
+    Word bit = ((Word)cl & Region::kRegionMask) / sizeof(Word);
+    const uint8_t *marks = Region::regionFromPointer(cl)->objectMarks();
+    return (marks[bit / 8] >> (bit % 8)) & 1;
+  }
+
+  u4 oldGenBlocks() const { return mm.oldGenBlocks_; }
+
+  Closure *newLarge(Word bytes) {
+    Closure *cl = mm.allocLarge(bytes);
+    cl->setInfo(MiscClosures::stg_BYTEARR_info);
+    return cl;
+  }
+
+  static u4 numRegions(Region *r) {
+    u4 n = 0;
+    for ( ; r != NULL; r = r->meta_.region_link_)
+      ++n;
+    return n;
+  }
+  u4 youngRegions() const { return numRegions(mm.region_); }
+  u4 oldRegions() const { return numRegions(mm.oldRegion_); }
+
+  // Sizes of the free chunks of large object regions.
+  std::vector<Word> freeLargeChunks() const {
+    std::vector<Word> sizes;
+    for (int i = 0; i < MemoryManager::kLargeObjectBins; ++i) {
+      for (LargeObject *p = mm.freeLargeObjects_[i]; p != NULL; p = p->next_)
+        sizes.push_back(sizeof(LargeObject) + p->payloadSize_);
+    }
+    return sizes;
+  }
+};
+
+_END_LAMBDACHINE_NAMESPACE
+
+TEST_F(GCTest, PromoteIntoHoles) {
+  Closure *list = newList(600);
+  Closure **roots[] = { &list };
+  collect(roots, 1);
+  ASSERT_TRUE(isOld(list));
+  ASSERT_EQ(1u, oldGenBlocks());
+
+  // Drop nodes 200 to 399.  They were promoted in order, so this
+  // frees a run of lines in the middle of the block.
+  Closure *before = nth(list, 199);
+  Closure *after = nth(before, 201);
+  char *holeStart = (char *)next(before);
+  char *holeEnd = (char *)after;
+  ASSERT_LT(holeStart, holeEnd);
+  before->setPayload(0, (Word)after);
+  collectMajor(roots, 1);
+  EXPECT_EQ(1u, oldGenBlocks());
+
+  // The next minor GC promotes into the hole.
+  Closure *young = newNode(end, 42);
+  Closure **roots2[] = { &list, &young };
+  collect(roots2, 2);
+  EXPECT_LE(holeStart, (char *)young);
+  EXPECT_LT((char *)young, holeEnd);
+  EXPECT_EQ((Word)42, young->payload(2));
+  EXPECT_EQ(1u, oldGenBlocks());
+
+  Closure *cl = list;
+  for (Word i = 0; i < 600; ++i) {
+    if (i == 200) i = 400;
+    ASSERT_EQ(i, cl->payload(2));
+    cl = next(cl);
+  }
+  EXPECT_EQ(end, cl);
+}
+
+TEST_F(GCTest, CoalesceLargeObjects) {
+  const Word kB = 1024;
+  // Objects of different size classes, which nearly fill one region.
+  Closure *a = newLarge(100 * kB);
+  Closure *b = newLarge(150 * kB);
+  Closure *c = newLarge(300 * kB);
+  Closure *d = newLarge(300 * kB);
+  ASSERT_EQ(Region::regionFromPointer(a), Region::regionFromPointer(d));
+  Word chunkB = (char *)c - (char *)b;
+  Word chunkC = (char *)d - (char *)c;
+  ((Word *)a)[2] = 0xabcd;
+
+  // Drop the two in the middle.
+  Closure **roots[] = { &a, &d };
+  collectMajor(roots, 2);
+  std::vector<Word> chunks = freeLargeChunks();
+  ASSERT_EQ((size_t)1, chunks.size());
+  EXPECT_EQ(chunkB + chunkC, chunks[0]);
+
+  // Neither chunk alone is big enough, nor is the rest of the region.
+  uint64_t committed = mm.committedBytes();
+  Closure *e = newLarge(400 * kB);
+  EXPECT_EQ(b, e);
+  EXPECT_EQ(committed, mm.committedBytes());
+  EXPECT_EQ((Word)0xabcd, ((Word *)a)[2]);
+}
+
+TEST_F(GCTest, ReleaseFreeRegions) {
+  // About 3MB, in both the nursery and the old generation.
+  Closure *list = newList(100000);
+  Closure **roots[] = { &list };
+  collect(roots, 1);
+  u4 young = youngRegions();
+  u4 old = oldRegions();
+  ASSERT_GE(young, 4u);
+  ASSERT_GE(old, 3u);
+  uint64_t committed = mm.committedBytes();
+
+  list = end;
+  collectMajor(roots, 1);
+  EXPECT_LT(youngRegions(), young);
+  EXPECT_EQ(0u, oldRegions());
+  EXPECT_LT(mm.committedBytes(),
+            committed - (uint64_t)old * Region::kRegionSize);
+}
+
+TEST_F(GCTest, MaxHeapSize) {
+  mm.setMaxHeapSize(2 * Region::kRegionSize);
+  Closure *list = newList(10000);
+  Closure **roots[] = { &list };
+  collect(roots, 1);
+  collectMajor(roots, 1);
+  EXPECT_EQ((Word)9999, nth(list, 9999)->payload(2));
+
+  // Now there's more live data than the limit allows.
+  nth(list, 9999)->setPayload(0, (Word)newList(100000));
+  mm.writeBarrier(nth(list, 9999));
+  EXPECT_EXIT(collect(roots, 1), ::testing::ExitedWithCode(1),
+              "Heap exhausted");
+}
+
+TEST_F(GCTest, IncrementalMarkingBarrier) {
+  // A list long enough to take several mark slices.  y and z are only
+  // reachable from its last node.
+  Closure *y = newNode(end, 111);
+  Closure *z = newNode(end, 222);
+  Closure *list = newList(10000);
+  Closure *last = nth(list, 9999);
+  last->setPayload(0, (Word)y);
+  last->setPayload(1, (Word)z);
+  Closure **roots[] = { &list };
+  collect(roots, 1);
+  ASSERT_TRUE(isOld(list));
+
+  startMarking(roots, 1);
+  ASSERT_TRUE(mm.markingInProgress());
+  EXPECT_EQ((uint64_t)0, mm.numMajorGCs());
+  last = nth(list, 9999);
+  y = next(last);
+  z = (Closure *)last->payload(1);
+  ASSERT_TRUE(isMarked(list));
+  ASSERT_FALSE(isMarked(y));
+  ASSERT_FALSE(isMarked(z));
+
+  // Between slices, move y into the already scanned head of the
+  // list, and z into a nursery object.
+  list->setPayload(1, (Word)y);
+  mm.writeBarrier(list);
+  Closure *young = newNode(z, 333);
+  last->setPayload(0, (Word)end);
+  last->setPayload(1, (Word)end);
+  mm.writeBarrier(last);
+
+  Closure **roots2[] = { &list, &young };
+  int slices = 0;
+  for ( ; slices < 100 && mm.markingInProgress(); ++slices)
+    collect(roots2, 2);
+  ASSERT_FALSE(mm.markingInProgress());
+  // Each pause did a minor GC, and the last one also finished the
+  // major GC.
+  EXPECT_EQ((uint64_t)(2 + slices), mm.numMinorGCs());
+  EXPECT_EQ((uint64_t)1, mm.numMajorGCs());
+  EXPECT_TRUE(isMarked(y));
+  EXPECT_TRUE(isMarked(z));
+
+  // Promote enough to fill any lines that were freed by mistake.
+  Closure *fill = newList(2000);
+  Closure **roots3[] = { &list, &young, &fill };
+  collect(roots3, 3);
+  ASSERT_EQ(y, (Closure *)list->payload(1));
+  ASSERT_EQ(z, next(young));
+  EXPECT_EQ((Word)111, y->payload(2));
+  EXPECT_EQ((Word)222, z->payload(2));
+  EXPECT_EQ((Word)333, young->payload(2));
+}
+
+TEST_F(GCTest, NurseryFollowsGCTarget) {
+  mm.setGCTarget(0.1);
+  u4 blocks = mm.nurseryBlocks();
+  // The first GC has no mutator time to compare with.
+  resizeNursery(1000, 1100);
+  EXPECT_EQ(blocks, mm.nurseryBlocks());
+  // Half of the time in the GC: grow, but at most by a factor of two.
+  resizeNursery(1200, 1300);
+  EXPECT_EQ(2 * blocks, mm.nurseryBlocks());
+  // On target.
+  resizeNursery(2200, 2300);
+  EXPECT_EQ(2 * blocks, mm.nurseryBlocks());
+  // Far below the target: shrink, but at most by a factor of two.
+  resizeNursery(12300, 12400);
+  EXPECT_EQ(blocks, mm.nurseryBlocks());
+  // Never below the minimum heap size.
+  mm.setMinHeapSize(blocks * Block::kBlockSize);
+  resizeNursery(22400, 22500);
+  EXPECT_EQ(blocks, mm.nurseryBlocks());
+
+  // Without a target, the nursery size is fixed.
+  mm.setGCTarget(0);
+  resizeNursery(22600, 22700);
+  EXPECT_EQ(blocks, mm.nurseryBlocks());
+}
+
+TEST_F(GCTest, CopyFirstChildrenEagerly) {
+  const Word size = 4 * sizeof(Word);
+  // The nodes of the list are not adjacent in the nursery.
+  Closure *c = newNode(end, 3);
+  Closure *x = newNode(end, 0);
+  Closure *b = newNode(c, 2);
+  Closure *y = newNode(end, 0);
+  Closure *a = newNode(b, 1);
+  Closure **roots[] = { &a, &x, &y };
+  collect(roots, 3);
+  // The list is copied before the next root.
+  b = next(a);
+  c = next(b);
+  EXPECT_EQ((char *)a + size, (char *)b);
+  EXPECT_EQ((char *)b + size, (char *)c);
+  EXPECT_EQ((char *)c + size, (char *)x);
+  EXPECT_EQ((char *)x + size, (char *)y);
+  EXPECT_EQ((Word)3, c->payload(2));
+
+  // Only up to 16 children are copied eagerly.
+  Closure *list = newList(40);
+  x = newNode(end, 0);
+  Closure **roots2[] = { &a, &list, &x };
+  collect(roots2, 3);
+  EXPECT_EQ((char *)nth(list, 16) + size, (char *)x);
+  EXPECT_EQ((Word)39, nth(list, 39)->payload(2));
+}
+
+TEST_F(GCTest, ReusedBlocksAreZeroed) {
+  // Garbage in a few nursery blocks.
+  std::set<Block *> used;
+  for (int i = 0; i < 3000; ++i)
+    used.insert(Region::blockFromPointer(newNode(end, ~(Word)0)));
+  ASSERT_GE(used.size(), (size_t)3);
+  collect(NULL, 0);
+
+  // Allocation soon moves on to one of the freed blocks.
+  Closure *cl = newNode(end, 1);
+  Block *b = Region::blockFromPointer(cl);
+  for (int i = 0; i < 3000 && used.count(b) == 0; ++i) {
+    cl = newNode(end, 1);
+    b = Region::blockFromPointer(cl);
+  }
+  ASSERT_TRUE(used.count(b) != 0);
+  EXPECT_EQ(b->start(), (char *)cl);
+#if !defined(NDEBUG)
+  // Only debug builds clear free blocks.
+  char *p = b->free();
+  while (p < b->end() && *p == 0)
+    ++p;
+  EXPECT_EQ(b->end(), p);
+#endif
+}
+
 TEST(LoaderTest, Simple) {
   MemoryManager mm;
   Loader l(&mm, "/usr/bin");
@@ -103,6 +563,38 @@ TEST(LoaderTest, DebugPrint) {
   l.printClosures(cerr);
 }
 
+TEST(LoaderTest, SaveImage) {
+  const char *path = "unittest_loader.img";
+  {
+    MemoryManager mm;
+    Loader l(&mm, "libraries");
+    ASSERT_TRUE(l.loadWiredInModules());
+    ASSERT_TRUE(l.loadModule("GHC.Base"));
+    ASSERT_TRUE(l.saveImage(path));
+  }
+  MemoryManager mm;
+  Loader l(&mm, "libraries");
+  ASSERT_TRUE(l.loadImage(path));
+  ASSERT_TRUE(l.module("GHC.Base") != NULL);
+  ASSERT_TRUE(l.loadWiredInModules());
+  ASSERT_TRUE(l.loadModule("GHC.Base"));
+  l.printInfoTables(cerr);
+  l.printClosures(cerr);
+  remove(path);
+}
+
+TEST(LoaderTest, LoadInParallel) {
+  MemoryManager mm;
+  Loader l(&mm, "libraries");
+  l.setThreads(4);
+  ASSERT_TRUE(l.loadWiredInModules());
+  ASSERT_TRUE(l.loadModule("GHC.Base"));
+  EXPECT_TRUE(l.module("GHC.Base") != NULL);
+  Closure *true_closure = l.closure("GHC.Types.True`closure");
+  ASSERT_TRUE(true_closure != NULL);
+  EXPECT_EQ(l.infoTable("GHC.Types.True`con_info"), true_closure->info());
+}
+
 TEST(LoaderTest, BuiltinClosures) {
   MemoryManager mm;
   EXPECT_TRUE(NULL == MiscClosures::stg_STOP_closure_addr);
@@ -119,6 +611,33 @@ TEST(LoaderTest, BuiltinClosures) {
   EXPECT_TRUE(NULL != MiscClosures::stg_IND_info);
 }
 
+TEST(LoaderTest, SharedClosures) {
+  MemoryManager mm;
+  Loader l(&mm, "libraries");
+  EXPECT_TRUE(NULL == MiscClosures::intLike(0));
+  ASSERT_TRUE(l.loadWiredInModules());
+
+  InfoTable *izh = l.infoTable("GHC.Types.I#`con_info");
+  Closure *five = MiscClosures::intLike(5);
+  ASSERT_TRUE(five != NULL);
+  EXPECT_EQ(izh, five->info());
+  EXPECT_EQ((Word)5, five->payload(0));
+  EXPECT_TRUE(NULL != MiscClosures::intLike(MiscClosures::kMinIntLike));
+  EXPECT_TRUE(NULL == MiscClosures::intLike(MiscClosures::kMaxIntLike + 1));
+  Word n = 5;
+  EXPECT_EQ(five, MiscClosures::sharedClosure(izh, &n));
+
+  Closure *a = MiscClosures::charLike('a');
+  ASSERT_TRUE(a != NULL);
+  EXPECT_EQ(l.infoTable("GHC.Types.C#`con_info"), a->info());
+  EXPECT_EQ((Word)'a', a->payload(0));
+
+  Closure *true_closure = l.closure("GHC.Types.True`closure");
+  ASSERT_TRUE(true_closure != NULL);
+  EXPECT_EQ(true_closure,
+            MiscClosures::sharedClosure(true_closure->info(), NULL));
+}
+
 TEST(RegSetTest, fromReg) {
   RegSet rs = RegSet::fromReg(4);
   for (int i = 0; i < 32; ++i) {
@@ -175,6 +694,26 @@ TEST(SpillSetTest, test) {
   }
 }
 
+TEST(SpillSetTest, reuse) {
+  SpillSet s;
+  EXPECT_EQ(1, s.alloc());
+  EXPECT_EQ(2, s.alloc());
+  EXPECT_EQ(3, s.alloc());
+  s.release(1, REF_BIAS + 20);
+  s.release(2, REF_BIAS + 10);
+  // Live beyond both definitions: needs a fresh slot.
+  EXPECT_EQ(4, s.allocReuse(REF_BIAS + 20));
+  // Dead before both: pick the closest fit.
+  EXPECT_EQ(2, s.allocReuse(REF_BIAS + 5));
+  EXPECT_EQ(1, s.allocReuse(REF_BIAS + 5));
+  EXPECT_EQ(5, s.allocReuse(REF_BIAS + 5));
+  // Released slots are never handed out by plain alloc().
+  s.release(3, REF_BIAS + 30);
+  EXPECT_EQ(6, s.alloc());
+  s.reset();
+  EXPECT_EQ(1, s.allocReuse(REF_BIAS + 5));
+}
+
 TEST(Flags, setVal) {
   Flags32 f;
   for (int i = 0; i < 32; ++i) {
@@ -204,6 +743,185 @@ TEST(AllocMachineCode, Simple) {
   EXPECT_TRUE(dist < (ptrdiff_t)1 << 31);
 }
 
+TEST(AllocMachineCode, ChainAndFlush) {
+  Prng prng;
+  MachineCode mcode(&prng);
+  mcode.setLimit(2 * MachineCode::kAreaSize);
+  MCode *from, *to;
+  EXPECT_TRUE(mcode.ensureSpace());
+  to = mcode.reserve(&from);
+  EXPECT_EQ(1u, mcode.numAreas());
+  // Fill the first area and commit it.
+  mcode.commit(from + MachineCode::kMinFree / 2);
+  EXPECT_TRUE(mcode.ensureSpace());
+  EXPECT_EQ(2u, mcode.numAreas());
+  MCode *from2, *to2;
+  to2 = mcode.reserve(&from2);
+  EXPECT_TRUE(to2 < from || from2 > to);
+  // Both areas must be able to reach each other with a rel32 branch.
+  ptrdiff_t dist = (char*)to2 - (char*)from;
+  if (dist < 0) dist = -dist;
+  EXPECT_TRUE(dist < (ptrdiff_t)1 << 31);
+  mcode.commit(from2 + MachineCode::kMinFree / 2);
+  EXPECT_FALSE(mcode.ensureSpace());  // Limit reached.
+  mcode.flush();
+  EXPECT_EQ(0u, mcode.numAreas());
+  EXPECT_EQ(0u, mcode.used());
+  EXPECT_EQ(1u, mcode.numFlushes());
+  EXPECT_TRUE(mcode.ensureSpace());
+}
+
+TEST(TraceCacheTest, CodeHash) {
+  BcIns ins[] = { BcIns::ad(BcIns::kFUNC, 3, 0),
+                  BcIns::ad(BcIns::kMOV, 0, 1),
+                  BcIns::ad(BcIns::kRET1, 0, 0) };
+  Code code;
+  memset(&code, 0, sizeof(code));
+  code.sizecode = 3;
+  code.code = ins;
+  uint32_t h = TraceCache::codeHash(&code);
+  EXPECT_EQ(h, TraceCache::codeHash(&code));
+  // IFUNC must not hash like FUNC.
+  ins[0] = BcIns::ad(BcIns::kIFUNC, 3, 0);
+  EXPECT_NE(h, TraceCache::codeHash(&code));
+  // A JFUNC that was not written by the JIT is hashed as it is.
+  ins[0] = BcIns::ad(BcIns::kJFUNC, 3, 0xffff);
+  EXPECT_NE(h, TraceCache::codeHash(&code));
+  // Changing the frame size must change the hash.
+  ins[0] = BcIns::ad(BcIns::kFUNC, 4, 0);
+  EXPECT_NE(h, TraceCache::codeHash(&code));
+  ins[0] = BcIns::ad(BcIns::kFUNC, 3, 0);
+  // So must changing the code.
+  ins[1] = BcIns::ad(BcIns::kMOV, 1, 0);
+  EXPECT_NE(h, TraceCache::codeHash(&code));
+}
+
+TEST(TraceCacheTest, MiscClosureSymbols) {
+  MemoryManager mm;
+  Loader l(&mm, NULL);
+  u4 sym;
+  ASSERT_TRUE(MiscClosures::symbolOf(MiscClosures::stg_UPD_closure_addr, &sym));
+  EXPECT_EQ(MiscClosures::stg_UPD_closure_addr, MiscClosures::closureFor(sym));
+  ASSERT_TRUE(MiscClosures::symbolOf(MiscClosures::stg_IND_info, &sym));
+  EXPECT_EQ(MiscClosures::stg_IND_info, MiscClosures::infoTableFor(sym));
+  InfoTable *ap = MiscClosures::getApInfo(6, 37);
+  ASSERT_TRUE(MiscClosures::symbolOf(ap, &sym));
+  EXPECT_EQ(ap, MiscClosures::infoTableFor(sym));
+  EXPECT_EQ((const InfoTable *)MiscClosures::stg_UPD_closure_addr->info(),
+            MiscClosures::codeInfoTableContaining(
+                MiscClosures::stg_UPD_return_pc));
+  EXPECT_TRUE(NULL == MiscClosures::closureFor(~0u));
+}
+
+TEST(HeapProfileTest, Census) {
+  // Unnamed info tables are listed by closure type.
+  static InfoTable info;
+  const char *path = "unittest_heapprofile.hp";
+  {
+    HeapProfile prof(path, "unittest");
+    ASSERT_TRUE(prof.ok());
+    WORD_MAP census;
+    census[(Word)&info] = 48;
+    prof.addSample(&census);
+    EXPECT_TRUE(census.empty());
+    EXPECT_EQ(1u, prof.samples());
+  }
+  ifstream in(path);
+  string line;
+  int begins = 0, ends = 0, bands = 0;
+  while (getline(in, line)) {
+    if (line.compare(0, 12, "BEGIN_SAMPLE") == 0) ++begins;
+    else if (line.compare(0, 10, "END_SAMPLE") == 0) ++ends;
+    else if (line.find('\t') != string::npos) {
+      ++bands;
+      EXPECT_EQ(string("INVALID_OBJECT\t48"), line);
+    }
+  }
+  // Empty first and last samples, plus ours.
+  EXPECT_EQ(3, begins);
+  EXPECT_EQ(3, ends);
+  EXPECT_EQ(1, bands);
+  remove(path);
+}
+
+TEST(ImageTest, MapAndRelocate) {
+  MemoryManager mm;
+  InfoTable *info;
+  {
+    AllocInfoTableHandle h(mm);
+    info = mm.allocInfoTable(h, wordsof(ConInfoTable));
+    memset(info, 0, sizeof(ConInfoTable));
+  }
+  char *str = mm.allocString(5);
+  strcpy(str, "hello");
+  Closure *cl = mm.allocStaticClosure(2);
+  cl->setInfo(info);
+  cl->setPayload(0, (Word)str);
+  cl->setPayload(1, 42);
+
+  const char *path = "unittest_image.img";
+  ImageWriter w;
+  w.addBlock(Region::blockFromPointer(cl));
+  w.addBlock(Region::blockFromPointer(info));
+  w.addBlock(Region::blockFromPointer(str));
+  w.addRelocation((Word *)&cl->header_.info_);
+  w.addRelocation(&cl->payload_[0]);
+  // Written as modules, shared closures, then the rest.
+  w.addSymbol(Image::kInfoTable, "Test.info", info);
+  w.addSymbol(Image::kClosure, "Test.cl", cl, Image::kSharedClosure);
+  w.addSymbol(Image::kModule, "Test", NULL);
+  ASSERT_TRUE(w.write(path));
+
+  // The second image cannot be mapped at the same address.
+  Image *img1 = Image::map(path);
+  Image *img2 = Image::map(path);
+  ASSERT_TRUE(img1 != NULL);
+  ASSERT_TRUE(img2 != NULL);
+  EXPECT_TRUE(img2->relocated());
+  Image *imgs[] = { img1, img2 };
+  Closure *cls[2];
+  for (int i = 0; i < 2; ++i) {
+    Image *img = imgs[i];
+    ASSERT_EQ(3u, img->numSymbols());
+    EXPECT_EQ(Image::kModule, img->symbolKind(0));
+    EXPECT_STREQ("Test", img->symbolName(0));
+    EXPECT_TRUE(img->symbolAddress(0) == NULL);
+    EXPECT_STREQ("Test.cl", img->symbolName(1));
+    EXPECT_EQ((u4)Image::kSharedClosure, img->symbolFlags(1));
+    EXPECT_EQ(0u, img->symbolFlags(2));
+    EXPECT_EQ(0u, img->findSymbol(Image::kModule, "Test"));
+    EXPECT_EQ(1u, img->findSymbol(Image::kClosure, "Test.cl"));
+    EXPECT_EQ(2u, img->findSymbol(Image::kInfoTable, "Test.info"));
+    EXPECT_EQ((u4)Image::kNoSymbol,
+              img->findSymbol(Image::kInfoTable, "Test.cl"));
+    EXPECT_EQ((u4)Image::kNoSymbol,
+              img->findSymbol(Image::kClosure, "Test.c"));
+    Closure *mcl = static_cast<Closure *>(img->symbolAddress(1));
+    InfoTable *minfo = static_cast<InfoTable *>(img->symbolAddress(2));
+    EXPECT_TRUE(mcl != cl);
+    EXPECT_EQ(minfo, mcl->info());
+    EXPECT_STREQ("hello", (const char *)mcl->payload(0));
+    EXPECT_EQ((Word)42, mcl->payload(1));
+    EXPECT_EQ(Block::kStaticClosures,
+              Region::blockFromPointer(mcl)->contents());
+    EXPECT_EQ(Block::kInfoTables,
+              Region::blockFromPointer(minfo)->contents());
+    cls[i] = mcl;
+  }
+  // Static closures are copy-on-write.
+  cls[1]->setPayload(1, 7);
+  EXPECT_EQ((Word)42, cls[0]->payload(1));
+  delete img2;
+  delete img1;
+
+  // Pointers out of the image are rejected.
+  ImageWriter w2;
+  w2.addBlock(Region::blockFromPointer(cl));
+  w2.addRelocation(&cl->payload_[0]);
+  EXPECT_FALSE(w2.write(path));
+  remove(path);
+}
+
 TEST(Timer, PreciseResolution) {
   // Check that timer resolution is at least 1us.
   initializeTimer();
@@ -1412,6 +2130,27 @@ TEST_F(RegAlloc, ManyRegs) {
   Dump();
 }
 
+TEST_F(RegAlloc, UpdateYoung) {
+  Word *base = SetupThread();
+  // REF_IND is initialised on reset, so reset after loading.
+  buf->reset(&stack[11], &stack[28]);
+  Closure *thunk = mm->allocClosure((InfoTable *)0x1234, 2);
+  Closure *value = mm->allocClosure((InfoTable *)0x5678, 1);
+  TRef s0 = buf->slot(0);
+  TRef s1 = buf->slot(1);
+  buf->emit(IR::kUPDATE, IRT_VOID, s0, s1);
+  SnapNo snapno = buf->snapshot(NULL);
+  buf->emit(IR::kSAVE, IRT_VOID, snapno, 0);
+  Compile();
+  base[0] = (Word)thunk;
+  base[1] = (Word)value;
+  RunAsm();
+  EXPECT_EQ(MiscClosures::stg_IND_info, thunk->info());
+  EXPECT_EQ((Word)value, thunk->payload(0));
+  // The nursery is not subject to the write barrier.
+  EXPECT_EQ((size_t)0, mm->rememberedSetSize());
+}
+
 TEST_F(RegAlloc, SnapTwice) {
   Word lit1 = 0x50001234;
   Word lit2 = 0x50001236;
@@ -1944,6 +2683,22 @@ public:
              T->stackLimit(), F->entry());
   }
 
+  // Check whether the given byte pattern occurs in the first `limit`
+  // bytes of the fragment's code.  A byte `b` matches if
+  // `(b & mask[i]) == pattern[i]`.
+  bool CodeMatches(const uint8_t *pattern, const uint8_t *mask, size_t len,
+                   size_t limit = 128) {
+    const MCode *code = F->entry();
+    for (size_t i = 0; i + len <= limit; ++i) {
+      size_t j = 0;
+      while (j < len && (code[i + j] & mask[j]) == pattern[j])
+        ++j;
+      if (j == len)
+        return true;
+    }
+    return false;
+  }
+
   void RunWithHeap(Word *hp, Word *hplim) {
     asmEnter(F->traceId(), T, hp, hplim,
              T->stackLimit(), F->entry());
@@ -2010,6 +2765,54 @@ TEST_F(TestFragment, Test2) {
   EXPECT_EQ(0, base[1]);
 }
 
+TEST_F(TestFragment, ExitStubsShareSaveCode) {
+  size_t saveCodes = 0;
+  for (int i = 0; i < 2; ++i) {
+    buf->reset(&stack[10], &stack[18]);
+    TRef x = buf->slot(0);
+    TRef five = buf->literal(IRT_I64, 5);
+    TRef y = buf->emit(IR::kADD, IRT_I64, x, five);
+    buf->setSlot(0, y);
+    buf->emit(IR::kLT, IRT_VOID|IRT_GUARD, x, five);
+    buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+    Assemble();
+    if (i == 0)
+      saveCodes = jit.numExitSaveCodes();
+  }
+  // The guard and the fall-through exit save different registers.
+  EXPECT_EQ((size_t)2, saveCodes);
+  // The second fragment reuses the code of the first.
+  EXPECT_EQ(saveCodes, jit.numExitSaveCodes());
+
+  Word *base = T->base();
+  base[0] = 10;
+  Run();
+  EXPECT_EQ(15, base[0]);
+  EXPECT_EQ(T->base(), base);
+}
+
+TEST_F(TestFragment, FallthroughBridgeNeedsSpace) {
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, IR_SAVE_FALLTHROUGH, 0);
+  Assemble();
+  Fragment *target = F;
+  buf->reset(&stack[10], &stack[18]);
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, IR_SAVE_FALLTHROUGH, 0);
+  Assemble();
+  ExitNo exitno = F->numExits() - 1;
+
+  MachineCode *mcode = jit.mcode();
+  size_t avail = mcode->available();
+  EXPECT_TRUE(jit.patchFallthrough(F, exitno, target));
+  EXPECT_LT(mcode->available(), avail);
+
+  // Use up the area.  The bridge must not be written below it.
+  MCode *limit;
+  mcode->reserve(&limit);
+  mcode->commit(limit + 16);
+  EXPECT_FALSE(jit.patchFallthrough(F, exitno, target));
+  EXPECT_EQ((size_t)16, mcode->available());
+}
+
 TEST_F(TestFragment, RestoreSnapSpill) {
   buf->disableOptimisation(IRBuffer::kOptFold);
   TRef s[5];
@@ -2084,6 +2887,30 @@ TEST_F(TestFragment, RestoreSnapSpill) {
   EXPECT_EQ(6566, base[1]);
 }
 
+TEST_F(TestFragment, RestoreSnapLiterals) {
+  TRef x = buf->slot(0);
+  TRef big = buf->literal(IRT_I64, 0x123456789LL);
+  TRef neg = buf->literal(IRT_I64, -3);
+  TRef zero = buf->literal(IRT_I64, 0);
+  buf->setSlot(1, big);
+  buf->setSlot(2, neg);
+  buf->setSlot(3, buf->baseLiteral(&stack[12]));
+  buf->emit(IR::kEQ, IRT_VOID|IRT_GUARD, x, zero);
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  Word *base = T->base();
+  base[0] = 1;  // Exit at the guard.
+  base[1] = base[2] = base[3] = 0;
+  Run();
+  EXPECT_EQ(T->base(), base);
+  EXPECT_EQ((Word)1, base[0]);
+  EXPECT_EQ((Word)0x123456789LL, base[1]);
+  EXPECT_EQ((Word)-3, base[2]);
+  EXPECT_EQ((Word)(base + 2), base[3]);
+}
+
 TEST_F(TestFragment, ItblGuard) {
   TRef clos1 = buf->slot(0);
   TRef clos2 = buf->slot(1);
@@ -2145,6 +2972,143 @@ TEST_F(TestFragment, LoadField) {
   EXPECT_EQ((Word)500000001234, base[0]);
 }
 
+TEST_F(TestFragment, ByteArrayLoad) {
+  TRef arr = buf->slot(0);
+  TRef idx = buf->slot(1);
+  TRef ref1 = buf->emit(IR::kAREF, IRT_PTR, arr, idx);
+  TRef val1 = buf->emit(IR::kALOAD, IRT_U8, ref1, 0);
+  TRef ref2 = buf->emit(IR::kAREF, IRT_PTR, arr, buf->literal(IRT_I64, 1));
+  TRef val2 = buf->emit(IR::kALOAD, IRT_U16, ref2, 0);
+  buf->setSlot(0, val1);
+  buf->setSlot(1, val2);
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  Word *base = T->base();
+  Word storage[4];
+  ByteArrayClosure *cl = (ByteArrayClosure *)storage;
+  cl->bytes_ = 2 * sizeof(Word);
+  cl->payload_[0] = 0x0807060504030201;
+  cl->payload_[1] = 0;
+  base[0] = (Word)cl;
+  base[1] = 5;
+  Run();
+  EXPECT_EQ((Word)0x06, base[0]);
+  EXPECT_EQ((Word)0x0403, base[1]);
+}
+
+TEST_F(TestFragment, ByteArrayStore) {
+  TRef arr = buf->slot(0);
+  TRef idx = buf->slot(1);
+  TRef val = buf->slot(2);
+  TRef ref1 = buf->emit(IR::kAREF, IRT_PTR, arr, idx);
+  buf->emit(IR::kASTORE, IRT_U8, ref1, val);
+  TRef ref2 = buf->emit(IR::kAREF, IRT_PTR, arr, buf->literal(IRT_I64, 1));
+  buf->emit(IR::kASTORE, IRT_U64, ref2, val);
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  Word *base = T->base();
+  Word storage[4];
+  ByteArrayClosure *cl = (ByteArrayClosure *)storage;
+  cl->bytes_ = 2 * sizeof(Word);
+  cl->payload_[0] = 0;
+  cl->payload_[1] = 0;
+  base[0] = (Word)cl;
+  base[1] = 3;
+  base[2] = 0x1234;
+  Run();
+  EXPECT_EQ((Word)0x34000000, cl->payload_[0]);
+  EXPECT_EQ((Word)0x1234, cl->payload_[1]);
+}
+
+TEST_F(TestFragment, FuseFieldLoad) {
+  TRef clos = buf->slot(0);
+  TRef y = buf->slot(1);
+  TRef ref = buf->emit(IR::kFREF, IRT_PTR, clos, 1);
+  TRef val = buf->emit(IR::kFLOAD, IRT_I64, ref, 0);
+  TRef res = buf->emit(IR::kADD, IRT_I64, y, val);
+  buf->setSlot(0, res);
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  // add r64, [r64 + 8]
+  static const uint8_t pattern[] = { 0x48, 0x03, 0x40, 0x08 };
+  static const uint8_t mask[] =    { 0xf8, 0xff, 0xc0, 0xff };
+  EXPECT_TRUE(CodeMatches(pattern, mask, sizeof(pattern)));
+
+  Word *base = T->base();
+  Word heap[2] = { 1234, 500000001234 };
+  base[0] = (Word)&heap[0];
+  base[1] = 42;
+  Run();
+  EXPECT_EQ((Word)500000001276, base[0]);
+}
+
+TEST_F(TestFragment, LeaAddConst) {
+  TRef x = buf->slot(0);
+  TRef res = buf->emit(IR::kADD, IRT_I64, x, buf->literal(IRT_I64, 5));
+  buf->setSlot(0, res);
+  buf->setSlot(1, x);  // Keep x live.
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  // lea r64, [r64 + 5]
+  static const uint8_t pattern[] = { 0x48, 0x8d, 0x40, 0x05 };
+  static const uint8_t mask[] =    { 0xf8, 0xff, 0xc0, 0xff };
+  EXPECT_TRUE(CodeMatches(pattern, mask, sizeof(pattern)));
+
+  Word *base = T->base();
+  base[0] = 37;
+  base[1] = 0;
+  Run();
+  EXPECT_EQ((Word)42, base[0]);
+  EXPECT_EQ((Word)37, base[1]);
+}
+
+TEST_F(TestFragment, LeaScaledIndex) {
+  TRef x = buf->slot(0);
+  TRef i = buf->slot(1);
+  TRef ofs = buf->emit(IR::kBSHL, IRT_I64, i, buf->literal(IRT_I64, 3));
+  TRef res = buf->emit(IR::kADD, IRT_I64, x, ofs);
+  buf->setSlot(0, res);
+  buf->setSlot(1, x);
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  // lea r64, [r64 + r64 * 8]
+  static const uint8_t pattern[] = { 0x48, 0x8d, 0x04, 0xc0 };
+  static const uint8_t mask[] =    { 0xf8, 0xff, 0xc7, 0xc0 };
+  EXPECT_TRUE(CodeMatches(pattern, mask, sizeof(pattern)));
+
+  Word *base = T->base();
+  base[0] = 1000;
+  base[1] = 3;
+  Run();
+  EXPECT_EQ((Word)1024, base[0]);
+  EXPECT_EQ((Word)1000, base[1]);
+}
+
+TEST_F(TestFragment, ItblGuardMemOperand) {
+  TRef clos = buf->slot(0);
+  TRef itbl = buf->literal(IRT_INFO, 0x1234);
+  buf->emit(IR::kEQINFO, IRT_VOID|IRT_GUARD, clos, itbl);
+  buf->setSlot(0, buf->literal(IRT_I64, 1));
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  // cmp qword [r64], imm32
+  static const uint8_t pattern[] = { 0x48, 0x81, 0x38, 0x34, 0x12, 0, 0 };
+  static const uint8_t mask[] =    { 0xf8, 0xff, 0xf8, 0xff, 0xff, 0xff, 0xff };
+  EXPECT_TRUE(CodeMatches(pattern, mask, sizeof(pattern)));
+}
+
 TEST_F(TestFragment, DivMod) {
   TRef inp1 = buf->slot(0);
   TRef inp2 = buf->slot(1);
@@ -2292,6 +3256,101 @@ TEST_F(TestFragment, Alloc1) {
   EXPECT_EQ(&heap[3], cap.traceExitHpLim());
 }
 
+TEST_F(TestFragment, HeapCheckGCMap) {
+  TRef itbl = buf->literal(IRT_INFO, 0x123456783);
+  TRef lit1 = buf->literal(IRT_I64, 5);
+  TRef node = buf->emit(IR::kSLOAD, IRT_CLOS, 0, 0);
+  buf->emitHeapCheck(3);
+  SnapNo hpsnap = buf->numSnapshots() - 1;
+  IRBuffer::HeapEntry he = 0;
+  TRef alloc = buf->emitNEW(itbl, 2, &he);
+  buf->setField(he, 0, lit1);
+  buf->setField(he, 1, node);
+  buf->setSlot(1, alloc);
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  Assemble();
+
+  // The loaded closure is live across the heap check, so it must be
+  // a root.  Its slot is unmodified and therefore not part of the
+  // snapshot, so the register is evacuated in place.
+  const GCMap &map = F->gcMap(hpsnap);
+  ASSERT_TRUE(map.valid);
+  ASSERT_EQ(1u, map.end - map.begin);
+  const GCRoot &root = F->gcRoot(map.begin);
+  EXPECT_TRUE(root.isClosure);
+  EXPECT_EQ(kNoStackSlot, root.slot);
+}
+
+TEST_F(TestFragment, HeapCheckGC) {
+  // The trace's heap check belongs to this ALLOC1.  Only slot 2 is
+  // live there.
+  BcIns code[3];
+  code[0] = BcIns::abc(BcIns::kALLOC1, 3, 0, 0);
+  code[1] = BcIns::bitmapOffset(sizeof(BcIns));
+  *(u2 *)&code[2] = 1 << 2;
+
+  // Nodes have two pointer fields and a data word.
+  InfoTable *node = MiscClosures::getApInfo(2, 1);
+  TRef itbl = buf->literal(IRT_INFO, (Word)node);
+  TRef a = buf->emit(IR::kSLOAD, IRT_CLOS, 0, 0);
+  TRef b = buf->emit(IR::kSLOAD, IRT_CLOS, 1, 0);
+  buf->setSlot(2, b);
+  buf->setPC(&code[0]);
+  buf->emitHeapCheck(4);
+  IRBuffer::HeapEntry he = 0;
+  TRef alloc = buf->emitNEW(itbl, 3, &he);
+  buf->setField(he, 0, a);
+  buf->setField(he, 1, b);
+  buf->setField(he, 2, buf->literal(IRT_I64, 33));
+  buf->setSlot(3, alloc);
+  buf->emit(IR::kSAVE, IRT_VOID|IRT_GUARD, 0, 0);
+
+  jit.setOption(Jit::kOptFastHeapCheckFail, true);
+  Assemble();
+
+  Closure *end = MiscClosures::stg_STOP_closure_addr;
+  Closure *nodes[2];
+  for (int i = 0; i < 2; ++i) {
+    nodes[i] = mm.allocClosure(node, 3);
+    nodes[i]->setPayload(0, (Word)end);
+    nodes[i]->setPayload(1, (Word)end);
+    nodes[i]->setPayload(2, 11 * (i + 1));
+  }
+
+  // Makes T the current thread, as when running a program.
+  ASSERT_TRUE(cap.eval(T, end));
+  // Only two words are left and the nursery is full, so the heap
+  // check runs a GC.  a stays in a register, b is reloaded from
+  // slot 2.
+  char *hp, *hplim;
+  mm.getBumpAllocatorBounds(cap.allocBuffer(), &hp, &hplim);
+  mm.setNextGC(1);
+  Word *base = T->base();
+  base[0] = (Word)nodes[0];
+  base[1] = (Word)nodes[1];
+  base[2] = 0;
+  base[3] = 0;
+  RunWithHeap((Word *)hplim - 2, (Word *)hplim);
+  EXPECT_EQ((uint64_t)1, mm.numMinorGCs());
+  ASSERT_NE((Word)0, base[3]);  // The trace ran to the end.
+
+  Closure *cl = (Closure *)base[3];
+  Closure *newA = (Closure *)cl->payload(0);
+  Closure *newB = (Closure *)cl->payload(1);
+  EXPECT_NE(nodes[0], newA);
+  EXPECT_NE(nodes[1], newB);
+  EXPECT_EQ((Word)newB, base[2]);
+  EXPECT_TRUE(Region::regionFromPointer(newA)->isOldGeneration());
+  EXPECT_TRUE(Region::regionFromPointer(newB)->isOldGeneration());
+  EXPECT_EQ(node, newA->info());
+  EXPECT_EQ((Word)11, newA->payload(2));
+  EXPECT_EQ(node, newB->info());
+  EXPECT_EQ((Word)22, newB->payload(2));
+  EXPECT_EQ((Word)33, cl->payload(2));
+  EXPECT_EQ((Word *)cl + 4, cap.traceExitHp());
+}
+
 TEST_F(TestFragment, Alloc2) {
   TRef itbl = buf->literal(IRT_INFO, 0x123456783);
   TRef lit1 = buf->literal(IRT_I64, 5);